@@ -1,9 +1,12 @@
 #pragma once
 
+#include <pmu-events/cpuset.h>
 #include <pmu-events/pmu-events.h>
+#include <pmu-events/stats.h>
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <linux/perf_event.h>
 
@@ -82,8 +85,361 @@ void free_assignment(struct assignment* asn);
 int parse_assignment_list(const char* str, struct assignment_list* list);
 void free_assignment_list(struct assignment_list* list);
 
-int apply_range_list_to_val(unsigned long long* config, uint64_t to_apply, struct range_list* list);
-int apply_config_def_to_attr(struct perf_event_attr* attr, uint64_t val, struct config_def* def);
+int apply_range_list_to_val(unsigned long long* config, uint64_t to_apply,
+                            const struct range_list* list);
+int apply_config_def_to_attr(struct perf_event_attr* attr, uint64_t val,
+                             const struct config_def* def);
 
 char* get_format_file_content(char* fmt_file, struct perf_cpu cpu);
 int read_perf_type(struct perf_cpu cpu);
+
+char* concat_path(const char* base, const char* filename);
+char* get_file_content(const char* path);
+
+/*
+ * Returns the map of arch/common, with the "software" and "tool" events, NULL if there is none
+ */
+const struct pmu_events_map* common_events_map(void);
+
+/*
+ * A single file in [pmu]/format, e.g. name="umask", def="config:8-15"
+ */
+struct pmu_format_def
+{
+    char* name;
+    char* def;
+    struct config_def config;
+};
+
+/*
+ * A single file in [pmu]/events, e.g. name="energy-pkg", event="event=0x02", with the
+ * content of its .scale and .unit files
+ */
+struct pmu_alias_def
+{
+    char* name;
+    char* event;
+    double scale;
+    /* NULL if there is no .unit file */
+    char* unit;
+    /* The scale and unit in the format of the ScaleUnit of the tables, NULL if neither exists */
+    char* scale_unit;
+};
+
+/*
+ * Everything we know about one PMU in /sys/bus/event_source/devices
+ */
+struct topology_pmu
+{
+    char* name;
+    uint32_t type;
+    /*
+     * true if the PMU is responsible for CPU cores, i.e. it is the "cpu" PMU
+     * or it has a "cpus" file.
+     */
+    bool is_core;
+    /*
+     * The raw content of the "cpus" (core PMUs) or "cpumask" (uncore PMUs) file,
+     * NULL if the PMU has neither.
+     */
+    char* cpus;
+    /* The CPUs of cpus, all CPUs for a core PMU without cpus file */
+    struct pmu_cpuset cpuset;
+    /* sorted by name */
+    struct pmu_format_def* formats;
+    size_t num_formats;
+    /* sorted by name, only read on the first lookup, see topology_find_alias() */
+    struct pmu_alias_def* aliases;
+    size_t num_aliases;
+    bool aliases_read;
+};
+
+struct pmu_topology
+{
+    /* The sysfs root this snapshot was taken from, usually "/sys" */
+    char* root;
+    /* sorted by name */
+    struct topology_pmu* pmus;
+    size_t num_pmus;
+    /* Dense CPU -> index into pmus of the core PMU, -1 if there is none */
+    int* core_pmu;
+    size_t num_cpus;
+    /* The online CPUs, from devices/system/cpu/online */
+    struct pmu_cpuset online;
+    /*
+     * Hash over the PMU names and the online CPUs, changes whenever a
+     * PMU appears/disappears or a CPU goes on- or offline.
+     */
+    uint64_t generation;
+    /* Next snapshot in the list of replaced ones, see pmu_topology_set() */
+    struct pmu_topology* next_retired;
+};
+
+struct pmu_events_change;
+
+int topology_refresh(const struct pmu_topology* topo, struct pmu_topology** refreshed,
+                     struct pmu_events_change* change);
+/*
+ * Replaces the process-wide snapshot "old" with "topo". If another thread replaced
+ * "old" in the meantime, "topo" is freed instead.
+ *
+ * Returns true if "topo" was published
+ */
+bool topology_publish(const struct pmu_topology* old, struct pmu_topology* topo);
+void free_topology_change(struct pmu_events_change* change);
+
+void map_for_cpu_invalidate(struct perf_cpu cpu);
+
+const struct topology_pmu* topology_core_pmu_for_cpu(const struct pmu_topology* topo,
+                                                     struct perf_cpu cpu);
+const struct topology_pmu* topology_pmu_for_event(const struct pmu_topology* topo,
+                                                  const struct pmu_event* ev, struct perf_cpu cpu);
+const struct pmu_format_def* topology_find_format(const struct topology_pmu* pmu,
+                                                  const char* name);
+const struct pmu_alias_def* topology_find_alias(const struct pmu_topology* topo,
+                                                const struct topology_pmu* pmu, const char* name);
+
+/*
+ * Puts "value" into the bits of "attr" the format "key" of "pmu" describes, or, if "pmu"
+ * has no such format, into the field of the term: config, config1 or config2 for those
+ * keys, config1 for "ldlat" and sample_period for "period"
+ *
+ * Returns 0 on success, -1 if there is neither
+ */
+int apply_event_term(struct perf_event_attr* attr, const struct topology_pmu* pmu,
+                     const char* key, uint64_t value);
+/*
+ * Returns the base the string "value" of the term "key" is in: 16 with a "0x" prefix,
+ * otherwise 10 for "period" and "cmask" and 16 for all other terms
+ */
+int event_term_base(const char* key, const char* value);
+int apply_event_string(struct perf_event_attr* attr, const struct topology_pmu* pmu,
+                       const char* event, unsigned flags);
+
+/* session_event->merged_into of events that are counted on their own */
+#define SESSION_NOT_MERGED SIZE_MAX
+
+struct session_event
+{
+    char* name;
+    struct perf_event_attr attr;
+    size_t group;
+    bool per_package;
+    /* The identical event of another group this one copies its count from */
+    size_t merged_into;
+    /* The event notifies about overflows, see pmu_session_arm() */
+    bool armed;
+};
+
+struct session_group
+{
+    size_t first_event;
+    size_t num_events;
+    /* The first event that is not a tool event, the kernel group leader */
+    size_t leader;
+    /* The number of events that are not tool events, the members of the kernel group */
+    size_t num_counters;
+    /* The group is only opened on some CPUs, see session->placed */
+    bool per_package;
+    /* The group does not fit into the fd budget and is never opened */
+    bool dropped;
+    /* The fds of the group are open, only ever false with session->max_open_groups */
+    bool is_open;
+};
+
+/*
+ * The counts a closed group collected while it was open, see session->max_open_groups
+ */
+struct session_count
+{
+    uint64_t raw;
+    uint64_t time_enabled;
+    uint64_t time_running;
+};
+
+/*
+ * A tool event (PMU_EVENTS_TYPE_TOOL) on one CPU, counted in the library
+ */
+struct tool_counter
+{
+    /* The count up to the last disable, or the value for constant tool events */
+    uint64_t value;
+    /* The reading at the last enable */
+    uint64_t start;
+};
+
+struct pmu_session
+{
+    struct perf_cpu* cpus;
+    size_t num_cpus;
+    struct session_event* events;
+    size_t num_events;
+    struct session_group* groups;
+    size_t num_groups;
+    /* [num_cpus][num_events], -1 for events that are not open */
+    int* fds;
+    bool opened;
+    bool enabled;
+    /* Number of groups enabled at once, 0 if the session does not rotate */
+    size_t active_groups;
+    uint64_t rotation_interval_ns;
+    size_t rotation_start;
+    uint64_t last_rotation_ns;
+    /* Wall time the session was enabled for, excluding the current stretch */
+    uint64_t enabled_ns;
+    /* Start of the current stretch, if enabled */
+    uint64_t enabled_since_ns;
+    /* Buffer for PERF_FORMAT_GROUP reads of the largest group */
+    uint64_t* read_buf;
+    size_t read_buf_len;
+    /* [num_cpus][num_events], NULL if the session has no tool events */
+    struct tool_counter* tools;
+    /* [num_cpus][2] user and system time (in ns) of the CPUs, from /proc/stat */
+    uint64_t* cpu_times;
+    /* [num_cpus] physical package id of the CPUs, -1 if unknown */
+    int* packages;
+    /* [num_groups] the indices into cpus each group is opened on, NULL if on all CPUs */
+    struct pmu_cpuset* placed;
+    /* The cgroup directory to count in while opening (PERF_FLAG_PID_CGROUP), -1 for none */
+    int cgroup_fd;
+    /*
+     * If not 0, only the active groups are open and the others are closed, which
+     * limits the fds of the session, see pmu_session_open_budget()
+     */
+    size_t max_open_groups;
+    /* [num_cpus][num_events] with max_open_groups, the counts of the closed groups */
+    struct session_count* saved;
+    /* NULL unless the groups are read with io_uring, see pmu_session_use_io_uring() */
+    struct session_uring* uring;
+    /* NULL unless the session has armed events, see pmu_session_arm() */
+    struct session_notify* notify;
+};
+
+uint64_t session_now_ns(void);
+uint64_t session_enabled_ns(const struct pmu_session* session);
+bool session_group_is_active(const struct pmu_session* session, size_t group);
+struct pmu_session* session_clone(const struct pmu_session* session);
+bool session_event_is_counter(const struct session_event* ev);
+void session_update_group(struct pmu_session* session, struct session_group* grp);
+int session_place_groups(struct pmu_session* session);
+bool session_group_is_placed(const struct pmu_session* session, size_t group, size_t cpu);
+
+struct session_uring;
+void session_uring_free(struct session_uring* uring);
+int session_uring_read(struct pmu_session* session);
+const uint64_t* session_uring_group(const struct session_uring* uring, size_t group, size_t cpu);
+
+struct session_notify;
+struct session_notify* session_notify_new(const struct pmu_session* session);
+void session_notify_free(const struct pmu_session* session, struct session_notify* notify);
+int session_notify_add(struct pmu_session* session, size_t event, size_t cpu, int fd);
+void session_notify_remove(struct pmu_session* session, size_t event, size_t cpu);
+int perf_event_open(struct perf_event_attr* attr, pid_t pid, int cpu, int group_fd,
+                    unsigned long flags);
+
+enum metric_expr_type
+{
+    EXPR_NUMBER,
+    /* A reference to an event or another metric */
+    EXPR_ID,
+    /* A value that is only known at runtime, e.g. #smt_on or #num_cpus */
+    EXPR_LITERAL,
+    /* op is '-' or '!' */
+    EXPR_UNARY,
+    /* op is one of + - * / % < > & | ^ */
+    EXPR_BINARY,
+    /* args[0] if args[1] else args[2] */
+    EXPR_SELECT,
+    EXPR_FUNCTION
+};
+
+enum metric_expr_function
+{
+    EXPR_MIN,
+    EXPR_MAX,
+    EXPR_D_RATIO,
+    EXPR_SOURCE_COUNT,
+    EXPR_HAS_EVENT,
+    EXPR_STRCMP_CPUID_STR
+};
+
+/*
+ * A node of a parsed metric expression, e.g. for
+ * "tma_info_thread_slots / (2 * cpu_core@CPU_CLK_UNHALTED.THREAD@)"
+ */
+struct metric_expr
+{
+    enum metric_expr_type type;
+    double value;
+    /* ID and LITERAL: the name with all escapes removed, without the leading '#' */
+    char* name;
+    char op;
+    enum metric_expr_function func;
+    struct metric_expr* args[3];
+    size_t num_args;
+    /* ID: set by the planner to the index of the event or metric, -1 otherwise */
+    int event;
+    int metric;
+};
+
+struct metric_expr* metric_expr_parse(const char* str);
+void metric_expr_free(struct metric_expr* expr);
+
+/*
+ * Resolves a literal like "smt_on" (from "#smt_on") to its value on this system
+ *
+ * Returns 0 on success, -1 for unknown literals
+ */
+int metric_literal_value(const char* name, double* value);
+
+char* get_cpuid_allow_env_override(struct perf_cpu cpu);
+/*
+ * Returns 0 if the cpuid "id" matches "mapcpuid" of a map of the architecture "arch"
+ * (e.g. "x86"), the way perf matches them on that architecture
+ */
+int strcmp_cpuid_str_for_arch(const char* arch, const char* mapcpuid, const char* id);
+
+/* The PMU_EVENTS_STATS_* flags of pmu_events_stats_enable() */
+extern unsigned pmu_events_stats_flags;
+
+void stats_add(enum pmu_events_counter counter);
+uint64_t stats_now(void);
+void stats_record(enum pmu_events_entry entry, uint64_t start);
+
+/*
+ * Counts one operation of "counter" if counters are collected
+ */
+static inline void stats_count(enum pmu_events_counter counter)
+{
+    if (__builtin_expect(__atomic_load_n(&pmu_events_stats_flags, __ATOMIC_RELAXED) &
+                             PMU_EVENTS_STATS_COUNTERS,
+                         0))
+    {
+        stats_add(counter);
+    }
+}
+
+/*
+ * Returns the start time of a call for stats_end(), 0 if latencies are not recorded
+ */
+static inline uint64_t stats_start(void)
+{
+    if (__builtin_expect(__atomic_load_n(&pmu_events_stats_flags, __ATOMIC_RELAXED) &
+                             PMU_EVENTS_STATS_LATENCY,
+                         0))
+    {
+        return stats_now();
+    }
+    return 0;
+}
+
+/*
+ * Records the latency of a call to "entry" that started at "start"
+ */
+static inline void stats_end(enum pmu_events_entry entry, uint64_t start)
+{
+    if (start != 0)
+    {
+        stats_record(entry, start);
+    }
+}
@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/limits.h>
+#include <pmu-events/cpuset.h>
 #include <pmu-events/pmu-events.h>
 #include <poll.h>
 #include <stdio.h>
@@ -14,24 +15,6 @@
 #include <string.h>
 #include <unistd.h>
 
-/*
- * linux/tool/include/uapi/linux/const.h
- */
-
-#define __AC(X, Y) (X##Y)
-#define _AC(X, Y) __AC(X, Y)
-
-#define _UL(x) (_AC(x, UL))
-
-#define GENMASK(h, l) (((~_UL(0)) << (l)) & (~_UL(0) >> (__BITS_PER_LONG - 1 - (h))))
-
-/*
- * linux/tools/include/linux/bitfield.h
- */
-
-#define __bf_shf(x) (__builtin_ffsll(x) - 1)
-#define FIELD_GET(_mask, _reg) ({ (typeof(_mask))(((_reg) & (_mask)) >> __bf_shf(_mask)); })
-
 /*
  * linux/tools/lib/api/io.h
  */
@@ -230,7 +213,6 @@ struct perf_cpu perf_cpu_map__cpu(const struct perf_cpu_map* cpus, int idx)
          (idx)++, (cpu) = perf_cpu_map__cpu(cpus, idx))
 
 struct perf_cpu_map* perf_cpu_map__new_online_cpus(void);
-static struct perf_cpu_map* cpu_map__trim_new(int nr_cpus, const struct perf_cpu* tmp_cpus);
 struct perf_cpu_map* perf_cpu_map__alloc(int nr_cpus);
 
 struct perf_cpu_map* perf_cpu_map__new_any_cpu(void)
@@ -246,11 +228,9 @@ struct perf_cpu_map* perf_cpu_map__new_any_cpu(void)
 struct perf_cpu_map* perf_cpu_map__new(const char* cpu_list)
 {
     struct perf_cpu_map* cpus = NULL;
-    unsigned long start_cpu, end_cpu = 0;
-    char* p = NULL;
-    int i, nr_cpus = 0;
-    struct perf_cpu *tmp_cpus = NULL, *tmp;
-    int max_entries = 0;
+    struct pmu_cpuset set = PMU_CPUSET_INIT;
+    long cpu;
+    int nr_cpus = 0;
 
     if (!cpu_list)
         return perf_cpu_map__new_online_cpus();
@@ -263,107 +243,27 @@ struct perf_cpu_map* perf_cpu_map__new(const char* cpu_list)
     if (!isdigit(*cpu_list) && *cpu_list != '\0')
         goto out;
 
-    while (isdigit(*cpu_list))
-    {
-        p = NULL;
-        start_cpu = strtoul(cpu_list, &p, 0);
-        if (start_cpu >= INT16_MAX || (*p != '\0' && *p != ',' && *p != '-' && *p != '\n'))
-            goto invalid;
-
-        if (*p == '-')
-        {
-            cpu_list = ++p;
-            p = NULL;
-            end_cpu = strtoul(cpu_list, &p, 0);
-
-            if (end_cpu >= INT16_MAX || (*p != '\0' && *p != ',' && *p != '\n'))
-                goto invalid;
-
-            if (end_cpu < start_cpu)
-                goto invalid;
-        }
-        else
-        {
-            end_cpu = start_cpu;
-        }
-
-        for (; start_cpu <= end_cpu; start_cpu++)
-        {
-            /* check for duplicates */
-            for (i = 0; i < nr_cpus; i++)
-                if (tmp_cpus[i].cpu == (int16_t)start_cpu)
-                    goto invalid;
-
-            if (nr_cpus == max_entries)
-            {
-                if (end_cpu - start_cpu + 1 > 16UL)
-                {
-                    max_entries += end_cpu - start_cpu + 1;
-                }
-                else
-                {
-                    max_entries += 16UL;
-                }
-                tmp = realloc(tmp_cpus, max_entries * sizeof(struct perf_cpu));
-                if (tmp == NULL)
-                    goto invalid;
-                tmp_cpus = tmp;
-            }
-            tmp_cpus[nr_cpus++].cpu = (int16_t)start_cpu;
-        }
-        if (*p)
-            ++p;
-
-        cpu_list = p;
-    }
+    /* The set is sorted and free of duplicates, struct perf_cpu holds an int16_t */
+    if (pmu_cpuset_parse(&set, cpu_list) == -1 || pmu_cpuset_last(&set) >= INT16_MAX)
+        goto out;
 
-    if (nr_cpus > 0)
-    {
-        cpus = cpu_map__trim_new(nr_cpus, tmp_cpus);
-    }
-    else if (*cpu_list != '\0')
-    {
-        cpus = perf_cpu_map__new_online_cpus();
-    }
-    else
+    if (pmu_cpuset_empty(&set))
     {
         cpus = perf_cpu_map__new_any_cpu();
+        goto out;
     }
-invalid:
-    free(tmp_cpus);
-out:
-    return cpus;
-}
-
-static int cmp_cpu(const void* a, const void* b)
-{
-    const struct perf_cpu *cpu_a = a, *cpu_b = b;
-
-    return cpu_a->cpu - cpu_b->cpu;
-}
-
-static struct perf_cpu_map* cpu_map__trim_new(int nr_cpus, const struct perf_cpu* tmp_cpus)
-{
-    size_t payload_size = nr_cpus * sizeof(struct perf_cpu);
-    struct perf_cpu_map* cpus = perf_cpu_map__alloc(nr_cpus);
-    int i, j;
 
+    cpus = perf_cpu_map__alloc(pmu_cpuset_count(&set));
     if (cpus != NULL)
     {
-        memcpy(cpus->map, tmp_cpus, payload_size);
-        qsort(cpus->map, nr_cpus, sizeof(struct perf_cpu), cmp_cpu);
-        /* Remove dups */
-        j = 0;
-        for (i = 0; i < nr_cpus; i++)
+        pmu_cpuset_for_each(cpu, &set)
         {
-            if (i == 0 || cpus->map[i].cpu != cpus->map[i - 1].cpu)
-            {
-                cpus->map[j++].cpu = cpus->map[i].cpu;
-            }
+            cpus->map[nr_cpus++].cpu = cpu;
         }
-        cpus->nr = j;
-        assert(j <= nr_cpus);
+        cpus->nr = nr_cpus;
     }
+out:
+    pmu_cpuset_release(&set);
     return cpus;
 }
 
@@ -432,8 +332,6 @@ struct perf_cpu_map* perf_cpu_map__new_online_cpus(void)
 #define MIDR_SIZE 19
 #define MIDR "/regs/identification/midr_el1"
 
-#define MIDR_REVISION_MASK GENMASK(3, 0)
-#define MIDR_VARIANT_MASK GENMASK(23, 20)
 
 static int _get_cpuid(char* buf, size_t sz, struct perf_cpu cpu)
 {
@@ -499,47 +397,4 @@ char* get_cpuid_str(struct perf_cpu cpu)
     return buf;
 }
 
-/*
- * Return 0 if idstr is a higher or equal to version of the same part as
- * mapcpuid. Therefore, if mapcpuid has 0 for revision and variant then any
- * version of idstr will match as long as it's the same CPU type.
- *
- * Return 1 if the CPU type is different or the version of idstr is lower.
- */
-int strcmp_cpuid_str(const char* mapcpuid, const char* idstr)
-{
-    uint64_t map_id = strtoull(mapcpuid, NULL, 16);
-    char map_id_variant = FIELD_GET(MIDR_VARIANT_MASK, map_id);
-    char map_id_revision = FIELD_GET(MIDR_REVISION_MASK, map_id);
-    uint64_t id = strtoull(idstr, NULL, 16);
-    char id_variant = FIELD_GET(MIDR_VARIANT_MASK, id);
-    char id_revision = FIELD_GET(MIDR_REVISION_MASK, id);
-    uint64_t id_fields = ~(MIDR_VARIANT_MASK | MIDR_REVISION_MASK);
-
-    /* Compare without version first */
-    if ((map_id & id_fields) != (id & id_fields))
-        return 1;
-
-    /*
-     * ID matches, now compare version.
-     *
-     * Arm revisions (like r0p0) are compared here like two digit semver
-     * values eg. 1.3 < 2.0 < 2.1 < 2.2.
-     *
-     *  r = high value = 'Variant' field in MIDR
-     *  p = low value  = 'Revision' field in MIDR
-     *
-     */
-    if (id_variant > map_id_variant)
-        return 0;
-
-    if (id_variant == map_id_variant && id_revision >= map_id_revision)
-        return 0;
-
-    /*
-     * variant is less than mapfile variant or variants are the same but
-     * the revision doesn't match. Return no match.
-     */
-    return 1;
-}
 #endif
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <pmu-events/pmu-events.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The resolved-event cache is a file holding the perf_event_attr of every event of a
+ * map on every core type of the host, optionally together with whether the event could
+ * be opened. It is built once per host and memory-mapped read-only by every later
+ * process, which then neither walks sysfs nor parses event strings:
+ *
+ *     struct pmu_events_cache* cache = pmu_events_cache_open(map, NULL, NULL);
+ *     if (cache == NULL && pmu_events_cache_build(map, NULL, PMU_EVENTS_CACHE_PROBE) == 0)
+ *     {
+ *         cache = pmu_events_cache_open(map, NULL, NULL);
+ *     }
+ *
+ * The cache is keyed by the kernel release and version, the cpuid string of the host,
+ * the map it was built for and a hash of the names, types and CPUs of the PMUs in
+ * sysfs. Opening a cache that does not match the host fails, so stale caches are
+ * rebuilt. Only the PMU directories are read to check this, not their formats.
+ */
+struct pmu_events_cache;
+
+#define PMU_EVENTS_CACHE_DEFAULT_PATH "/run/pmu-events/cache"
+
+/* Also try to open every resolved event on a CPU of each core type */
+#define PMU_EVENTS_CACHE_PROBE (1 << 0)
+
+/* The attr of the event could be generated */
+#define PMU_EVENTS_CACHE_RESOLVED (1 << 0)
+/* The event was probed when the cache was built */
+#define PMU_EVENTS_CACHE_PROBED (1 << 1)
+/* The event could be opened, with the privileges of the process that built the cache */
+#define PMU_EVENTS_CACHE_OPENABLE (1 << 2)
+
+/*
+ * Resolves all events of "map" against the topology snapshot (see pmu_topology_get())
+ * and writes them to "path", or PMU_EVENTS_CACHE_DEFAULT_PATH if it is NULL. The file
+ * is replaced atomically, so that processes that have the old one mapped keep it.
+ * "flags" is a combination of PMU_EVENTS_CACHE_PROBE.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_events_cache_build(const struct pmu_events_map* map, const char* path, unsigned flags);
+
+/*
+ * Maps the cache at "path" (PMU_EVENTS_CACHE_DEFAULT_PATH if NULL) if it was built for
+ * "map" on this host. "sysfs_root" is the root the PMUs are compared against, "/sys" if
+ * it is NULL.
+ *
+ * Returns NULL if there is no such cache, it is stale or on failure. The caller is
+ * responsible for closing the cache with pmu_events_cache_close().
+ */
+struct pmu_events_cache* pmu_events_cache_open(const struct pmu_events_map* map,
+                                               const char* path, const char* sysfs_root);
+
+void pmu_events_cache_close(struct pmu_events_cache* cache);
+
+/*
+ * Puts the type and config fields of the event "id" on "cpu" into "attr", as
+ * gen_attr_for_event_id() would on a zeroed attr.
+ *
+ * Returns the PMU_EVENTS_CACHE_* flags of the event, or -1 if "id" or "cpu" is out of
+ * range. "attr" is only filled if PMU_EVENTS_CACHE_RESOLVED is set.
+ */
+int pmu_events_cache_lookup(const struct pmu_events_cache* cache, pmu_event_id id,
+                            struct perf_cpu cpu, struct perf_event_attr* attr);
+
+#ifdef __cplusplus
+}
+#endif
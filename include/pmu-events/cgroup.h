@@ -0,0 +1,83 @@
+#pragma once
+
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/session.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Per-cgroup counting opens the groups of a session once per attached cgroup and CPU,
+ * with PERF_FLAG_PID_CGROUP, so that every cgroup (e.g. container) gets its own
+ * [cpu][event] counts matrix:
+ *
+ *     struct pmu_cgroups* cgroups = pmu_cgroups_new(session);
+ *     int id = pmu_cgroups_attach(cgroups, "/sys/fs/cgroup/system.slice/foo.service");
+ *     ...
+ *     pmu_cgroups_read(cgroups, id, counts);
+ *
+ * The groups and attrs are resolved once, in the session, and shared by all cgroups.
+ * Cgroups can be attached and detached at any time, e.g. as containers come and go,
+ * without touching the counters of the others. The cgroup directories are only kept
+ * open while the counters are opened, so every cgroup costs one fd per event and CPU
+ * the group is placed on (see pmu_session_open()).
+ */
+struct pmu_cgroups;
+
+/*
+ * Creates per-cgroup counting for the groups and CPUs of "session", which is only
+ * used as a template and neither needs to be opened, nor to outlive the result.
+ *
+ * Returns NULL on failure. The caller is responsible for freeing the result with
+ * pmu_cgroups_free().
+ */
+struct pmu_cgroups* pmu_cgroups_new(const struct pmu_session* session);
+
+/*
+ * Closes the counters of all cgroups and frees "cgroups"
+ */
+void pmu_cgroups_free(struct pmu_cgroups* cgroups);
+
+/*
+ * Opens the groups for the cgroup directory "path" on all CPUs. They are enabled
+ * right away if the cgroups are enabled.
+ *
+ * Returns the id of the cgroup, which is reused once it is detached, -1 on failure
+ * (with errno set by open() or perf_event_open)
+ */
+int pmu_cgroups_attach(struct pmu_cgroups* cgroups, const char* path);
+
+/*
+ * Closes the counters of the cgroup "id"
+ *
+ * Returns 0 on success, -1 if there is no such cgroup
+ */
+int pmu_cgroups_detach(struct pmu_cgroups* cgroups, int id);
+
+/*
+ * Enables or disables counting for all attached cgroups, and those attached later on
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_cgroups_enable(struct pmu_cgroups* cgroups);
+int pmu_cgroups_disable(struct pmu_cgroups* cgroups);
+
+/*
+ * Returns the number of attached cgroups
+ */
+size_t pmu_cgroups_num_attached(const struct pmu_cgroups* cgroups);
+
+/*
+ * Reads the counters of the cgroup "id" into "counts", in the layout of
+ * pmu_session_read(). The times are those since the cgroup was attached.
+ *
+ * Returns 0 on success, -1 if there is no such cgroup or on failure
+ */
+int pmu_cgroups_read(struct pmu_cgroups* cgroups, int id, struct pmu_count* counts);
+
+#ifdef __cplusplus
+}
+#endif
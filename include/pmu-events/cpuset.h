@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A set of CPU numbers as a bitmap of 64 bit words, e.g. the CPUs a PMU is responsible
+ * for or the online CPUs (see pmu_topology_pmu_cpuset() and pmu_topology_online()).
+ *
+ * Lookups are a single bit test, and counting, iterating and the set algebra work a word
+ * at a time, so they stay cheap on systems with thousands of CPUs:
+ *
+ *     struct pmu_cpuset cpus = PMU_CPUSET_INIT;
+ *     if (pmu_cpuset_parse(&cpus, "0-3,8") == 0 &&
+ *         pmu_cpuset_and(&cpus, pmu_topology_online(topo)) == 0)
+ *     {
+ *         long cpu;
+ *         pmu_cpuset_for_each(cpu, &cpus)
+ *         {
+ *             ...
+ *         }
+ *     }
+ *     pmu_cpuset_release(&cpus);
+ *
+ * A set grows as CPUs are added, the words beyond num_words are all 0. Sets are embedded
+ * by value, a zeroed set (PMU_CPUSET_INIT) is an empty set.
+ */
+struct pmu_cpuset
+{
+    uint64_t* words;
+    size_t num_words;
+};
+
+#define PMU_CPUSET_INIT { NULL, 0 }
+
+/* The highest CPU number a set can hold, plus one */
+#define PMU_CPUSET_MAX_CPUS 65536
+
+/*
+ * Initializes "set" as an empty set with room for the CPUs [0, num_cpus)
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_cpuset_init(struct pmu_cpuset* set, size_t num_cpus);
+
+/*
+ * Frees the words of "set", which is empty afterwards
+ */
+void pmu_cpuset_release(struct pmu_cpuset* set);
+
+/*
+ * Replaces the CPUs of "set" with those of the CPU list "list" in the format of sysfs,
+ * e.g. "0-3,8-11\n". An empty list is an empty set.
+ *
+ * Returns 0 on success, -1 on failure with errno set to EINVAL for malformed lists and
+ * ERANGE for CPUs beyond PMU_CPUSET_MAX_CPUS. "set" is unchanged on failure.
+ */
+int pmu_cpuset_parse(struct pmu_cpuset* set, const char* list);
+
+/*
+ * Formats "set" as a CPU list, e.g. "0-3,8-11", "" for an empty set
+ *
+ * Returns NULL on failure. The caller is responsible for free()-ing the result.
+ */
+char* pmu_cpuset_format(const struct pmu_cpuset* set);
+
+/*
+ * Adds the CPUs [first, last] to "set"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_cpuset_add_range(struct pmu_cpuset* set, size_t first, size_t last);
+
+int pmu_cpuset_add(struct pmu_cpuset* set, size_t cpu);
+
+void pmu_cpuset_remove(struct pmu_cpuset* set, size_t cpu);
+
+/*
+ * Removes all CPUs from "set", keeping its words
+ */
+void pmu_cpuset_clear(struct pmu_cpuset* set);
+
+static inline bool pmu_cpuset_test(const struct pmu_cpuset* set, size_t cpu)
+{
+    return cpu / 64 < set->num_words && ((set->words[cpu / 64] >> (cpu % 64)) & 1);
+}
+
+size_t pmu_cpuset_count(const struct pmu_cpuset* set);
+
+bool pmu_cpuset_empty(const struct pmu_cpuset* set);
+
+/*
+ * Returns the lowest CPU of "set" that is not below "cpu", -1 if there is none
+ */
+long pmu_cpuset_next(const struct pmu_cpuset* set, size_t cpu);
+
+/*
+ * Returns the highest CPU of "set", -1 if it is empty
+ */
+long pmu_cpuset_last(const struct pmu_cpuset* set);
+
+/*
+ * Iterates the long "cpu" over the CPUs of "set" in ascending order
+ */
+#define pmu_cpuset_for_each(cpu, set)                                                              \
+    for ((cpu) = pmu_cpuset_next((set), 0); (cpu) != -1; (cpu) = pmu_cpuset_next((set), (cpu) + 1))
+
+/*
+ * Makes "dst" a copy of "src"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_cpuset_copy(struct pmu_cpuset* dst, const struct pmu_cpuset* src);
+
+/*
+ * The set algebra, in place on "dst": the intersection, the union and the CPUs of "dst"
+ * that are not in "src". Only pmu_cpuset_or() grows "dst", and can fail.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_cpuset_and(struct pmu_cpuset* dst, const struct pmu_cpuset* src);
+int pmu_cpuset_or(struct pmu_cpuset* dst, const struct pmu_cpuset* src);
+int pmu_cpuset_andnot(struct pmu_cpuset* dst, const struct pmu_cpuset* src);
+
+bool pmu_cpuset_equal(const struct pmu_cpuset* a, const struct pmu_cpuset* b);
+
+/*
+ * Returns true if every CPU of "a" is in "b"
+ */
+bool pmu_cpuset_subset(const struct pmu_cpuset* a, const struct pmu_cpuset* b);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/topology.h>
+
+#include <linux/perf_event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The event decoder turns the type and config fields of a perf_event_attr, e.g. from
+ * a perf.data file, back into the event of a pmu_events_map.
+ *
+ * The config fields are split into terms (event=0xd1,umask=0x1) with the format
+ * definitions of the PMU of attr->type, and the terms are looked up in a hash index
+ * generated by jevents.py, so decoding costs a few hash probes per attr.
+ */
+struct pmu_event_decoder;
+
+/* The attr matches all terms of the event */
+#define PMU_EVENT_DECODE_EXACT 0
+/* Only the event and umask terms match, e.g. because a cmask or inv was added */
+#define PMU_EVENT_DECODE_PARTIAL 1
+
+/*
+ * Creates a decoder for the events of "map", with the PMU types and formats of "topo".
+ * If "topo" is NULL, pmu_topology_get() is used. The formats are copied, so "topo" may
+ * be freed or refreshed afterwards.
+ *
+ * Returns NULL on failure. The caller is responsible for freeing the decoder with
+ * pmu_event_decoder_free().
+ */
+struct pmu_event_decoder* pmu_event_decoder_new(const struct pmu_events_map* map,
+                                                const struct pmu_topology* topo);
+
+void pmu_event_decoder_free(struct pmu_event_decoder* dec);
+
+/*
+ * Looks up the event "attr" was generated for (see gen_attr_for_event()), and puts its
+ * id into "id".
+ *
+ * Returns PMU_EVENT_DECODE_EXACT or PMU_EVENT_DECODE_PARTIAL on success, -1 if no
+ * event matches.
+ */
+int pmu_event_decode(const struct pmu_event_decoder* dec, const struct perf_event_attr* attr,
+                     pmu_event_id* id);
+
+#ifdef __cplusplus
+}
+#endif
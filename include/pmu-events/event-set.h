@@ -0,0 +1,97 @@
+#pragma once
+
+#include <pmu-events/pmu-events.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event sets compare the events of different pmu_events_maps, e.g. to find the
+ * events that can be counted the same way on every CPU model of a fleet:
+ *
+ *     struct pmu_event_set* common = pmu_event_set_new(models[0]);
+ *     for (size_t i = 1; i < num_models && common != NULL; i++)
+ *     {
+ *         struct pmu_event_set* other = pmu_event_set_new(models[i]);
+ *         struct pmu_event_set* next =
+ *             pmu_event_set_intersect(common, other, PMU_EVENT_SET_SAME_ENCODING);
+ *         pmu_event_set_free(other);
+ *         pmu_event_set_free(common);
+ *         common = next;
+ *     }
+ *
+ * Events of different maps are the same if they have the same name and PMU.
+ * As the ids of a map are assigned in (PMU, name) order, all operations are
+ * merge-joins over the ids of both sets, which only look at the event names,
+ * and only decompress the events that have to be checked for the same encoding.
+ */
+
+/*
+ * Events only match if their event strings have the same terms, ignoring
+ * the order, the period and terms that are 0
+ */
+#define PMU_EVENT_SET_SAME_ENCODING (1 << 0)
+
+struct pmu_event_set
+{
+    const struct pmu_events_map* map;
+    /* The ids of the events of "map" in the set, in ascending order */
+    pmu_event_id* ids;
+    size_t num_ids;
+};
+
+struct pmu_event_pair
+{
+    /* The id of the event in the map of the first set */
+    pmu_event_id a;
+    /* The id of the same event in the map of the second set */
+    pmu_event_id b;
+};
+
+/*
+ * Creates the set of all events of "map".
+ *
+ * Returns NULL on failure. The caller is responsible for freeing the set with
+ * pmu_event_set_free().
+ */
+struct pmu_event_set* pmu_event_set_new(const struct pmu_events_map* map);
+
+void pmu_event_set_free(struct pmu_event_set* set);
+
+/*
+ * Returns the set of the events of "a" that are also in "b", with the ids of the
+ * map of "a". "flags" is a combination of PMU_EVENT_SET_* flags.
+ *
+ * Returns NULL on failure. The caller is responsible for freeing the set with
+ * pmu_event_set_free().
+ */
+struct pmu_event_set* pmu_event_set_intersect(const struct pmu_event_set* a,
+                                              const struct pmu_event_set* b, unsigned flags);
+
+/*
+ * Returns the set of the events of "a" that are not in "b", with the ids of the
+ * map of "a". With PMU_EVENT_SET_SAME_ENCODING, this includes the events of "a"
+ * that are encoded differently in "b".
+ *
+ * Returns NULL on failure. The caller is responsible for freeing the set with
+ * pmu_event_set_free().
+ */
+struct pmu_event_set* pmu_event_set_difference(const struct pmu_event_set* a,
+                                               const struct pmu_event_set* b, unsigned flags);
+
+/*
+ * Pairs the events of "a" with the same events of "b", ordered by the ids of "a".
+ * The pairs are put into "pairs", which has to be freed by the caller, and their
+ * number into "num_pairs".
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_event_set_join(const struct pmu_event_set* a, const struct pmu_event_set* b,
+                       unsigned flags, struct pmu_event_pair** pairs, size_t* num_pairs);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <pmu-events/pmu-events.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The PMU topology snapshot (see topology.h) and the map_for_cpu() cache
+ * go stale when CPUs are hot(un)plugged or PMU drivers are loaded later on.
+ *
+ * Long-running users keep them up to date by either calling
+ * pmu_events_check_changes() periodically, or by polling the fd returned by
+ * pmu_events_uevent_open() and calling pmu_events_uevent_process() whenever
+ * it becomes readable. Only the affected CPUs and PMUs are re-read.
+ *
+ * A refresh publishes a new snapshot, pmu_topology_get() returns it from then on.
+ * Pointers into the previous snapshot stay valid until the library is unloaded.
+ */
+
+/*
+ * Describes what changed since the last check
+ */
+struct pmu_events_change
+{
+    struct perf_cpu* cpus_online;
+    size_t num_cpus_online;
+    struct perf_cpu* cpus_offline;
+    size_t num_cpus_offline;
+    char** pmus_added;
+    size_t num_pmus_added;
+    char** pmus_removed;
+    size_t num_pmus_removed;
+};
+
+typedef void (*pmu_events_change_cb)(const struct pmu_events_change* change, void* data);
+
+/*
+ * Registers "cb" to be called with "data" after every refresh that found changes.
+ * Callbacks may (un)register callbacks, a callback removed during a notification is
+ * not called anymore.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_events_add_change_callback(pmu_events_change_cb cb, void* data);
+
+/*
+ * Unregisters a callback registered with the same "cb" and "data".
+ *
+ * Returns 0 on success, -1 if there is no such callback
+ */
+int pmu_events_remove_change_callback(pmu_events_change_cb cb, void* data);
+
+/*
+ * Compares devices/system/cpu/online and the list of PMUs in
+ * bus/event_source/devices against the topology snapshot, publishes a
+ * refreshed snapshot and notifies the registered callbacks. Concurrent
+ * calls are serialized.
+ *
+ * Returns 1 if something changed, 0 if not and -1 on failure
+ */
+int pmu_events_check_changes(void);
+
+/*
+ * Opens a netlink socket listening for kernel uevents.
+ *
+ * Returns a non-blocking fd that becomes readable on uevents, or -1 on failure.
+ * The caller is responsible for close()-ing it.
+ */
+int pmu_events_uevent_open(void);
+
+/*
+ * Drains all pending uevents from "fd". If any of them concern CPUs or PMUs,
+ * pmu_events_check_changes() is run.
+ *
+ * Returns 1 if something changed, 0 if not and -1 on failure
+ */
+int pmu_events_uevent_process(int fd);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <pmu-events/pmu-events.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The metric planner turns a list of metrics and metric groups into the
+ * minimal set of events that has to be counted for them.
+ *
+ * Metrics are expanded recursively, as metric expressions refer to other
+ * metrics (e.g. "tma_info_thread_slots"). Events referenced by more than one
+ * metric are only counted once. The events of each metric are grouped per
+ * PMU, so that the ratios within a metric are computed from counts over the
+ * same time, and groups that are a subset of another group are dropped.
+ */
+
+/* Also plan for the events and metrics referenced by the metric thresholds */
+#define METRIC_PLAN_THRESHOLDS (1 << 0)
+
+/* Parsed metric expression, opaque to callers */
+struct metric_expr;
+
+struct metric_plan_event
+{
+    /* The PMU to count on, e.g. "default_core", "cpu_core", "uncore_imc" or "tool" */
+    char* pmu;
+    /* The lower-cased event name, e.g. "inst_retired.any" or "topdown-be-bound" */
+    char* name;
+    /* The modifiers of the event, e.g. "k" for "CPU_CLK_UNHALTED.THREAD_P:k", NULL if none */
+    char* modifiers;
+    /* The id of the event in the map of the plan, PMU_EVENT_ID_NONE if it is not in there */
+    pmu_event_id id;
+};
+
+struct metric_plan_group
+{
+    /* Indices into metric_plan->events, the first one is the group leader */
+    size_t* events;
+    size_t num_events;
+};
+
+struct metric_plan_metric
+{
+    struct pmu_metric metric;
+    pmu_metric_id id;
+    /* false if the metric was not requested, but is referenced by another metric */
+    bool requested;
+    /*
+     * The event slots (indices into metric_plan->events) the expression, or its threshold,
+     * refers to directly
+     */
+    size_t* events;
+    size_t num_events;
+    /*
+     * The metrics (indices into metric_plan->metrics) the expression refers to directly.
+     * These always come before the metric itself.
+     */
+    size_t* metrics;
+    size_t num_metrics;
+    struct metric_expr* expr;
+    /* NULL if the metric has no threshold or METRIC_PLAN_THRESHOLDS was not given */
+    struct metric_expr* threshold;
+};
+
+struct metric_plan
+{
+    struct metric_plan_event* events;
+    size_t num_events;
+    struct metric_plan_group* groups;
+    size_t num_groups;
+    /* Ordered such that every metric comes after the metrics it refers to */
+    struct metric_plan_metric* metrics;
+    size_t num_metrics;
+};
+
+/*
+ * Plans the events for the metrics in "map" that are named, or in a metric group
+ * named, by one of the "num_names" entries of "names". Names are compared ignoring case.
+ * "flags" is a combination of METRIC_PLAN_* flags.
+ *
+ * Returns NULL if one of the names matches nothing, an expression does not parse
+ * or on failure. The caller is responsible for freeing the plan with metric_plan_free().
+ */
+struct metric_plan* metric_plan_new(const struct pmu_events_map* map, const char* const* names,
+                                    size_t num_names, unsigned flags);
+
+void metric_plan_free(struct metric_plan* plan);
+
+/*
+ * The same as gen_attr_for_event(), for an event of a plan created from "map".
+ *
+ * Besides the events of the map, this handles events with further terms (e.g.
+ * "uops_decoded.dec0,cmask=1") and the aliases in the events/ directory of the
+ * PMU in sysfs (e.g. "topdown-retiring" or "slots"). The modifiers of the event
+ * are applied like those of pmu_parse_events(), e.g. "k" sets exclude_user and exclude_hv.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int gen_attr_for_plan_event(const struct pmu_events_map* map, const struct metric_plan_event* ev,
+                            struct perf_cpu cpu, struct perf_event_attr* attr);
+
+/*
+ * The metric evaluator computes the metrics of a plan, and their thresholds, from
+ * the per-interval deltas of the planned events on many CPUs at once.
+ *
+ * Every metric expression is compiled to a small stack program, which is run over
+ * batches of CPUs, so that every instruction is a tight loop over an array.
+ *
+ * Only changes of the threshold state are reported: a metric of a CPU "crosses"
+ * when its threshold starts or stops to hold. Initially, no threshold holds.
+ */
+struct metric_evaluator;
+
+struct metric_threshold_crossing
+{
+    /* Index into metric_plan->metrics */
+    size_t metric;
+    /* Index of the CPU in the deltas, not the CPU number */
+    size_t cpu;
+    /* true if the threshold holds now, false if it stopped to hold */
+    bool above;
+    /* The value of the metric in this interval */
+    double value;
+};
+
+typedef void (*metric_threshold_cb)(const struct metric_threshold_crossing* crossing, void* data);
+
+/*
+ * Creates an evaluator for the metrics of "plan" on "num_cpus" CPUs. Thresholds are only
+ * evaluated if the plan was created with METRIC_PLAN_THRESHOLDS. "map" has to be the map
+ * the plan was created from. The plan has to outlive the evaluator.
+ *
+ * Runtime constants like #smt_on or #num_packages are read from the system once.
+ *
+ * Returns NULL on failure. The caller is responsible for freeing the evaluator with
+ * metric_evaluator_free().
+ */
+struct metric_evaluator* metric_evaluator_new(const struct metric_plan* plan,
+                                              const struct pmu_events_map* map, size_t num_cpus);
+
+void metric_evaluator_free(struct metric_evaluator* eval);
+
+/*
+ * Makes the evaluator compute every metric at the granularity of its aggr_mode: PerCore
+ * metrics from the deltas summed over the SMT siblings of a core, PerChip metrics from
+ * the deltas summed over a package. Metrics without an aggr_mode stay per CPU. "cpus"
+ * holds the CPU number of each CPU of the deltas, the cores and packages are read from
+ * the topology/ directories of the CPUs in sysfs. A CPU whose package or core is unknown
+ * forms a core and a package of its own.
+ *
+ * Every CPU gets the value of its core or package, threshold crossings are reported once
+ * per core or package, for its first CPU in "cpus". The metrics a metric refers to are
+ * computed from the same sums as the metric itself. The threshold state is reset.
+ *
+ * Returns 0 on success, -1 on failure, after which the evaluator can only be freed
+ */
+int metric_evaluator_aggregate(struct metric_evaluator* eval, const struct perf_cpu* cpus);
+
+/*
+ * Evaluates one interval. "deltas" holds the change of every planned event on every CPU
+ * in the interval, with the delta of event e on the c-th CPU in deltas[e * num_cpus + c].
+ *
+ * "cb" is called with "data" for every threshold crossing.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int metric_evaluator_push(struct metric_evaluator* eval, const double* deltas,
+                          metric_threshold_cb cb, void* data);
+
+/*
+ * Returns the values of the metric with the index "metric" for all CPUs, as computed
+ * by the last metric_evaluator_push(), or NULL if "metric" is out of range.
+ */
+const double* metric_evaluator_values(const struct metric_evaluator* eval, size_t metric);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <pmu-events/pmu-events.h>
+
+#include <stddef.h>
+
+#include <linux/perf_event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Parses event specifications in the syntax of perf, e.g.
+ *
+ *     cpu/event=0x3c,umask=0,cmask=1,inv/ukpp
+ *     {cycles,instructions}:S
+ *     uncore_imc/cas_count_read/,inst_retired.any:u
+ *
+ * A specification is a comma separated list of events and groups of events in braces.
+ * An event is either
+ *  - the name of an event, which is resolved like get_event_by_name() does, or a raw
+ *    event "rNNN" with a hex config, or
+ *  - "pmu/terms/", a PMU with a comma separated list of terms. A "key=value" term puts
+ *    the value (decimal, or hex with 0x) into the bits the format "key" of the PMU
+ *    describes. "config", "config1" and "config2" set those fields, "period" and "freq"
+ *    the sampling period or frequency, "name" is ignored. A term without a value is a
+ *    format set to 1 (e.g. "inv"), an alias in the events/ directory of the PMU
+ *    (e.g. "cas_count_read") or an event of the PMU in the tables.
+ *
+ * Events and groups may be followed by modifiers, after a ':' or, for "pmu/terms/",
+ * directly after the closing '/':
+ *  - u, k, h: only count in user space, the kernel or the hypervisor, combinable
+ *  - G, H: only count in the guest or on the host
+ *  - I: do not count while the CPU is idle
+ *  - p: one more level of precise_ip, up to 3; P: precise_ip 3
+ *  - S: the leader samples the counts of the whole group (PERF_SAMPLE_READ), the other
+ *    members do not sample on their own
+ *  - D: pin the group (or the event) to the PMU
+ * The modifiers of a group apply to all of its members, after their own modifiers.
+ */
+
+struct pmu_parsed_event
+{
+    /* The event in the specification, e.g. "cpu/event=0x3c/u", not null-terminated */
+    const char* spec;
+    size_t spec_len;
+    struct perf_event_attr attr;
+    /* The index of the leader of the group of the event, its own index if it is no member */
+    size_t leader;
+};
+
+/*
+ * Parses the specification "spec" in one pass, resolving the events against "map" and
+ * the PMUs of the topology snapshot (see pmu_topology_get()) for "cpu". The events are
+ * put into "events", which has room for "max_events" events, in the order of "spec"
+ * and with the leader of a group first. Nothing is allocated, apart from what the
+ * topology snapshot reads on first use.
+ *
+ * Returns the number of events on success, -1 on failure with errno set to EINVAL for
+ * malformed specifications, ENOENT for events or PMUs that do not exist and ENOSPC if
+ * there are more than "max_events" events. If "error_offset" is not NULL, the offset
+ * into "spec" where parsing failed is put into it.
+ */
+int pmu_parse_events(const struct pmu_events_map* map, struct perf_cpu cpu, const char* spec,
+                     struct pmu_parsed_event* events, size_t max_events, size_t* error_offset);
+
+#ifdef __cplusplus
+}
+#endif
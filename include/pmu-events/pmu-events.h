@@ -12,6 +12,10 @@
 
 #include <linux/perf_event.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct perf_cpu {
 	int16_t cpu;
 };
@@ -67,6 +71,12 @@ struct pmu_event {
 	const char *retirement_latency_max;
 	bool perpkg;
 	bool deprecated;
+	/* The PEBS level of the JSON files: 0 none, 1 precise, 2 must be precise */
+	int precise;
+	/* Samples of the event can hold the data address (Data_LA) */
+	bool data_la;
+	/* The event is counted on a fixed counter, not on one of the generic counters */
+	bool fixed_counter;
 };
 
 struct pmu_metric {
@@ -92,19 +102,49 @@ struct pmu_table_entry {
         const struct compact_pmu_event *entries;
         uint32_t num_entries;
         struct compact_pmu_event pmu_name;
+        /* The id of entries[0], the entries of a table are numbered densely */
+        uint32_t first_id;
+        /* The generic counters of the PMU per hardware thread, 0 if unknown */
+        uint32_t num_generic_counters;
 };
 
 
+struct pmu_config_index_entry {
+        /*
+         * FNV-1a of "pmu\0", combined with the FNV-1a of the "key=0xvalue" terms,
+         * sorted by key and without period, see config_hash() in jevents.py
+         */
+        uint64_t hash;
+        /* The event id + 1, 0 for empty slots */
+        uint32_t id;
+};
+
+/* Open addressing hash table with linear probing, size is a power of two */
+struct pmu_config_index {
+        const struct pmu_config_index_entry *entries;
+        uint32_t size;
+};
+
 /* Struct used to make the PMU event table implementation opaque to callers. */
 struct pmu_events_table {
         const struct pmu_table_entry *pmus;
         uint32_t num_pmus;
+        /* The ids of all events of the table, sorted by name */
+        const uint32_t *by_name;
+        uint32_t num_events;
+        /* Reverse index by all terms of the event string */
+        struct pmu_config_index by_config;
+        /* Reverse index by only the event and umask terms */
+        struct pmu_config_index by_event_umask;
 };
 
 /* Struct used to make the PMU metric table implementation opaque to callers. */
 struct pmu_metrics_table {
         const struct pmu_table_entry *pmus;
         uint32_t num_pmus;
+        /* The ids of all metrics of the table, sorted by lower-cased name */
+        const uint32_t *by_name;
+        uint32_t num_metrics;
 };
 
 /*
@@ -128,6 +168,17 @@ struct pmu_events_map {
  */
 const struct pmu_events_map *map_for_cpu(struct perf_cpu cpu);
 
+/*
+ * Returns the map of the architecture "arch" (e.g. "x86" or "arm64", any if NULL)
+ * for the cpuid string "cpuid", in the format get_cpuid_str() has on that
+ * architecture (e.g. "GenuineIntel-6-55-4" or "0x00000000410fd0c0"), or NULL if
+ * there is none.
+ *
+ * Unlike map_for_cpu(), this does not look at the local CPU, so it can be used to
+ * analyze data recorded on other hosts.
+ */
+const struct pmu_events_map* map_for_cpuid(const char* arch, const char* cpuid);
+
 /*
  * Non-Linux functions
  */
@@ -144,27 +195,154 @@ const struct pmu_events_map* all_pmu_events_maps();
  */
 void decompress_event(int offset, struct pmu_event *pe);
 
+/*
+ * The same as decompress_event(), but for the entries of a pmu_metrics_table
+ */
+void decompress_metric(int offset, struct pmu_metric *pm);
+
 /*
  * For a pmu_table_entry, get the name of the pmu
  */
 const char *get_pmu_name(struct pmu_table_entry entry);
 
+/*
+ * Get the name of a compressed event, without decompressing all of it
+ */
+const char *get_compact_event_name(struct compact_pmu_event event);
+
 /*
  * Resolve the event name "ev" in the pmu_events_map "map", and put the result into the
  * given "pmu_ev"
  *
+ * Events that are not in the map are looked up in the aliases in the events/ directories
+ * of the PMUs in sysfs (e.g. "cycles" or "energy-pkg"), see pmu_topology_pmu_alias().
+ * The unit of those holds their scale and unit, like the ScaleUnit of the tables.
+ * Before that, the software and tool events of arch/common (e.g. "cs" or "duration_time")
+ * are looked up.
+ *
  * Return 0 on success, -1 on failure
  */
 int get_event_by_name(const struct pmu_events_map* map, const char* ev, struct pmu_event* pmu_ev);
 
+/*
+ * Resolve the metric name "metric" (ignoring case) in the pmu_events_map "map", and put the
+ * result into the given "pmu_metric"
+ *
+ * Return 0 on success, -1 on failure
+ */
+int get_metric_by_name(const struct pmu_events_map* map, const char* metric,
+                       struct pmu_metric* pmu_metric);
+
+/*
+ * Every event and metric of a pmu_events_map has an id in [0, number of events/metrics),
+ * so the ids can be stored instead of names and used to index flat arrays. The ids are
+ * generated by jevents.py and stay the same as long as the JSON files of a map do.
+ */
+typedef uint32_t pmu_event_id;
+typedef uint32_t pmu_metric_id;
+
+/* Marks the absence of an event, e.g. in struct metric_plan_event */
+#define PMU_EVENT_ID_NONE UINT32_MAX
+
+uint32_t pmu_events_num_events(const struct pmu_events_map* map);
+uint32_t pmu_events_num_metrics(const struct pmu_events_map* map);
+
+/*
+ * Returns the number of generic counters per hardware thread of the PMU "pmu" (e.g.
+ * "default_core" or "cpu_atom") of "map", from the counter.json of the model, 0 if unknown.
+ * Events with fixed_counter set do not take one of these.
+ */
+uint32_t pmu_events_num_generic_counters(const struct pmu_events_map* map, const char* pmu);
+
+/*
+ * Looks up the id of the event "ev" on the PMU "pmu" in "map". If "pmu" is NULL,
+ * the event of the alphabetically first PMU is returned, like get_event_by_name() does.
+ *
+ * Returns 0 on success, -1 if there is no such event
+ */
+int get_event_id(const struct pmu_events_map* map, const char* pmu, const char* ev,
+                 pmu_event_id* id);
+
+/*
+ * Puts the event with the id "id" in "map" into "pmu_ev"
+ *
+ * Returns 0 on success, -1 if "id" is out of range
+ */
+int get_event_by_id(const struct pmu_events_map* map, pmu_event_id id, struct pmu_event* pmu_ev);
+
+/*
+ * The same as get_event_id(), but for metrics, whose names are compared ignoring case
+ */
+int get_metric_id(const struct pmu_events_map* map, const char* pmu, const char* metric,
+                  pmu_metric_id* id);
+
+int get_metric_by_id(const struct pmu_events_map* map, pmu_metric_id id,
+                     struct pmu_metric* pmu_metric);
+
+/*
+ * The perf_event_attr type of the events of the "tool" PMU in arch/common (e.g.
+ * "duration_time" or "user_time"). The kernel does not know them, they can only be
+ * counted in a session (see <pmu-events/session.h>), which reads them in the library.
+ */
+#define PMU_EVENTS_TYPE_TOOL 0xfffffffeU
+
 /*
  * For the given pmu_event, and cpu, set the config[12] fields of the given perf_event_attr
  * structure to the values supplied by the event, so that the event can later be opened with
  * perf_event_open.
  *
+ * Events of the "software" PMU get PERF_TYPE_SOFTWARE, those of the "tool" PMU
+ * PMU_EVENTS_TYPE_TOOL, neither needs the PMU in sysfs.
+ *
  * Returns 0 on success, -1 on failure
  */
 int gen_attr_for_event(const struct pmu_event* ev, struct perf_cpu cpu,
                        struct perf_event_attr* attr);
 
+/* Set the attr up for sampling, with the period and PEBS level of the tables */
+#define PMU_EVENT_SAMPLE (1 << 0)
+/*
+ * Set the attr up for memory sampling (load latency on x86), which implies PMU_EVENT_SAMPLE:
+ * with PMU_EVENT_SAMPLE_MEM_TYPE, at least precise_ip 1 and mmap_data, for the load
+ * latency threshold of the "ldlat" term of the tables
+ */
+#define PMU_EVENT_SAMPLE_MEM (1 << 1)
+
+/*
+ * The sample_type of PMU_EVENT_SAMPLE_MEM: where and when the access happened, its data
+ * address, where the data came from and the latency (weight) of the access
+ */
+#define PMU_EVENT_SAMPLE_MEM_TYPE                                                                  \
+    (PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_CPU | PERF_SAMPLE_ADDR |    \
+     PERF_SAMPLE_DATA_SRC | PERF_SAMPLE_WEIGHT)
+
+/*
+ * The same as gen_attr_for_event(), but for sampling: with PMU_EVENT_SAMPLE in "flags",
+ * sample_period is the "period" term (the SampleAfterValue of the tables) and precise_ip
+ * the PEBS level of the event. With PMU_EVENT_SAMPLE_MEM, see above, the event has to be
+ * one whose samples hold data addresses (pmu_event.data_la).
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int gen_sample_attr_for_event(const struct pmu_event* ev, struct perf_cpu cpu, unsigned flags,
+                              struct perf_event_attr* attr);
+
+/*
+ * The same as gen_attr_for_event(), for the event with the id "id" in "map"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int gen_attr_for_event_id(const struct pmu_events_map* map, pmu_event_id id,
+                          struct perf_cpu cpu, struct perf_event_attr* attr);
+
+/*
+ * Returns the sampling period the tables give the event, the "period" term from the
+ * SampleAfterValue of the JSON files, or 0 if it has none
+ */
+uint64_t pmu_event_sample_after_value(const struct pmu_event* ev);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,429 @@
+#pragma once
+
+/*
+ * Compile-time event lookup for C++20 consumers.
+ *
+ * jevents.py generates one header per model, <pmu-events/models/<model>.hpp>,
+ * with a constexpr table of all events of that model:
+ *
+ *     #include <pmu-events/models/skylake.hpp>
+ *
+ *     constexpr auto& ev = pmu_events::models::skylake::event("inst_retired.any");
+ *     constexpr auto enc = pmu_events::encode(ev);
+ *     static_assert(enc.get("event") == 0xc0);
+ *
+ *     struct pmu_event c_ev = ev.to_pmu_event(); // for gen_attr_for_event()
+ *
+ * A misspelled event name does not compile. <pmu-events/models.hpp> lists the
+ * models and the cpuids they are used for.
+ */
+
+#include <pmu-events/pmu-events.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace pmu_events
+{
+
+/*
+ * 64-bit FNV-1a, the same hash jevents.py uses to sort the tables
+ */
+constexpr std::uint64_t fnv1a(std::string_view str)
+{
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char c : str)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * The same information as struct pmu_event, usable in constant expressions.
+ * Fields that are not set in the JSON files are nullptr.
+ */
+struct event_desc
+{
+    std::uint64_t hash;
+    /* The id of the event in the pmu_events_map of the model, see get_event_by_id() */
+    pmu_event_id id;
+    const char* name;
+    const char* pmu;
+    const char* topic;
+    const char* desc;
+    const char* event;
+    const char* compat;
+    const char* unit;
+    const char* retirement_latency_mean;
+    const char* retirement_latency_min;
+    const char* retirement_latency_max;
+    const char* long_desc;
+    bool perpkg;
+    bool deprecated;
+    int precise;
+    bool data_la;
+    bool fixed_counter;
+
+    /*
+     * Converts to the C struct pmu_event, which points to the same strings
+     */
+    constexpr struct pmu_event to_pmu_event() const
+    {
+        struct pmu_event ev{};
+        ev.name = name;
+        ev.compat = compat;
+        ev.event = event;
+        ev.desc = desc;
+        ev.topic = topic;
+        ev.long_desc = long_desc;
+        ev.pmu = pmu;
+        ev.unit = unit;
+        ev.retirement_latency_mean = retirement_latency_mean;
+        ev.retirement_latency_min = retirement_latency_min;
+        ev.retirement_latency_max = retirement_latency_max;
+        ev.perpkg = perpkg;
+        ev.deprecated = deprecated;
+        ev.precise = precise;
+        ev.data_la = data_la;
+        ev.fixed_counter = fixed_counter;
+        return ev;
+    }
+};
+
+/*
+ * Deliberately not constexpr: reaching one of these during constant evaluation
+ * turns the lookup or encoding into a compile error naming the problem.
+ */
+void unknown_event_name();
+void malformed_event_terms();
+void unknown_event_term();
+
+/*
+ * The events of one model, sorted by (hash, name, pmu)
+ */
+template <std::size_t N>
+struct event_table
+{
+    std::array<event_desc, N> events;
+
+    /*
+     * Returns the event "name" on "pmu" (any PMU if empty), or nullptr if there is none.
+     * If the event exists on several PMUs, the one with the alphabetically first PMU is returned.
+     */
+    constexpr const event_desc* lookup(std::string_view name, std::string_view pmu = {}) const
+    {
+        std::uint64_t hash = fnv1a(name);
+        std::size_t low = 0, high = N;
+
+        while (low < high)
+        {
+            std::size_t mid = low + (high - low) / 2;
+            if (events[mid].hash < hash)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        for (std::size_t i = low; i < N && events[i].hash == hash; i++)
+        {
+            if (name == events[i].name && (pmu.empty() || pmu == events[i].pmu))
+            {
+                return &events[i];
+            }
+        }
+        return nullptr;
+    }
+
+    /*
+     * The same as lookup(), but fails to compile if there is no such event
+     */
+    consteval const event_desc& get(std::string_view name, std::string_view pmu = {}) const
+    {
+        const event_desc* ev = lookup(name, pmu);
+        if (ev == nullptr)
+        {
+            unknown_event_name();
+        }
+        return *ev;
+    }
+};
+
+/*
+ * A single term of an event string, e.g. "umask=0x1"
+ */
+struct event_term
+{
+    std::string_view key;
+    std::uint64_t value;
+};
+
+/*
+ * The parsed terms of an event string like "event=0x3c,period=2000003"
+ */
+struct event_encoding
+{
+    static constexpr std::size_t max_terms = 16;
+
+    std::array<event_term, max_terms> terms;
+    std::size_t num_terms;
+
+    constexpr bool has(std::string_view key) const
+    {
+        for (std::size_t i = 0; i < num_terms; i++)
+        {
+            if (terms[i].key == key)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     * Returns the value of the term "key", or "fallback" if there is no such term
+     */
+    constexpr std::uint64_t get(std::string_view key, std::uint64_t fallback = 0) const
+    {
+        for (std::size_t i = 0; i < num_terms; i++)
+        {
+            if (terms[i].key == key)
+            {
+                return terms[i].value;
+            }
+        }
+        return fallback;
+    }
+};
+
+namespace detail
+{
+/*
+ * Parses a number in "base", or hexadecimal with a "0x" prefix
+ */
+constexpr std::uint64_t parse_number(std::string_view str, std::uint64_t base = 10)
+{
+    if (str.size() > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+    {
+        base = 16;
+        str.remove_prefix(2);
+    }
+    if (str.empty())
+    {
+        malformed_event_terms();
+    }
+
+    std::uint64_t value = 0;
+    for (char c : str)
+    {
+        std::uint64_t digit;
+        if (c >= '0' && c <= '9')
+        {
+            digit = c - '0';
+        }
+        else if (base == 16 && c >= 'a' && c <= 'f')
+        {
+            digit = c - 'a' + 10;
+        }
+        else if (base == 16 && c >= 'A' && c <= 'F')
+        {
+            digit = c - 'A' + 10;
+        }
+        else
+        {
+            malformed_event_terms();
+            return 0;
+        }
+        value = value * base + digit;
+    }
+    return value;
+}
+
+/*
+ * Parses the value of the term "key" like event_term_base() does at runtime: the
+ * period and the counter mask are decimal, all other terms hexadecimal, "None" is 0
+ */
+constexpr std::uint64_t parse_term_value(std::string_view key, std::string_view value)
+{
+    if (value == "None")
+    {
+        return 0;
+    }
+    return parse_number(value, key == "period" || key == "cmask" ? 10 : 16);
+}
+} // namespace detail
+
+/*
+ * Parses an event string like "event=0x3c,period=2000003" at compile time.
+ * A term without a value, e.g. "inv", is the same as "inv=1".
+ */
+consteval event_encoding encode(std::string_view str)
+{
+    event_encoding enc{};
+
+    while (!str.empty())
+    {
+        std::size_t comma = str.find(',');
+        std::string_view term = str.substr(0, comma);
+        str = comma == std::string_view::npos ? std::string_view{} : str.substr(comma + 1);
+
+        std::size_t equals = term.find('=');
+        if (equals == 0 || enc.num_terms == event_encoding::max_terms)
+        {
+            malformed_event_terms();
+        }
+        std::string_view key = term.substr(0, equals);
+        std::uint64_t value = 1;
+        if (equals != std::string_view::npos)
+        {
+            value = detail::parse_term_value(key, term.substr(equals + 1));
+        }
+        enc.terms[enc.num_terms].key = key;
+        enc.terms[enc.num_terms].value = value;
+        enc.num_terms++;
+    }
+    return enc;
+}
+
+consteval event_encoding encode(const event_desc& ev)
+{
+    return encode(ev.event != nullptr ? std::string_view(ev.event) : std::string_view{});
+}
+
+/*
+ * A format of a PMU, as found in [pmu]/format, e.g. { "umask", "config:8-15" }
+ */
+struct format_def
+{
+    std::string_view name;
+    std::string_view def;
+};
+
+/*
+ * The config fields of a perf_event_attr
+ */
+struct event_config
+{
+    std::uint64_t config;
+    std::uint64_t config1;
+    std::uint64_t config2;
+};
+
+/*
+ * The formats of the core PMU of Intel CPUs. These are fixed by the architecture,
+ * but the format files in sysfs stay authoritative, see gen_attr_for_event().
+ */
+inline constexpr std::array<format_def, 12> x86_core_formats = { {
+    { "event", "config:0-7" },
+    { "umask", "config:8-15" },
+    { "edge", "config:18" },
+    { "pc", "config:19" },
+    { "any", "config:21" },
+    { "inv", "config:23" },
+    { "cmask", "config:24-31" },
+    { "in_tx", "config:32" },
+    { "in_tx_cp", "config:33" },
+    { "ldlat", "config1:0-15" },
+    { "offcore_rsp", "config1:0-63" },
+    { "frontend", "config1:0-23" },
+} };
+
+namespace detail
+{
+/*
+ * Scatters the bits of "value" into "config" according to the range list "ranges",
+ * e.g. "0-7,32-35", like apply_range_list_to_val() does at runtime
+ */
+constexpr void apply_ranges(std::uint64_t& config, std::uint64_t value, std::string_view ranges)
+{
+    while (!ranges.empty())
+    {
+        std::size_t comma = ranges.find(',');
+        std::string_view range = ranges.substr(0, comma);
+        ranges = comma == std::string_view::npos ? std::string_view{} : ranges.substr(comma + 1);
+
+        std::size_t dash = range.find('-');
+        std::uint64_t start = parse_number(range.substr(0, dash));
+        std::uint64_t end =
+            dash == std::string_view::npos ? start : parse_number(range.substr(dash + 1));
+        for (std::uint64_t bit = start; bit <= end && bit < 64; bit++)
+        {
+            config |= (value & 1) << bit;
+            value >>= 1;
+        }
+    }
+}
+} // namespace detail
+
+/*
+ * Computes the config fields for "enc" from the PMU formats "formats".
+ * The period term is no config field and is ignored, any other term without
+ * a format fails to compile.
+ */
+template <std::size_t N>
+consteval event_config encode_config(const event_encoding& enc,
+                                     const std::array<format_def, N>& formats)
+{
+    event_config result{};
+
+    for (std::size_t i = 0; i < enc.num_terms; i++)
+    {
+        if (enc.terms[i].key == "period")
+        {
+            continue;
+        }
+
+        const format_def* format = nullptr;
+        for (const format_def& candidate : formats)
+        {
+            if (candidate.name == enc.terms[i].key)
+            {
+                format = &candidate;
+            }
+        }
+        if (format == nullptr)
+        {
+            unknown_event_term();
+            continue;
+        }
+
+        std::size_t colon = format->def.find(':');
+        std::string_view var = format->def.substr(0, colon);
+        std::string_view ranges = format->def.substr(colon + 1);
+        if (var == "config")
+        {
+            detail::apply_ranges(result.config, enc.terms[i].value, ranges);
+        }
+        else if (var == "config1")
+        {
+            detail::apply_ranges(result.config1, enc.terms[i].value, ranges);
+        }
+        else if (var == "config2")
+        {
+            detail::apply_ranges(result.config2, enc.terms[i].value, ranges);
+        }
+        else
+        {
+            unknown_event_term();
+        }
+    }
+    return result;
+}
+
+/*
+ * An entry of the pmu_events_map, with the model header that holds its events
+ */
+struct model_info
+{
+    const char* arch;
+    const char* cpuid;
+    const char* model;
+};
+
+} // namespace pmu_events
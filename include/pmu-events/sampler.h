@@ -0,0 +1,136 @@
+#pragma once
+
+#include <pmu-events/pmu-events.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/perf_event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A sampler opens sampling events on a set of CPUs and adapts their sampling periods to
+ * an overhead budget: a fixed period causes an interrupt storm on a busy host and too
+ * few samples on an idle one.
+ *
+ * Every event starts with the sample_period of its attr, usually the SampleAfterValue of
+ * the tables (see pmu_event_sample_after_value()). pmu_sampler_poll() reads the samples
+ * and throttle records from the ring buffer of every event and CPU, and
+ * pmu_sampler_adjust() moves every period towards the rate the budget allows, from the
+ * rate the event occurred at since the last adjustment, with PERF_EVENT_IOC_PERIOD.
+ */
+struct pmu_sampler;
+
+struct pmu_sampler_event
+{
+    const char* name;
+    /* sample_period is the starting period, sample_type the data of the samples */
+    struct perf_event_attr attr;
+};
+
+struct pmu_sampler_budget
+{
+    /* The samples per second to aim for, per event and CPU, 0 for no limit */
+    double samples_per_sec;
+    /* The fraction of the time of a CPU its samples may cost, e.g. 0.01, 0 for no limit */
+    double max_overhead;
+    /* The cost of one sample in ns for max_overhead, PMU_SAMPLER_SAMPLE_COST_NS if 0 */
+    double sample_cost_ns;
+};
+
+/* The cost of a sample assumed for max_overhead, the time of a typical PMU interrupt */
+#define PMU_SAMPLER_SAMPLE_COST_NS 2000.0
+
+/*
+ * A period is adjusted by at most this factor at once, and stays within this factor
+ * squared of its starting period
+ */
+#define PMU_SAMPLER_MAX_STEP 4
+
+struct pmu_sampler_sample
+{
+    /* The index of the event and of the CPU in the sampler */
+    size_t event;
+    size_t cpu;
+    /* The PERF_RECORD_SAMPLE record, with the fields of attr.sample_type */
+    const struct perf_event_header* record;
+};
+
+typedef void (*pmu_sampler_sample_cb)(const struct pmu_sampler_sample* sample, void* data);
+
+/* What happened to one event on one CPU up to the last pmu_sampler_adjust() */
+struct pmu_sampler_state
+{
+    /* The current sampling period */
+    uint64_t period;
+    /* The samples per second between the last two adjustments */
+    double samples_per_sec;
+    /* The throttle records between the last two adjustments */
+    uint64_t throttled;
+};
+
+/*
+ * Creates a new, empty sampler for the given CPUs that adapts its periods to "budget"
+ *
+ * Returns NULL on failure. The caller is responsible for freeing the sampler
+ * with pmu_sampler_free().
+ */
+struct pmu_sampler* pmu_sampler_new(const struct perf_cpu* cpus, size_t num_cpus,
+                                    const struct pmu_sampler_budget* budget);
+
+/*
+ * Closes all file descriptors and ring buffers of the sampler and frees it.
+ */
+void pmu_sampler_free(struct pmu_sampler* sampler);
+
+/*
+ * Adds an event to the sampler, the attr is copied. Events can only be added before
+ * pmu_sampler_open().
+ *
+ * Returns 0 on success, -1 on failure or if attr.sample_period is 0
+ */
+int pmu_sampler_add_event(struct pmu_sampler* sampler, const struct pmu_sampler_event* ev);
+
+/*
+ * Opens every event on every CPU of the sampler, disabled, each with a ring buffer
+ * of "ring_pages" pages (a power of 2).
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_sampler_open(struct pmu_sampler* sampler, size_t ring_pages);
+
+int pmu_sampler_enable(struct pmu_sampler* sampler);
+int pmu_sampler_disable(struct pmu_sampler* sampler);
+
+/*
+ * Reads all records from the ring buffers, calling "cb" with "data" for every sample,
+ * "cb" may be NULL. The record passed to "cb" is only valid during the call.
+ *
+ * Returns the number of samples on success, -1 on failure
+ */
+long pmu_sampler_poll(struct pmu_sampler* sampler, pmu_sampler_sample_cb cb, void* data);
+
+/*
+ * Sets the period of every event on every CPU to the one that, at the rate the event
+ * occurred at since the last adjustment, yields the samples the budget allows. Periods
+ * of events that were throttled since are at least doubled. Call it after
+ * pmu_sampler_poll(), e.g. once a second.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_sampler_adjust(struct pmu_sampler* sampler);
+
+/*
+ * Puts the state of the event with the index "event" on the c-th CPU into "state"
+ *
+ * Returns 0 on success, -1 if either is out of range
+ */
+int pmu_sampler_state(const struct pmu_sampler* sampler, size_t event, size_t cpu,
+                      struct pmu_sampler_state* state);
+
+#ifdef __cplusplus
+}
+#endif
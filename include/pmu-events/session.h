@@ -0,0 +1,302 @@
+#pragma once
+
+#include <pmu-events/cpuset.h>
+#include <pmu-events/pmu-events.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/perf_event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A session is a set of event groups that is opened on a set of CPUs and
+ * read as a dense [cpu][event] counts matrix.
+ *
+ * If more events are requested than the hardware has counters, the kernel
+ * multiplexes the groups. Every count carries the time it was enabled and
+ * running, the scaled estimate and the running fraction as a confidence
+ * indicator.
+ *
+ * Optionally, the session itself round-robins the groups, so that only a
+ * fixed number of them is enabled at once (see pmu_session_set_rotation()).
+ */
+struct pmu_session;
+
+/*
+ * One event to add to a session, usually with an attr generated by gen_attr_for_event()
+ */
+struct pmu_session_event
+{
+    const char* name;
+    struct perf_event_attr attr;
+    /*
+     * Only open the event on one CPU per package, e.g. for the events the tables flag as
+     * perpkg. The whole group of the event is placed like this.
+     */
+    bool per_package;
+};
+
+/* The group the count belongs to was enabled, but never got onto the PMU */
+#define PMU_COUNT_NEVER_RAN (1 << 0)
+/* The group the count belongs to only ran for part of the time, the count is an estimate */
+#define PMU_COUNT_MULTIPLEXED (1 << 1)
+/* The count is that of the whole package of the CPU, see pmu_session_cpu_package() */
+#define PMU_COUNT_PACKAGE (1 << 2)
+/* The event is counted on another CPU of the package, so this count is always 0 */
+#define PMU_COUNT_NOT_PLACED (1 << 3)
+/* The count is that of an identical event of another group, see pmu_session_open_budget() */
+#define PMU_COUNT_MERGED (1 << 4)
+/* The group of the event did not fit into the fd budget, so this count is always 0 */
+#define PMU_COUNT_DROPPED (1 << 5)
+
+struct pmu_count
+{
+    /* The value as read from the kernel */
+    uint64_t raw;
+    /* The time (in ns) the event was enabled */
+    uint64_t time_enabled;
+    /* The time (in ns) the event was actually counting */
+    uint64_t time_running;
+    /* raw, extrapolated to the full enabled time */
+    double scaled;
+    /* time_running / time_enabled, 1.0 for events that were never multiplexed */
+    double running_fraction;
+    /* PMU_COUNT_* flags */
+    uint32_t flags;
+};
+
+/*
+ * Creates a new, empty session for the given CPUs.
+ *
+ * Returns NULL on failure. The caller is responsible for freeing the session
+ * with pmu_session_free().
+ */
+struct pmu_session* pmu_session_new(const struct perf_cpu* cpus, size_t num_cpus);
+
+/*
+ * Creates a new, empty session for the CPUs of "cpus", in ascending order.
+ *
+ * Returns NULL on failure. The caller is responsible for freeing the session
+ * with pmu_session_free().
+ */
+struct pmu_session* pmu_session_new_cpuset(const struct pmu_cpuset* cpus);
+
+/*
+ * Closes all file descriptors of the session and frees it.
+ */
+void pmu_session_free(struct pmu_session* session);
+
+/*
+ * Adds a group of "num_events" events. The first event is the group leader.
+ * Groups can only be added before the session is opened.
+ *
+ * Tool events (PMU_EVENTS_TYPE_TOOL, e.g. "duration_time") are counted in the library
+ * for the time the session is enabled, and are left out of the group in the kernel.
+ *
+ * Returns the index of the group on success, -1 on failure
+ */
+int pmu_session_add_group(struct pmu_session* session, const struct pmu_session_event* events,
+                          size_t num_events);
+
+/*
+ * Opens all groups on all CPUs of the session. The groups start disabled.
+ *
+ * Groups with a per_package event, and groups led by an event of an uncore PMU with a
+ * cpumask, are placed instead: uncore groups are opened on the CPUs of the session in
+ * the cpumask of the PMU, if there are any, all others on the first CPU of the session
+ * in every package. The packages are read from devices/system/cpu/cpuN/topology.
+ *
+ * Returns 0 on success, -1 on failure (with errno set by perf_event_open)
+ */
+int pmu_session_open(struct pmu_session* session);
+
+/*
+ * The fd budget of pmu_session_open_budget(), and how the session was degraded to fit it
+ */
+struct pmu_session_budget
+{
+    /* The fds all groups need on the CPUs they are placed on */
+    size_t required_fds;
+    /* The fds the session may use */
+    size_t available_fds;
+    /* The soft RLIMIT_NOFILE after raising it, 0 if it was not raised */
+    uint64_t raised_limit;
+    /* The events that were merged into an identical event of another group */
+    size_t merged_events;
+    /* The groups that are opened on one CPU per package instead of on every CPU */
+    size_t per_package_groups;
+    /* If not 0, only this many groups are open at a time, see pmu_session_open_budget() */
+    size_t open_groups;
+    /* The groups that do not fit into the budget on their own, and are not counted */
+    size_t dropped_groups;
+};
+
+/*
+ * Opens the session like pmu_session_open(), with at most "max_fds" file descriptors,
+ * or, if it is 0, with the fds left below the soft RLIMIT_NOFILE (keeping a few for the
+ * caller). If the groups need more than that, the session is degraded in this order,
+ * until they fit:
+ *
+ * 1. Without "max_fds", the soft RLIMIT_NOFILE is raised, up to the hard limit.
+ * 2. Events that are identical to an event of an earlier group are not opened, but
+ *    get its count (PMU_COUNT_MERGED).
+ * 3. Per-package and uncore groups are opened once per package, as pmu_session_open()
+ *    always does.
+ * 4. The groups are time-sliced: only as many groups as fit are open at a time, and
+ *    pmu_session_tick() closes them and opens the next ones, like the rotation of
+ *    pmu_session_set_rotation() does (which can not enable more groups at a time).
+ * 5. Groups that do not fit on their own are dropped (PMU_COUNT_DROPPED).
+ *
+ * What was done is reported in "budget" if it is not NULL, and per event by
+ * pmu_session_event_flags().
+ *
+ * Returns 0 on success, -1 on failure (with errno set by perf_event_open)
+ */
+int pmu_session_open_budget(struct pmu_session* session, size_t max_fds,
+                            struct pmu_session_budget* budget);
+
+/*
+ * Returns how the event with the index "event" was degraded to fit the fd budget:
+ * PMU_COUNT_MERGED, PMU_COUNT_DROPPED, and PMU_COUNT_MULTIPLEXED if the groups are
+ * time-sliced
+ */
+uint32_t pmu_session_event_flags(const struct pmu_session* session, size_t event);
+
+/*
+ * Enables or disables counting for the session. With rotation, only the
+ * currently active groups are enabled.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_session_enable(struct pmu_session* session);
+int pmu_session_disable(struct pmu_session* session);
+
+size_t pmu_session_num_cpus(const struct pmu_session* session);
+size_t pmu_session_num_events(const struct pmu_session* session);
+size_t pmu_session_num_groups(const struct pmu_session* session);
+
+/*
+ * Returns the physical package id of the c-th CPU of an opened session, -1 if it is unknown
+ */
+int pmu_session_cpu_package(const struct pmu_session* session, size_t cpu);
+
+/*
+ * Puts the CPUs the group with the index "group" of an opened session is opened on into
+ * "cpus", see pmu_session_open()
+ *
+ * Returns 0 on success, -1 on failure or if the session is not open
+ */
+int pmu_session_group_cpus(const struct pmu_session* session, size_t group,
+                           struct pmu_cpuset* cpus);
+
+/*
+ * Returns the name of the event with the index "event", in the order they were added
+ */
+const char* pmu_session_event_name(const struct pmu_session* session, size_t event);
+
+/*
+ * Reads all counters of the session into "counts", which has to have room for
+ * pmu_session_num_cpus() * pmu_session_num_events() entries. The count of
+ * event e on the c-th CPU of the session is stored in counts[c * num_events + e].
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_session_read(struct pmu_session* session, struct pmu_count* counts);
+
+/*
+ * Makes pmu_session_read() read the groups of the opened session with io_uring: the
+ * reads of all groups on all CPUs are submitted in one batch (a few for very large
+ * sessions), into a buffer registered with the kernel, so that the syscalls per read
+ * no longer grow with the number of groups and CPUs.
+ *
+ * Returns 0 on success, -1 on failure, in which case pmu_session_read() keeps reading
+ * every group with read(). errno is ENOSYS or EPERM if io_uring is not available (e.g.
+ * disabled by seccomp or the kernel.io_uring_disabled sysctl), or if the buffer can not
+ * be registered and the kernel is too old (before 5.6) to read into other buffers.
+ */
+int pmu_session_use_io_uring(struct pmu_session* session);
+
+/*
+ * Arms the event with the index "event" to notify about overflows: every "threshold"
+ * occurrences of the event on a CPU (its sample_period, with wakeup_events 1), the
+ * notification fd of the session becomes readable and pmu_session_overflows() reports
+ * the event and CPU. Events are armed before the session is opened, tool events can not
+ * be armed. The counts of armed events are read as usual.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_session_arm(struct pmu_session* session, size_t event, uint64_t threshold);
+
+/*
+ * Returns a single fd for all armed events of the opened session, which is readable
+ * (EPOLLIN/POLLIN) once any of them overflowed, e.g. to add to the epoll set of the
+ * caller. The fd belongs to the session. Returns -1 if the session has no armed events.
+ */
+int pmu_session_notify_fd(const struct pmu_session* session);
+
+struct pmu_overflow
+{
+    /* The index of the event and of the CPU in the session */
+    size_t event;
+    size_t cpu;
+    /* The overflows since the event was last reported */
+    uint64_t overflows;
+};
+
+/*
+ * Puts the armed events that overflowed since the last call, at most "max_overflows",
+ * into "overflows", without blocking. If there are more, the next call reports them, and it may
+ * report an event and CPU again. Call it whenever the notification fd is readable.
+ *
+ * Returns the number of entries on success, 0 if nothing overflowed, -1 on failure
+ */
+long pmu_session_overflows(struct pmu_session* session, struct pmu_overflow* overflows,
+                           size_t max_overflows);
+
+/*
+ * Enables user-space round-robin of the event groups: only "active_groups"
+ * groups are enabled at a time and every "interval_ns" nanoseconds
+ * pmu_session_tick() moves on to the next "active_groups" groups.
+ *
+ * Compared to multiplexing by the kernel, this gives every group the same,
+ * deterministic share of the time. Counts are then scaled to the time the
+ * session was enabled, not to the time the group was enabled.
+ *
+ * Passing 0 for active_groups disables rotation.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_session_set_rotation(struct pmu_session* session, size_t active_groups,
+                             uint64_t interval_ns);
+
+/*
+ * Immediately moves on to the next set of groups.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_session_rotate(struct pmu_session* session);
+
+/*
+ * Rotates if the rotation interval has elapsed since the last rotation.
+ * Meant to be called regularly, e.g. from the main loop of the caller.
+ *
+ * Returns 1 if the groups were rotated, 0 if not and -1 on failure
+ */
+int pmu_session_tick(struct pmu_session* session);
+
+/*
+ * Fills "count" from the raw value and times, scaling raw to "enabled".
+ *
+ * "enabled" is normally time_enabled. For groups rotated in user-space
+ * it is the time the whole session was enabled.
+ */
+void pmu_count_scale(struct pmu_count* count, uint64_t raw, uint64_t time_enabled,
+                     uint64_t time_running, uint64_t enabled);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Statistics about the work done inside the library, e.g. to attribute the startup
+ * time of a tool to the map_for_cpu() lookups and the sysfs reads behind them.
+ *
+ * Collecting is off until pmu_events_stats_enable() is called, until then every
+ * counted operation costs a single branch. Every thread counts into a block of its
+ * own, which pmu_events_stats_read() sums on demand. The counts of threads that
+ * exited are kept.
+ */
+
+enum pmu_events_counter
+{
+    /* map_for_cpu() calls */
+    PMU_EVENTS_MAP_FOR_CPU,
+    /* map_for_cpu() calls that had to identify the CPU again */
+    PMU_EVENTS_MAP_FOR_CPU_MISSES,
+    /* cpuid regexes compiled to select a map */
+    PMU_EVENTS_REGEX_COMPILES,
+    /* sysfs and procfs files read */
+    PMU_EVENTS_FILE_READS,
+    /* gen_attr_for_event() calls */
+    PMU_EVENTS_GEN_ATTRS,
+    /* events and metrics decompressed from the tables */
+    PMU_EVENTS_DECOMPRESSIONS,
+    PMU_EVENTS_NUM_COUNTERS
+};
+
+/* The entry points whose latency is recorded with PMU_EVENTS_STATS_LATENCY */
+enum pmu_events_entry
+{
+    PMU_EVENTS_ENTRY_MAP_FOR_CPU,
+    PMU_EVENTS_ENTRY_GET_EVENT_BY_NAME,
+    PMU_EVENTS_ENTRY_GET_METRIC_BY_NAME,
+    PMU_EVENTS_ENTRY_GEN_ATTR_FOR_EVENT,
+    PMU_EVENTS_ENTRY_METRIC_PLAN_NEW,
+    PMU_EVENTS_ENTRY_SESSION_OPEN,
+    PMU_EVENTS_ENTRY_SESSION_READ,
+    PMU_EVENTS_NUM_ENTRIES
+};
+
+/* Count the operations of enum pmu_events_counter */
+#define PMU_EVENTS_STATS_COUNTERS (1 << 0)
+/* Record the latency of the entry points, which reads the clock twice per call */
+#define PMU_EVENTS_STATS_LATENCY (1 << 1)
+
+/* Bucket b of a latency histogram holds the calls of [2^b, 2^(b + 1)) ns, bucket 0 also 0 ns */
+#define PMU_EVENTS_STATS_BUCKETS 32
+
+struct pmu_events_stats
+{
+    uint64_t counters[PMU_EVENTS_NUM_COUNTERS];
+    /* The calls of every entry point, and the time spent in them */
+    uint64_t calls[PMU_EVENTS_NUM_ENTRIES];
+    uint64_t total_ns[PMU_EVENTS_NUM_ENTRIES];
+    uint64_t latency[PMU_EVENTS_NUM_ENTRIES][PMU_EVENTS_STATS_BUCKETS];
+};
+
+/*
+ * Starts collecting what "flags", a combination of PMU_EVENTS_STATS_* flags, names,
+ * and stops collecting everything else. Collecting is off with flags 0.
+ */
+void pmu_events_stats_enable(unsigned flags);
+
+/*
+ * Sums the statistics of all threads since the last pmu_events_stats_reset() into "stats"
+ */
+void pmu_events_stats_read(struct pmu_events_stats* stats);
+
+/*
+ * Starts the statistics over from 0
+ */
+void pmu_events_stats_reset(void);
+
+/*
+ * Returns the name of the counter, or the entry point, e.g. "map_for_cpu_misses"
+ * or "gen_attr_for_event", NULL if it is out of range
+ */
+const char* pmu_events_counter_name(enum pmu_events_counter counter);
+const char* pmu_events_entry_name(enum pmu_events_entry entry);
+
+/*
+ * Writes the statistics of pmu_events_stats_read() to "file" in a human readable form:
+ * one line per counter, and one line per entry point that was called, with its number of
+ * calls, total time and the upper bounds of the median and 99th percentile latency.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_events_stats_dump(FILE* file);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <pmu-events/pmu-events.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * TMA mode collects the top-down microarchitecture analysis metrics of the TopdownL1
+ * (and TopdownL2) metric groups on a set of CPUs, and returns them as a breakdown of
+ * the pipeline slots of every CPU.
+ *
+ * Since Ice Lake, Intel CPUs compute the level 1 (and since Sapphire Rapids, level 2)
+ * nodes themselves. They are read from the PERF_METRICS register through the
+ * topdown-* events, which the kernel only allows in a group led by the slots event.
+ * The metric planner builds these groups, see metric_plan_new().
+ */
+struct pmu_tma;
+
+enum pmu_tma_node
+{
+    /* Level 1, these add up to 1 */
+    PMU_TMA_RETIRING,
+    PMU_TMA_BAD_SPECULATION,
+    PMU_TMA_FRONTEND_BOUND,
+    PMU_TMA_BACKEND_BOUND,
+    /* Level 2, every pair adds up to its level 1 node */
+    PMU_TMA_HEAVY_OPERATIONS,
+    PMU_TMA_LIGHT_OPERATIONS,
+    PMU_TMA_BRANCH_MISPREDICTS,
+    PMU_TMA_MACHINE_CLEARS,
+    PMU_TMA_FETCH_LATENCY,
+    PMU_TMA_FETCH_BANDWIDTH,
+    PMU_TMA_MEMORY_BOUND,
+    PMU_TMA_CORE_BOUND,
+    PMU_TMA_NUM_NODES
+};
+
+/* Also collect the level 2 nodes */
+#define PMU_TMA_LEVEL2 (1 << 0)
+/*
+ * Only open the slots-led group of topdown events, and compute the nodes from
+ * PERF_METRICS alone, without the corrections the metric tables apply on top.
+ * This costs one read() per CPU, and no other counters.
+ */
+#define PMU_TMA_PERF_METRICS (1 << 1)
+/*
+ * With PMU_TMA_PERF_METRICS: for the CPU the caller is running on, read slots and
+ * PERF_METRICS with rdpmc instead of read() where the kernel allows it. The fractions in
+ * PERF_METRICS only have 8 bits, so this trades precision on short intervals for speed.
+ */
+#define PMU_TMA_RDPMC (1 << 2)
+
+/*
+ * Returns the name of the metric for "node", e.g. "tma_retiring"
+ */
+const char* pmu_tma_node_name(enum pmu_tma_node node);
+
+/*
+ * Creates a TMA collection for the metrics of "map" on "num_cpus" CPUs, which all need
+ * to have the same core PMU (create one per core type on hybrid systems). "flags" is a
+ * combination of PMU_TMA_* flags. The counters are opened, but not enabled.
+ *
+ * Returns NULL if the map has no TopdownL1 metrics (or no topdown events, with
+ * PMU_TMA_PERF_METRICS), on failure, or if the counters cannot be opened. The caller
+ * is responsible for freeing the collection with pmu_tma_free().
+ */
+struct pmu_tma* pmu_tma_new(const struct pmu_events_map* map, const struct perf_cpu* cpus,
+                            size_t num_cpus, unsigned flags);
+
+void pmu_tma_free(struct pmu_tma* tma);
+
+/*
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_tma_enable(struct pmu_tma* tma);
+int pmu_tma_disable(struct pmu_tma* tma);
+
+/*
+ * Puts the breakdown of the slots since the last pmu_tma_read() (or since the counters
+ * were enabled) into "values", which has to have room for num_cpus * PMU_TMA_NUM_NODES
+ * entries. The value of "node" on the c-th CPU is stored in
+ * values[c * PMU_TMA_NUM_NODES + node], as a fraction of the slots. Nodes that were not
+ * collected are NaN.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_tma_read(struct pmu_tma* tma, double* values);
+
+/*
+ * Computes the nodes from a raw PERF_METRICS value, as read with rdpmc, into
+ * values[PMU_TMA_NUM_NODES]. The level 2 nodes are NaN unless "level2" is set.
+ */
+void pmu_tma_from_perf_metrics(uint64_t perf_metrics, bool level2, double* values);
+
+#ifdef __cplusplus
+}
+#endif
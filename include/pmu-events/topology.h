@@ -0,0 +1,139 @@
+#pragma once
+
+#include <pmu-events/cpuset.h>
+#include <pmu-events/pmu-events.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A snapshot of all PMUs in /sys/bus/event_source/devices:
+ * their names, perf_event_attr types, the CPUs they are responsible for
+ * and their format/ definitions, together with a dense CPU -> core PMU array.
+ *
+ * All PMU resolution in this library (gen_attr_for_event(), read_perf_type(),
+ * get_format_file_content(), ...) is done against the snapshot returned by
+ * pmu_topology_get(), so sysfs is only walked once per process.
+ */
+struct pmu_topology;
+
+/*
+ * Walks [sysfs_root]/bus/event_source/devices and builds a new topology snapshot.
+ * If sysfs_root is NULL, "/sys" is used.
+ *
+ * Returns the snapshot on success, NULL on failure.
+ * The caller is responsible for freeing the result with pmu_topology_free()
+ */
+struct pmu_topology* pmu_topology_new(const char* sysfs_root);
+
+void pmu_topology_free(struct pmu_topology* topo);
+
+/*
+ * Writes the snapshot to the file "path", so that it can later be restored
+ * with pmu_topology_load() without walking sysfs again.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int pmu_topology_save(const struct pmu_topology* topo, const char* path);
+
+/*
+ * Reads a snapshot previously written with pmu_topology_save()
+ *
+ * Returns the snapshot on success, NULL on failure.
+ * The caller is responsible for freeing the result with pmu_topology_free()
+ */
+struct pmu_topology* pmu_topology_load(const char* path);
+
+/*
+ * Returns the process-wide snapshot, building it on first use.
+ *
+ * If the environment variable PMU_EVENTS_TOPOLOGY is set, the snapshot is
+ * loaded from the file it names instead of walking sysfs. Safe to call from many
+ * threads at once, all of them get the same snapshot.
+ *
+ * Returns NULL on failure.
+ */
+const struct pmu_topology* pmu_topology_get(void);
+
+/*
+ * Replaces the process-wide snapshot with "topo", which is then owned by the library.
+ * Passing NULL drops the current snapshot, so that the next pmu_topology_get() rebuilds it.
+ * The replaced snapshot is not freed before the library is unloaded, as other threads
+ * may still be using it.
+ */
+void pmu_topology_set(struct pmu_topology* topo);
+
+size_t pmu_topology_num_pmus(const struct pmu_topology* topo);
+
+const char* pmu_topology_pmu_name(const struct pmu_topology* topo, size_t pmu);
+
+/*
+ * Returns the perf_event_attr.type of the PMU, or -1 if pmu is out of range
+ */
+int pmu_topology_pmu_type(const struct pmu_topology* topo, size_t pmu);
+
+/*
+ * Returns the raw cpus (or cpumask) list of the PMU, e.g. "0-79", or NULL if it has none
+ */
+const char* pmu_topology_pmu_cpus(const struct pmu_topology* topo, size_t pmu);
+
+/*
+ * Returns the CPUs the PMU is responsible for: those of its cpus (or cpumask) list, all
+ * CPUs for a core PMU without one and none for other PMUs without one. NULL if pmu is out
+ * of range. The set belongs to the snapshot.
+ */
+const struct pmu_cpuset* pmu_topology_pmu_cpuset(const struct pmu_topology* topo, size_t pmu);
+
+/*
+ * Returns the online CPUs of the snapshot, from devices/system/cpu/online. The set
+ * belongs to the snapshot.
+ */
+const struct pmu_cpuset* pmu_topology_online(const struct pmu_topology* topo);
+
+/*
+ * Returns the format definition "format" of the PMU, e.g. "config:8-15" for "umask",
+ * or NULL if the PMU has no such format.
+ */
+const char* pmu_topology_pmu_format(const struct pmu_topology* topo, size_t pmu,
+                                    const char* format);
+
+/*
+ * An event alias in the events/ directory of a PMU in sysfs, e.g. "cache-misses"
+ */
+struct pmu_event_alias
+{
+    const char* name;
+    /* The event string, e.g. "event=0x2e,umask=0x41" */
+    const char* event;
+    /* The factor to multiply counts with, from the .scale file, 1.0 if there is none */
+    double scale;
+    /* The unit of the scaled counts, e.g. "Joules", from the .unit file, NULL if there is none */
+    const char* unit;
+};
+
+/*
+ * Looks up the alias "name" of the PMU and puts it into "alias". The events/ directory of
+ * a PMU is only read on the first lookup, the strings belong to the snapshot. Snapshots
+ * from pmu_topology_load() have the aliases that were saved with them instead.
+ *
+ * Returns 0 on success, -1 if the PMU has no such alias or pmu is out of range
+ */
+int pmu_topology_pmu_alias(const struct pmu_topology* topo, size_t pmu, const char* name,
+                           struct pmu_event_alias* alias);
+
+/*
+ * Returns the index of the PMU named "name", or -1 if there is none
+ */
+int pmu_topology_find_pmu(const struct pmu_topology* topo, const char* name);
+
+/*
+ * Returns the index of the core PMU responsible for "cpu", or -1 if there is none
+ */
+int pmu_topology_core_pmu(const struct pmu_topology* topo, struct perf_cpu cpu);
+
+#ifdef __cplusplus
+}
+#endif
@@ -31,12 +31,16 @@ _arch_std_events = {}
 _pending_events = []
 # Name of events table to be written out
 _pending_events_tblname = None
+# Generic counters of the core PMUs of the pending events table, from counter.json
+_pending_generic_counters = {}
 # Metrics to write out when the table is closed
 _pending_metrics = []
 # Name of metrics table to be written out
 _pending_metrics_tblname = None
 # Global BigCString shared by all structures.
 _bcs = None
+# (arch, cpuid, model) of the C++ model headers, for models.hpp
+_cxx_models = []
 # Map from the name of a metric group to a description of the group.
 _metricgroups = {}
 # Order specific JsonEvent attributes will be visited.
@@ -46,7 +50,7 @@ _json_event_attributes = [
     # Seems useful, put it early.
     'event',
     # Short things in alphabetical order.
-    'compat', 'deprecated', 'perpkg', 'unit',
+    'compat', 'data_la', 'deprecated', 'fixed_counter', 'perpkg', 'precise', 'unit',
     # Retirement latency specific to Intel granite rapids currently.
     'retirement_latency_mean', 'retirement_latency_min',
     'retirement_latency_max',
@@ -61,7 +65,8 @@ _json_metric_attributes = [
     'default_metricgroup_name', 'aggr_mode', 'event_grouping'
 ]
 # Attributes that are bools or enum int values, encoded as '0', '1',...
-_json_enum_attributes = ['aggr_mode', 'deprecated', 'event_grouping', 'perpkg']
+_json_enum_attributes = ['aggr_mode', 'data_la', 'deprecated', 'event_grouping',
+                         'fixed_counter', 'perpkg', 'precise']
 
 def removesuffix(s: str, suffix: str) -> str:
   """Remove the suffix from a string
@@ -72,6 +77,11 @@ def removesuffix(s: str, suffix: str) -> str:
   return s[0:-len(suffix)] if s.endswith(suffix) else s
 
 
+def removeprefix(s: str, prefix: str) -> str:
+  """Remove the prefix from a string, see removesuffix."""
+  return s[len(prefix):] if s.startswith(prefix) else s
+
+
 def file_name_to_table_name(prefix: str, parents: Sequence[str],
                             dirname: str) -> str:
   """Generate a C table name from directory names."""
@@ -331,6 +341,11 @@ class JsonEvent:
     self.desc = fixdesc(jd.get('BriefDescription'))
     self.long_desc = fixdesc(jd.get('PublicDescription'))
     precise = jd.get('PEBS')
+    # The PEBS level and whether samples have data addresses, for gen_sample_attr_for_event()
+    self.precise = precise if precise != '0' else None
+    self.data_la = '1' if jd.get('Data_LA') not in (None, '0') else None
+    # "Fixed counter 1" rather than a list of generic counters, e.g. "0,1,2,3"
+    self.fixed_counter = '1' if 'fixed' in jd.get('Counter', '').lower() else None
     msr = lookup_msr(jd.get('MSRIndex'))
     msrval = jd.get('MSRValue')
     extra_desc = ''
@@ -487,6 +502,15 @@ def preprocess_arch_std_files(archpath: str) -> None:
         raise RuntimeError(f'Failure processing \'{item.name}\' in \'{archpath}\'') from e
 
 
+def add_generic_counters(item: os.DirEntry) -> None:
+  """Record the generic counters of the core PMUs in counter.json for the pending events table."""
+  for counter in json.load(open(item.path)):
+    unit = counter.get('Unit')
+    if unit in ('core', 'cpu_core', 'cpu_atom') and 'CountersNumGeneric' in counter:
+      pmu = 'default_core' if unit == 'core' else unit
+      _pending_generic_counters[pmu] = int(counter['CountersNumGeneric'])
+
+
 def add_events_table_entries(item: os.DirEntry, topic: str) -> None:
   """Add contents of file to _pending_events table."""
   for e in read_json_events(item.path, topic):
@@ -509,7 +533,9 @@ def print_pending_events() -> None:
             fix_none(j.metric_name))
 
   global _pending_events
+  global _pending_generic_counters
   if not _pending_events:
+    _pending_generic_counters = {}
     return
 
   global _pending_events_tblname
@@ -524,6 +550,7 @@ def print_pending_events() -> None:
   last_pmu = None
   last_name = None
   pmus = set()
+  pmu_events = collections.defaultdict(list)
   for event in sorted(_pending_events, key=event_cmp_key):
     if last_pmu and last_pmu == event.pmu:
       assert event.name != last_name, f"Duplicate event: {last_pmu}/{last_name}/ in {_pending_events_tblname}"
@@ -538,12 +565,18 @@ def print_pending_events() -> None:
       pmus.add((event.pmu, pmu_name))
 
     _args.output_file.write(event.to_c_string(metric=False))
+    pmu_events[event.pmu].append(event)
     last_name = event.name
+  _args.output_file.write('};\n')
+
+  first_ids, ids = assign_ids(sorted(pmus), pmu_events)
+  print_by_name_index(_pending_events_tblname, ids, lambda e: e.name)
+  print_config_index(_pending_events_tblname, ids)
+  if _args.cxx_dir:
+    print_cxx_events(_pending_events_tblname, ids)
   _pending_events = []
 
   _args.output_file.write(f"""
-}};
-
 const struct pmu_table_entry {_pending_events_tblname}[] = {{
 """)
   for (pmu, tbl_pmu) in sorted(pmus):
@@ -552,9 +585,213 @@ const struct pmu_table_entry {_pending_events_tblname}[] = {{
      .entries = {_pending_events_tblname}_{tbl_pmu},
      .num_entries = ARRAY_SIZE({_pending_events_tblname}_{tbl_pmu}),
      .pmu_name = {{ {_bcs.offsets[pmu_name]} /* {pmu_name} */ }},
+     .first_id = {first_ids[pmu]},
+     .num_generic_counters = {_pending_generic_counters.get(pmu, 0)},
 }},
 """)
   _args.output_file.write('};\n\n')
+  _pending_generic_counters = {}
+
+
+def assign_ids(pmus: Sequence[Tuple[str, str]],
+               entries: Dict[str, Sequence[JsonEvent]]) -> Tuple[Dict[str, int], Dict[int, JsonEvent]]:
+  """Number the entries of a table densely, in the order of its pmu_table_entries.
+
+  Returns the first id of every PMU and the entry of every id.
+  """
+  first_ids = {}
+  ids = {}
+  for (pmu, _) in pmus:
+    first_ids[pmu] = len(ids)
+    for entry in entries[pmu]:
+      ids[len(ids)] = entry
+  return first_ids, ids
+
+
+def print_by_name_index(tblname: str, ids: Dict[int, JsonEvent],
+                        name: Callable[[JsonEvent], str]) -> None:
+  """Write the ids of a table sorted by name, for a binary search by name."""
+  _args.output_file.write(f'static const uint32_t {tblname}_by_name[] = {{\n')
+  for i in sorted(ids, key=lambda i: (name(ids[i]), i)):
+    _args.output_file.write(f'{i}, /* {name(ids[i])} */\n')
+  _args.output_file.write('};\n')
+
+def fnv1a(s: str) -> int:
+  """64-bit FNV-1a, the same as pmu_events::fnv1a() in pmu-events.hpp."""
+  h = 0xcbf29ce484222325
+  for b in s.encode('utf-8'):
+    h ^= b
+    h = (h * 0x100000001b3) & 0xffffffffffffffff
+  return h
+
+
+def cxx_model_name(tblname: str) -> str:
+  """The model name of a table, e.g. pmu_events__skylake -> skylake."""
+  return removeprefix(tblname, 'pmu_events__')
+
+
+def config_terms(event: Optional[str]) -> Optional[Dict[str, int]]:
+  """The non-zero terms of an event string, without the period.
+
+  Values are hexadecimal, except for the decimal cmask, like event_term_base()
+  reads them. Returns None if the event string is no list of assignments.
+  """
+  if not event:
+    return None
+  terms = {}
+  for term in event.split(','):
+    key, sep, value = term.partition('=')
+    if not sep:
+      return None
+    if key == 'period' or value == 'None':
+      continue
+    try:
+      if value.lower().startswith('0x'):
+        val = int(value, 16)
+      else:
+        val = int(value, 10 if key == 'cmask' else 16)
+    except ValueError:
+      return None
+    if val != 0:
+      terms[key] = val
+  return terms
+
+
+def config_hash(pmu: str, terms: Dict[str, int]) -> int:
+  """The hash of an event encoding, the same as pmu_event_decode() computes.
+
+  FNV-1a over "pmu\\0", combined with the FNV-1a of every "key=0xvalue" term,
+  with the keys sorted.
+  """
+  h = fnv1a(pmu + '\0')
+  for key in sorted(terms):
+    h = ((h ^ fnv1a(f'{key}={terms[key]:#x}')) * 0x100000001b3) & 0xffffffffffffffff
+  return h
+
+
+def print_hash_index(name: str, entries: Sequence[Tuple[int, int]]) -> None:
+  """Write an open addressing hash table of (hash, id) with linear probing.
+
+  The first entry for a hash wins, slots hold the id + 1, so that empty slots are 0.
+  """
+  size = 1
+  while size < 2 * len(entries):
+    size *= 2
+  slots = {}
+  seen = set()
+  for (h, i) in entries:
+    if h in seen:
+      continue
+    seen.add(h)
+    slot = h & (size - 1)
+    while slot in slots:
+      slot = (slot + 1) & (size - 1)
+    slots[slot] = (h, i)
+  _args.output_file.write(f'static const struct pmu_config_index_entry {name}[{size}] = {{\n')
+  if not slots:
+    _args.output_file.write('{ 0, 0 },\n')
+  for slot in sorted(slots):
+    h, i = slots[slot]
+    _args.output_file.write(f'[{slot}] = {{ {h:#x}ULL, {i + 1} }},\n')
+  _args.output_file.write('};\n')
+
+
+def print_config_index(tblname: str, ids: Dict[int, JsonEvent]) -> None:
+  """Write the reverse indices from the encoding of an event to its id.
+
+  {tblname}_by_config is keyed by all terms of the events, {tblname}_by_event_umask
+  only by their event and umask terms. Deprecated events lose against the others,
+  and for event and umask, events without further terms win.
+  """
+  exact = []
+  partial = []
+  for (i, e) in ids.items():
+    terms = config_terms(e.event)
+    if terms is None:
+      continue
+    deprecated = e.deprecated == '1'
+    exact.append(((deprecated, i), config_hash(e.pmu, terms), i))
+    base = {key: terms[key] for key in ('event', 'umask') if key in terms}
+    if base:
+      partial.append(((len(terms) != len(base), deprecated, i), config_hash(e.pmu, base), i))
+  print_hash_index(f'{tblname}_by_config', [(h, i) for (_, h, i) in sorted(exact)])
+  print_hash_index(f'{tblname}_by_event_umask', [(h, i) for (_, h, i) in sorted(partial)])
+
+
+def print_cxx_events(tblname: str, ids: Dict[int, JsonEvent]) -> None:
+  """Write the events of a table, by their id, as constexpr C++ header."""
+
+  def cxx_str(s: Optional[str]) -> str:
+    # The strings are already escaped for the C big_c_string.
+    return f'"{s}"' if s else 'nullptr'
+
+  model = cxx_model_name(tblname)
+  path = f'{_args.cxx_dir}/pmu-events/models/{model}.hpp'
+  os.makedirs(os.path.dirname(path), exist_ok=True)
+  entries = sorted(ids.items(), key=lambda i: (fnv1a(i[1].name), i[1].name, i[1].pmu))
+  with open(path, 'w', encoding='utf-8') as f:
+    f.write(f"""/* SPDX-License-Identifier: GPL-2.0 */
+/* THIS FILE WAS AUTOGENERATED BY jevents.py arch={_args.arch} model={_args.model} ! */
+#pragma once
+
+#include <pmu-events/pmu-events.hpp>
+
+namespace pmu_events::models::{model}
+{{
+
+inline constexpr event_table<{len(entries)}> events = {{ {{ {{
+""")
+    for (i, e) in entries:
+      fields = [f'{fnv1a(e.name):#x}ULL', str(i), cxx_str(e.name), cxx_str(e.pmu), cxx_str(e.topic),
+                cxx_str(e.desc), cxx_str(e.event), cxx_str(e.compat), cxx_str(e.unit),
+                cxx_str(e.retirement_latency_mean), cxx_str(e.retirement_latency_min),
+                cxx_str(e.retirement_latency_max), cxx_str(e.long_desc),
+                'true' if e.perpkg == '1' else 'false',
+                'true' if e.deprecated == '1' else 'false',
+                e.precise if e.precise else '0',
+                'true' if e.data_la == '1' else 'false',
+                'true' if e.fixed_counter == '1' else 'false']
+      f.write(f'    {{ {", ".join(fields)} }},\n')
+    f.write("""} } };
+
+/*
+ * Returns the event "name" (on "pmu") of this model, fails to compile if there is none
+ */
+consteval const event_desc& event(std::string_view name, std::string_view pmu = {})
+{
+    return events.get(name, pmu);
+}
+
+}
+""")
+
+
+def print_cxx_models() -> None:
+  """Write models.hpp, which maps the cpuids to the model headers."""
+  path = f'{_args.cxx_dir}/pmu-events/models.hpp'
+  os.makedirs(os.path.dirname(path), exist_ok=True)
+  with open(path, 'w', encoding='utf-8') as f:
+    f.write(f"""/* SPDX-License-Identifier: GPL-2.0 */
+/* THIS FILE WAS AUTOGENERATED BY jevents.py arch={_args.arch} model={_args.model} ! */
+#pragma once
+
+#include <pmu-events/pmu-events.hpp>
+
+namespace pmu_events::models
+{{
+
+/*
+ * The entries of pmu_events_map, with the header <pmu-events/models/<model>.hpp> of each
+ */
+inline constexpr model_info all[] = {{
+""")
+    for arch, cpuid, model in _cxx_models:
+      f.write(f'    {{ "{arch}", "{cpuid}", "{model}" }},\n')
+    f.write("""};
+
+}
+""")
+
 
 def print_pending_metrics() -> None:
   """Optionally close metrics table."""
@@ -582,6 +819,7 @@ def print_pending_metrics() -> None:
   first = True
   last_pmu = None
   pmus = set()
+  pmu_metrics = collections.defaultdict(list)
   for metric in sorted(_pending_metrics, key=metric_cmp_key):
     if metric.pmu != last_pmu:
       if not first:
@@ -594,11 +832,15 @@ def print_pending_metrics() -> None:
       pmus.add((metric.pmu, pmu_name))
 
     _args.output_file.write(metric.to_c_string(metric=True))
+    pmu_metrics[metric.pmu].append(metric)
   _pending_metrics = []
+  _args.output_file.write('};\n')
 
-  _args.output_file.write(f"""
-}};
+  # Metric names are looked up ignoring case
+  first_ids, ids = assign_ids(sorted(pmus), pmu_metrics)
+  print_by_name_index(_pending_metrics_tblname, ids, lambda m: m.metric_name.lower())
 
+  _args.output_file.write(f"""
 const struct pmu_table_entry {_pending_metrics_tblname}[] = {{
 """)
   for (pmu, tbl_pmu) in sorted(pmus):
@@ -607,6 +849,7 @@ const struct pmu_table_entry {_pending_metrics_tblname}[] = {{
      .entries = {_pending_metrics_tblname}_{tbl_pmu},
      .num_entries = ARRAY_SIZE({_pending_metrics_tblname}_{tbl_pmu}),
      .pmu_name = {{ {_bcs.offsets[pmu_name]} /* {pmu_name} */ }},
+     .first_id = {first_ids[pmu]},
 }},
 """)
   _args.output_file.write('};\n\n')
@@ -687,6 +930,10 @@ def process_one_file(parents: Sequence[str], item: os.DirEntry) -> None:
   if not item.is_file() or not item.name.endswith('.json') or item.name == 'metricgroups.json':
     return
 
+  if item.name == 'counter.json':
+    add_generic_counters(item)
+    return
+
   add_events_table_entries(item, get_topic(item.name))
 
 
@@ -701,16 +948,23 @@ const struct pmu_events_map pmu_events_map[] = {
 """)
   for arch in archs:
     if arch == 'test':
+      _cxx_models.append(('testarch', 'testcpu', cxx_model_name('pmu_events__test_soc_cpu')))
       _args.output_file.write("""{
 \t.arch = "testarch",
 \t.cpuid = "testcpu",
 \t.event_table = {
 \t\t.pmus = pmu_events__test_soc_cpu,
 \t\t.num_pmus = ARRAY_SIZE(pmu_events__test_soc_cpu),
+\t\t.by_name = pmu_events__test_soc_cpu_by_name,
+\t\t.num_events = ARRAY_SIZE(pmu_events__test_soc_cpu_by_name),
+\t\t.by_config = CONFIG_INDEX(pmu_events__test_soc_cpu_by_config),
+\t\t.by_event_umask = CONFIG_INDEX(pmu_events__test_soc_cpu_by_event_umask),
 \t},
 \t.metric_table = {
 \t\t.pmus = pmu_metrics__test_soc_cpu,
 \t\t.num_pmus = ARRAY_SIZE(pmu_metrics__test_soc_cpu),
+\t\t.by_name = pmu_metrics__test_soc_cpu_by_name,
+\t\t.num_metrics = ARRAY_SIZE(pmu_metrics__test_soc_cpu_by_name),
 \t}
 },
 """)
@@ -721,6 +975,10 @@ const struct pmu_events_map pmu_events_map[] = {
 \t.event_table = {
 \t\t.pmus = pmu_events__common,
 \t\t.num_pmus = ARRAY_SIZE(pmu_events__common),
+\t\t.by_name = pmu_events__common_by_name,
+\t\t.num_events = ARRAY_SIZE(pmu_events__common_by_name),
+\t\t.by_config = CONFIG_INDEX(pmu_events__common_by_config),
+\t\t.by_event_umask = CONFIG_INDEX(pmu_events__common_by_event_umask),
 \t},
 \t.metric_table = {},
 },
@@ -735,28 +993,48 @@ const struct pmu_events_map pmu_events_map[] = {
             event_tblname = file_name_to_table_name('pmu_events_', [], row[2].replace('/', '_'))
             if event_tblname in _event_tables:
               event_size = f'ARRAY_SIZE({event_tblname})'
+              event_index = f'{event_tblname}_by_name'
+              num_events = f'ARRAY_SIZE({event_index})'
+              config_index = f'CONFIG_INDEX({event_tblname}_by_config)'
+              event_umask_index = f'CONFIG_INDEX({event_tblname}_by_event_umask)'
             else:
               event_tblname = 'NULL'
               event_size = '0'
+              event_index = 'NULL'
+              num_events = '0'
+              config_index = '{}'
+              event_umask_index = '{}'
             metric_tblname = file_name_to_table_name('pmu_metrics_', [], row[2].replace('/', '_'))
             if metric_tblname in _metric_tables:
               metric_size = f'ARRAY_SIZE({metric_tblname})'
+              metric_index = f'{metric_tblname}_by_name'
+              num_metrics = f'ARRAY_SIZE({metric_index})'
             else:
               metric_tblname = 'NULL'
               metric_size = '0'
+              metric_index = 'NULL'
+              num_metrics = '0'
             if event_size == '0' and metric_size == '0':
               continue
             cpuid = row[0].replace('\\', '\\\\')
+            if event_tblname != 'NULL':
+              _cxx_models.append((arch, cpuid, cxx_model_name(event_tblname)))
             _args.output_file.write(f"""{{
 \t.arch = "{arch}",
 \t.cpuid = "{cpuid}",
 \t.event_table = {{
 \t\t.pmus = {event_tblname},
-\t\t.num_pmus = {event_size}
+\t\t.num_pmus = {event_size},
+\t\t.by_name = {event_index},
+\t\t.num_events = {num_events},
+\t\t.by_config = {config_index},
+\t\t.by_event_umask = {event_umask_index}
 \t}},
 \t.metric_table = {{
 \t\t.pmus = {metric_tblname},
-\t\t.num_pmus = {metric_size}
+\t\t.num_pmus = {metric_size},
+\t\t.by_name = {metric_index},
+\t\t.num_metrics = {num_metrics}
 \t}}
 }},
 """)
@@ -788,14 +1066,20 @@ static const struct pmu_sys_events pmu_sys_event_tables[] = {
     _args.output_file.write(f"""\t{{
 \t\t.event_table = {{
 \t\t\t.pmus = {tblname},
-\t\t\t.num_pmus = ARRAY_SIZE({tblname})
+\t\t\t.num_pmus = ARRAY_SIZE({tblname}),
+\t\t\t.by_name = {tblname}_by_name,
+\t\t\t.num_events = ARRAY_SIZE({tblname}_by_name),
+\t\t\t.by_config = CONFIG_INDEX({tblname}_by_config),
+\t\t\t.by_event_umask = CONFIG_INDEX({tblname}_by_event_umask)
 \t\t}},""")
     metric_tblname = _sys_event_table_to_metric_table_mapping[tblname]
     if metric_tblname in _sys_metric_tables:
       _args.output_file.write(f"""
 \t\t.metric_table = {{
 \t\t\t.pmus = {metric_tblname},
-\t\t\t.num_pmus = ARRAY_SIZE({metric_tblname})
+\t\t\t.num_pmus = ARRAY_SIZE({metric_tblname}),
+\t\t\t.by_name = {metric_tblname}_by_name,
+\t\t\t.num_metrics = ARRAY_SIZE({metric_tblname}_by_name)
 \t\t}},""")
       printed_metric_tables.append(metric_tblname)
     _args.output_file.write(f"""
@@ -808,7 +1092,9 @@ static const struct pmu_sys_events pmu_sys_event_tables[] = {
     _args.output_file.write(f"""\t{{
 \t\t.metric_table = {{
 \t\t\t.pmus = {tblname},
-\t\t\t.num_pmus = ARRAY_SIZE({tblname})
+\t\t\t.num_pmus = ARRAY_SIZE({tblname}),
+\t\t\t.by_name = {tblname}_by_name,
+\t\t\t.num_metrics = ARRAY_SIZE({tblname}_by_name)
 \t\t}},
 \t\t.name = \"{tblname}\",
 \t}},
@@ -822,6 +1108,8 @@ static const struct pmu_sys_events pmu_sys_event_tables[] = {
 void decompress_event(int offset, struct pmu_event *pe)
 {
 \tconst char *p = &big_c_string[offset];
+
+\tstats_count(PMU_EVENTS_DECOMPRESSIONS);
 """)
   for attr in _json_event_attributes:
     _args.output_file.write(f'\n\tpe->{attr} = ')
@@ -837,9 +1125,11 @@ void decompress_event(int offset, struct pmu_event *pe)
       _args.output_file.write('\twhile (*p++);')
   _args.output_file.write("""}
 
-static void decompress_metric(int offset, struct pmu_metric *pm)
+void decompress_metric(int offset, struct pmu_metric *pm)
 {
 \tconst char *p = &big_c_string[offset];
+
+\tstats_count(PMU_EVENTS_DECOMPRESSIONS);
 """)
   for attr in _json_metric_attributes:
     _args.output_file.write(f'\n\tpm->{attr} = ')
@@ -857,17 +1147,33 @@ static void decompress_metric(int offset, struct pmu_metric *pm)
 
 
 
-const struct pmu_events_map *map_for_cpu(struct perf_cpu cpu)
+static struct {
+        const struct pmu_events_map *map;
+        struct perf_cpu cpu;
+} last_result;
+static bool has_last_result;
+/* Protects last_result and the last search in find_map_for_cpu() */
+static pthread_mutex_t map_for_cpu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Drops the cached result of map_for_cpu() if it belongs to cpu, or
+ * unconditionally if cpu.cpu is -1.
+ */
+void map_for_cpu_invalidate(struct perf_cpu cpu)
+{
+        pthread_mutex_lock(&map_for_cpu_lock);
+        if (cpu.cpu == -1 || (has_last_result && last_result.cpu.cpu == cpu.cpu))
+                has_last_result = false;
+        pthread_mutex_unlock(&map_for_cpu_lock);
+}
+
+static const struct pmu_events_map *find_map_for_cpu(struct perf_cpu cpu)
 {
-        static struct {
-                const struct pmu_events_map *map;
-                struct perf_cpu cpu;
-        } last_result;
         static struct {
                 const struct pmu_events_map *map;
                 char *cpuid;
         } last_map_search;
-        static bool has_last_result, has_last_map_search;
+        static bool has_last_map_search;
         const struct pmu_events_map *map = NULL;
         char *cpuid = NULL;
         size_t i;
@@ -875,6 +1181,7 @@ const struct pmu_events_map *map_for_cpu(struct perf_cpu cpu)
         if (has_last_result && last_result.cpu.cpu == cpu.cpu)
                 return last_result.map;
 
+        stats_count(PMU_EVENTS_MAP_FOR_CPU_MISSES);
         cpuid = get_cpuid_allow_env_override(cpu);
 
         /*
@@ -897,7 +1204,7 @@ const struct pmu_events_map *map_for_cpu(struct perf_cpu cpu)
                                 break;
                         }
 
-                        if (!strcmp_cpuid_str(map->cpuid, cpuid))
+                        if (!strcmp_cpuid_str_for_arch(map->arch, map->cpuid, cpuid))
                                 break;
                }
                free(last_map_search.cpuid);
@@ -912,6 +1219,19 @@ out_update_last_result:
         return map;
 }
 
+const struct pmu_events_map *map_for_cpu(struct perf_cpu cpu)
+{
+        uint64_t start = stats_start();
+        const struct pmu_events_map *map;
+
+        stats_count(PMU_EVENTS_MAP_FOR_CPU);
+        pthread_mutex_lock(&map_for_cpu_lock);
+        map = find_map_for_cpu(cpu);
+        pthread_mutex_unlock(&map_for_cpu_lock);
+        stats_end(PMU_EVENTS_ENTRY_MAP_FOR_CPU, start);
+        return map;
+}
+
 const struct pmu_events_map *all_pmu_events_maps()
 {
     return pmu_events_map;
@@ -921,6 +1241,12 @@ const char *get_pmu_name(struct pmu_table_entry entry)
 {
     return &big_c_string[entry.pmu_name.offset];
 }
+
+const char *get_compact_event_name(struct compact_pmu_event event)
+{
+    /* The name is the first field of the compressed event */
+    return &big_c_string[event.offset];
+}
 """)
 
 def print_metricgroups() -> None:
@@ -997,6 +1323,12 @@ such as "arm/cortex-a34".''',
   )
   ap.add_argument(
       'output_file', type=argparse.FileType('w', encoding='utf-8'), nargs='?', default=sys.stdout)
+  ap.add_argument(
+      '--offline', action='store_true',
+      help='Do not identify the local CPU, so that the output builds on any host')
+  ap.add_argument(
+      '--cxx-dir',
+      help='Also write constexpr C++ headers for every model into this include directory')
   _args = ap.parse_args()
 
   _args.output_file.write(f"""
@@ -1011,8 +1343,25 @@ such as "arm/cortex-a34".''',
 #include <stdint.h>
 #include <errno.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <pmu-events/pmu-events.h>
-
+#include <pmu-events/_impl/pmu-events.h>
+""")
+  if _args.offline:
+    _args.output_file.write("""
+/*
+ * Offline build: the local CPU is never identified, so that the tables of all
+ * architectures can be used on any host. Maps are selected with map_for_cpuid(),
+ * or map_for_cpu() with the PERF_CPUID override.
+ */
+static char *get_cpuid_str(struct perf_cpu cpu)
+{
+	(void)cpu;
+	return NULL;
+}
+""")
+  else:
+    _args.output_file.write("""
 #ifdef __x86_64__
 #include <pmu-events/x86/util.h>
 #elif __aarch64__
@@ -1020,7 +1369,8 @@ such as "arm/cortex-a34".''',
 #else
 #error "Sorry, no pmu-events for your architecture yet!"
 #endif
-
+""")
+  _args.output_file.write("""
 char *get_cpuid_allow_env_override(struct perf_cpu cpu)
 {
 	char *cpuid;
@@ -1039,6 +1389,7 @@ char *get_cpuid_allow_env_override(struct perf_cpu cpu)
 
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
+#define CONFIG_INDEX(x) { .entries = x, .size = ARRAY_SIZE(x) }
 
 
 """)
@@ -1072,6 +1423,8 @@ char *get_cpuid_allow_env_override(struct perf_cpu cpu)
   print_mapping_table(archs)
   print_system_mapping_table()
   print_metricgroups()
+  if _args.cxx_dir:
+    print_cxx_models()
 
 if __name__ == '__main__':
   main()
@@ -0,0 +1,211 @@
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/session.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+/* The fds left to the caller below the soft RLIMIT_NOFILE */
+#define BUDGET_RESERVED_FDS 32
+
+/*
+ * Returns the number of fds the process has open, 0 if /proc/self/fd can not be read
+ */
+static size_t count_open_fds(void)
+{
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    size_t num_fds = 0;
+    for (struct dirent* entry = readdir(dir); entry != NULL; entry = readdir(dir))
+    {
+        num_fds += entry->d_name[0] != '.';
+    }
+    closedir(dir);
+    /* Without the fd of the directory itself */
+    return num_fds ? num_fds - 1 : 0;
+}
+
+/*
+ * Returns the fds the process may still open with a soft limit of "limit"
+ */
+static size_t fds_below(rlim_t limit, size_t open_fds)
+{
+    if (limit == RLIM_INFINITY)
+    {
+        return SIZE_MAX;
+    }
+    if (limit <= open_fds + BUDGET_RESERVED_FDS)
+    {
+        return 0;
+    }
+    return limit - open_fds - BUDGET_RESERVED_FDS;
+}
+
+/*
+ * Returns the fds "group" needs on the CPUs it is placed on
+ */
+static size_t group_fds(const struct pmu_session* session, size_t group)
+{
+    const struct session_group* grp = &session->groups[group];
+    if (grp->dropped)
+    {
+        return 0;
+    }
+    size_t num_cpus = session->placed != NULL ? pmu_cpuset_count(&session->placed[group])
+                                              : session->num_cpus;
+    return grp->num_counters * num_cpus;
+}
+
+static size_t session_fds(const struct pmu_session* session)
+{
+    size_t num_fds = 0;
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        num_fds += group_fds(session, group);
+    }
+    return num_fds;
+}
+
+/*
+ * Merges every counter into the first identical counter of an earlier group
+ *
+ * Returns the number of merged events
+ */
+static size_t merge_events(struct pmu_session* session)
+{
+    size_t merged = 0;
+
+    for (size_t event = 0; event < session->num_events; event++)
+    {
+        struct session_event* ev = &session->events[event];
+        /* Armed events notify about their own overflows, they have to be opened */
+        for (size_t prev = 0; prev < event && session_event_is_counter(ev) && !ev->armed; prev++)
+        {
+            const struct session_event* other = &session->events[prev];
+            if (other->group != ev->group && session_event_is_counter(other) && !other->armed &&
+                memcmp(&other->attr, &ev->attr, sizeof(struct perf_event_attr)) == 0)
+            {
+                ev->merged_into = prev;
+                merged++;
+            }
+        }
+    }
+    for (size_t group = 0; group < session->num_groups && merged != 0; group++)
+    {
+        session_update_group(session, &session->groups[group]);
+    }
+    return merged;
+}
+
+/*
+ * Returns the largest number of consecutive groups (in the order they are rotated) that
+ * fit into "available" fds wherever the rotation is, at least 1
+ */
+static size_t max_open_groups(const struct pmu_session* session, size_t available)
+{
+    size_t num_groups = session->num_groups;
+
+    for (size_t open = num_groups - 1; open > 1; open--)
+    {
+        bool fits = true;
+        for (size_t start = 0; start < num_groups && fits; start++)
+        {
+            size_t num_fds = 0;
+            for (size_t i = 0; i < open; i++)
+            {
+                num_fds += group_fds(session, (start + i) % num_groups);
+            }
+            fits = num_fds <= available;
+        }
+        if (fits)
+        {
+            return open;
+        }
+    }
+    return 1;
+}
+
+int pmu_session_open_budget(struct pmu_session* session, size_t max_fds,
+                            struct pmu_session_budget* budget)
+{
+    struct pmu_session_budget report;
+    memset(&report, 0, sizeof(report));
+
+    if (session->opened)
+    {
+        return -1;
+    }
+    if (session->packages == NULL && session_place_groups(session) == -1)
+    {
+        return -1;
+    }
+
+    report.required_fds = session_fds(session);
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        report.per_package_groups += session->groups[group].per_package;
+    }
+
+    struct rlimit limit;
+    size_t open_fds = count_open_fds();
+    if (max_fds != 0)
+    {
+        report.available_fds = max_fds;
+    }
+    else if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        report.available_fds = fds_below(limit.rlim_cur, open_fds);
+        if (report.available_fds < report.required_fds && limit.rlim_cur < limit.rlim_max)
+        {
+            rlim_t wanted = open_fds + BUDGET_RESERVED_FDS + report.required_fds;
+            limit.rlim_cur = limit.rlim_max != RLIM_INFINITY && wanted > limit.rlim_max
+                                 ? limit.rlim_max
+                                 : wanted;
+            if (setrlimit(RLIMIT_NOFILE, &limit) == 0)
+            {
+                report.raised_limit = limit.rlim_cur;
+                report.available_fds = fds_below(limit.rlim_cur, open_fds);
+            }
+        }
+    }
+    else
+    {
+        report.available_fds = SIZE_MAX;
+    }
+
+    if (session_fds(session) > report.available_fds)
+    {
+        report.merged_events = merge_events(session);
+    }
+
+    /* A group that does not fit on its own can never be opened */
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        if (group_fds(session, group) > report.available_fds)
+        {
+            session->groups[group].dropped = true;
+            report.dropped_groups++;
+        }
+    }
+
+    if (session_fds(session) > report.available_fds)
+    {
+        report.open_groups = max_open_groups(session, report.available_fds);
+        session->max_open_groups = report.open_groups;
+        session->active_groups = report.open_groups;
+        session->rotation_start = 0;
+    }
+
+    if (budget != NULL)
+    {
+        *budget = report;
+    }
+    return pmu_session_open(session);
+}
@@ -0,0 +1,465 @@
+#include <pmu-events/cache.h>
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/topology.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "pmu-evc"
+#define CACHE_VERSION 1
+
+/*
+ * Everything the cache has to match. Strings are zero-padded, so that keys are compared
+ * with memcmp().
+ */
+struct cache_key
+{
+    char release[65];
+    char version[65];
+    char cpuid[128];
+    char map_arch[32];
+    char map_cpuid[128];
+    uint32_t num_events;
+    /* Over the PMU and event names of the map, in id order */
+    uint64_t events_hash;
+    /* Over the names, types and CPUs of the PMUs in sysfs, see hash_sysfs_pmus() */
+    uint64_t sysfs_hash;
+};
+
+/*
+ * The file is the header, followed by the core type of every CPU and the entries of all
+ * events for every core type, [num_types][num_events]
+ */
+struct cache_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_cpus;
+    uint32_t num_types;
+    struct cache_key key;
+};
+
+struct cache_entry
+{
+    uint32_t type;
+    /* PMU_EVENTS_CACHE_* flags */
+    uint32_t flags;
+    uint64_t config;
+    uint64_t config1;
+    uint64_t config2;
+};
+
+struct pmu_events_cache
+{
+    void* base;
+    size_t size;
+    const struct cache_header* header;
+    const int32_t* cpu_types;
+    const struct cache_entry* entries;
+};
+
+static uint64_t fnv1a(uint64_t hash, const char* str)
+{
+    for (const char* c = str; *c != '\0'; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 0x100000001b3ULL;
+    }
+    /* Terminate, so that "ab" "c" and "a" "bc" differ */
+    return hash * 0x100000001b3ULL;
+}
+
+static int cmp_str(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * Hashes the name and the type, cpus and cpumask files of every PMU below
+ * [root]/bus/event_source/devices. This is what the resolved attrs depend on besides
+ * the formats, which only change with the kernel.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int hash_sysfs_pmus(const char* root, uint64_t* hash)
+{
+    char* devices_path = concat_path(root, "bus/event_source/devices");
+    DIR* devices = devices_path != NULL ? opendir(devices_path) : NULL;
+    if (devices == NULL)
+    {
+        free(devices_path);
+        return -1;
+    }
+
+    char** names = NULL;
+    size_t num_names = 0;
+    int ret = -1;
+    struct dirent* ent;
+    while ((ent = readdir(devices)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+        {
+            continue;
+        }
+        char** new_names = realloc(names, (num_names + 1) * sizeof(char*));
+        if (new_names == NULL)
+        {
+            goto out;
+        }
+        names = new_names;
+        names[num_names] = strdup(ent->d_name);
+        if (names[num_names] == NULL)
+        {
+            goto out;
+        }
+        num_names++;
+    }
+    /* readdir() order differs between otherwise equal directories */
+    if (num_names > 1)
+    {
+        qsort(names, num_names, sizeof(char*), cmp_str);
+    }
+
+    *hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < num_names; i++)
+    {
+        static const char* const files[] = { "type", "cpus", "cpumask" };
+        *hash = fnv1a(*hash, names[i]);
+        for (size_t f = 0; f < sizeof(files) / sizeof(files[0]); f++)
+        {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s/%s", devices_path, names[i], files[f]);
+            char* content = get_file_content(path);
+            *hash = fnv1a(*hash, content != NULL ? content : "");
+            free(content);
+        }
+    }
+    ret = 0;
+
+out:
+    for (size_t i = 0; i < num_names; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    closedir(devices);
+    free(devices_path);
+    return ret;
+}
+
+/*
+ * Fills the key of "map" on this host
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int fill_key(struct cache_key* key, const struct pmu_events_map* map, const char* root)
+{
+    memset(key, 0, sizeof(struct cache_key));
+
+    struct utsname uts;
+    if (uname(&uts) == -1)
+    {
+        return -1;
+    }
+    snprintf(key->release, sizeof(key->release), "%s", uts.release);
+    snprintf(key->version, sizeof(key->version), "%s", uts.version);
+
+    struct perf_cpu cpu = { .cpu = 0 };
+    char* cpuid = get_cpuid_allow_env_override(cpu);
+    snprintf(key->cpuid, sizeof(key->cpuid), "%s", cpuid != NULL ? cpuid : "");
+    free(cpuid);
+
+    snprintf(key->map_arch, sizeof(key->map_arch), "%s", map->arch);
+    snprintf(key->map_cpuid, sizeof(key->map_cpuid), "%s", map->cpuid);
+    key->num_events = pmu_events_num_events(map);
+    key->events_hash = 0xcbf29ce484222325ULL;
+    for (size_t p = 0; p < map->event_table.num_pmus; p++)
+    {
+        const struct pmu_table_entry* entry = &map->event_table.pmus[p];
+        key->events_hash = fnv1a(key->events_hash, get_pmu_name(*entry));
+        for (size_t i = 0; i < entry->num_entries; i++)
+        {
+            key->events_hash = fnv1a(key->events_hash, get_compact_event_name(entry->entries[i]));
+        }
+    }
+    return hash_sysfs_pmus(root, &key->sysfs_hash);
+}
+
+/*
+ * Assigns a core type to every CPU, one per core PMU (and one for CPUs without a core
+ * PMU), and picks the first CPU of each type to resolve and probe its events on
+ *
+ * Returns the number of types
+ */
+static int assign_types(const struct pmu_topology* topo, int32_t* cpu_types,
+                        struct perf_cpu* type_cpus)
+{
+    int num_types = 0;
+    for (size_t cpu = 0; cpu < topo->num_cpus; cpu++)
+    {
+        int32_t type = 0;
+        while (type < num_types && topo->core_pmu[type_cpus[type].cpu] != topo->core_pmu[cpu])
+        {
+            type++;
+        }
+        if (type == num_types)
+        {
+            type_cpus[num_types++].cpu = cpu;
+        }
+        cpu_types[cpu] = type;
+    }
+    return num_types;
+}
+
+static void probe_entry(struct cache_entry* entry, struct perf_cpu cpu)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = entry->type;
+    attr.config = entry->config;
+    attr.config1 = entry->config1;
+    attr.config2 = entry->config2;
+    attr.disabled = 1;
+
+    entry->flags |= PMU_EVENTS_CACHE_PROBED;
+    int fd = perf_event_open(&attr, -1, cpu.cpu, -1, 0);
+    if (fd != -1)
+    {
+        entry->flags |= PMU_EVENTS_CACHE_OPENABLE;
+        close(fd);
+    }
+}
+
+/*
+ * Writes "len" bytes of "buf" to "fd"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int write_all(int fd, const void* buf, size_t len)
+{
+    const char* pos = buf;
+    while (len > 0)
+    {
+        ssize_t ret = write(fd, pos, len);
+        if (ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            return -1;
+        }
+        pos += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/*
+ * Writes the cache to a temporary file next to "path" and renames it over "path"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int write_cache(const char* path, const struct cache_header* header,
+                       const int32_t* cpu_types, const struct cache_entry* entries)
+{
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >= sizeof(tmp_path))
+    {
+        return -1;
+    }
+
+    /* Create the directory if it is missing, e.g. /run/pmu-events after a reboot */
+    char* slash = strrchr(tmp_path, '/');
+    if (slash != NULL && slash != tmp_path)
+    {
+        *slash = '\0';
+        mkdir(tmp_path, 0755);
+        *slash = '/';
+    }
+
+    int fd = mkstemp(tmp_path);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    size_t num_entries = (size_t)header->num_types * header->key.num_events;
+    bool written = fchmod(fd, 0644) == 0 &&
+                   write_all(fd, header, sizeof(struct cache_header)) == 0 &&
+                   write_all(fd, cpu_types, header->num_cpus * sizeof(int32_t)) == 0 &&
+                   write_all(fd, entries, num_entries * sizeof(struct cache_entry)) == 0;
+    if (close(fd) == -1 || !written || rename(tmp_path, path) == -1)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int pmu_events_cache_build(const struct pmu_events_map* map, const char* path, unsigned flags)
+{
+    const struct pmu_topology* topo = pmu_topology_get();
+    if (map == NULL || topo == NULL)
+    {
+        return -1;
+    }
+
+    struct cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.num_cpus = topo->num_cpus;
+    if (fill_key(&header.key, map, topo->root) == -1)
+    {
+        return -1;
+    }
+
+    int ret = -1;
+    int32_t* cpu_types = malloc((topo->num_cpus + 1) * sizeof(int32_t));
+    struct perf_cpu* type_cpus = malloc((topo->num_cpus + 1) * sizeof(struct perf_cpu));
+    struct cache_entry* entries = NULL;
+    if (cpu_types == NULL || type_cpus == NULL)
+    {
+        goto out;
+    }
+    header.num_types = assign_types(topo, cpu_types, type_cpus);
+
+    size_t num_events = header.key.num_events;
+    entries = calloc((size_t)header.num_types * num_events + 1, sizeof(struct cache_entry));
+    if (entries == NULL)
+    {
+        goto out;
+    }
+    for (size_t type = 0; type < header.num_types; type++)
+    {
+        for (pmu_event_id id = 0; id < num_events; id++)
+        {
+            struct cache_entry* entry = &entries[type * num_events + id];
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            if (gen_attr_for_event_id(map, id, type_cpus[type], &attr) == -1)
+            {
+                continue;
+            }
+            entry->type = attr.type;
+            entry->flags = PMU_EVENTS_CACHE_RESOLVED;
+            entry->config = attr.config;
+            entry->config1 = attr.config1;
+            entry->config2 = attr.config2;
+            if (flags & PMU_EVENTS_CACHE_PROBE)
+            {
+                probe_entry(entry, type_cpus[type]);
+            }
+        }
+    }
+    ret = write_cache(path ? path : PMU_EVENTS_CACHE_DEFAULT_PATH, &header, cpu_types, entries);
+
+out:
+    free(entries);
+    free(type_cpus);
+    free(cpu_types);
+    return ret;
+}
+
+struct pmu_events_cache* pmu_events_cache_open(const struct pmu_events_map* map,
+                                               const char* path, const char* sysfs_root)
+{
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    int fd = open(path ? path : PMU_EVENTS_CACHE_DEFAULT_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(struct cache_header))
+    {
+        close(fd);
+        return NULL;
+    }
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    struct pmu_events_cache* cache = calloc(1, sizeof(struct pmu_events_cache));
+    if (cache == NULL)
+    {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    cache->base = base;
+    cache->size = st.st_size;
+    cache->header = base;
+
+    const struct cache_header* header = cache->header;
+    struct cache_key key;
+    size_t size = sizeof(struct cache_header) + header->num_cpus * sizeof(int32_t) +
+                  (size_t)header->num_types * header->key.num_events * sizeof(struct cache_entry);
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CACHE_VERSION || size != cache->size ||
+        fill_key(&key, map, sysfs_root ? sysfs_root : "/sys") == -1 ||
+        memcmp(&key, &header->key, sizeof(key)) != 0)
+    {
+        pmu_events_cache_close(cache);
+        return NULL;
+    }
+    cache->cpu_types = (const int32_t*)(header + 1);
+    cache->entries = (const struct cache_entry*)(cache->cpu_types + header->num_cpus);
+    for (size_t cpu = 0; cpu < header->num_cpus; cpu++)
+    {
+        if (cache->cpu_types[cpu] < 0 || cache->cpu_types[cpu] >= header->num_types)
+        {
+            pmu_events_cache_close(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+void pmu_events_cache_close(struct pmu_events_cache* cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    munmap(cache->base, cache->size);
+    free(cache);
+}
+
+int pmu_events_cache_lookup(const struct pmu_events_cache* cache, pmu_event_id id,
+                            struct perf_cpu cpu, struct perf_event_attr* attr)
+{
+    const struct cache_header* header = cache->header;
+    if (id >= header->key.num_events || cpu.cpu < 0 || cpu.cpu >= header->num_cpus)
+    {
+        return -1;
+    }
+
+    const struct cache_entry* entry =
+        &cache->entries[(size_t)cache->cpu_types[cpu.cpu] * header->key.num_events + id];
+    if (entry->flags & PMU_EVENTS_CACHE_RESOLVED)
+    {
+        attr->type = entry->type;
+        attr->config = entry->config;
+        attr->config1 = entry->config1;
+        attr->config2 = entry->config2;
+    }
+    return entry->flags;
+}
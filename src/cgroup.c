@@ -0,0 +1,190 @@
+#include <pmu-events/cgroup.h>
+#include <pmu-events/session.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct pmu_cgroups
+{
+    /* The unopened session the groups of every cgroup are cloned from */
+    struct pmu_session* groups;
+    /* Indexed by cgroup id, NULL for ids that are free */
+    struct pmu_session** sessions;
+    size_t num_sessions;
+    size_t num_attached;
+    bool enabled;
+};
+
+struct pmu_cgroups* pmu_cgroups_new(const struct pmu_session* session)
+{
+    struct pmu_cgroups* cgroups = calloc(1, sizeof(struct pmu_cgroups));
+    if (cgroups == NULL)
+    {
+        return NULL;
+    }
+    cgroups->groups = session_clone(session);
+    if (cgroups->groups == NULL)
+    {
+        free(cgroups);
+        return NULL;
+    }
+    return cgroups;
+}
+
+void pmu_cgroups_free(struct pmu_cgroups* cgroups)
+{
+    if (cgroups == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < cgroups->num_sessions; i++)
+    {
+        pmu_session_free(cgroups->sessions[i]);
+    }
+    free(cgroups->sessions);
+    pmu_session_free(cgroups->groups);
+    free(cgroups);
+}
+
+/*
+ * Returns the session of the cgroup "id", NULL if it is not attached
+ */
+static struct pmu_session* find_session(const struct pmu_cgroups* cgroups, int id)
+{
+    if (id < 0 || (size_t)id >= cgroups->num_sessions)
+    {
+        return NULL;
+    }
+    return cgroups->sessions[id];
+}
+
+/*
+ * Returns the first free cgroup id, growing the sessions if there is none
+ *
+ * Returns -1 on failure
+ */
+static int free_id(struct pmu_cgroups* cgroups)
+{
+    for (size_t i = 0; i < cgroups->num_sessions; i++)
+    {
+        if (cgroups->sessions[i] == NULL)
+        {
+            return i;
+        }
+    }
+
+    size_t num_sessions = cgroups->num_sessions ? 2 * cgroups->num_sessions : 4;
+    struct pmu_session** sessions =
+        realloc(cgroups->sessions, num_sessions * sizeof(struct pmu_session*));
+    if (sessions == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = cgroups->num_sessions; i < num_sessions; i++)
+    {
+        sessions[i] = NULL;
+    }
+    cgroups->sessions = sessions;
+
+    int id = cgroups->num_sessions;
+    cgroups->num_sessions = num_sessions;
+    return id;
+}
+
+int pmu_cgroups_attach(struct pmu_cgroups* cgroups, const char* path)
+{
+    int id = free_id(cgroups);
+    if (id == -1)
+    {
+        return -1;
+    }
+
+    struct pmu_session* session = session_clone(cgroups->groups);
+    if (session == NULL)
+    {
+        return -1;
+    }
+
+    /* The kernel only needs the directory while the counters are opened */
+    session->cgroup_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int ret = session->cgroup_fd == -1 ? -1 : pmu_session_open(session);
+    int err = errno;
+    if (session->cgroup_fd != -1)
+    {
+        close(session->cgroup_fd);
+        session->cgroup_fd = -1;
+    }
+    if (ret == 0 && cgroups->enabled)
+    {
+        ret = pmu_session_enable(session);
+        err = errno;
+    }
+    if (ret == -1)
+    {
+        pmu_session_free(session);
+        errno = err;
+        return -1;
+    }
+
+    cgroups->sessions[id] = session;
+    cgroups->num_attached++;
+    return id;
+}
+
+int pmu_cgroups_detach(struct pmu_cgroups* cgroups, int id)
+{
+    struct pmu_session* session = find_session(cgroups, id);
+    if (session == NULL)
+    {
+        return -1;
+    }
+    pmu_session_free(session);
+    cgroups->sessions[id] = NULL;
+    cgroups->num_attached--;
+    return 0;
+}
+
+int pmu_cgroups_enable(struct pmu_cgroups* cgroups)
+{
+    for (size_t i = 0; i < cgroups->num_sessions; i++)
+    {
+        if (cgroups->sessions[i] != NULL && pmu_session_enable(cgroups->sessions[i]) == -1)
+        {
+            return -1;
+        }
+    }
+    cgroups->enabled = true;
+    return 0;
+}
+
+int pmu_cgroups_disable(struct pmu_cgroups* cgroups)
+{
+    for (size_t i = 0; i < cgroups->num_sessions; i++)
+    {
+        if (cgroups->sessions[i] != NULL && pmu_session_disable(cgroups->sessions[i]) == -1)
+        {
+            return -1;
+        }
+    }
+    cgroups->enabled = false;
+    return 0;
+}
+
+size_t pmu_cgroups_num_attached(const struct pmu_cgroups* cgroups)
+{
+    return cgroups->num_attached;
+}
+
+int pmu_cgroups_read(struct pmu_cgroups* cgroups, int id, struct pmu_count* counts)
+{
+    struct pmu_session* session = find_session(cgroups, id);
+    if (session == NULL)
+    {
+        return -1;
+    }
+    return pmu_session_read(session, counts);
+}
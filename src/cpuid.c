@@ -0,0 +1,142 @@
+#include <pmu-events/pmu-events.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <regex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The cpuid matching of every architecture in arch/, lifted from
+ * linux/tools/perf/arch/xxx/util/header.c and linux/tools/perf/util/pmu.c.
+ *
+ * These do not depend on the architecture the library is built for, so that
+ * maps of other architectures can be selected, see map_for_cpuid().
+ */
+
+/*
+ * Returns true if "mapcpuid" matches all of "id", or the first "len" characters of it
+ */
+static bool regex_matches(const char* mapcpuid, const char* id, size_t len)
+{
+    regex_t re;
+    regmatch_t pmatch[1];
+
+    stats_count(PMU_EVENTS_REGEX_COMPILES);
+    if (regcomp(&re, mapcpuid, REG_EXTENDED) != 0)
+    {
+        return false;
+    }
+    bool match = regexec(&re, id, 1, pmatch, 0) == 0;
+    regfree(&re);
+
+    /* Verify the entire string matched */
+    return match && (size_t)(pmatch[0].rm_eo - pmatch[0].rm_so) == len;
+}
+
+/*
+ * x86 cpuids are "vendor-family-model-stepping", e.g. "GenuineIntel-6-55-4"
+ */
+static bool x86_is_full_cpuid(const char* id)
+{
+    int count = 0;
+    for (const char* tmp = id; (tmp = strchr(tmp, '-')) != NULL; tmp++)
+    {
+        count++;
+    }
+    return count == 3;
+}
+
+static int x86_strcmp_cpuid_str(const char* mapcpuid, const char* id)
+{
+    bool full_mapcpuid = x86_is_full_cpuid(mapcpuid);
+    bool full_cpuid = x86_is_full_cpuid(id);
+
+    /*
+     * Full CPUID format is required to identify a platform.
+     * Error out if the cpuid string is incomplete.
+     */
+    if (full_mapcpuid && !full_cpuid)
+    {
+        return 1;
+    }
+
+    /* If the full CPUID format isn't required, ignore the stepping */
+    size_t len = !full_mapcpuid && full_cpuid ? (size_t)(strrchr(id, '-') - id) : strlen(id);
+    return regex_matches(mapcpuid, id, len) ? 0 : 1;
+}
+
+#define MIDR_REVISION_MASK 0xfULL
+#define MIDR_VARIANT_MASK (0xfULL << 20)
+
+/*
+ * arm64 cpuids are the MIDR_EL1 register in hex, e.g. "0x00000000410fd0c0"
+ *
+ * Returns 0 if idstr is a higher or equal to version of the same part as
+ * mapcpuid. Therefore, if mapcpuid has 0 for revision and variant then any
+ * version of idstr will match as long as it's the same CPU type.
+ */
+static int arm64_strcmp_cpuid_str(const char* mapcpuid, const char* idstr)
+{
+    uint64_t map_id = strtoull(mapcpuid, NULL, 16);
+    uint64_t id = strtoull(idstr, NULL, 16);
+    uint64_t id_fields = ~(MIDR_VARIANT_MASK | MIDR_REVISION_MASK);
+
+    /* Compare without version first */
+    if ((map_id & id_fields) != (id & id_fields))
+    {
+        return 1;
+    }
+
+    /*
+     * Arm revisions (like r0p0) are compared like two digit semver values,
+     * with the variant as the high and the revision as the low value.
+     */
+    uint64_t map_version = (map_id & MIDR_VARIANT_MASK) >> 16 | (map_id & MIDR_REVISION_MASK);
+    uint64_t version = (id & MIDR_VARIANT_MASK) >> 16 | (id & MIDR_REVISION_MASK);
+    return version >= map_version ? 0 : 1;
+}
+
+/*
+ * The default of perf, used by all other architectures
+ */
+static int default_strcmp_cpuid_str(const char* mapcpuid, const char* id)
+{
+    return regex_matches(mapcpuid, id, strlen(id)) ? 0 : 1;
+}
+
+int strcmp_cpuid_str_for_arch(const char* arch, const char* mapcpuid, const char* id)
+{
+    if (strcmp(arch, "x86") == 0)
+    {
+        return x86_strcmp_cpuid_str(mapcpuid, id);
+    }
+    if (strcmp(arch, "arm64") == 0)
+    {
+        return arm64_strcmp_cpuid_str(mapcpuid, id);
+    }
+    return default_strcmp_cpuid_str(mapcpuid, id);
+}
+
+const struct pmu_events_map* map_for_cpuid(const char* arch, const char* cpuid)
+{
+    if (cpuid == NULL)
+    {
+        return NULL;
+    }
+
+    for (const struct pmu_events_map* map = all_pmu_events_maps(); map->arch != NULL; map++)
+    {
+        if (arch != NULL && strcmp(map->arch, arch) != 0)
+        {
+            continue;
+        }
+        if (strcmp_cpuid_str_for_arch(map->arch, map->cpuid, cpuid) == 0)
+        {
+            return map;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,359 @@
+#include <pmu-events/cpuset.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CPUSET_WORDS(num_cpus) (((num_cpus) + 63) / 64)
+
+/*
+ * Returns the word with the bits [first, last] of the word set, both in [0, 63]
+ */
+static uint64_t word_mask(size_t first, size_t last)
+{
+    return (~0ULL << first) & (~0ULL >> (63 - last));
+}
+
+/*
+ * Makes room for at least "num_words" words in "set", the new words are 0
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int grow(struct pmu_cpuset* set, size_t num_words)
+{
+    if (num_words <= set->num_words)
+    {
+        return 0;
+    }
+    /* At least double, so that adding CPUs one by one does not realloc every word */
+    size_t new_words = set->num_words * 2 > num_words ? set->num_words * 2 : num_words;
+    if (new_words > CPUSET_WORDS(PMU_CPUSET_MAX_CPUS))
+    {
+        new_words = CPUSET_WORDS(PMU_CPUSET_MAX_CPUS);
+    }
+    uint64_t* words = realloc(set->words, new_words * sizeof(uint64_t));
+    if (words == NULL)
+    {
+        return -1;
+    }
+    memset(&words[set->num_words], 0, (new_words - set->num_words) * sizeof(uint64_t));
+    set->words = words;
+    set->num_words = new_words;
+    return 0;
+}
+
+int pmu_cpuset_init(struct pmu_cpuset* set, size_t num_cpus)
+{
+    set->words = NULL;
+    set->num_words = 0;
+    if (num_cpus > PMU_CPUSET_MAX_CPUS)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+    return grow(set, CPUSET_WORDS(num_cpus));
+}
+
+void pmu_cpuset_release(struct pmu_cpuset* set)
+{
+    free(set->words);
+    set->words = NULL;
+    set->num_words = 0;
+}
+
+int pmu_cpuset_add_range(struct pmu_cpuset* set, size_t first, size_t last)
+{
+    if (first > last || last >= PMU_CPUSET_MAX_CPUS)
+    {
+        errno = first > last ? EINVAL : ERANGE;
+        return -1;
+    }
+    if (grow(set, last / 64 + 1) == -1)
+    {
+        return -1;
+    }
+
+    size_t first_word = first / 64, last_word = last / 64;
+    if (first_word == last_word)
+    {
+        set->words[first_word] |= word_mask(first % 64, last % 64);
+        return 0;
+    }
+    set->words[first_word] |= word_mask(first % 64, 63);
+    for (size_t word = first_word + 1; word < last_word; word++)
+    {
+        set->words[word] = ~0ULL;
+    }
+    set->words[last_word] |= word_mask(0, last % 64);
+    return 0;
+}
+
+int pmu_cpuset_add(struct pmu_cpuset* set, size_t cpu)
+{
+    return pmu_cpuset_add_range(set, cpu, cpu);
+}
+
+void pmu_cpuset_remove(struct pmu_cpuset* set, size_t cpu)
+{
+    if (cpu / 64 < set->num_words)
+    {
+        set->words[cpu / 64] &= ~(1ULL << (cpu % 64));
+    }
+}
+
+void pmu_cpuset_clear(struct pmu_cpuset* set)
+{
+    if (set->num_words != 0)
+    {
+        memset(set->words, 0, set->num_words * sizeof(uint64_t));
+    }
+}
+
+/*
+ * Parses the decimal CPU number at "*pos" and moves past it
+ *
+ * Returns 0 on success, -1 if there is no number or it is out of range
+ */
+static int parse_cpu(const char** pos, size_t* cpu)
+{
+    if (!isdigit((unsigned char)**pos))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    char* end;
+    errno = 0;
+    unsigned long value = strtoul(*pos, &end, 10);
+    if (errno != 0 || value >= PMU_CPUSET_MAX_CPUS)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+    *cpu = value;
+    *pos = end;
+    return 0;
+}
+
+int pmu_cpuset_parse(struct pmu_cpuset* set, const char* list)
+{
+    /* Parsed into a set of the same size, so that "set" is unchanged on failure */
+    struct pmu_cpuset parsed = PMU_CPUSET_INIT;
+    if (grow(&parsed, set->num_words) == -1)
+    {
+        return -1;
+    }
+
+    const char* pos = list;
+    while (*pos != '\0' && *pos != '\n')
+    {
+        size_t first, last;
+        if (parse_cpu(&pos, &first) == -1)
+        {
+            goto err;
+        }
+        last = first;
+        if (*pos == '-')
+        {
+            pos++;
+            if (parse_cpu(&pos, &last) == -1)
+            {
+                goto err;
+            }
+        }
+        if (pmu_cpuset_add_range(&parsed, first, last) == -1)
+        {
+            goto err;
+        }
+
+        if (*pos == ',')
+        {
+            pos++;
+        }
+        else if (*pos != '\0' && *pos != '\n')
+        {
+            errno = EINVAL;
+            goto err;
+        }
+    }
+
+    pmu_cpuset_release(set);
+    *set = parsed;
+    return 0;
+
+err:
+    pmu_cpuset_release(&parsed);
+    return -1;
+}
+
+/*
+ * Returns the lowest CPU that is not in "set" and not below "cpu"
+ */
+static size_t next_clear(const struct pmu_cpuset* set, size_t cpu)
+{
+    for (size_t word = cpu / 64; word < set->num_words; word++)
+    {
+        uint64_t clear = ~set->words[word];
+        if (word == cpu / 64)
+        {
+            clear &= ~0ULL << (cpu % 64);
+        }
+        if (clear != 0)
+        {
+            return word * 64 + __builtin_ctzll(clear);
+        }
+    }
+    return set->num_words * 64 > cpu ? set->num_words * 64 : cpu;
+}
+
+char* pmu_cpuset_format(const struct pmu_cpuset* set)
+{
+    /* Every range takes at most "65535-65535," */
+    size_t num_ranges = 0;
+    for (long cpu = pmu_cpuset_next(set, 0); cpu != -1;
+         cpu = pmu_cpuset_next(set, next_clear(set, cpu)))
+    {
+        num_ranges++;
+    }
+    char* str = malloc(num_ranges * 12 + 1);
+    if (str == NULL)
+    {
+        return NULL;
+    }
+
+    size_t len = 0;
+    str[0] = '\0';
+    for (long cpu = pmu_cpuset_next(set, 0); cpu != -1;)
+    {
+        size_t end = next_clear(set, cpu);
+        if (end == (size_t)cpu + 1)
+        {
+            len += sprintf(str + len, "%s%ld", len ? "," : "", cpu);
+        }
+        else
+        {
+            len += sprintf(str + len, "%s%ld-%zu", len ? "," : "", cpu, end - 1);
+        }
+        cpu = pmu_cpuset_next(set, end);
+    }
+    return str;
+}
+
+size_t pmu_cpuset_count(const struct pmu_cpuset* set)
+{
+    size_t count = 0;
+    for (size_t word = 0; word < set->num_words; word++)
+    {
+        count += __builtin_popcountll(set->words[word]);
+    }
+    return count;
+}
+
+bool pmu_cpuset_empty(const struct pmu_cpuset* set)
+{
+    for (size_t word = 0; word < set->num_words; word++)
+    {
+        if (set->words[word] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+long pmu_cpuset_next(const struct pmu_cpuset* set, size_t cpu)
+{
+    for (size_t word = cpu / 64; word < set->num_words; word++)
+    {
+        uint64_t bits = set->words[word];
+        if (word == cpu / 64)
+        {
+            bits &= ~0ULL << (cpu % 64);
+        }
+        if (bits != 0)
+        {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+long pmu_cpuset_last(const struct pmu_cpuset* set)
+{
+    for (size_t word = set->num_words; word > 0; word--)
+    {
+        if (set->words[word - 1] != 0)
+        {
+            return (word - 1) * 64 + 63 - __builtin_clzll(set->words[word - 1]);
+        }
+    }
+    return -1;
+}
+
+int pmu_cpuset_copy(struct pmu_cpuset* dst, const struct pmu_cpuset* src)
+{
+    if (dst == src)
+    {
+        return 0;
+    }
+    if (grow(dst, src->num_words) == -1)
+    {
+        return -1;
+    }
+    pmu_cpuset_clear(dst);
+    if (src->num_words != 0)
+    {
+        memcpy(dst->words, src->words, src->num_words * sizeof(uint64_t));
+    }
+    return 0;
+}
+
+int pmu_cpuset_and(struct pmu_cpuset* dst, const struct pmu_cpuset* src)
+{
+    for (size_t word = 0; word < dst->num_words; word++)
+    {
+        dst->words[word] &= word < src->num_words ? src->words[word] : 0;
+    }
+    return 0;
+}
+
+int pmu_cpuset_or(struct pmu_cpuset* dst, const struct pmu_cpuset* src)
+{
+    if (grow(dst, src->num_words) == -1)
+    {
+        return -1;
+    }
+    for (size_t word = 0; word < src->num_words; word++)
+    {
+        dst->words[word] |= src->words[word];
+    }
+    return 0;
+}
+
+int pmu_cpuset_andnot(struct pmu_cpuset* dst, const struct pmu_cpuset* src)
+{
+    for (size_t word = 0; word < dst->num_words && word < src->num_words; word++)
+    {
+        dst->words[word] &= ~src->words[word];
+    }
+    return 0;
+}
+
+bool pmu_cpuset_equal(const struct pmu_cpuset* a, const struct pmu_cpuset* b)
+{
+    return pmu_cpuset_subset(a, b) && pmu_cpuset_subset(b, a);
+}
+
+bool pmu_cpuset_subset(const struct pmu_cpuset* a, const struct pmu_cpuset* b)
+{
+    for (size_t word = 0; word < a->num_words; word++)
+    {
+        uint64_t other = word < b->num_words ? b->words[word] : 0;
+        if ((a->words[word] & ~other) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,688 @@
+#include <pmu-events/decode.h>
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/topology.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Formats are tracked in 64-bit bitmaps, further formats of a PMU are ignored */
+#define DECODER_MAX_FORMATS 64
+/* Groups of overlapping formats up to this size are split into all disjoint subsets */
+#define DECODER_MAX_GROUP_SUBSETS 12
+
+struct decoder_format
+{
+    char* name;
+    /* FNV-1a of "name=0x" */
+    uint64_t key_hash;
+    struct config_def config;
+    /* The bits of the attr field config.var the format covers */
+    uint64_t mask;
+};
+
+/*
+ * A set of formats of which no two cover the same bits
+ */
+struct decoder_subset
+{
+    /* Bitmap of indices into decoder_pmu->formats */
+    uint64_t formats;
+    uint64_t mask;
+};
+
+/*
+ * Formats that cover overlapping bits, e.g. "ldlat" (config1:0-15) and "offcore_rsp"
+ * (config1:0-63). Which of them an event used can not be told from the bits alone,
+ * so every disjoint subset of them is tried.
+ */
+struct decoder_group
+{
+    enum ATTR_VAR var;
+    uint64_t mask;
+    struct decoder_subset* subsets;
+    size_t num_subsets;
+};
+
+struct decoder_pmu
+{
+    uint32_t type;
+    /*
+     * The FNV-1a state after "pmu\0", for the names the events of the PMU have in the
+     * tables, e.g. "uncore_imc_0" and "uncore_imc", or "cpu" and "default_core"
+     */
+    uint64_t prefixes[2];
+    size_t num_prefixes;
+    /* sorted by name, like the keys in the hashed encodings */
+    struct decoder_format* formats;
+    size_t num_formats;
+    struct decoder_group* groups;
+    size_t num_groups;
+    /* Indices into formats, -1 if the PMU has no such format */
+    int event_format;
+    int umask_format;
+};
+
+struct pmu_event_decoder
+{
+    const struct pmu_events_map* map;
+    /* sorted by type */
+    struct decoder_pmu* pmus;
+    size_t num_pmus;
+};
+
+static uint64_t fnv1a(uint64_t hash, const char* str, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char)str[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Returns the hash of the term "key=0xvalue", with "key_hash" the FNV-1a state after "key=0x".
+ * The terms of an encoding are combined by combine_term(), see config_hash() in jevents.py.
+ */
+static uint64_t hash_term(uint64_t key_hash, uint64_t value)
+{
+    int shift = 60;
+    while (shift > 0 && (value >> shift) == 0)
+    {
+        shift -= 4;
+    }
+    for (; shift >= 0; shift -= 4)
+    {
+        key_hash = (key_hash ^ (unsigned char)"0123456789abcdef"[(value >> shift) & 0xf]) *
+                   0x100000001b3ULL;
+    }
+    return key_hash;
+}
+
+static uint64_t combine_term(uint64_t hash, uint64_t term_hash)
+{
+    return (hash ^ term_hash) * 0x100000001b3ULL;
+}
+
+static uint64_t range_mask(const struct range* range)
+{
+    if (range->start >= 64 || range->end < range->start)
+    {
+        return 0;
+    }
+    uint64_t len = range->end - range->start + 1;
+    return (len >= 64 ? UINT64_MAX : (1ULL << len) - 1) << range->start;
+}
+
+static uint64_t attr_field(const struct perf_event_attr* attr, enum ATTR_VAR var)
+{
+    switch (var)
+    {
+    case CONFIG1:
+        return attr->config1;
+    case CONFIG2:
+        return attr->config2;
+    default:
+        return attr->config;
+    }
+}
+
+/*
+ * The inverse of apply_range_list_to_val(): gathers the bits of the format from the attr
+ */
+static uint64_t extract_value(const struct perf_event_attr* attr, const struct decoder_format* fmt)
+{
+    uint64_t field = attr_field(attr, fmt->config.var);
+    uint64_t value = 0;
+    uint64_t shift = 0;
+
+    for (size_t i = 0; i < fmt->config.range.len; i++)
+    {
+        const struct range* range = &fmt->config.range.ranges[i];
+        uint64_t len = range->end - range->start + 1;
+        if (shift < 64 && range->start < 64)
+        {
+            value |= ((field & range_mask(range)) >> range->start) << shift;
+        }
+        shift += len;
+    }
+    return value;
+}
+
+/*
+ * Probes the generated hash index for "hash"
+ */
+static bool probe(const struct pmu_config_index* index, uint64_t hash, pmu_event_id* id)
+{
+    if (index->size == 0)
+    {
+        return false;
+    }
+
+    uint32_t slot = hash & (index->size - 1);
+    for (uint32_t n = 0; n < index->size; n++)
+    {
+        const struct pmu_config_index_entry* entry = &index->entries[slot];
+        if (entry->id == 0)
+        {
+            return false;
+        }
+        if (entry->hash == hash)
+        {
+            *id = entry->id - 1;
+            return true;
+        }
+        slot = (slot + 1) & (index->size - 1);
+    }
+    return false;
+}
+
+static int cmp_pmu_type(const void* a, const void* b)
+{
+    const struct decoder_pmu* pa = a;
+    const struct decoder_pmu* pb = b;
+    return (pa->type > pb->type) - (pa->type < pb->type);
+}
+
+static void free_decoder_pmu(struct decoder_pmu* pmu)
+{
+    for (size_t i = 0; i < pmu->num_formats; i++)
+    {
+        free(pmu->formats[i].name);
+        free_config_def(&pmu->formats[i].config);
+    }
+    free(pmu->formats);
+    for (size_t i = 0; i < pmu->num_groups; i++)
+    {
+        free(pmu->groups[i].subsets);
+    }
+    free(pmu->groups);
+}
+
+static int copy_config_def(struct config_def* dst, const struct config_def* src)
+{
+    dst->var = src->var;
+    dst->range.len = src->range.len;
+    dst->range.ranges = malloc(src->range.len * sizeof(struct range));
+    if (dst->range.ranges == NULL)
+    {
+        return -1;
+    }
+    memcpy(dst->range.ranges, src->range.ranges, src->range.len * sizeof(struct range));
+    return 0;
+}
+
+/*
+ * Splits the formats of "pmu" into groups of formats that overlap, directly or through
+ * other formats, and enumerates the disjoint subsets of every group.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int build_groups(struct decoder_pmu* pmu)
+{
+    size_t group_of[DECODER_MAX_FORMATS];
+
+    for (size_t i = 0; i < pmu->num_formats; i++)
+    {
+        group_of[i] = i;
+    }
+    /* Formats are few, so a quadratic union of overlapping formats is good enough */
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t i = 0; i < pmu->num_formats; i++)
+        {
+            for (size_t j = i + 1; j < pmu->num_formats; j++)
+            {
+                if (pmu->formats[i].config.var == pmu->formats[j].config.var &&
+                    (pmu->formats[i].mask & pmu->formats[j].mask) != 0 &&
+                    group_of[i] != group_of[j])
+                {
+                    size_t low = group_of[i] < group_of[j] ? group_of[i] : group_of[j];
+                    group_of[i] = group_of[j] = low;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for (size_t leader = 0; leader < pmu->num_formats; leader++)
+    {
+        if (group_of[leader] != leader)
+        {
+            continue;
+        }
+
+        size_t members[DECODER_MAX_FORMATS];
+        size_t num_members = 0;
+        uint64_t group_mask = 0;
+        for (size_t i = leader; i < pmu->num_formats; i++)
+        {
+            if (group_of[i] == leader)
+            {
+                members[num_members++] = i;
+                group_mask |= pmu->formats[i].mask;
+            }
+        }
+
+        struct decoder_group* groups =
+            realloc(pmu->groups, (pmu->num_groups + 1) * sizeof(struct decoder_group));
+        if (groups == NULL)
+        {
+            return -1;
+        }
+        pmu->groups = groups;
+        struct decoder_group* group = &pmu->groups[pmu->num_groups++];
+        group->var = pmu->formats[leader].config.var;
+        group->mask = group_mask;
+        group->subsets = NULL;
+        group->num_subsets = 0;
+
+        /* For huge groups, only try the formats on their own */
+        bool singletons_only = num_members > DECODER_MAX_GROUP_SUBSETS;
+        uint64_t num_combinations = singletons_only ? num_members : (1ULL << num_members) - 1;
+        group->subsets = malloc(num_combinations * sizeof(struct decoder_subset));
+        if (group->subsets == NULL)
+        {
+            return -1;
+        }
+
+        for (uint64_t combination = 1; combination <= num_combinations; combination++)
+        {
+            struct decoder_subset subset = { 0 };
+            bool disjoint = true;
+            for (size_t m = 0; m < num_members; m++)
+            {
+                bool member = singletons_only ? m + 1 == combination : (combination >> m) & 1;
+                if (!member)
+                {
+                    continue;
+                }
+                const struct decoder_format* fmt = &pmu->formats[members[m]];
+                disjoint &= (subset.mask & fmt->mask) == 0;
+                subset.mask |= fmt->mask;
+                subset.formats |= 1ULL << members[m];
+            }
+            if (disjoint)
+            {
+                group->subsets[group->num_subsets++] = subset;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copies the formats and names of the topology PMU "src"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int init_decoder_pmu(struct decoder_pmu* pmu, const struct topology_pmu* src)
+{
+    memset(pmu, 0, sizeof(*pmu));
+    pmu->type = src->type;
+    pmu->event_format = -1;
+    pmu->umask_format = -1;
+
+    const uint64_t fnv_offset = 0xcbf29ce484222325ULL;
+    pmu->prefixes[pmu->num_prefixes++] = fnv1a(fnv_offset, src->name, strlen(src->name) + 1);
+    if (src->is_core)
+    {
+        pmu->prefixes[pmu->num_prefixes++] =
+            fnv1a(fnv_offset, "default_core", sizeof("default_core"));
+    }
+    else
+    {
+        /* uncore_imc_0 -> uncore_imc */
+        const char* underscore = strrchr(src->name, '_');
+        if (underscore != NULL && underscore[1] != '\0' &&
+            strspn(underscore + 1, "0123456789") == strlen(underscore + 1))
+        {
+            uint64_t hash = fnv1a(fnv_offset, src->name, underscore - src->name);
+            pmu->prefixes[pmu->num_prefixes++] = fnv1a(hash, "", 1);
+        }
+    }
+
+    size_t num_formats = src->num_formats;
+    if (num_formats > DECODER_MAX_FORMATS)
+    {
+        num_formats = DECODER_MAX_FORMATS;
+    }
+    pmu->formats = calloc(num_formats, sizeof(struct decoder_format));
+    if (num_formats != 0 && pmu->formats == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < num_formats; i++)
+    {
+        struct decoder_format* fmt = &pmu->formats[i];
+        fmt->name = strdup(src->formats[i].name);
+        if (fmt->name == NULL || copy_config_def(&fmt->config, &src->formats[i].config) == -1)
+        {
+            free(fmt->name);
+            return -1;
+        }
+        pmu->num_formats++;
+        fmt->key_hash = fnv1a(fnv1a(fnv_offset, fmt->name, strlen(fmt->name)), "=0x", 3);
+
+        for (size_t r = 0; r < fmt->config.range.len; r++)
+        {
+            fmt->mask |= range_mask(&fmt->config.range.ranges[r]);
+        }
+        if (strcmp(fmt->name, "event") == 0)
+        {
+            pmu->event_format = i;
+        }
+        else if (strcmp(fmt->name, "umask") == 0)
+        {
+            pmu->umask_format = i;
+        }
+    }
+    return build_groups(pmu);
+}
+
+struct pmu_event_decoder* pmu_event_decoder_new(const struct pmu_events_map* map,
+                                                const struct pmu_topology* topo)
+{
+    if (topo == NULL)
+    {
+        topo = pmu_topology_get();
+        if (topo == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    struct pmu_event_decoder* dec = calloc(1, sizeof(struct pmu_event_decoder));
+    if (dec == NULL)
+    {
+        return NULL;
+    }
+    dec->map = map;
+    dec->pmus = calloc(topo->num_pmus, sizeof(struct decoder_pmu));
+    if (topo->num_pmus != 0 && dec->pmus == NULL)
+    {
+        free(dec);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < topo->num_pmus; i++)
+    {
+        int ret = init_decoder_pmu(&dec->pmus[i], &topo->pmus[i]);
+        dec->num_pmus++;
+        if (ret == -1)
+        {
+            pmu_event_decoder_free(dec);
+            return NULL;
+        }
+    }
+    if (dec->num_pmus > 1)
+    {
+        qsort(dec->pmus, dec->num_pmus, sizeof(struct decoder_pmu), cmp_pmu_type);
+    }
+    return dec;
+}
+
+void pmu_event_decoder_free(struct pmu_event_decoder* dec)
+{
+    if (dec == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < dec->num_pmus; i++)
+    {
+        free_decoder_pmu(&dec->pmus[i]);
+    }
+    free(dec->pmus);
+    free(dec);
+}
+
+/*
+ * The groups of formats whose bits are set in the attr to decode
+ */
+struct decode_state
+{
+    const struct pmu_event_decoder* dec;
+    const struct decoder_pmu* pmu;
+    /* Bitmap of the formats with a value other than 0 */
+    uint64_t nonzero;
+    /* The value of every format in nonzero */
+    const uint64_t* values;
+    /* hash_term() of every format in nonzero */
+    uint64_t terms[DECODER_MAX_FORMATS];
+    /* The groups with more than one way to decode their bits, and their bits in the attr */
+    const struct decoder_group* ambiguous[DECODER_MAX_FORMATS];
+    uint64_t ambiguous_bits[DECODER_MAX_FORMATS];
+    size_t num_ambiguous;
+};
+
+/*
+ * Returns true if the formats of "subset" explain the bits "bits" of its group.
+ * Terms with a value of 0 are not part of an encoding, so all formats have to be set.
+ */
+static bool subset_matches(const struct decoder_subset* subset, uint64_t bits, uint64_t nonzero)
+{
+    return (bits & ~subset->mask) == 0 && (subset->formats & ~nonzero) == 0;
+}
+
+/*
+ * Returns the index of the format "name" of length "len" of the PMU, -1 if it has none
+ */
+static int find_format(const struct decoder_pmu* pmu, const char* name, size_t len)
+{
+    for (size_t i = 0; i < pmu->num_formats; i++)
+    {
+        if (strncmp(pmu->formats[i].name, name, len) == 0 && pmu->formats[i].name[len] == '\0')
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns true if the event "id" sets exactly the formats in "selected", to the values
+ * of the attr. A hash hit alone could be a collision with another encoding.
+ */
+static bool event_matches(const struct decode_state* state, uint64_t selected, pmu_event_id id)
+{
+    struct pmu_event ev;
+    if (get_event_by_id(state->dec->map, id, &ev) == -1 || ev.event == NULL)
+    {
+        return false;
+    }
+
+    uint64_t seen = 0;
+    const char* term = ev.event;
+    while (true)
+    {
+        const char* end = strchr(term, ',');
+        end = end != NULL ? end : term + strlen(term);
+        const char* equal_sign = memchr(term, '=', end - term);
+        const char* key_end = equal_sign != NULL ? equal_sign : end;
+        char key[64];
+        if (key_end == term || key_end - term >= sizeof(key))
+        {
+            return false;
+        }
+        memcpy(key, term, key_end - term);
+        key[key_end - term] = '\0';
+
+        /* Like config_terms() in jevents.py: the period and zero terms are not hashed */
+        uint64_t value = equal_sign == NULL;
+        if (equal_sign != NULL && strcmp(key, "period") != 0 &&
+            (end - equal_sign - 1 != strlen("None") ||
+             strncmp(equal_sign + 1, "None", strlen("None")) != 0))
+        {
+            char* value_end;
+            value = strtoull(equal_sign + 1, &value_end, event_term_base(key, equal_sign + 1));
+            if (value_end != end)
+            {
+                return false;
+            }
+        }
+        if (value != 0)
+        {
+            int fmt = find_format(state->pmu, key, key_end - term);
+            if (fmt == -1 || !((selected >> fmt) & 1) || state->values[fmt] != value)
+            {
+                return false;
+            }
+            seen |= 1ULL << fmt;
+        }
+
+        if (*end == '\0')
+        {
+            return seen == selected;
+        }
+        term = end + 1;
+    }
+}
+
+/*
+ * Chooses a subset of formats for every ambiguous group from "group" on, and probes the
+ * terms of the formats in "selected" and the chosen ones.
+ *
+ * Returns true if an event was found
+ */
+static bool probe_choices(const struct decode_state* state, size_t group, uint64_t selected,
+                          pmu_event_id* id)
+{
+    if (group == state->num_ambiguous)
+    {
+        for (size_t p = 0; p < state->pmu->num_prefixes; p++)
+        {
+            uint64_t hash = state->pmu->prefixes[p];
+            for (uint64_t rest = selected; rest != 0; rest &= rest - 1)
+            {
+                hash = combine_term(hash, state->terms[__builtin_ctzll(rest)]);
+            }
+            if (probe(&state->dec->map->event_table.by_config, hash, id) &&
+                event_matches(state, selected, *id))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const struct decoder_group* g = state->ambiguous[group];
+    for (size_t s = 0; s < g->num_subsets; s++)
+    {
+        if (subset_matches(&g->subsets[s], state->ambiguous_bits[group], state->nonzero) &&
+            probe_choices(state, group + 1, selected | g->subsets[s].formats, id))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Looks up the encoding of all terms of the attr
+ *
+ * Returns true if an event was found
+ */
+static bool decode_exact(struct decode_state* state, const struct perf_event_attr* attr,
+                         pmu_event_id* id)
+{
+    const struct decoder_pmu* pmu = state->pmu;
+    uint64_t selected = 0;
+
+    state->num_ambiguous = 0;
+    for (size_t i = 0; i < pmu->num_groups; i++)
+    {
+        const struct decoder_group* g = &pmu->groups[i];
+        uint64_t bits = attr_field(attr, g->var) & g->mask;
+        if (bits == 0)
+        {
+            continue;
+        }
+        if (g->num_subsets > 1)
+        {
+            state->ambiguous[state->num_ambiguous] = g;
+            state->ambiguous_bits[state->num_ambiguous] = bits;
+            state->num_ambiguous++;
+        }
+        else if (g->num_subsets == 1 && subset_matches(&g->subsets[0], bits, state->nonzero))
+        {
+            selected |= g->subsets[0].formats;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return probe_choices(state, 0, selected, id);
+}
+
+int pmu_event_decode(const struct pmu_event_decoder* dec, const struct perf_event_attr* attr,
+                     pmu_event_id* id)
+{
+    struct decoder_pmu key = { .type = attr->type };
+    const struct decoder_pmu* pmu =
+        bsearch(&key, dec->pmus, dec->num_pmus, sizeof(struct decoder_pmu), cmp_pmu_type);
+    if (pmu == NULL)
+    {
+        return -1;
+    }
+
+    /* Only the terms of the formats in state.nonzero are ever read */
+    struct decode_state state;
+    state.dec = dec;
+    state.pmu = pmu;
+    state.nonzero = 0;
+    uint64_t values[DECODER_MAX_FORMATS];
+    state.values = values;
+    for (size_t i = 0; i < pmu->num_formats; i++)
+    {
+        const struct decoder_format* fmt = &pmu->formats[i];
+        values[i] = 0;
+        if ((attr_field(attr, fmt->config.var) & fmt->mask) != 0)
+        {
+            values[i] = extract_value(attr, fmt);
+        }
+        if (values[i] != 0)
+        {
+            state.nonzero |= 1ULL << i;
+            state.terms[i] = hash_term(pmu->formats[i].key_hash, values[i]);
+        }
+    }
+
+    if (decode_exact(&state, attr, id))
+    {
+        return PMU_EVENT_DECODE_EXACT;
+    }
+
+    uint64_t event = pmu->event_format != -1 ? values[pmu->event_format] : 0;
+    uint64_t umask = pmu->umask_format != -1 ? values[pmu->umask_format] : 0;
+    if (event == 0 && umask == 0)
+    {
+        return -1;
+    }
+    /* "event" sorts before "umask", like in config_hash() */
+    uint64_t event_hash =
+        event != 0 ? hash_term(pmu->formats[pmu->event_format].key_hash, event) : 0;
+    uint64_t umask_hash =
+        umask != 0 ? hash_term(pmu->formats[pmu->umask_format].key_hash, umask) : 0;
+    for (size_t p = 0; p < pmu->num_prefixes; p++)
+    {
+        uint64_t hash = pmu->prefixes[p];
+        if (event != 0)
+        {
+            hash = combine_term(hash, event_hash);
+        }
+        if (umask != 0)
+        {
+            hash = combine_term(hash, umask_hash);
+        }
+        if (probe(&dec->map->event_table.by_event_umask, hash, id))
+        {
+            return PMU_EVENT_DECODE_PARTIAL;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,1118 @@
+#include <pmu-events/metric.h>
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/topology.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/* Number of CPUs every instruction of a program is run for at once */
+#define EVAL_BATCH 64
+
+enum eval_op
+{
+    OP_CONST,
+    OP_EVENT,
+    OP_METRIC,
+    OP_NEG,
+    OP_NOT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_LT,
+    OP_GT,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_MIN,
+    OP_MAX,
+    OP_D_RATIO,
+    /* Pops the condition, the value if false and the value if true */
+    OP_SELECT
+};
+
+struct eval_instr
+{
+    enum eval_op op;
+    /* OP_EVENT: the event slot, OP_METRIC: the metric index */
+    size_t index;
+    /* OP_CONST */
+    double value;
+};
+
+struct eval_program
+{
+    struct eval_instr* code;
+    size_t len;
+    size_t max_depth;
+};
+
+/* The granularities metrics are evaluated at, indexed by enum aggr_mode_class */
+#define EVAL_LEVEL_CPU 0
+#define EVAL_NUM_LEVELS (PerCore + 1)
+
+/*
+ * The metrics evaluated at one granularity. A unit is a CPU, a core or a package.
+ *
+ * The CPUs of the u-th unit are order[first[u]] ... order[first[u + 1] - 1], the
+ * CPUs are sorted such that every core and every package is a contiguous run.
+ */
+struct eval_level
+{
+    size_t num_units;
+    /* [num_units + 1], NULL for EVAL_LEVEL_CPU, whose units are the CPUs themselves */
+    size_t* first;
+    /* [num_events][num_units], the summed deltas, unused for EVAL_LEVEL_CPU */
+    double* deltas;
+    /* [num_metrics][num_units] */
+    double* values;
+    /* [num_metrics][num_units], true if the threshold held in the last interval */
+    bool* above;
+    /* [num_metrics], true if the metric is evaluated at this level */
+    bool* needed;
+};
+
+struct metric_evaluator
+{
+    const struct metric_plan* plan;
+    const struct pmu_events_map* map;
+    size_t num_cpus;
+    /* Parallel to plan->metrics */
+    struct eval_program* programs;
+    struct eval_program* thresholds;
+    /* [num_metrics][num_cpus], the value of every metric at its level, for every CPU */
+    double* values;
+    /* [max_depth][EVAL_BATCH] */
+    double* stack;
+    size_t max_depth;
+    /* Set by metric_evaluator_aggregate(), the CPU indices sorted by package and core */
+    size_t* order;
+    struct eval_level levels[EVAL_NUM_LEVELS];
+};
+
+/*
+ * Reads the number from the file "path" below the sysfs root of the topology
+ *
+ * Returns the number, or -1 if the file can not be read
+ */
+static long read_sysfs_long(const struct pmu_topology* topo, const char* path)
+{
+    char* full_path = concat_path(topo->root, path);
+    if (full_path == NULL)
+    {
+        return -1;
+    }
+    char* content = get_file_content(full_path);
+    free(full_path);
+    if (content == NULL)
+    {
+        return -1;
+    }
+    long value = strtol(content, NULL, 0);
+    free(content);
+    return value;
+}
+
+/*
+ * Counts the distinct values of the topology files in "fields" (e.g. "physical_package_id")
+ * over all online CPUs, for #num_packages, #num_dies and #num_cores.
+ */
+static size_t count_distinct(const struct pmu_topology* topo, const char* const* fields,
+                             size_t num_fields)
+{
+    long* seen = malloc(topo->num_cpus * num_fields * sizeof(long));
+    size_t num_seen = 0;
+    if (seen == NULL)
+    {
+        return 0;
+    }
+
+    long cpu;
+    pmu_cpuset_for_each(cpu, &topo->online)
+    {
+        if ((size_t)cpu >= topo->num_cpus)
+        {
+            break;
+        }
+
+        long* ids = &seen[num_seen * num_fields];
+        for (size_t f = 0; f < num_fields; f++)
+        {
+            char path[128];
+            snprintf(path, sizeof(path), "devices/system/cpu/cpu%ld/topology/%s", cpu, fields[f]);
+            ids[f] = read_sysfs_long(topo, path);
+        }
+
+        bool duplicate = false;
+        for (size_t i = 0; i < num_seen && !duplicate; i++)
+        {
+            duplicate = memcmp(&seen[i * num_fields], ids, num_fields * sizeof(long)) == 0;
+        }
+        if (!duplicate)
+        {
+            num_seen++;
+        }
+    }
+    free(seen);
+    return num_seen;
+}
+
+/*
+ * Returns the TSC frequency in Hz, taken from the "model name" in /proc/cpuinfo,
+ * e.g. "Intel(R) Xeon(R) Gold 6130 CPU @ 2.10GHz", 0 if it is unknown.
+ */
+static double read_tsc_freq(void)
+{
+    FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (cpuinfo == NULL)
+    {
+        return 0;
+    }
+
+    char line[256];
+    double freq = 0;
+    while (fgets(line, sizeof(line), cpuinfo) != NULL)
+    {
+        if (strncmp(line, "model name", strlen("model name")) != 0)
+        {
+            continue;
+        }
+        const char* at = strrchr(line, '@');
+        if (at != NULL)
+        {
+            freq = strtod(at + 1, NULL) * 1e9;
+        }
+        break;
+    }
+    fclose(cpuinfo);
+    return freq;
+}
+
+int metric_literal_value(const char* name, double* value)
+{
+    const struct pmu_topology* topo = pmu_topology_get();
+    if (topo == NULL)
+    {
+        return -1;
+    }
+
+    static const char* const package[] = { "physical_package_id" };
+    static const char* const die[] = { "physical_package_id", "die_id" };
+    static const char* const core[] = { "physical_package_id", "die_id", "core_id" };
+
+    if (strcasecmp(name, "smt_on") == 0 || strcasecmp(name, "core_wide") == 0)
+    {
+        /* Counting is always system-wide, so core_wide holds whenever SMT is on */
+        *value = read_sysfs_long(topo, "devices/system/cpu/smt/active") > 0;
+    }
+    else if (strcasecmp(name, "num_cpus") == 0)
+    {
+        *value = topo->num_cpus;
+    }
+    else if (strcasecmp(name, "num_cpus_online") == 0)
+    {
+        *value = pmu_cpuset_count(&topo->online);
+    }
+    else if (strcasecmp(name, "num_packages") == 0)
+    {
+        *value = count_distinct(topo, package, 1);
+    }
+    else if (strcasecmp(name, "num_dies") == 0)
+    {
+        *value = count_distinct(topo, die, 2);
+    }
+    else if (strcasecmp(name, "num_cores") == 0)
+    {
+        *value = count_distinct(topo, core, 3);
+    }
+    else if (strcasecmp(name, "system_tsc_freq") == 0)
+    {
+        *value = read_tsc_freq();
+    }
+    else if (strcasecmp(name, "has_pmem") == 0)
+    {
+        /* Persistent memory is described by the ACPI NFIT table */
+        char* path = concat_path(topo->root, "firmware/acpi/tables/NFIT");
+        *value = path != NULL && access(path, F_OK) == 0;
+        free(path);
+    }
+    else if (strcasecmp(name, "slots") == 0)
+    {
+        /* The pipeline slots per cycle of the core PMU, 0 if it does not report them */
+        long slots = -1;
+        if (topo->num_cpus != 0 && topo->core_pmu[0] != -1)
+        {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "bus/event_source/devices/%s/caps/slots",
+                     topo->pmus[topo->core_pmu[0]].name);
+            slots = read_sysfs_long(topo, path);
+        }
+        *value = slots > 0 ? slots : 0;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Splits an event reference like "EVENT", or "pmu@event@" into the lower-cased
+ * event name and PMU (NULL if there is none). The caller is responsible for
+ * free()-ing the returned string, which "pmu" and "event" point into.
+ */
+static char* split_event_ref(const char* ref, const char** pmu, const char** event)
+{
+    char* name = strdup(ref);
+    if (name == NULL)
+    {
+        return NULL;
+    }
+    for (char* c = name; *c != '\0'; c++)
+    {
+        *c = tolower((unsigned char)*c);
+    }
+
+    *pmu = NULL;
+    *event = name;
+    char* at = strchr(name, '@');
+    if (at != NULL)
+    {
+        *at = '\0';
+        *pmu = name;
+        *event = at + 1;
+        char* end = strchr(at + 1, '@');
+        if (end != NULL)
+        {
+            *end = '\0';
+        }
+    }
+    return name;
+}
+
+/*
+ * Returns the number of instances of the PMU of the event "ref" for source_count(),
+ * e.g. 6 for an uncore_imc event on a system with uncore_imc_0 ... uncore_imc_5
+ */
+static double source_count(const struct pmu_events_map* map, const char* ref)
+{
+    const char *pmu, *event;
+    char* name = split_event_ref(ref, &pmu, &event);
+    const struct pmu_topology* topo = pmu_topology_get();
+    struct pmu_event ev;
+    size_t count = 0;
+
+    if (name == NULL)
+    {
+        return 1;
+    }
+    if (pmu == NULL && get_event_by_name(map, event, &ev) == 0)
+    {
+        pmu = ev.pmu;
+    }
+
+    if (topo != NULL && pmu != NULL && strcmp(pmu, "default_core") != 0)
+    {
+        size_t len = strlen(pmu);
+        for (size_t i = 0; i < topo->num_pmus; i++)
+        {
+            const char* candidate = topo->pmus[i].name;
+            if (strcmp(candidate, pmu) == 0 ||
+                (strncmp(candidate, pmu, len) == 0 && candidate[len] == '_' &&
+                 isdigit((unsigned char)candidate[len + 1])))
+            {
+                count++;
+            }
+        }
+    }
+    free(name);
+    return count != 0 ? count : 1;
+}
+
+/*
+ * Returns 1 if the event "ref" is known, either from the map or as a sysfs alias
+ */
+static double has_event(const struct pmu_events_map* map, const char* ref)
+{
+    const char *pmu, *event;
+    char* name = split_event_ref(ref, &pmu, &event);
+    const struct pmu_topology* topo = pmu_topology_get();
+    struct pmu_event ev;
+    bool found = false;
+
+    if (name == NULL)
+    {
+        return 0;
+    }
+    if (pmu == NULL)
+    {
+        found = get_event_by_name(map, event, &ev) == 0;
+    }
+    for (size_t i = 0; topo != NULL && !found && i < topo->num_pmus; i++)
+    {
+        if (pmu != NULL && strcmp(topo->pmus[i].name, pmu) != 0)
+        {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/bus/event_source/devices/%s/events/%s", topo->root,
+                 topo->pmus[i].name, event);
+        found = access(path, F_OK) == 0;
+    }
+    free(name);
+    return found;
+}
+
+/*
+ * Returns 1 if the CPU matches the cpuid "ref" of the architecture of "map", for
+ * strcmp_cpuid_str()
+ */
+static double cpuid_matches(const struct pmu_events_map* map, const char* ref)
+{
+    struct perf_cpu cpu = { .cpu = 0 };
+    char* cpuid = get_cpuid_allow_env_override(cpu);
+    if (cpuid == NULL)
+    {
+        return 0;
+    }
+    double matches = strcmp_cpuid_str_for_arch(map->arch, ref, cpuid) == 0;
+    free(cpuid);
+    return matches;
+}
+
+static int emit(struct eval_program* program, enum eval_op op, size_t index, double value)
+{
+    struct eval_instr* code =
+        realloc(program->code, (program->len + 1) * sizeof(struct eval_instr));
+    if (code == NULL)
+    {
+        return -1;
+    }
+    program->code = code;
+    program->code[program->len].op = op;
+    program->code[program->len].index = index;
+    program->code[program->len].value = value;
+    program->len++;
+    return 0;
+}
+
+/*
+ * Compiles "expr" to "program" in post-order, "depth" is the stack depth before
+ * the expression and is updated to the depth after it.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int compile(const struct pmu_events_map* map, const struct metric_expr* expr,
+                   struct eval_program* program, size_t* depth)
+{
+    double value;
+
+    switch (expr->type)
+    {
+    case EXPR_NUMBER:
+        value = expr->value;
+        break;
+    case EXPR_LITERAL:
+        if (metric_literal_value(expr->name, &value) == -1)
+        {
+            return -1;
+        }
+        break;
+    case EXPR_ID:
+        if (expr->event != -1 || expr->metric != -1)
+        {
+            if (emit(program, expr->event != -1 ? OP_EVENT : OP_METRIC,
+                     expr->event != -1 ? (size_t)expr->event : (size_t)expr->metric, 0) == -1)
+            {
+                return -1;
+            }
+            goto push;
+        }
+        /* Not resolved by the planner */
+        return -1;
+    case EXPR_FUNCTION:
+        if (expr->func == EXPR_SOURCE_COUNT || expr->func == EXPR_HAS_EVENT ||
+            expr->func == EXPR_STRCMP_CPUID_STR)
+        {
+            const struct metric_expr* arg = expr->args[0];
+            const char* ref = arg->type == EXPR_ID ? arg->name : NULL;
+            if (ref == NULL)
+            {
+                return -1;
+            }
+            value = expr->func == EXPR_SOURCE_COUNT ? source_count(map, ref)
+                    : expr->func == EXPR_HAS_EVENT  ? has_event(map, ref)
+                                                    : cpuid_matches(map, ref);
+            break;
+        }
+        /* fallthrough */
+    default:
+        for (size_t i = 0; i < expr->num_args; i++)
+        {
+            if (compile(map, expr->args[i], program, depth) == -1)
+            {
+                return -1;
+            }
+        }
+
+        enum eval_op op;
+        if (expr->type == EXPR_UNARY)
+        {
+            op = expr->op == '-' ? OP_NEG : OP_NOT;
+        }
+        else if (expr->type == EXPR_SELECT)
+        {
+            op = OP_SELECT;
+        }
+        else if (expr->type == EXPR_FUNCTION)
+        {
+            op = expr->func == EXPR_MIN ? OP_MIN : expr->func == EXPR_MAX ? OP_MAX : OP_D_RATIO;
+        }
+        else
+        {
+            switch (expr->op)
+            {
+            case '+':
+                op = OP_ADD;
+                break;
+            case '-':
+                op = OP_SUB;
+                break;
+            case '*':
+                op = OP_MUL;
+                break;
+            case '/':
+                op = OP_DIV;
+                break;
+            case '%':
+                op = OP_MOD;
+                break;
+            case '<':
+                op = OP_LT;
+                break;
+            case '>':
+                op = OP_GT;
+                break;
+            case '&':
+                op = OP_AND;
+                break;
+            case '|':
+                op = OP_OR;
+                break;
+            default:
+                op = OP_XOR;
+                break;
+            }
+        }
+        if (emit(program, op, 0, 0) == -1)
+        {
+            return -1;
+        }
+        /* All operators replace their arguments by a single result */
+        *depth -= expr->num_args - 1;
+        return 0;
+    }
+
+    if (emit(program, OP_CONST, 0, value) == -1)
+    {
+        return -1;
+    }
+push:
+    (*depth)++;
+    if (*depth > program->max_depth)
+    {
+        program->max_depth = *depth;
+    }
+    return 0;
+}
+
+static int compile_program(const struct pmu_events_map* map, const struct metric_expr* expr,
+                           struct eval_program* program)
+{
+    size_t depth = 0;
+    return compile(map, expr, program, &depth);
+}
+
+static void free_level(const struct metric_evaluator* eval, struct eval_level* level)
+{
+    free(level->first);
+    free(level->deltas);
+    if (level->values != eval->values)
+    {
+        free(level->values);
+    }
+    free(level->above);
+    free(level->needed);
+    memset(level, 0, sizeof(struct eval_level));
+}
+
+/*
+ * Marks the metrics the program refers to as needed
+ */
+static void mark_needed(const struct eval_program* program, bool* needed)
+{
+    for (size_t pc = 0; pc < program->len; pc++)
+    {
+        if (program->code[pc].op == OP_METRIC)
+        {
+            needed[program->code[pc].index] = true;
+        }
+    }
+}
+
+/*
+ * Returns the level the metric with the index "m" is evaluated at
+ */
+static size_t metric_level(const struct metric_evaluator* eval, size_t m)
+{
+    enum aggr_mode_class mode = eval->plan->metrics[m].metric.aggr_mode;
+    if (eval->order == NULL || (mode != PerChip && mode != PerCore))
+    {
+        return EVAL_LEVEL_CPU;
+    }
+    return mode;
+}
+
+/*
+ * Sets up the level "index" for "num_units" units, which evaluates the metrics at
+ * that level together with the metrics they refer to. "first" is taken over.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int init_level(struct metric_evaluator* eval, size_t index, size_t num_units,
+                      size_t* first)
+{
+    struct eval_level* level = &eval->levels[index];
+    size_t num_metrics = eval->plan->num_metrics;
+    size_t num_values = num_metrics * num_units;
+
+    free_level(eval, level);
+    level->num_units = num_units;
+    level->first = first;
+    level->needed = calloc(num_metrics ? num_metrics : 1, sizeof(bool));
+    level->above = calloc(num_values ? num_values : 1, sizeof(bool));
+    if (level->needed == NULL || level->above == NULL)
+    {
+        return -1;
+    }
+    if (index == EVAL_LEVEL_CPU && eval->order == NULL)
+    {
+        /* Without aggregation, the CPU level computes the values of the evaluator directly */
+        level->values = eval->values;
+    }
+    else
+    {
+        size_t num_deltas = eval->plan->num_events * num_units;
+        level->values = malloc((num_values ? num_values : 1) * sizeof(double));
+        if (level->values == NULL)
+        {
+            return -1;
+        }
+        if (index != EVAL_LEVEL_CPU)
+        {
+            level->deltas = malloc((num_deltas ? num_deltas : 1) * sizeof(double));
+            if (level->deltas == NULL)
+            {
+                return -1;
+            }
+        }
+    }
+
+    for (size_t m = 0; m < num_metrics; m++)
+    {
+        if (metric_level(eval, m) == index)
+        {
+            level->needed[m] = true;
+            mark_needed(&eval->thresholds[m], level->needed);
+        }
+    }
+    /* Metrics only refer to the metrics before them, so one pass backwards is enough */
+    for (size_t m = num_metrics; m-- > 0;)
+    {
+        if (level->needed[m])
+        {
+            mark_needed(&eval->programs[m], level->needed);
+        }
+    }
+    return 0;
+}
+
+void metric_evaluator_free(struct metric_evaluator* eval)
+{
+    if (eval == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < eval->plan->num_metrics; i++)
+    {
+        free(eval->programs[i].code);
+        free(eval->thresholds[i].code);
+    }
+    free(eval->programs);
+    free(eval->thresholds);
+    free(eval->values);
+    free(eval->stack);
+    free(eval->order);
+    for (size_t level = 0; level < EVAL_NUM_LEVELS; level++)
+    {
+        free_level(eval, &eval->levels[level]);
+    }
+    free(eval);
+}
+
+struct metric_evaluator* metric_evaluator_new(const struct metric_plan* plan,
+                                              const struct pmu_events_map* map, size_t num_cpus)
+{
+    struct metric_evaluator* eval = calloc(1, sizeof(struct metric_evaluator));
+    if (eval == NULL)
+    {
+        return NULL;
+    }
+    eval->plan = plan;
+    eval->map = map;
+    eval->num_cpus = num_cpus;
+
+    size_t num_metrics = plan->num_metrics;
+    eval->programs = calloc(num_metrics, sizeof(struct eval_program));
+    eval->thresholds = calloc(num_metrics, sizeof(struct eval_program));
+    eval->values = calloc(num_metrics * num_cpus, sizeof(double));
+    if (eval->programs == NULL || eval->thresholds == NULL ||
+        (num_metrics * num_cpus != 0 && eval->values == NULL))
+    {
+        metric_evaluator_free(eval);
+        return NULL;
+    }
+
+    for (size_t m = 0; m < num_metrics; m++)
+    {
+        const struct metric_plan_metric* metric = &plan->metrics[m];
+        if (compile_program(map, metric->expr, &eval->programs[m]) == -1 ||
+            (metric->threshold != NULL &&
+             compile_program(map, metric->threshold, &eval->thresholds[m]) == -1))
+        {
+            metric_evaluator_free(eval);
+            return NULL;
+        }
+        if (eval->programs[m].max_depth > eval->max_depth)
+        {
+            eval->max_depth = eval->programs[m].max_depth;
+        }
+        if (eval->thresholds[m].max_depth > eval->max_depth)
+        {
+            eval->max_depth = eval->thresholds[m].max_depth;
+        }
+    }
+
+    eval->stack = malloc(eval->max_depth * EVAL_BATCH * sizeof(double));
+    if ((eval->stack == NULL && eval->max_depth != 0) ||
+        init_level(eval, EVAL_LEVEL_CPU, num_cpus, NULL) == -1)
+    {
+        metric_evaluator_free(eval);
+        return NULL;
+    }
+    return eval;
+}
+
+/*
+ * Runs "program" for the "n" units of "level" starting at "start", on the deltas of
+ * the units in "deltas". Returns the result, which is the bottom of the stack.
+ */
+static const double* run(struct metric_evaluator* eval, const struct eval_program* program,
+                         const struct eval_level* level, const double* deltas, size_t start,
+                         size_t n)
+{
+    double* stack = eval->stack;
+    size_t sp = 0;
+
+    for (size_t pc = 0; pc < program->len; pc++)
+    {
+        const struct eval_instr* instr = &program->code[pc];
+        double* top = &stack[sp * EVAL_BATCH];
+        /* The arguments of binary operators: a is below b, the result replaces a */
+        double* a = sp >= 2 ? &stack[(sp - 2) * EVAL_BATCH] : NULL;
+        double* b = sp >= 1 ? &stack[(sp - 1) * EVAL_BATCH] : NULL;
+
+        switch (instr->op)
+        {
+        case OP_CONST:
+            for (size_t i = 0; i < n; i++)
+            {
+                top[i] = instr->value;
+            }
+            sp++;
+            continue;
+        case OP_EVENT:
+            memcpy(top, &deltas[instr->index * level->num_units + start], n * sizeof(double));
+            sp++;
+            continue;
+        case OP_METRIC:
+            memcpy(top, &level->values[instr->index * level->num_units + start],
+                   n * sizeof(double));
+            sp++;
+            continue;
+        case OP_NEG:
+            for (size_t i = 0; i < n; i++)
+            {
+                b[i] = -b[i];
+            }
+            continue;
+        case OP_NOT:
+            for (size_t i = 0; i < n; i++)
+            {
+                b[i] = b[i] == 0;
+            }
+            continue;
+        case OP_ADD:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] += b[i];
+            }
+            break;
+        case OP_SUB:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] -= b[i];
+            }
+            break;
+        case OP_MUL:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] *= b[i];
+            }
+            break;
+        case OP_DIV:
+            /* Like perf, a division by zero gives NaN rather than inf */
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] = b[i] == 0 ? NAN : a[i] / b[i];
+            }
+            break;
+        case OP_MOD:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] = (long)b[i] == 0 ? NAN : (double)((long)a[i] % (long)b[i]);
+            }
+            break;
+        case OP_LT:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] = a[i] < b[i];
+            }
+            break;
+        case OP_GT:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] = a[i] > b[i];
+            }
+            break;
+        case OP_AND:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] = a[i] != 0 && b[i] != 0;
+            }
+            break;
+        case OP_OR:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] = a[i] != 0 || b[i] != 0;
+            }
+            break;
+        case OP_XOR:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] = (a[i] != 0) != (b[i] != 0);
+            }
+            break;
+        case OP_MIN:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] = a[i] < b[i] ? a[i] : b[i];
+            }
+            break;
+        case OP_MAX:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] = a[i] > b[i] ? a[i] : b[i];
+            }
+            break;
+        case OP_D_RATIO:
+            for (size_t i = 0; i < n; i++)
+            {
+                a[i] = b[i] == 0 ? 0 : a[i] / b[i];
+            }
+            break;
+        case OP_SELECT:
+        {
+            /* stack: value if true, condition, value if false */
+            double* if_true = &stack[(sp - 3) * EVAL_BATCH];
+            for (size_t i = 0; i < n; i++)
+            {
+                if_true[i] = a[i] != 0 ? if_true[i] : b[i];
+            }
+            sp -= 2;
+            continue;
+        }
+        }
+        sp--;
+    }
+    return stack;
+}
+
+/*
+ * Sums the deltas of the CPUs of every unit of "level"
+ */
+static void sum_deltas(const struct metric_evaluator* eval, struct eval_level* level,
+                       const double* deltas)
+{
+    for (size_t e = 0; e < eval->plan->num_events; e++)
+    {
+        /* One row of deltas is small enough to stay in the cache while it is gathered */
+        const double* row = &deltas[e * eval->num_cpus];
+        double* sums = &level->deltas[e * level->num_units];
+        for (size_t u = 0; u < level->num_units; u++)
+        {
+            double sum = 0;
+            for (size_t i = level->first[u]; i < level->first[u + 1]; i++)
+            {
+                sum += row[eval->order[i]];
+            }
+            sums[u] = sum;
+        }
+    }
+}
+
+/*
+ * Evaluates the metrics of the level "index" on "deltas" and reports the threshold
+ * crossings of the metrics at that level
+ */
+static void evaluate(struct metric_evaluator* eval, size_t index, const double* deltas,
+                     metric_threshold_cb cb, void* data)
+{
+    const struct metric_plan* plan = eval->plan;
+    struct eval_level* level = &eval->levels[index];
+
+    for (size_t start = 0; start < level->num_units; start += EVAL_BATCH)
+    {
+        size_t n = level->num_units - start < EVAL_BATCH ? level->num_units - start : EVAL_BATCH;
+
+        /* Metrics come after the metrics they refer to, so one pass is enough */
+        for (size_t m = 0; m < plan->num_metrics; m++)
+        {
+            if (!level->needed[m])
+            {
+                continue;
+            }
+            const double* result = run(eval, &eval->programs[m], level, deltas, start, n);
+            memcpy(&level->values[m * level->num_units + start], result, n * sizeof(double));
+        }
+
+        /* Thresholds may refer to any metric, so they run after all metrics */
+        for (size_t m = 0; m < plan->num_metrics; m++)
+        {
+            if (eval->thresholds[m].len == 0 || metric_level(eval, m) != index)
+            {
+                continue;
+            }
+            const double* result = run(eval, &eval->thresholds[m], level, deltas, start, n);
+            for (size_t i = 0; i < n; i++)
+            {
+                size_t unit = start + i;
+                bool* above = &level->above[m * level->num_units + unit];
+                /* NaN compares unequal to 0, but never holds */
+                bool holds = result[i] != 0 && !isnan(result[i]);
+                if (holds == *above)
+                {
+                    continue;
+                }
+                *above = holds;
+
+                if (cb != NULL)
+                {
+                    /* Cores and packages are reported as their first CPU */
+                    struct metric_threshold_crossing crossing = {
+                        .metric = m,
+                        .cpu = level->first != NULL ? eval->order[level->first[unit]] : unit,
+                        .above = holds,
+                        .value = level->values[m * level->num_units + unit],
+                    };
+                    cb(&crossing, data);
+                }
+            }
+        }
+    }
+}
+
+int metric_evaluator_push(struct metric_evaluator* eval, const double* deltas,
+                          metric_threshold_cb cb, void* data)
+{
+    const struct metric_plan* plan = eval->plan;
+
+    evaluate(eval, EVAL_LEVEL_CPU, deltas, cb, data);
+    if (eval->order == NULL)
+    {
+        return 0;
+    }
+
+    for (size_t index = EVAL_LEVEL_CPU + 1; index < EVAL_NUM_LEVELS; index++)
+    {
+        struct eval_level* level = &eval->levels[index];
+        if (level->first != NULL)
+        {
+            sum_deltas(eval, level, deltas);
+            evaluate(eval, index, level->deltas, cb, data);
+        }
+    }
+
+    /* Every CPU gets the value of its core or package */
+    for (size_t m = 0; m < plan->num_metrics; m++)
+    {
+        const struct eval_level* level = &eval->levels[metric_level(eval, m)];
+        const double* values = &level->values[m * level->num_units];
+        double* cpu_values = &eval->values[m * eval->num_cpus];
+        if (level->first == NULL)
+        {
+            memcpy(cpu_values, values, eval->num_cpus * sizeof(double));
+            continue;
+        }
+        for (size_t u = 0; u < level->num_units; u++)
+        {
+            for (size_t i = level->first[u]; i < level->first[u + 1]; i++)
+            {
+                cpu_values[eval->order[i]] = values[u];
+            }
+        }
+    }
+    return 0;
+}
+
+/* The position of a CPU in the topology, -1 for ids that are unknown */
+struct cpu_key
+{
+    long package;
+    long die;
+    long core;
+    size_t index;
+};
+
+static int compare_cpu_keys(const void* a, const void* b)
+{
+    const struct cpu_key* x = a;
+    const struct cpu_key* y = b;
+    if (x->package != y->package)
+    {
+        return x->package < y->package ? -1 : 1;
+    }
+    if (x->die != y->die)
+    {
+        return x->die < y->die ? -1 : 1;
+    }
+    if (x->core != y->core)
+    {
+        return x->core < y->core ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/*
+ * Returns true if the sorted key "key" starts a new core (or a new package if
+ * "package"), after the key before it
+ */
+static bool starts_unit(const struct cpu_key* key, bool package)
+{
+    const struct cpu_key* prev = key - 1;
+    if (key->package == -1 || key->package != prev->package)
+    {
+        return true;
+    }
+    return !package && (key->core == -1 || key->die != prev->die || key->core != prev->core);
+}
+
+int metric_evaluator_aggregate(struct metric_evaluator* eval, const struct perf_cpu* cpus)
+{
+    const struct pmu_topology* topo = pmu_topology_get();
+    size_t num_cpus = eval->num_cpus;
+    if (topo == NULL)
+    {
+        return -1;
+    }
+
+    struct cpu_key* keys = malloc((num_cpus ? num_cpus : 1) * sizeof(struct cpu_key));
+    size_t* order = malloc((num_cpus ? num_cpus : 1) * sizeof(size_t));
+    if (keys == NULL || order == NULL)
+    {
+        free(keys);
+        free(order);
+        return -1;
+    }
+    for (size_t c = 0; c < num_cpus; c++)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/topology/physical_package_id",
+                 cpus[c].cpu);
+        keys[c].package = read_sysfs_long(topo, path);
+        snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/topology/die_id", cpus[c].cpu);
+        keys[c].die = read_sysfs_long(topo, path);
+        snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/topology/core_id", cpus[c].cpu);
+        keys[c].core = read_sysfs_long(topo, path);
+        keys[c].index = c;
+    }
+    qsort(keys, num_cpus, sizeof(struct cpu_key), compare_cpu_keys);
+    for (size_t i = 0; i < num_cpus; i++)
+    {
+        order[i] = keys[i].index;
+    }
+    free(eval->order);
+    eval->order = order;
+
+    int ret = init_level(eval, EVAL_LEVEL_CPU, num_cpus, NULL);
+    for (size_t index = EVAL_LEVEL_CPU + 1; index < EVAL_NUM_LEVELS && ret == 0; index++)
+    {
+        bool used = false;
+        for (size_t m = 0; m < eval->plan->num_metrics; m++)
+        {
+            used |= metric_level(eval, m) == index;
+        }
+        free_level(eval, &eval->levels[index]);
+        if (!used)
+        {
+            continue;
+        }
+
+        size_t* first = malloc((num_cpus + 1) * sizeof(size_t));
+        size_t num_units = 0;
+        if (first == NULL)
+        {
+            ret = -1;
+            break;
+        }
+        for (size_t i = 0; i < num_cpus; i++)
+        {
+            if (i == 0 || starts_unit(&keys[i], index == PerChip))
+            {
+                first[num_units++] = i;
+            }
+        }
+        first[num_units] = num_cpus;
+        ret = init_level(eval, index, num_units, first);
+    }
+    free(keys);
+    return ret;
+}
+
+const double* metric_evaluator_values(const struct metric_evaluator* eval, size_t metric)
+{
+    if (metric >= eval->plan->num_metrics)
+    {
+        return NULL;
+    }
+    return &eval->values[metric * eval->num_cpus];
+}
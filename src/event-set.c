@@ -0,0 +1,342 @@
+#include <pmu-events/event-set.h>
+#include <pmu-events/pmu-events.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct pmu_event_set* pmu_event_set_new(const struct pmu_events_map* map)
+{
+    struct pmu_event_set* set = calloc(1, sizeof(struct pmu_event_set));
+    if (set == NULL)
+    {
+        return NULL;
+    }
+    set->map = map;
+    set->num_ids = pmu_events_num_events(map);
+    /* At least one element, so that an empty set is not mistaken for a failure */
+    set->ids = malloc((set->num_ids + 1) * sizeof(pmu_event_id));
+    if (set->ids == NULL)
+    {
+        free(set);
+        return NULL;
+    }
+    for (size_t i = 0; i < set->num_ids; i++)
+    {
+        set->ids[i] = i;
+    }
+    return set;
+}
+
+void pmu_event_set_free(struct pmu_event_set* set)
+{
+    if (set == NULL)
+    {
+        return;
+    }
+    free(set->ids);
+    free(set);
+}
+
+/*
+ * Walks the ids of a set, together with the pmu_table_entry they belong to
+ */
+struct set_cursor
+{
+    const struct pmu_event_set* set;
+    size_t pos;
+    const struct pmu_table_entry* entry;
+    const struct pmu_table_entry* end;
+};
+
+static void cursor_init(struct set_cursor* cursor, const struct pmu_event_set* set)
+{
+    cursor->set = set;
+    cursor->pos = 0;
+    cursor->entry = set->map->event_table.pmus;
+    cursor->end = cursor->entry + set->map->event_table.num_pmus;
+}
+
+static bool cursor_done(const struct set_cursor* cursor)
+{
+    return cursor->pos == cursor->set->num_ids;
+}
+
+static pmu_event_id cursor_id(const struct set_cursor* cursor)
+{
+    return cursor->set->ids[cursor->pos];
+}
+
+static struct compact_pmu_event cursor_event(const struct set_cursor* cursor)
+{
+    return cursor->entry->entries[cursor_id(cursor) - cursor->entry->first_id];
+}
+
+/*
+ * Moves the entry of the cursor forward to the one holding the id at the current position.
+ *
+ * Returns -1 if the id is not in the map, or the ids are not ascending
+ */
+static int cursor_sync(struct set_cursor* cursor)
+{
+    if (cursor_done(cursor))
+    {
+        return 0;
+    }
+
+    pmu_event_id id = cursor_id(cursor);
+    while (cursor->entry < cursor->end &&
+           id >= cursor->entry->first_id + cursor->entry->num_entries)
+    {
+        cursor->entry++;
+    }
+    if (cursor->entry == cursor->end || id < cursor->entry->first_id)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int cursor_next(struct set_cursor* cursor)
+{
+    cursor->pos++;
+    return cursor_sync(cursor);
+}
+
+/*
+ * Skips all ids of the PMU of the current entry
+ */
+static int cursor_next_pmu(struct set_cursor* cursor)
+{
+    pmu_event_id next = cursor->entry->first_id + cursor->entry->num_entries;
+    size_t low = cursor->pos, high = cursor->set->num_ids;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (cursor->set->ids[mid] < next)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    cursor->pos = low;
+    return cursor_sync(cursor);
+}
+
+static int cmp_assignment_key(const void* a, const void* b)
+{
+    return strcmp(((const struct assignment*)a)->key, ((const struct assignment*)b)->key);
+}
+
+/*
+ * Drops the period and the terms that are 0 from "list" and sorts the rest by key
+ */
+static void canonicalize_assignments(struct assignment_list* list)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < list->len; i++)
+    {
+        if (list->assignments[i].value == 0 || strcmp(list->assignments[i].key, "period") == 0)
+        {
+            free_assignment(&list->assignments[i]);
+            continue;
+        }
+        list->assignments[len++] = list->assignments[i];
+    }
+    list->len = len;
+    if (len > 1)
+    {
+        qsort(list->assignments, len, sizeof(struct assignment), cmp_assignment_key);
+    }
+}
+
+static bool same_terms(const char* a, const char* b)
+{
+    struct assignment_list list_a, list_b;
+    if (parse_assignment_list(a, &list_a) == -1)
+    {
+        return false;
+    }
+    if (parse_assignment_list(b, &list_b) == -1)
+    {
+        free_assignment_list(&list_a);
+        return false;
+    }
+    canonicalize_assignments(&list_a);
+    canonicalize_assignments(&list_b);
+
+    bool same = list_a.len == list_b.len;
+    for (size_t i = 0; same && i < list_a.len; i++)
+    {
+        same = strcmp(list_a.assignments[i].key, list_b.assignments[i].key) == 0 &&
+               list_a.assignments[i].value == list_b.assignments[i].value;
+    }
+    free_assignment_list(&list_a);
+    free_assignment_list(&list_b);
+    return same;
+}
+
+static bool same_encoding(struct compact_pmu_event a, struct compact_pmu_event b)
+{
+    /* The compressed events are deduplicated, so the same offset means the same event */
+    if (a.offset == b.offset)
+    {
+        return true;
+    }
+
+    struct pmu_event ev_a, ev_b;
+    decompress_event(a.offset, &ev_a);
+    decompress_event(b.offset, &ev_b);
+    if (ev_a.event == NULL || ev_b.event == NULL)
+    {
+        return ev_a.event == ev_b.event;
+    }
+    return strcmp(ev_a.event, ev_b.event) == 0 || same_terms(ev_a.event, ev_b.event);
+}
+
+/*
+ * Merge-joins the ids of "a" and "b" on (PMU, name), and puts the id in "b" of every
+ * id of "a" into "matches", PMU_EVENT_ID_NONE if it is not in "b".
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int match_ids(const struct pmu_event_set* a, const struct pmu_event_set* b, unsigned flags,
+                     pmu_event_id* matches)
+{
+    struct set_cursor ca, cb;
+    cursor_init(&ca, a);
+    cursor_init(&cb, b);
+    if (cursor_sync(&ca) == -1 || cursor_sync(&cb) == -1)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < a->num_ids; i++)
+    {
+        matches[i] = PMU_EVENT_ID_NONE;
+    }
+
+    while (!cursor_done(&ca) && !cursor_done(&cb))
+    {
+        int ret;
+        int cmp = strcmp(get_pmu_name(*ca.entry), get_pmu_name(*cb.entry));
+        if (cmp < 0)
+        {
+            ret = cursor_next_pmu(&ca);
+        }
+        else if (cmp > 0)
+        {
+            ret = cursor_next_pmu(&cb);
+        }
+        else
+        {
+            struct compact_pmu_event ev_a = cursor_event(&ca);
+            struct compact_pmu_event ev_b = cursor_event(&cb);
+            cmp = strcmp(get_compact_event_name(ev_a), get_compact_event_name(ev_b));
+            if (cmp < 0)
+            {
+                ret = cursor_next(&ca);
+            }
+            else if (cmp > 0)
+            {
+                ret = cursor_next(&cb);
+            }
+            else
+            {
+                if (!(flags & PMU_EVENT_SET_SAME_ENCODING) || same_encoding(ev_a, ev_b))
+                {
+                    matches[ca.pos] = cursor_id(&cb);
+                }
+                ret = cursor_next(&ca) | cursor_next(&cb);
+            }
+        }
+        if (ret == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the ids of "a" that have (or have no) match in "b"
+ */
+static struct pmu_event_set* filter_set(const struct pmu_event_set* a,
+                                        const struct pmu_event_set* b, unsigned flags,
+                                        bool matched)
+{
+    struct pmu_event_set* result = calloc(1, sizeof(struct pmu_event_set));
+    pmu_event_id* matches = malloc((a->num_ids + 1) * sizeof(pmu_event_id));
+    if (result == NULL || matches == NULL || match_ids(a, b, flags, matches) == -1)
+    {
+        free(result);
+        free(matches);
+        return NULL;
+    }
+
+    /* The matches are not needed anymore, so the ids of the result are stored in their place */
+    result->map = a->map;
+    result->ids = matches;
+    for (size_t i = 0; i < a->num_ids; i++)
+    {
+        if ((matches[i] != PMU_EVENT_ID_NONE) == matched)
+        {
+            result->ids[result->num_ids++] = a->ids[i];
+        }
+    }
+    return result;
+}
+
+struct pmu_event_set* pmu_event_set_intersect(const struct pmu_event_set* a,
+                                              const struct pmu_event_set* b, unsigned flags)
+{
+    return filter_set(a, b, flags, true);
+}
+
+struct pmu_event_set* pmu_event_set_difference(const struct pmu_event_set* a,
+                                               const struct pmu_event_set* b, unsigned flags)
+{
+    return filter_set(a, b, flags, false);
+}
+
+int pmu_event_set_join(const struct pmu_event_set* a, const struct pmu_event_set* b,
+                       unsigned flags, struct pmu_event_pair** pairs, size_t* num_pairs)
+{
+    pmu_event_id* matches = malloc((a->num_ids + 1) * sizeof(pmu_event_id));
+    if (matches == NULL || match_ids(a, b, flags, matches) == -1)
+    {
+        free(matches);
+        return -1;
+    }
+
+    size_t num = 0;
+    for (size_t i = 0; i < a->num_ids; i++)
+    {
+        num += matches[i] != PMU_EVENT_ID_NONE;
+    }
+
+    *pairs = malloc((num + 1) * sizeof(struct pmu_event_pair));
+    if (*pairs == NULL)
+    {
+        free(matches);
+        return -1;
+    }
+    *num_pairs = 0;
+    for (size_t i = 0; i < a->num_ids; i++)
+    {
+        if (matches[i] != PMU_EVENT_ID_NONE)
+        {
+            (*pairs)[*num_pairs].a = a->ids[i];
+            (*pairs)[*num_pairs].b = matches[i];
+            (*num_pairs)++;
+        }
+    }
+    free(matches);
+    return 0;
+}
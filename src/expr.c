@@ -0,0 +1,394 @@
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A recursive descent parser for the metric expressions of the JSON files,
+ * following the grammar of tools/perf/util/expr.y:
+ *
+ *  expr     := binary ["if" binary "else" expr]
+ *  binary   := unary {op unary}, with the precedence | < ^ < & < (< >) < (+ -) < (* / %)
+ *  unary    := ("-" | "!") unary | primary
+ *  primary  := number | "#"id | id | function "(" expr {"," expr} ")" | "(" expr ")"
+ */
+struct expr_parser
+{
+    const char* p;
+};
+
+static const struct
+{
+    const char* name;
+    enum metric_expr_function func;
+    size_t num_args;
+} functions[] = {
+    { "min", EXPR_MIN, 2 },
+    { "max", EXPR_MAX, 2 },
+    { "d_ratio", EXPR_D_RATIO, 2 },
+    { "source_count", EXPR_SOURCE_COUNT, 1 },
+    { "has_event", EXPR_HAS_EVENT, 1 },
+    { "strcmp_cpuid_str", EXPR_STRCMP_CPUID_STR, 1 },
+};
+
+static struct metric_expr* parse_expr(struct expr_parser* parser);
+
+static bool is_id_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '_' || c == '.' || c == ':' || c == '@' || c == '?';
+}
+
+static void skip_whitespace(struct expr_parser* parser)
+{
+    while (isspace((unsigned char)*parser->p))
+    {
+        parser->p++;
+    }
+}
+
+/*
+ * Returns true, and skips it, if the next token is the keyword "word"
+ */
+static bool accept_keyword(struct expr_parser* parser, const char* word)
+{
+    skip_whitespace(parser);
+    size_t len = strlen(word);
+    if (strncmp(parser->p, word, len) == 0 && !is_id_char(parser->p[len]) &&
+        parser->p[len] != '\\')
+    {
+        parser->p += len;
+        return true;
+    }
+    return false;
+}
+
+static bool accept_char(struct expr_parser* parser, char c)
+{
+    skip_whitespace(parser);
+    if (*parser->p == c)
+    {
+        parser->p++;
+        return true;
+    }
+    return false;
+}
+
+static struct metric_expr* new_node(enum metric_expr_type type)
+{
+    struct metric_expr* node = calloc(1, sizeof(struct metric_expr));
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    node->type = type;
+    node->event = -1;
+    node->metric = -1;
+    return node;
+}
+
+/*
+ * Reads an identifier, removing the backslashes of escaped characters,
+ * e.g. "cpu_core@topdown\-be\-bound@" -> "cpu_core@topdown-be-bound@"
+ *
+ * Returns NULL if there is no identifier at the current position or on failure
+ */
+static char* parse_id(struct expr_parser* parser)
+{
+    const char* start = parser->p;
+    size_t len = 0;
+
+    while (is_id_char(*parser->p) || (parser->p[0] == '\\' && parser->p[1] != '\0'))
+    {
+        parser->p += parser->p[0] == '\\' ? 2 : 1;
+        len++;
+    }
+    if (len == 0)
+    {
+        return NULL;
+    }
+
+    char* id = malloc(len + 1);
+    if (id == NULL)
+    {
+        return NULL;
+    }
+    char* out = id;
+    for (const char* in = start; in < parser->p; in++)
+    {
+        if (*in == '\\')
+        {
+            in++;
+        }
+        *out++ = *in;
+    }
+    *out = '\0';
+    return id;
+}
+
+static struct metric_expr* parse_function(struct expr_parser* parser, size_t function)
+{
+    struct metric_expr* node = new_node(EXPR_FUNCTION);
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    node->func = functions[function].func;
+
+    for (size_t i = 0; i < functions[function].num_args; i++)
+    {
+        if (i != 0 && !accept_char(parser, ','))
+        {
+            metric_expr_free(node);
+            return NULL;
+        }
+        node->args[i] = parse_expr(parser);
+        if (node->args[i] == NULL)
+        {
+            metric_expr_free(node);
+            return NULL;
+        }
+        node->num_args++;
+    }
+    if (!accept_char(parser, ')'))
+    {
+        metric_expr_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+static struct metric_expr* parse_primary(struct expr_parser* parser)
+{
+    skip_whitespace(parser);
+
+    if (accept_char(parser, '('))
+    {
+        struct metric_expr* node = parse_expr(parser);
+        if (node != NULL && !accept_char(parser, ')'))
+        {
+            metric_expr_free(node);
+            return NULL;
+        }
+        return node;
+    }
+
+    if (*parser->p == '#')
+    {
+        parser->p++;
+        struct metric_expr* node = new_node(EXPR_LITERAL);
+        if (node == NULL)
+        {
+            return NULL;
+        }
+        node->name = parse_id(parser);
+        if (node->name == NULL)
+        {
+            metric_expr_free(node);
+            return NULL;
+        }
+        return node;
+    }
+
+    if (isdigit((unsigned char)*parser->p) ||
+        (*parser->p == '.' && isdigit((unsigned char)parser->p[1])))
+    {
+        char* end;
+        double value = strtod(parser->p, &end);
+        /* Like the lexer of perf, prefer the longer match, e.g. for "2nd_event" */
+        if (!is_id_char(*end) && *end != '\\')
+        {
+            struct metric_expr* node = new_node(EXPR_NUMBER);
+            if (node == NULL)
+            {
+                return NULL;
+            }
+            node->value = value;
+            parser->p = end;
+            return node;
+        }
+    }
+
+    const char* start = parser->p;
+    char* id = parse_id(parser);
+    if (id == NULL)
+    {
+        return NULL;
+    }
+
+    if (strcmp(id, "if") == 0 || strcmp(id, "else") == 0)
+    {
+        free(id);
+        parser->p = start;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++)
+    {
+        if (strcmp(id, functions[i].name) == 0 && accept_char(parser, '('))
+        {
+            free(id);
+            return parse_function(parser, i);
+        }
+    }
+
+    struct metric_expr* node = new_node(EXPR_ID);
+    if (node == NULL)
+    {
+        free(id);
+        return NULL;
+    }
+    node->name = id;
+    return node;
+}
+
+static struct metric_expr* parse_unary(struct expr_parser* parser)
+{
+    skip_whitespace(parser);
+    if (*parser->p == '-' || *parser->p == '!')
+    {
+        struct metric_expr* node = new_node(EXPR_UNARY);
+        if (node == NULL)
+        {
+            return NULL;
+        }
+        node->op = *parser->p++;
+        node->args[0] = parse_unary(parser);
+        node->num_args = 1;
+        if (node->args[0] == NULL)
+        {
+            metric_expr_free(node);
+            return NULL;
+        }
+        return node;
+    }
+    return parse_primary(parser);
+}
+
+/*
+ * Returns the precedence of the binary operator "op", 0 if it is none
+ */
+static int precedence(char op)
+{
+    switch (op)
+    {
+    case '|':
+        return 1;
+    case '^':
+        return 2;
+    case '&':
+        return 3;
+    case '<':
+    case '>':
+        return 4;
+    case '+':
+    case '-':
+        return 5;
+    case '*':
+    case '/':
+    case '%':
+        return 6;
+    default:
+        return 0;
+    }
+}
+
+static struct metric_expr* parse_binary(struct expr_parser* parser, int min_precedence)
+{
+    struct metric_expr* lhs = parse_unary(parser);
+
+    while (lhs != NULL)
+    {
+        skip_whitespace(parser);
+        char op = *parser->p;
+        int prec = precedence(op);
+        if (prec == 0 || prec < min_precedence)
+        {
+            break;
+        }
+        parser->p++;
+
+        struct metric_expr* node = new_node(EXPR_BINARY);
+        if (node == NULL)
+        {
+            metric_expr_free(lhs);
+            return NULL;
+        }
+        node->op = op;
+        node->args[0] = lhs;
+        node->args[1] = parse_binary(parser, prec + 1);
+        node->num_args = 2;
+        if (node->args[1] == NULL)
+        {
+            metric_expr_free(node);
+            return NULL;
+        }
+        lhs = node;
+    }
+    return lhs;
+}
+
+static struct metric_expr* parse_expr(struct expr_parser* parser)
+{
+    struct metric_expr* value = parse_binary(parser, 1);
+    if (value == NULL || !accept_keyword(parser, "if"))
+    {
+        return value;
+    }
+
+    struct metric_expr* node = new_node(EXPR_SELECT);
+    if (node == NULL)
+    {
+        metric_expr_free(value);
+        return NULL;
+    }
+    node->args[0] = value;
+    node->num_args = 3;
+    node->args[1] = parse_binary(parser, 1);
+    if (node->args[1] == NULL || !accept_keyword(parser, "else"))
+    {
+        metric_expr_free(node);
+        return NULL;
+    }
+    node->args[2] = parse_expr(parser);
+    if (node->args[2] == NULL)
+    {
+        metric_expr_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+/*
+ * Parses the metric expression "str".
+ *
+ * Returns the root of the expression tree on success, NULL on failure.
+ * The caller is responsible for freeing it with metric_expr_free().
+ */
+struct metric_expr* metric_expr_parse(const char* str)
+{
+    struct expr_parser parser = { .p = str };
+
+    struct metric_expr* expr = parse_expr(&parser);
+    skip_whitespace(&parser);
+    if (expr != NULL && *parser.p != '\0')
+    {
+        metric_expr_free(expr);
+        return NULL;
+    }
+    return expr;
+}
+
+void metric_expr_free(struct metric_expr* expr)
+{
+    if (expr == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < 3; i++)
+    {
+        metric_expr_free(expr->args[i]);
+    }
+    free(expr->name);
+    free(expr);
+}
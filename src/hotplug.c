@@ -0,0 +1,245 @@
+#include <pmu-events/hotplug.h>
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/topology.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <errno.h>
+#include <linux/netlink.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+struct change_callback
+{
+    pmu_events_change_cb cb;
+    void* data;
+};
+
+static struct change_callback* callbacks = NULL;
+static size_t num_callbacks = 0;
+/* Protects callbacks, which may be changed from within a callback or another thread */
+static pthread_mutex_t callbacks_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Serializes pmu_events_check_changes(), so that no refresh is built on a stale snapshot */
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int pmu_events_add_change_callback(pmu_events_change_cb cb, void* data)
+{
+    pthread_mutex_lock(&callbacks_lock);
+    struct change_callback* new_callbacks =
+        realloc(callbacks, (num_callbacks + 1) * sizeof(struct change_callback));
+    if (new_callbacks == NULL)
+    {
+        pthread_mutex_unlock(&callbacks_lock);
+        return -1;
+    }
+    callbacks = new_callbacks;
+    callbacks[num_callbacks].cb = cb;
+    callbacks[num_callbacks].data = data;
+    num_callbacks++;
+    pthread_mutex_unlock(&callbacks_lock);
+    return 0;
+}
+
+/*
+ * Returns the index of the callback "cb" with "data", or -1 if it is not registered.
+ * Has to be called with callbacks_lock held.
+ */
+static ssize_t find_callback(pmu_events_change_cb cb, void* data)
+{
+    for (size_t i = 0; i < num_callbacks; i++)
+    {
+        if (callbacks[i].cb == cb && callbacks[i].data == data)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int pmu_events_remove_change_callback(pmu_events_change_cb cb, void* data)
+{
+    pthread_mutex_lock(&callbacks_lock);
+    ssize_t i = find_callback(cb, data);
+    if (i != -1)
+    {
+        memmove(&callbacks[i], &callbacks[i + 1],
+                (num_callbacks - i - 1) * sizeof(struct change_callback));
+        num_callbacks--;
+    }
+    pthread_mutex_unlock(&callbacks_lock);
+    return i != -1 ? 0 : -1;
+}
+
+/*
+ * Calls the callbacks registered at the time of the call. The lock is not held
+ * while a callback runs, so that it can (un)register callbacks: callbacks that
+ * were removed in the meantime are skipped, the ones added are not called.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int notify_callbacks(const struct pmu_events_change* change)
+{
+    pthread_mutex_lock(&callbacks_lock);
+    size_t num = num_callbacks;
+    struct change_callback* copy = malloc((num ? num : 1) * sizeof(struct change_callback));
+    if (copy == NULL)
+    {
+        pthread_mutex_unlock(&callbacks_lock);
+        return -1;
+    }
+    memcpy(copy, callbacks, num * sizeof(struct change_callback));
+    pthread_mutex_unlock(&callbacks_lock);
+
+    for (size_t i = 0; i < num; i++)
+    {
+        pthread_mutex_lock(&callbacks_lock);
+        bool registered = find_callback(copy[i].cb, copy[i].data) != -1;
+        pthread_mutex_unlock(&callbacks_lock);
+        if (registered)
+        {
+            copy[i].cb(change, copy[i].data);
+        }
+    }
+    free(copy);
+    return 0;
+}
+
+int pmu_events_check_changes(void)
+{
+    pthread_mutex_lock(&check_lock);
+    const struct pmu_topology* topo = pmu_topology_get();
+    if (topo == NULL)
+    {
+        pthread_mutex_unlock(&check_lock);
+        return -1;
+    }
+
+    struct pmu_topology* refreshed;
+    struct pmu_events_change change;
+    int ret = topology_refresh(topo, &refreshed, &change);
+    if (ret != 1)
+    {
+        pthread_mutex_unlock(&check_lock);
+        return ret;
+    }
+
+    /*
+     * Readers of the old snapshot keep using it, it is retired rather than freed.
+     * If pmu_topology_set() replaced it meanwhile, the change does not apply.
+     */
+    if (!topology_publish(topo, refreshed))
+    {
+        pthread_mutex_unlock(&check_lock);
+        free_topology_change(&change);
+        return 0;
+    }
+
+    /*
+     * The cpuid, and thus the events map, of a CPU can only change while it is offline
+     * (e.g. on big.LITTLE systems where a different core is brought up)
+     */
+    for (size_t i = 0; i < change.num_cpus_online; i++)
+    {
+        map_for_cpu_invalidate(change.cpus_online[i]);
+    }
+    for (size_t i = 0; i < change.num_cpus_offline; i++)
+    {
+        map_for_cpu_invalidate(change.cpus_offline[i]);
+    }
+    pthread_mutex_unlock(&check_lock);
+
+    ret = notify_callbacks(&change) == -1 ? -1 : 1;
+    free_topology_change(&change);
+    return ret;
+}
+
+int pmu_events_uevent_open(void)
+{
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Checks if the uevent message "msg" of length "len" concerns CPUs or PMUs.
+ *
+ * A uevent message looks like:
+ *  "offline@/devices/system/cpu/cpu3\0ACTION=offline\0DEVPATH=...\0SUBSYSTEM=cpu\0..."
+ */
+static bool is_relevant_uevent(const char* msg, size_t len)
+{
+    const char* end = msg + len;
+
+    for (const char* line = msg; line < end; line += strnlen(line, end - line) + 1)
+    {
+        if (strncmp(line, "SUBSYSTEM=", strlen("SUBSYSTEM=")) != 0)
+        {
+            continue;
+        }
+        const char* subsystem = line + strlen("SUBSYSTEM=");
+        if (strcmp(subsystem, "cpu") == 0 || strcmp(subsystem, "event_source") == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int pmu_events_uevent_process(int fd)
+{
+    char buf[8192];
+    bool relevant = false;
+
+    for (;;)
+    {
+        ssize_t len = recv(fd, buf, sizeof(buf) - 1, 0);
+        if (len == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            /* ENOBUFS: we lost messages, assume the worst */
+            if (errno == ENOBUFS)
+            {
+                relevant = true;
+                continue;
+            }
+            return -1;
+        }
+        if (len == 0)
+        {
+            break;
+        }
+        buf[len] = '\0';
+        relevant |= is_relevant_uevent(buf, len);
+    }
+
+    if (!relevant)
+    {
+        return 0;
+    }
+    return pmu_events_check_changes();
+}
@@ -0,0 +1,1130 @@
+#include <pmu-events/metric.h>
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/topology.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/*
+ * A growable list of indices
+ */
+struct index_list
+{
+    size_t* indices;
+    size_t len;
+};
+
+struct planner
+{
+    const struct pmu_events_map* map;
+    struct metric_plan* plan;
+    unsigned flags;
+    /* The metric_name of the metrics currently being expanded, to detect cycles */
+    const char** stack;
+    size_t stack_len;
+    /* Parallel to plan->metrics: true if the events of the metric must not be grouped */
+    bool* nogroup;
+    bool nmi_watchdog;
+    bool smt_active;
+};
+
+/*
+ * Appends "index" to "list", unless it is already in it
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int index_list_add(struct index_list* list, size_t index)
+{
+    for (size_t i = 0; i < list->len; i++)
+    {
+        if (list->indices[i] == index)
+        {
+            return 0;
+        }
+    }
+    size_t* indices = realloc(list->indices, (list->len + 1) * sizeof(size_t));
+    if (indices == NULL)
+    {
+        return -1;
+    }
+    list->indices = indices;
+    list->indices[list->len++] = index;
+    return 0;
+}
+
+/*
+ * Checks if "name" is one of the entries of the ';'-separated "list", ignoring case
+ */
+static bool in_semicolon_list(const char* list, const char* name)
+{
+    if (list == NULL)
+    {
+        return false;
+    }
+
+    size_t len = strlen(name);
+    for (const char* p = list; *p != '\0';)
+    {
+        const char* end = strchr(p, ';');
+        size_t entry_len = end ? (size_t)(end - p) : strlen(p);
+        if (entry_len == len && strncasecmp(p, name, len) == 0)
+        {
+            return true;
+        }
+        if (end == NULL)
+        {
+            break;
+        }
+        p = end + 1;
+    }
+    return false;
+}
+
+/*
+ * Returns true if the file "path" starts with a non-zero number.
+ *
+ * Not get_file_content(), as files in /proc report a size of 0
+ */
+static bool read_flag_file(const char* path)
+{
+    char buf[16];
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return false;
+    }
+    buf[len] = '\0';
+    return atoi(buf) != 0;
+}
+
+/*
+ * Looks up the metric "name" in the metric table of the map, preferring the metric of "pmu"
+ * for hybrid systems, where the same metric exists for e.g. "cpu_core" and "cpu_atom".
+ *
+ * Returns 0 on success, -1 if there is no such metric
+ */
+static int find_metric(const struct pmu_events_map* map, const char* name, const char* pmu,
+                       struct pmu_metric* metric)
+{
+    pmu_metric_id id;
+    if (get_metric_id(map, pmu, name, &id) == -1 && get_metric_id(map, NULL, name, &id) == -1)
+    {
+        return -1;
+    }
+    return get_metric_by_id(map, id, metric);
+}
+
+/*
+ * Looks up the PMU of the event "name" in the event table of "map", preferring "pmu"
+ * if the event exists for more than one PMU.
+ *
+ * Returns NULL if there is no such event
+ */
+static const char* find_event_pmu(const struct pmu_events_map* map, const char* name,
+                                  const char* pmu)
+{
+    pmu_event_id id;
+    if (get_event_id(map, pmu, name, &id) == 0)
+    {
+        return pmu;
+    }
+
+    struct pmu_event ev;
+    if (get_event_id(map, NULL, name, &id) == -1 || get_event_by_id(map, id, &ev) == -1)
+    {
+        return NULL;
+    }
+    return ev.pmu;
+}
+
+/*
+ * Returns the PMU the event "name" without explicit PMU of a metric on "pmu" is counted on:
+ * The PMU of the event in the map, the software or tool PMU for common events, or
+ * "pmu" itself for events that are not in the tables, e.g. sysfs aliases.
+ */
+static const char* event_pmu(const struct pmu_events_map* map, const char* name, const char* pmu)
+{
+    const char* event_pmu = find_event_pmu(map, name, pmu);
+    if (event_pmu != NULL)
+    {
+        return event_pmu;
+    }
+
+    const struct pmu_events_map* common = common_events_map();
+    if (common != NULL)
+    {
+        event_pmu = find_event_pmu(common, name, pmu);
+    }
+    return event_pmu != NULL ? event_pmu : pmu;
+}
+
+/*
+ * Checks if "pmu" names the core PMU in the tables or metric expressions
+ */
+static bool is_core_pmu(const char* pmu)
+{
+    return strcmp(pmu, "default_core") == 0 || strcmp(pmu, "cpu") == 0 ||
+           strcmp(pmu, "cpu_core") == 0 || strcmp(pmu, "cpu_atom") == 0;
+}
+
+/*
+ * Returns the PMU of a "pmu@event@" reference of a metric on "metric_pmu". Metric
+ * expressions name the core PMU "cpu" (or "cpu_core" and "cpu_atom"), the tables name it
+ * "default_core" on non-hybrid systems, so such references are resolved to the PMU of the
+ * metric, to be grouped with the events without explicit PMU.
+ */
+static const char* reference_pmu(const char* pmu, const char* metric_pmu)
+{
+    if (is_core_pmu(metric_pmu) &&
+        (strcmp(pmu, "cpu") == 0 || (strcmp(metric_pmu, "default_core") == 0 && is_core_pmu(pmu))))
+    {
+        return metric_pmu;
+    }
+    return pmu;
+}
+
+/*
+ * Checks if the modifiers "a" and "b" of two events, either of which may be NULL, are the same
+ */
+static bool same_modifiers(const char* a, const char* b)
+{
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+/*
+ * Returns the index of the event "name" with "modifiers" (NULL for none) on "pmu" in the plan,
+ * adding it if necessary
+ *
+ * Returns -1 on failure
+ */
+static int add_event(struct planner* planner, const char* pmu, const char* name,
+                     const char* modifiers)
+{
+    struct metric_plan* plan = planner->plan;
+
+    for (size_t i = 0; i < plan->num_events; i++)
+    {
+        if (strcmp(plan->events[i].pmu, pmu) == 0 && strcmp(plan->events[i].name, name) == 0 &&
+            same_modifiers(plan->events[i].modifiers, modifiers))
+        {
+            return i;
+        }
+    }
+
+    struct metric_plan_event* events =
+        realloc(plan->events, (plan->num_events + 1) * sizeof(struct metric_plan_event));
+    if (events == NULL)
+    {
+        return -1;
+    }
+    plan->events = events;
+
+    struct metric_plan_event* ev = &plan->events[plan->num_events];
+    ev->pmu = strdup(pmu);
+    ev->name = strdup(name);
+    ev->modifiers = modifiers ? strdup(modifiers) : NULL;
+    if (get_event_id(planner->map, pmu, name, &ev->id) == -1)
+    {
+        ev->id = PMU_EVENT_ID_NONE;
+    }
+    if (ev->pmu == NULL || ev->name == NULL || (modifiers != NULL && ev->modifiers == NULL))
+    {
+        free(ev->pmu);
+        free(ev->name);
+        free(ev->modifiers);
+        return -1;
+    }
+    return plan->num_events++;
+}
+
+static int add_metric(struct planner* planner, const struct pmu_metric* pm, bool requested,
+                      bool nogroup);
+
+static void to_lower(char* str)
+{
+    for (char* c = str; *c != '\0'; c++)
+    {
+        *c = tolower((unsigned char)*c);
+    }
+}
+
+/*
+ * Resolves the event referenced by the ID node "node" of a metric on "pmu", which is
+ * either "EVENT_NAME", "EVENT_NAME:modifiers" or "pmu@event,terms@modifiers"
+ *
+ * Events with the "R" (retirement latency) modifier are not counted, the node is
+ * replaced by the mean retirement latency from the event table instead.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int resolve_event(struct planner* planner, struct metric_expr* node, const char* pmu,
+                         struct index_list* events)
+{
+    char* name = strdup(node->name);
+    if (name == NULL)
+    {
+        return -1;
+    }
+
+    /* The PMU and event are lower-cased, the modifiers keep their case, e.g. "H" or "h" */
+    char* event = name;
+    char* modifiers = NULL;
+    char* at = strchr(name, '@');
+    if (at != NULL)
+    {
+        /* "pmu@event@", possibly followed by modifiers, e.g. "cpu@cpu_clk_unhalted.core_p@k" */
+        *at = '\0';
+        to_lower(name);
+        pmu = reference_pmu(name, pmu);
+        event = at + 1;
+        char* end = strchr(event, '@');
+        if (end != NULL)
+        {
+            *end = '\0';
+            modifiers = end[1] == ':' ? end + 2 : end + 1;
+        }
+    }
+    else if ((modifiers = strchr(name, ':')) != NULL)
+    {
+        *modifiers++ = '\0';
+    }
+    to_lower(event);
+    if (modifiers != NULL && *modifiers == '\0')
+    {
+        modifiers = NULL;
+    }
+
+    if (modifiers != NULL && strpbrk(modifiers, "Rr") != NULL)
+    {
+        struct pmu_event ev;
+        node->type = EXPR_NUMBER;
+        node->value = 0;
+        if (get_event_by_name(planner->map, event, &ev) == 0 &&
+            ev.retirement_latency_mean != NULL)
+        {
+            node->value = strtod(ev.retirement_latency_mean, NULL);
+        }
+        free(name);
+        return 0;
+    }
+    if (at == NULL)
+    {
+        pmu = event_pmu(planner->map, event, pmu);
+    }
+
+    int index = add_event(planner, pmu, event, modifiers);
+    free(name);
+    if (index == -1 || index_list_add(events, index) == -1)
+    {
+        return -1;
+    }
+    node->event = index;
+    return 0;
+}
+
+/*
+ * Resolves all IDs of "expr" of a metric on "pmu" to events or metrics, adding them
+ * to the plan, and records them in "events" and "metrics".
+ *
+ * For threshold expressions, "metrics" is NULL and "self" is the index of the metric
+ * the threshold belongs to, otherwise "self" is -1.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int resolve_ids(struct planner* planner, struct metric_expr* expr, const char* pmu,
+                       struct index_list* events, struct index_list* metrics, int self)
+{
+    if (expr->type == EXPR_FUNCTION &&
+        (expr->func == EXPR_SOURCE_COUNT || expr->func == EXPR_HAS_EVENT ||
+         expr->func == EXPR_STRCMP_CPUID_STR))
+    {
+        /* The arguments of these are looked up when evaluating, not counted */
+        return 0;
+    }
+
+    for (size_t i = 0; i < expr->num_args; i++)
+    {
+        if (resolve_ids(planner, expr->args[i], pmu, events, metrics, self) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if (expr->type != EXPR_ID)
+    {
+        return 0;
+    }
+
+    struct pmu_metric dep;
+    if (strchr(expr->name, '@') != NULL || strchr(expr->name, ':') != NULL ||
+        find_metric(planner->map, expr->name, pmu, &dep) == -1)
+    {
+        return resolve_event(planner, expr, pmu, events);
+    }
+
+    if (self != -1 &&
+        strcasecmp(dep.metric_name, planner->plan->metrics[self].metric.metric_name) == 0)
+    {
+        expr->metric = self;
+        return 0;
+    }
+
+    int index = add_metric(planner, &dep, false, false);
+    if (index == -1)
+    {
+        return -1;
+    }
+    expr->metric = index;
+    if (metrics != NULL && index_list_add(metrics, index) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns true if the events of "pm" must not be put into a group
+ */
+static bool metric_nogroup(const struct planner* planner, const struct pmu_metric* pm)
+{
+    switch (pm->event_grouping)
+    {
+    case MetricNoGroupEvents:
+        return true;
+    case MetricNoGroupEventsNmi:
+        return planner->nmi_watchdog;
+    case MetricNoGroupEventsSmt:
+        return planner->smt_active;
+    case MetricNoGroupEventsThresholdAndNmi:
+        return planner->nmi_watchdog || (planner->flags & METRIC_PLAN_THRESHOLDS);
+    default:
+        return false;
+    }
+}
+
+/*
+ * Adds the metric "pm" to the plan, after all the metrics it refers to
+ *
+ * Returns the index of the metric in the plan, -1 on failure or if the
+ * metrics refer to each other in a cycle
+ */
+static int add_metric(struct planner* planner, const struct pmu_metric* pm, bool requested,
+                      bool nogroup)
+{
+    struct metric_plan* plan = planner->plan;
+
+    for (size_t i = 0; i < plan->num_metrics; i++)
+    {
+        if (plan->metrics[i].metric.metric_name == pm->metric_name)
+        {
+            plan->metrics[i].requested |= requested;
+            planner->nogroup[i] |= nogroup;
+            return i;
+        }
+    }
+    for (size_t i = 0; i < planner->stack_len; i++)
+    {
+        if (planner->stack[i] == pm->metric_name)
+        {
+            return -1;
+        }
+    }
+    if (pm->metric_expr == NULL)
+    {
+        return -1;
+    }
+
+    const char** stack = realloc(planner->stack, (planner->stack_len + 1) * sizeof(char*));
+    if (stack == NULL)
+    {
+        return -1;
+    }
+    planner->stack = stack;
+    planner->stack[planner->stack_len++] = pm->metric_name;
+
+    struct index_list events = { 0 };
+    struct index_list metrics = { 0 };
+    struct metric_expr* expr = metric_expr_parse(pm->metric_expr);
+    int ret = expr == NULL ? -1 : resolve_ids(planner, expr, pm->pmu, &events, &metrics, -1);
+    planner->stack_len--;
+    if (ret == -1)
+    {
+        goto err;
+    }
+
+    struct metric_plan_metric* new_metrics =
+        realloc(plan->metrics, (plan->num_metrics + 1) * sizeof(struct metric_plan_metric));
+    if (new_metrics == NULL)
+    {
+        goto err;
+    }
+    plan->metrics = new_metrics;
+    bool* new_nogroup = realloc(planner->nogroup, (plan->num_metrics + 1) * sizeof(bool));
+    if (new_nogroup == NULL)
+    {
+        goto err;
+    }
+    planner->nogroup = new_nogroup;
+
+    struct metric_plan_metric* metric = &plan->metrics[plan->num_metrics];
+    metric->metric = *pm;
+    if (get_metric_id(planner->map, pm->pmu, pm->metric_name, &metric->id) == -1)
+    {
+        goto err;
+    }
+    metric->requested = requested;
+    metric->events = events.indices;
+    metric->num_events = events.len;
+    metric->metrics = metrics.indices;
+    metric->num_metrics = metrics.len;
+    metric->expr = expr;
+    metric->threshold = NULL;
+    planner->nogroup[plan->num_metrics] = nogroup || metric_nogroup(planner, pm);
+    return plan->num_metrics++;
+
+err:
+    metric_expr_free(expr);
+    free(events.indices);
+    free(metrics.indices);
+    return -1;
+}
+
+/*
+ * Parses the threshold of the metric with the index "index" and adds the
+ * events and metrics it refers to.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int add_threshold(struct planner* planner, size_t index)
+{
+    struct metric_plan_metric* metric = &planner->plan->metrics[index];
+    if (metric->metric.metric_threshold == NULL)
+    {
+        return 0;
+    }
+
+    struct metric_expr* threshold = metric_expr_parse(metric->metric.metric_threshold);
+    if (threshold == NULL)
+    {
+        return -1;
+    }
+
+    struct index_list events = { .indices = metric->events, .len = metric->num_events };
+    int ret = resolve_ids(planner, threshold, metric->metric.pmu, &events, NULL, index);
+
+    /* resolve_ids() may have added metrics, moving plan->metrics */
+    metric = &planner->plan->metrics[index];
+    metric->events = events.indices;
+    metric->num_events = events.len;
+    metric->threshold = threshold;
+    return ret;
+}
+
+static bool bits_test(const uint64_t* bits, size_t bit)
+{
+    return bits[bit / 64] & (1ULL << (bit % 64));
+}
+
+static void bits_set(uint64_t* bits, size_t bit)
+{
+    bits[bit / 64] |= 1ULL << (bit % 64);
+}
+
+struct group_candidate
+{
+    uint64_t* bits;
+    size_t count;
+};
+
+static int cmp_candidate_count(const void* a, const void* b)
+{
+    const struct group_candidate* ca = a;
+    const struct group_candidate* cb = b;
+    return (ca->count < cb->count) - (ca->count > cb->count);
+}
+
+static bool is_slots_event(const char* name)
+{
+    return strcmp(name, "slots") == 0 || strcmp(name, "topdown.slots") == 0;
+}
+
+/*
+ * Topdown events (e.g. "topdown-retiring") are read from the PERF_METRICS register,
+ * which the kernel only allows in a group led by the slots event
+ */
+static bool is_topdown_event(const char* name)
+{
+    return strncmp(name, "topdown-", strlen("topdown-")) == 0;
+}
+
+/*
+ * Returns the index of the slots event on "pmu" in the plan, -1 if there is none
+ */
+static int find_slots_event(const struct metric_plan* plan, const char* pmu)
+{
+    for (size_t i = 0; i < plan->num_events; i++)
+    {
+        if (strcmp(plan->events[i].pmu, pmu) == 0 && is_slots_event(plan->events[i].name))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Adds the slots event to every PMU with topdown events that does not have one yet
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int add_slots_events(struct planner* planner)
+{
+    struct metric_plan* plan = planner->plan;
+
+    for (size_t i = 0; i < plan->num_events; i++)
+    {
+        if (is_topdown_event(plan->events[i].name) &&
+            find_slots_event(plan, plan->events[i].pmu) == -1 &&
+            add_event(planner, plan->events[i].pmu, "slots", NULL) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Adds a group consisting of the events set in "bits". Topdown events can only be
+ * counted in a group that is led by the slots event, so that is moved to the front.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int add_group(struct metric_plan* plan, const uint64_t* bits)
+{
+    struct metric_plan_group* groups =
+        realloc(plan->groups, (plan->num_groups + 1) * sizeof(struct metric_plan_group));
+    if (groups == NULL)
+    {
+        return -1;
+    }
+    plan->groups = groups;
+
+    struct metric_plan_group* group = &plan->groups[plan->num_groups];
+    group->num_events = 0;
+    group->events = malloc(plan->num_events * sizeof(size_t));
+    if (group->events == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < plan->num_events; i++)
+    {
+        if (!bits_test(bits, i))
+        {
+            continue;
+        }
+        group->events[group->num_events] = i;
+        if (is_slots_event(plan->events[i].name))
+        {
+            memmove(&group->events[1], &group->events[0], group->num_events * sizeof(size_t));
+            group->events[0] = i;
+        }
+        group->num_events++;
+    }
+    plan->num_groups++;
+    return 0;
+}
+
+/*
+ * Checks if the planned event "e" takes one of the generic counters of its PMU. Events
+ * that are not in the map, e.g. sysfs aliases, are assumed to.
+ */
+static bool needs_generic_counter(const struct planner* planner, size_t e)
+{
+    struct pmu_event ev;
+    pmu_event_id id = planner->plan->events[e].id;
+    return id == PMU_EVENT_ID_NONE || get_event_by_id(planner->map, id, &ev) == -1 ||
+           !ev.fixed_counter;
+}
+
+/*
+ * Adds the events set in "bits", which are all on one PMU, as groups. A group of the core
+ * PMU that needs more generic counters than there are would never be scheduled, so those
+ * are split into groups that fit, see pmu_events_num_generic_counters().
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int add_counter_groups(struct planner* planner, const uint64_t* bits, size_t words)
+{
+    struct metric_plan* plan = planner->plan;
+    const char* pmu = NULL;
+    for (size_t e = 0; e < plan->num_events && pmu == NULL; e++)
+    {
+        pmu = bits_test(bits, e) ? plan->events[e].pmu : NULL;
+    }
+    uint32_t max = pmu != NULL && is_core_pmu(pmu)
+                       ? pmu_events_num_generic_counters(planner->map, pmu)
+                       : 0;
+    if (max == 0)
+    {
+        return add_group(plan, bits);
+    }
+
+    uint64_t* part = calloc(words, sizeof(uint64_t));
+    if (part == NULL)
+    {
+        return -1;
+    }
+    uint32_t num_generic = 0;
+    int ret = 0;
+    for (size_t e = 0; e < plan->num_events && ret == 0; e++)
+    {
+        if (!bits_test(bits, e))
+        {
+            continue;
+        }
+        if (needs_generic_counter(planner, e) && num_generic++ == max)
+        {
+            ret = add_group(plan, part);
+            memset(part, 0, words * sizeof(uint64_t));
+            num_generic = 1;
+        }
+        bits_set(part, e);
+    }
+    if (ret == 0)
+    {
+        ret = add_group(plan, part);
+    }
+    free(part);
+    return ret;
+}
+
+/*
+ * Groups the events of every metric, including the events of the metrics it refers to,
+ * per PMU. Groups that are contained in a larger group are dropped, events that are
+ * not in any group are counted on their own. Core PMU groups are split to fit the
+ * generic counters.
+ *
+ * The topdown events of a PMU are always put into one group with the slots event as
+ * leader, regardless of the metrics they belong to, see add_slots_events().
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int build_groups(struct planner* planner)
+{
+    struct metric_plan* plan = planner->plan;
+    size_t words = (plan->num_events + 63) / 64;
+    int ret = -1;
+
+    uint64_t* closures = calloc(plan->num_metrics * words + 3 * words, sizeof(uint64_t));
+    struct group_candidate* candidates = NULL;
+    size_t num_candidates = 0;
+    if (closures == NULL)
+    {
+        return -1;
+    }
+    uint64_t* done = &closures[plan->num_metrics * words];
+    uint64_t* covered = done + words;
+    /* The topdown events and the slots events leading them */
+    uint64_t* topdown = covered + words;
+
+    for (size_t e = 0; e < plan->num_events; e++)
+    {
+        if (is_topdown_event(plan->events[e].name))
+        {
+            bits_set(topdown, e);
+            bits_set(topdown, find_slots_event(plan, plan->events[e].pmu));
+        }
+    }
+    for (size_t e = 0; e < plan->num_events; e++)
+    {
+        if (!bits_test(topdown, e) || bits_test(covered, e))
+        {
+            continue;
+        }
+        memset(done, 0, words * sizeof(uint64_t));
+        for (size_t o = e; o < plan->num_events; o++)
+        {
+            if (bits_test(topdown, o) && strcmp(plan->events[o].pmu, plan->events[e].pmu) == 0)
+            {
+                bits_set(done, o);
+                bits_set(covered, o);
+            }
+        }
+        if (add_group(plan, done) == -1)
+        {
+            goto out;
+        }
+    }
+
+    for (size_t m = 0; m < plan->num_metrics; m++)
+    {
+        uint64_t* closure = &closures[m * words];
+        const struct metric_plan_metric* metric = &plan->metrics[m];
+
+        for (size_t i = 0; i < metric->num_events; i++)
+        {
+            bits_set(closure, metric->events[i]);
+        }
+        for (size_t i = 0; i < metric->num_metrics; i++)
+        {
+            for (size_t w = 0; w < words; w++)
+            {
+                closure[w] |= closures[metric->metrics[i] * words + w];
+            }
+        }
+        if (planner->nogroup[m])
+        {
+            continue;
+        }
+
+        /* Split the closure into one candidate group per PMU */
+        memset(done, 0, words * sizeof(uint64_t));
+        for (size_t e = 0; e < plan->num_events; e++)
+        {
+            if (!bits_test(closure, e) || bits_test(done, e) || bits_test(topdown, e))
+            {
+                continue;
+            }
+
+            struct group_candidate* new_candidates =
+                realloc(candidates, (num_candidates + 1) * sizeof(struct group_candidate));
+            if (new_candidates == NULL)
+            {
+                goto out;
+            }
+            candidates = new_candidates;
+            struct group_candidate* candidate = &candidates[num_candidates];
+            candidate->count = 0;
+            candidate->bits = calloc(words, sizeof(uint64_t));
+            if (candidate->bits == NULL)
+            {
+                goto out;
+            }
+            num_candidates++;
+
+            for (size_t o = e; o < plan->num_events; o++)
+            {
+                if (bits_test(closure, o) && !bits_test(topdown, o) &&
+                    strcmp(plan->events[o].pmu, plan->events[e].pmu) == 0)
+                {
+                    bits_set(candidate->bits, o);
+                    bits_set(done, o);
+                    candidate->count++;
+                }
+            }
+        }
+    }
+
+    if (num_candidates > 1)
+    {
+        qsort(candidates, num_candidates, sizeof(struct group_candidate), cmp_candidate_count);
+    }
+
+    for (size_t c = 0; c < num_candidates; c++)
+    {
+        bool subset = false;
+        for (size_t prev = 0; prev < c && !subset; prev++)
+        {
+            if (candidates[prev].count == 0)
+            {
+                continue;
+            }
+            subset = true;
+            for (size_t w = 0; w < words; w++)
+            {
+                if ((candidates[c].bits[w] & ~candidates[prev].bits[w]) != 0)
+                {
+                    subset = false;
+                    break;
+                }
+            }
+        }
+        if (subset)
+        {
+            /* Mark as dropped, so that later candidates are not compared against it */
+            candidates[c].count = 0;
+            continue;
+        }
+        if (add_counter_groups(planner, candidates[c].bits, words) == -1)
+        {
+            goto out;
+        }
+        for (size_t w = 0; w < words; w++)
+        {
+            covered[w] |= candidates[c].bits[w];
+        }
+    }
+
+    for (size_t e = 0; e < plan->num_events; e++)
+    {
+        if (bits_test(covered, e))
+        {
+            continue;
+        }
+        memset(done, 0, words * sizeof(uint64_t));
+        bits_set(done, e);
+        if (add_group(plan, done) == -1)
+        {
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    for (size_t c = 0; c < num_candidates; c++)
+    {
+        free(candidates[c].bits);
+    }
+    free(candidates);
+    free(closures);
+    return ret;
+}
+
+static struct metric_plan* plan_metrics(const struct pmu_events_map* map,
+                                        const char* const* names, size_t num_names,
+                                        unsigned flags)
+{
+    struct planner planner = { .map = map, .flags = flags };
+
+    planner.plan = calloc(1, sizeof(struct metric_plan));
+    if (planner.plan == NULL)
+    {
+        return NULL;
+    }
+
+    const struct pmu_topology* topo = pmu_topology_get();
+    char* smt_path = concat_path(topo ? topo->root : "/sys", "devices/system/cpu/smt/active");
+    if (smt_path != NULL)
+    {
+        planner.smt_active = read_flag_file(smt_path);
+        free(smt_path);
+    }
+    planner.nmi_watchdog = read_flag_file("/proc/sys/kernel/nmi_watchdog");
+
+    for (size_t n = 0; n < num_names; n++)
+    {
+        bool found = false;
+
+        for (pmu_metric_id id = 0; id < pmu_events_num_metrics(map); id++)
+        {
+            struct pmu_metric pm;
+            get_metric_by_id(map, id, &pm);
+
+            if (strcasecmp(pm.metric_name, names[n]) != 0 &&
+                !in_semicolon_list(pm.metric_group, names[n]))
+            {
+                continue;
+            }
+            found = true;
+            if (add_metric(&planner, &pm, true,
+                           in_semicolon_list(pm.metricgroup_no_group, names[n])) == -1)
+            {
+                goto err;
+            }
+        }
+        if (!found)
+        {
+            goto err;
+        }
+    }
+
+    if (flags & METRIC_PLAN_THRESHOLDS)
+    {
+        /* add_threshold() may append further metrics, which are handled by the loop too */
+        for (size_t i = 0; i < planner.plan->num_metrics; i++)
+        {
+            if (add_threshold(&planner, i) == -1)
+            {
+                goto err;
+            }
+        }
+    }
+
+    if (add_slots_events(&planner) == -1 || build_groups(&planner) == -1)
+    {
+        goto err;
+    }
+
+    free(planner.stack);
+    free(planner.nogroup);
+    return planner.plan;
+
+err:
+    free(planner.stack);
+    free(planner.nogroup);
+    metric_plan_free(planner.plan);
+    return NULL;
+}
+
+struct metric_plan* metric_plan_new(const struct pmu_events_map* map, const char* const* names,
+                                    size_t num_names, unsigned flags)
+{
+    uint64_t start = stats_start();
+    struct metric_plan* plan = plan_metrics(map, names, num_names, flags);
+    stats_end(PMU_EVENTS_ENTRY_METRIC_PLAN_NEW, start);
+    return plan;
+}
+
+/*
+ * Applies the modifiers of a planned event, e.g. "k" or "u", to "attr" the way the event
+ * parser does
+ *
+ * Returns 0 on success, -1 for unknown modifiers
+ */
+static int apply_modifiers(const char* modifiers, struct perf_event_attr* attr)
+{
+    bool user = false, kernel = false, hv = false;
+    for (const char* m = modifiers; *m != '\0'; m++)
+    {
+        switch (*m)
+        {
+        case 'u':
+            user = true;
+            break;
+        case 'k':
+            kernel = true;
+            break;
+        case 'h':
+            hv = true;
+            break;
+        case 'G':
+            attr->exclude_host = 1;
+            break;
+        case 'H':
+            attr->exclude_guest = 1;
+            break;
+        case 'I':
+            attr->exclude_idle = 1;
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (user || kernel || hv)
+    {
+        attr->exclude_user = !user;
+        attr->exclude_kernel = !kernel;
+        attr->exclude_hv = !hv;
+    }
+    return 0;
+}
+
+/*
+ * gen_attr_for_plan_event(), without the modifiers of the event
+ */
+static int gen_attr_for_unmodified(const struct pmu_events_map* map,
+                                   const struct metric_plan_event* ev, struct perf_cpu cpu,
+                                   struct perf_event_attr* attr)
+{
+    if (ev->id != PMU_EVENT_ID_NONE)
+    {
+        return gen_attr_for_event_id(map, ev->id, cpu, attr);
+    }
+
+    /* "uops_decoded.dec0,cmask=1": the event of the map with further terms */
+    const char* terms = strchr(ev->name, ',');
+    if (terms != NULL)
+    {
+        char* name = strndup(ev->name, terms - ev->name);
+        if (name == NULL)
+        {
+            return -1;
+        }
+
+        pmu_event_id id;
+        struct pmu_event pe;
+        int ret = -1;
+        if ((get_event_id(map, ev->pmu, name, &id) == 0 ||
+             get_event_id(map, NULL, name, &id) == 0) &&
+            get_event_by_id(map, id, &pe) == 0 && pe.event != NULL)
+        {
+            size_t len = strlen(pe.event) + strlen(terms) + 1;
+            char* event = malloc(len);
+            if (event != NULL)
+            {
+                snprintf(event, len, "%s%s", pe.event, terms);
+                pe.pmu = ev->pmu;
+                pe.event = event;
+                ret = gen_attr_for_event(&pe, cpu, attr);
+                free(event);
+            }
+        }
+        free(name);
+        return ret;
+    }
+
+    /* "duration_time": a software or tool event of arch/common */
+    const struct pmu_events_map* common = common_events_map();
+    pmu_event_id id;
+    if (common != NULL && get_event_id(common, ev->pmu, ev->name, &id) == 0)
+    {
+        return gen_attr_for_event_id(common, id, cpu, attr);
+    }
+
+    /* "topdown-retiring": an alias in the events/ directory of the PMU */
+    const struct pmu_topology* topo = pmu_topology_get();
+    struct pmu_event alias = { .name = ev->name, .pmu = ev->pmu };
+    const struct topology_pmu* pmu = topo ? topology_pmu_for_event(topo, &alias, cpu) : NULL;
+    const struct pmu_alias_def* def = pmu ? topology_find_alias(topo, pmu, ev->name) : NULL;
+    if (def == NULL)
+    {
+        return -1;
+    }
+    alias.event = def->event;
+    return gen_attr_for_event(&alias, cpu, attr);
+}
+
+int gen_attr_for_plan_event(const struct pmu_events_map* map, const struct metric_plan_event* ev,
+                            struct perf_cpu cpu, struct perf_event_attr* attr)
+{
+    if (gen_attr_for_unmodified(map, ev, cpu, attr) == -1)
+    {
+        return -1;
+    }
+    return ev->modifiers != NULL ? apply_modifiers(ev->modifiers, attr) : 0;
+}
+
+void metric_plan_free(struct metric_plan* plan)
+{
+    if (plan == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < plan->num_events; i++)
+    {
+        free(plan->events[i].pmu);
+        free(plan->events[i].name);
+        free(plan->events[i].modifiers);
+    }
+    free(plan->events);
+    for (size_t i = 0; i < plan->num_groups; i++)
+    {
+        free(plan->groups[i].events);
+    }
+    free(plan->groups);
+    for (size_t i = 0; i < plan->num_metrics; i++)
+    {
+        free(plan->metrics[i].events);
+        free(plan->metrics[i].metrics);
+        metric_expr_free(plan->metrics[i].expr);
+        metric_expr_free(plan->metrics[i].threshold);
+    }
+    free(plan->metrics);
+    free(plan);
+}
@@ -0,0 +1,210 @@
+#include <pmu-events/session.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * The data pages of the ring buffer of an armed event. Its records only mark the
+ * overflows, so a page holds hundreds of them between two pmu_session_overflows().
+ */
+#define NOTIFY_RING_PAGES 1
+
+/* The most ready fds taken from the epoll fd at once, see pmu_session_overflows() */
+#define NOTIFY_BATCH 64
+
+struct session_notify
+{
+    /* Watches the fds of all open armed events, with cpu * num_events + event as data */
+    int epoll_fd;
+    size_t ring_len;
+    /* [num_cpus][num_events], the ring buffers of the open armed events, NULL elsewhere */
+    struct perf_event_mmap_page** rings;
+    /* The ring pmu_session_overflows() starts at */
+    size_t next;
+};
+
+int pmu_session_arm(struct pmu_session* session, size_t event, uint64_t threshold)
+{
+    if (session->opened || event >= session->num_events || threshold == 0 ||
+        !session_event_is_counter(&session->events[event]))
+    {
+        return -1;
+    }
+
+    struct session_event* ev = &session->events[event];
+    ev->attr.sample_period = threshold;
+    ev->attr.freq = 0;
+    /* Wake the epoll fd up on every overflow */
+    ev->attr.watermark = 0;
+    ev->attr.wakeup_events = 1;
+    ev->armed = true;
+    return 0;
+}
+
+struct session_notify* session_notify_new(const struct pmu_session* session)
+{
+    struct session_notify* notify = calloc(1, sizeof(struct session_notify));
+    if (notify == NULL)
+    {
+        return NULL;
+    }
+
+    size_t num_rings = session->num_cpus * session->num_events;
+    notify->rings = calloc(num_rings ? num_rings : 1, sizeof(struct perf_event_mmap_page*));
+    notify->ring_len = (1 + NOTIFY_RING_PAGES) * sysconf(_SC_PAGESIZE);
+    notify->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (notify->rings == NULL || notify->epoll_fd == -1)
+    {
+        int err = errno;
+        session_notify_free(session, notify);
+        errno = err;
+        return NULL;
+    }
+    return notify;
+}
+
+void session_notify_free(const struct pmu_session* session, struct session_notify* notify)
+{
+    if (notify == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; notify->rings != NULL && i < session->num_cpus * session->num_events;
+         i++)
+    {
+        if (notify->rings[i] != NULL)
+        {
+            munmap(notify->rings[i], notify->ring_len);
+        }
+    }
+    if (notify->epoll_fd != -1)
+    {
+        close(notify->epoll_fd);
+    }
+    free(notify->rings);
+    free(notify);
+}
+
+int session_notify_add(struct pmu_session* session, size_t event, size_t cpu, int fd)
+{
+    struct session_notify* notify = session->notify;
+    size_t index = cpu * session->num_events + event;
+
+    void* ring = mmap(NULL, notify->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+    {
+        return -1;
+    }
+    notify->rings[index] = ring;
+
+    struct epoll_event watch = { .events = EPOLLIN, .data.u64 = index };
+    return epoll_ctl(notify->epoll_fd, EPOLL_CTL_ADD, fd, &watch);
+}
+
+void session_notify_remove(struct pmu_session* session, size_t event, size_t cpu)
+{
+    struct session_notify* notify = session->notify;
+    size_t index = cpu * session->num_events + event;
+
+    /* Closing the fd removes it from the epoll fd */
+    if (notify->rings[index] != NULL)
+    {
+        munmap(notify->rings[index], notify->ring_len);
+        notify->rings[index] = NULL;
+    }
+}
+
+int pmu_session_notify_fd(const struct pmu_session* session)
+{
+    return session->notify != NULL ? session->notify->epoll_fd : -1;
+}
+
+/*
+ * Consumes the records of a ring buffer
+ *
+ * Returns the number of overflows they mark, including those the kernel lost
+ */
+static uint64_t drain(struct perf_event_mmap_page* ring)
+{
+    const char* buf = (const char*)ring + ring->data_offset;
+    uint64_t size = ring->data_size;
+    uint64_t head = __atomic_load_n(&ring->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->data_tail;
+    uint64_t overflows = 0;
+
+    while (tail < head)
+    {
+        /* Records are 8 byte aligned, so every 64 bit field of one is in one piece */
+        const struct perf_event_header* header = (const void*)&buf[tail % size];
+        if (header->size < sizeof(struct perf_event_header))
+        {
+            break;
+        }
+        if (header->type == PERF_RECORD_SAMPLE)
+        {
+            overflows++;
+        }
+        else if (header->type == PERF_RECORD_LOST)
+        {
+            /* { header, id, lost } */
+            overflows += *(const uint64_t*)&buf[(tail + 16) % size];
+        }
+        tail += header->size;
+    }
+    __atomic_store_n(&ring->data_tail, tail, __ATOMIC_RELEASE);
+    return overflows;
+}
+
+long pmu_session_overflows(struct pmu_session* session, struct pmu_overflow* overflows,
+                           size_t max_overflows)
+{
+    struct session_notify* notify = session->notify;
+    if (notify == NULL)
+    {
+        return -1;
+    }
+
+    /*
+     * Polling the fd of an event, as the epoll set of the caller does, consumes its
+     * wakeup, so the ready list of the epoll fd is no reliable account of the overflows.
+     * It is only emptied, so that the next overflow makes the fd readable again, before
+     * the rings are checked for new records, which costs no syscalls.
+     */
+    struct epoll_event ready[NOTIFY_BATCH];
+    int n;
+    do
+    {
+        n = epoll_wait(notify->epoll_fd, ready, NOTIFY_BATCH, 0);
+    } while (n == NOTIFY_BATCH || (n == -1 && errno == EINTR));
+    if (n == -1)
+    {
+        return -1;
+    }
+
+    size_t num_rings = session->num_cpus * session->num_events;
+    size_t num = 0;
+    for (size_t i = 0; i < num_rings && num < max_overflows; i++)
+    {
+        /* Start after the last reported ring, so that no ring is starved */
+        size_t index = (notify->next + i) % num_rings;
+        uint64_t count = notify->rings[index] ? drain(notify->rings[index]) : 0;
+        if (count != 0)
+        {
+            overflows[num].event = index % session->num_events;
+            overflows[num].cpu = index / session->num_events;
+            overflows[num].overflows = count;
+            num++;
+        }
+        if (num == max_overflows)
+        {
+            notify->next = (index + 1) % num_rings;
+        }
+    }
+    return num;
+}
@@ -0,0 +1,465 @@
+#include <pmu-events/parse.h>
+#include <pmu-events/topology.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The longest event, PMU or term name, longer names are rejected */
+#define PARSE_MAX_NAME 256
+
+/* The highest precise_ip, "skid must be 0" */
+#define PARSE_MAX_PRECISE 3
+
+struct parser
+{
+    const struct pmu_events_map* map;
+    struct perf_cpu cpu;
+    const char* spec;
+    /* The next character to parse, where parsing failed after an error */
+    const char* pos;
+    struct pmu_parsed_event* events;
+    size_t num_events;
+    size_t max_events;
+};
+
+/*
+ * Returns true if "c" ends a name: one of the characters of the syntax
+ */
+static bool ends_name(char c)
+{
+    return c == '\0' || strchr(",/:{}=", c) != NULL;
+}
+
+/*
+ * Copies the name at the position of the parser into "name", lower-cased if "lower",
+ * and moves past it
+ *
+ * Returns 0 on success, -1 if there is no name or it does not fit into "name"
+ */
+static int parse_name(struct parser* p, char* name, bool lower)
+{
+    size_t len = 0;
+    for (; !ends_name(p->pos[len]); len++)
+    {
+        if (len + 1 == PARSE_MAX_NAME)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        name[len] = lower ? tolower((unsigned char)p->pos[len]) : p->pos[len];
+    }
+    if (len == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    name[len] = '\0';
+    p->pos += len;
+    return 0;
+}
+
+/*
+ * Parses the value of a term, decimal or hex with 0x, and moves past it
+ *
+ * Returns 0 on success, -1 if there is no number
+ */
+static int parse_value(struct parser* p, uint64_t* value)
+{
+    bool hex = p->pos[0] == '0' && (p->pos[1] == 'x' || p->pos[1] == 'X');
+    char* end;
+    errno = 0;
+    *value = strtoull(p->pos, &end, hex ? 16 : 10);
+    if (end == p->pos || errno != 0 || !isdigit((unsigned char)*p->pos))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    p->pos = end;
+    return 0;
+}
+
+/*
+ * Applies a term without a value, e.g. "inv" or "cas_count_read", of the PMU
+ * "pmu" that was given as "pmu_name"
+ *
+ * Returns 0 on success, -1 if the PMU knows no such format, alias or event
+ */
+static int apply_flag_term(const struct parser* p, const struct pmu_topology* topo,
+                           const struct topology_pmu* pmu, const char* pmu_name,
+                           struct perf_event_attr* attr, const char* key)
+{
+    if (topology_find_format(pmu, key) != NULL)
+    {
+        return apply_event_term(attr, pmu, key, 1);
+    }
+
+    const struct pmu_alias_def* alias = topology_find_alias(topo, pmu, key);
+    if (alias != NULL)
+    {
+        return apply_event_string(attr, pmu, alias->event, 0);
+    }
+
+    pmu_event_id id;
+    struct pmu_event ev;
+    if ((get_event_id(p->map, pmu_name, key, &id) == 0 ||
+         (pmu->is_core && get_event_id(p->map, "default_core", key, &id) == 0)) &&
+        get_event_by_id(p->map, id, &ev) == 0)
+    {
+        return apply_event_string(attr, pmu, ev.event, 0);
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/*
+ * Parses the value of the term "key" of "pmu" after the '=' and applies it
+ *
+ * Returns 0 on success, -1 for malformed values and unknown terms
+ */
+static int parse_value_term(struct parser* p, const struct topology_pmu* pmu,
+                            struct perf_event_attr* attr, const char* key)
+{
+    if (strcmp(key, "name") == 0)
+    {
+        /* Only names the event for perf */
+        p->pos += strcspn(p->pos, ",/");
+        return 0;
+    }
+
+    uint64_t value;
+    if (parse_value(p, &value) == -1)
+    {
+        return -1;
+    }
+    if (strcmp(key, "period") == 0)
+    {
+        attr->sample_period = value;
+        attr->freq = 0;
+    }
+    else if (strcmp(key, "freq") == 0)
+    {
+        attr->sample_freq = value;
+        attr->freq = 1;
+    }
+    else if (apply_event_term(attr, pmu, key, value) == -1)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Parses the terms of "pmu/terms/" after the first '/', and the closing '/'
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int parse_terms(struct parser* p, const char* pmu_name, struct perf_event_attr* attr)
+{
+    const struct pmu_topology* topo = pmu_topology_get();
+    struct pmu_event lookup = { .pmu = pmu_name };
+    const struct topology_pmu* pmu = topo ? topology_pmu_for_event(topo, &lookup, p->cpu) : NULL;
+    if (pmu == NULL)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    attr->type = pmu->type;
+
+    while (*p->pos != '/')
+    {
+        const char* term = p->pos;
+        char key[PARSE_MAX_NAME];
+        if (parse_name(p, key, false) == -1)
+        {
+            return -1;
+        }
+
+        int ret;
+        if (*p->pos == '=')
+        {
+            p->pos++;
+            ret = parse_value_term(p, pmu, attr, key);
+        }
+        else
+        {
+            ret = apply_flag_term(p, topo, pmu, pmu_name, attr, key);
+        }
+        if (ret == -1)
+        {
+            p->pos = term;
+            return -1;
+        }
+
+        if (*p->pos == ',')
+        {
+            p->pos++;
+        }
+        else if (*p->pos != '/')
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    p->pos++;
+    return 0;
+}
+
+/*
+ * Resolves the event "name" like get_event_by_name() does, or as a raw event "rNNN"
+ *
+ * Returns 0 on success, -1 if there is no such event
+ */
+static int resolve_name(const struct parser* p, const char* name, struct perf_event_attr* attr)
+{
+    struct pmu_event ev;
+    if (get_event_by_name(p->map, name, &ev) == 0)
+    {
+        return gen_attr_for_event(&ev, p->cpu, attr);
+    }
+
+    if (name[0] == 'r' && name[1] != '\0' && strspn(name + 1, "0123456789abcdef") ==
+                                                 strlen(name + 1))
+    {
+        attr->type = PERF_TYPE_RAW;
+        attr->config = strtoull(name + 1, NULL, 16);
+        return 0;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/*
+ * Applies the modifiers at the position of the parser to the events [first, last)
+ * of the parser, and moves past them
+ *
+ * Returns 0 on success, -1 for unknown modifiers
+ */
+static int parse_modifiers(struct parser* p, size_t first, size_t last)
+{
+    bool user = false, kernel = false, hv = false;
+    bool guest = false, host = false, no_idle = false;
+    bool group_read = false, pinned = false, max_precise = false;
+    size_t precise = 0;
+    const char* start = p->pos;
+
+    for (; !ends_name(*p->pos); p->pos++)
+    {
+        switch (*p->pos)
+        {
+        case 'u':
+            user = true;
+            break;
+        case 'k':
+            kernel = true;
+            break;
+        case 'h':
+            hv = true;
+            break;
+        case 'G':
+            guest = true;
+            break;
+        case 'H':
+            host = true;
+            break;
+        case 'I':
+            no_idle = true;
+            break;
+        case 'p':
+            precise++;
+            break;
+        case 'P':
+            max_precise = true;
+            break;
+        case 'S':
+            group_read = true;
+            break;
+        case 'D':
+            pinned = true;
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    for (size_t i = first; i < last; i++)
+    {
+        struct perf_event_attr* attr = &p->events[i].attr;
+        if (user || kernel || hv)
+        {
+            attr->exclude_user = !user;
+            attr->exclude_kernel = !kernel;
+            attr->exclude_hv = !hv;
+        }
+        attr->exclude_host |= guest;
+        attr->exclude_guest |= host;
+        attr->exclude_idle |= no_idle;
+        if (attr->precise_ip + precise > PARSE_MAX_PRECISE)
+        {
+            p->pos = start;
+            errno = EINVAL;
+            return -1;
+        }
+        attr->precise_ip = max_precise ? PARSE_MAX_PRECISE : attr->precise_ip + precise;
+
+        /* Only the leader is pinned, and samples for the group */
+        bool leader = p->events[i].leader == i;
+        attr->pinned |= pinned && leader;
+        if (group_read && leader)
+        {
+            attr->sample_type |= PERF_SAMPLE_READ;
+            attr->read_format |= PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+        }
+        else if (group_read)
+        {
+            attr->sample_period = 0;
+            attr->freq = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Parses one event, with its modifiers, as a member of the group led by "leader"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int parse_event(struct parser* p, size_t leader)
+{
+    if (p->num_events == p->max_events)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+    size_t index = p->num_events;
+    struct pmu_parsed_event* ev = &p->events[index];
+    memset(ev, 0, sizeof(struct pmu_parsed_event));
+    ev->spec = p->pos;
+    ev->leader = leader == SIZE_MAX ? index : leader;
+    ev->attr.size = sizeof(struct perf_event_attr);
+
+    const char* name_pos = p->pos;
+    char name[PARSE_MAX_NAME];
+    if (parse_name(p, name, true) == -1)
+    {
+        return -1;
+    }
+
+    if (*p->pos == '/')
+    {
+        /* The PMU name as it is, sysfs is case-sensitive */
+        name[p->pos - name_pos] = '\0';
+        memcpy(name, name_pos, p->pos - name_pos);
+        p->pos++;
+        if (parse_terms(p, name, &ev->attr) == -1)
+        {
+            return -1;
+        }
+    }
+    else if (resolve_name(p, name, &ev->attr) == -1)
+    {
+        p->pos = name_pos;
+        return -1;
+    }
+
+    /* Claim the event before the modifiers, which apply to the events of the parser */
+    p->num_events++;
+    if (*p->pos == ':' || (*p->pos != '\0' && !ends_name(*p->pos)))
+    {
+        p->pos += *p->pos == ':';
+        if (parse_modifiers(p, index, index + 1) == -1)
+        {
+            return -1;
+        }
+    }
+    ev->spec_len = p->pos - ev->spec;
+    return 0;
+}
+
+/*
+ * Parses a group in braces after the '{', with its modifiers
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int parse_group(struct parser* p)
+{
+    size_t first = p->num_events;
+    while (true)
+    {
+        if (parse_event(p, first) == -1)
+        {
+            return -1;
+        }
+        if (*p->pos == '}')
+        {
+            break;
+        }
+        if (*p->pos != ',')
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        p->pos++;
+    }
+    p->pos++;
+
+    if (*p->pos == ':')
+    {
+        p->pos++;
+        return parse_modifiers(p, first, p->num_events);
+    }
+    return 0;
+}
+
+int pmu_parse_events(const struct pmu_events_map* map, struct perf_cpu cpu, const char* spec,
+                     struct pmu_parsed_event* events, size_t max_events, size_t* error_offset)
+{
+    struct parser p = {
+        .map = map,
+        .cpu = cpu,
+        .spec = spec,
+        .pos = spec,
+        .events = events,
+        .max_events = max_events,
+    };
+
+    while (true)
+    {
+        int ret;
+        if (*p.pos == '{')
+        {
+            p.pos++;
+            ret = parse_group(&p);
+        }
+        else
+        {
+            ret = parse_event(&p, SIZE_MAX);
+        }
+
+        if (ret == 0 && *p.pos == ',')
+        {
+            p.pos++;
+            continue;
+        }
+        if (ret == 0 && *p.pos != '\0')
+        {
+            errno = EINVAL;
+            ret = -1;
+        }
+        if (ret == -1)
+        {
+            if (error_offset != NULL)
+            {
+                *error_offset = p.pos - spec;
+            }
+            return -1;
+        }
+        return p.num_events;
+    }
+}
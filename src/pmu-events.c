@@ -1,12 +1,13 @@
 #include <pmu-events/pmu-events.h>
+#include <pmu-events/topology.h>
 
 #include <pmu-events/_impl/pmu-events.h>
 
-#include <dirent.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 /*
@@ -15,10 +16,14 @@
  * On success, returns the concatenated path, on failure returns NULL
  * The caller is responsible for free()-ing the string
  */
-static char* concat_path(const char* base, const char* filename)
+char* concat_path(const char* base, const char* filename)
 {
     size_t path_len = strlen(base) + strlen(filename) + 1;
     char* path = malloc(path_len + 1);
+    if (path == NULL)
+    {
+        return NULL;
+    }
     if (snprintf(path, path_len + 1, "%s/%s", base, filename) != path_len)
     {
         free(path);
@@ -27,22 +32,6 @@ static char* concat_path(const char* base, const char* filename)
     return path;
 }
 
-/*
- * Checks if "num" is in any of the ranges in range_list
- */
-static bool in_range_list(uint64_t num, struct range_list* range_list)
-{
-    int i = 0;
-    for (; i < range_list->len; i++)
-    {
-        if (num >= range_list->ranges[i].start && num <= range_list->ranges[i].end)
-        {
-            return true;
-        }
-    }
-    return false;
-}
-
 /*
  * Returns the content of the file with the name "path"
  *
@@ -50,8 +39,9 @@ static bool in_range_list(uint64_t num, struct range_list* range_list)
  *
  * The caller is responsible for free()-ing the result.
  */
-static char* get_file_content(const char* path)
+char* get_file_content(const char* path)
 {
+    stats_count(PMU_EVENTS_FILE_READS);
     int fd = open(path, O_RDONLY);
     if (fd == -1)
     {
@@ -67,7 +57,15 @@ static char* get_file_content(const char* path)
     }
 
     char* content = malloc(end + 1);
-    if (read(fd, content, end) == -1)
+    if (content == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    /* sysfs files report a size of a page, regardless of their actual content */
+    ssize_t len = read(fd, content, end);
+    if (len == -1)
     {
         free(content);
         close(fd);
@@ -75,7 +73,7 @@ static char* get_file_content(const char* path)
     }
 
     close(fd);
-    content[end] = '\0';
+    content[len] = '\0';
 
     char* newline = strchr(content, '\n');
     if (newline != NULL)
@@ -289,6 +287,14 @@ int parse_assignment(char* term, struct assignment* assignment)
 
     uint64_t value = 0;
 
+    assignment->key = malloc(equal_sign - term + 1);
+    if (assignment->key == NULL)
+    {
+        return -1;
+    }
+    assignment->key[equal_sign - term] = '\0';
+    strncpy(assignment->key, term, equal_sign - term);
+
     /* Some of the assignments we have encountered can look like:
      * foo=None
      *
@@ -297,16 +303,14 @@ int parse_assignment(char* term, struct assignment* assignment)
     if (strncmp(equal_sign + 1, "None", sizeof("None")) != 0)
     {
         char* endptr;
-        value = strtoull(equal_sign + 1, &endptr, 16);
+        value = strtoull(equal_sign + 1, &endptr, event_term_base(assignment->key, equal_sign + 1));
         if (*endptr != '\0')
         {
+            free(assignment->key);
             return -1;
         }
     }
     assignment->value = value;
-    assignment->key = malloc(equal_sign - term + 1);
-    assignment->key[equal_sign - term] = '\0';
-    strncpy(assignment->key, term, equal_sign - term);
 
     return 0;
 }
@@ -391,7 +395,8 @@ void free_assignment_list(struct assignment_list* list)
  * to_apply[bit0-7] is moved to config[bit0-7]
  * to_apply[bit8-15] is moved to config[bit32-39]
  */
-int apply_range_list_to_val(unsigned long long* config, uint64_t to_apply, struct range_list* list)
+int apply_range_list_to_val(unsigned long long* config, uint64_t to_apply,
+                            const struct range_list* list)
 {
     int range_nr = 0;
     for (; range_nr < list->len; range_nr++)
@@ -416,7 +421,8 @@ int apply_range_list_to_val(unsigned long long* config, uint64_t to_apply, struc
  * Applies the value "val" to the correct member of perf_event_attr by using
  * the config_def->range range_list and apply_range_list_to_val()
  */
-int apply_config_def_to_attr(struct perf_event_attr* attr, uint64_t val, struct config_def* def)
+int apply_config_def_to_attr(struct perf_event_attr* attr, uint64_t val,
+                             const struct config_def* def)
 {
     switch (def->var)
     {
@@ -435,95 +441,38 @@ int apply_config_def_to_attr(struct perf_event_attr* attr, uint64_t val, struct
 /*
  * Returns the syfs PMU path for the specific cpu
  *
+ * The PMUs responsible for the CPU cores are either the "cpu" PMU (mostly x86),
+ * which is responsible for all cores, or the PMUs that contain a "cpus" file
+ * listing the cores they are responsible for (ARM, Intel's P/E-Core systems).
+ *
+ * This is resolved using the topology snapshot (see pmu_topology_get()), so sysfs
+ * is not walked on every call.
+ *
  * Returns NULL on error
  */
 char* get_pmu_path_for_cpu(struct perf_cpu cpu)
 {
-    /*
-     * First case (mostly x86 CPUs): there is a "cpu" PMU.
-     *
-     * If that PMU exists, then it is automatically responsible for all
-     * cpu cores.
-     */
-    if (access("/sys/bus/event_source/devices/cpu/", F_OK) == F_OK)
+    const struct pmu_topology* topo = pmu_topology_get();
+    if (topo == NULL)
     {
-        return strdup("/sys/bus/event_source/devices/cpu/");
+        return NULL;
     }
 
-    /*
-     * Second case (mostly observed on ARM and on Intel's P/E-Core systems):
-     *
-     * On architectures without a "cpu" PMU, the PMUs that are responsible
-     * for the CPU cores contain a "cpus" file.
-     *
-     * This "cpus" file contains a range list of the CPUs it is responsible for.
-     *
-     * For example (ARM Neoverse N1 architecture):
-     * There is one PMU folder in /sys/bus/event_source/devices/ with a "cpus" file.
-     *
-     *      /sys/bus/event_source/devices/armv8_pmuv3_0/cpus
-     *
-     * That contains the string "0-79". That means it is responsible for the cores
-     * 0 through 79 (which in fact are all the cores on that system.
-     *
-     * We simply iterate here through all PMU folders in /sys/bus/event_source/devices,
-     * checking if they contain a "cpus" file and then checking if the
-     * given cpu is in the range of the PMU.
-     */
-    const char* pmu_dir = "/sys/bus/event_source/devices";
-    DIR* pmu_devices = opendir(pmu_dir);
-    if (pmu_devices == NULL)
+    const struct topology_pmu* pmu = topology_core_pmu_for_cpu(topo, cpu);
+    if (pmu == NULL)
     {
         return NULL;
     }
-    struct dirent* ent;
-    while ((ent = readdir(pmu_devices)) != NULL)
-    {
-        if ((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0))
-        {
-            continue;
-        }
-        char* pmu_path = concat_path(pmu_dir, ent->d_name);
-        if (pmu_path == NULL)
-        {
-            closedir(pmu_devices);
-            return NULL;
-        }
-        char* cpus_path = concat_path(pmu_path, "cpus");
-        if (cpus_path == NULL)
-        {
-            closedir(pmu_devices);
-            free(pmu_path);
-            return NULL;
-        }
 
-        char* content = get_file_content(cpus_path);
-        free(cpus_path);
-        if (content == NULL)
-        {
-            free(pmu_path);
-            continue;
-        }
-
-        struct range_list range_list;
-        if (parse_range_list(content, &range_list) == -1)
-        {
-            free(content);
-            closedir(pmu_devices);
-            free(pmu_path);
-            return NULL;
-        }
-        free(content);
-
-        if (in_range_list(cpu.cpu, &range_list))
-        {
-            closedir(pmu_devices);
-            free_range_list(&range_list);
-            return pmu_path;
-        }
+    size_t path_len =
+        strlen(topo->root) + strlen("/bus/event_source/devices/") + strlen(pmu->name) + 1;
+    char* path = malloc(path_len + 1);
+    if (path == NULL)
+    {
+        return NULL;
     }
-    closedir(pmu_devices);
-    return NULL;
+    snprintf(path, path_len + 1, "%s/bus/event_source/devices/%s/", topo->root, pmu->name);
+    return path;
 }
 
 /*
@@ -535,31 +484,24 @@ char* get_pmu_path_for_cpu(struct perf_cpu cpu)
  */
 char* get_format_file_content(char* fmt_file, struct perf_cpu cpu)
 {
-    char* pmu_path = get_pmu_path_for_cpu(cpu);
-    if (pmu_path == NULL)
+    const struct pmu_topology* topo = pmu_topology_get();
+    if (topo == NULL)
     {
         return NULL;
     }
 
-    char* format_path = concat_path(pmu_path, "format/");
-    if (format_path == NULL)
+    const struct topology_pmu* pmu = topology_core_pmu_for_cpu(topo, cpu);
+    if (pmu == NULL)
     {
-        free(pmu_path);
         return NULL;
     }
 
-    free(pmu_path);
-    char* path = concat_path(format_path, fmt_file);
-    free(format_path);
-    if (path == NULL)
+    const struct pmu_format_def* fmt = topology_find_format(pmu, fmt_file);
+    if (fmt == NULL)
     {
         return NULL;
     }
-
-    char* content = get_file_content(path);
-
-    free(path);
-    return content;
+    return strdup(fmt->def);
 }
 
 /*
@@ -569,69 +511,120 @@ char* get_format_file_content(char* fmt_file, struct perf_cpu cpu)
  */
 int read_perf_type(struct perf_cpu cpu)
 {
-    char* pmu_path = get_pmu_path_for_cpu(cpu);
-
-    if (pmu_path == NULL)
+    const struct pmu_topology* topo = pmu_topology_get();
+    if (topo == NULL)
     {
         return -1;
     }
 
-    char* type_path = concat_path(pmu_path, "type");
-    free(pmu_path);
-    if (type_path == NULL)
+    const struct topology_pmu* pmu = topology_core_pmu_for_cpu(topo, cpu);
+    if (pmu == NULL)
     {
-        free(pmu_path);
         return -1;
     }
-    int fd = open(type_path, O_RDONLY);
-    if (fd == -1)
+    return pmu->type;
+}
+
+/* The attr fields the terms of event_terms go to */
+enum term_field
+{
+    TERM_CONFIG,
+    TERM_CONFIG1,
+    TERM_CONFIG2,
+    TERM_SAMPLE_PERIOD
+};
+
+/*
+ * The terms of event strings that are not looked up in the format/ directory of the PMU,
+ * or only if it has such a format
+ */
+static const struct event_term
+{
+    const char* key;
+    enum term_field field;
+    /* The base of the value in the event strings of the tables and sysfs */
+    int base;
+} event_terms[] = {
+    /* A config field as a whole, like "config=0x300" in sysfs aliases */
+    { "config", TERM_CONFIG, 16 },
+    { "config1", TERM_CONFIG1, 16 },
+    { "config2", TERM_CONFIG2, 16 },
+    /* The load latency threshold of MSR 0x3f6, for PMUs without an ldlat format */
+    { "ldlat", TERM_CONFIG1, 16 },
+    /* The SampleAfterValue of the tables, in decimal */
+    { "period", TERM_SAMPLE_PERIOD, 10 },
+};
+
+/*
+ * Returns the entry of event_terms for "key", NULL if there is none
+ */
+static const struct event_term* find_event_term(const char* key)
+{
+    for (size_t i = 0; i < sizeof(event_terms) / sizeof(event_terms[0]); i++)
     {
-        return -1;
+        if (strcmp(event_terms[i].key, key) == 0)
+        {
+            return &event_terms[i];
+        }
     }
+    return NULL;
+}
 
-    free(type_path);
-    off_t end = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
-    if (end == -1)
+int event_term_base(const char* key, const char* value)
+{
+    if (value[0] == '0' && (value[1] == 'x' || value[1] == 'X'))
     {
-        close(fd);
-        return -1;
+        return 16;
     }
-
-    char* content = malloc(end + 1);
-    if (read(fd, content, end) == -1)
+    const struct event_term* special = find_event_term(key);
+    if (special != NULL)
     {
-        free(content);
-        close(fd);
-        return -1;
+        return special->base;
     }
-    content[end] = '\0';
+    /* The CounterMask of the JSON files is decimal, like perf reads it */
+    return strcmp(key, "cmask") == 0 ? 10 : 16;
+}
 
-    char* newline = strchr(content, '\n');
-    if (newline != NULL)
+int apply_event_term(struct perf_event_attr* attr, const struct topology_pmu* pmu,
+                     const char* key, uint64_t value)
+{
+    const struct pmu_format_def* fmt = pmu ? topology_find_format(pmu, key) : NULL;
+    if (fmt != NULL)
     {
-        *newline = '\0';
+        return apply_config_def_to_attr(attr, value, &fmt->config);
     }
 
-    char* endptr;
-    uint64_t res = strtoull(content, &endptr, 10);
-
-    if (*endptr != '\0')
+    const struct event_term* term = find_event_term(key);
+    if (term == NULL)
     {
         return -1;
     }
-    free(content);
-    close(fd);
-    return res;
+    switch (term->field)
+    {
+    case TERM_CONFIG:
+        attr->config = value;
+        break;
+    case TERM_CONFIG1:
+        attr->config1 = value;
+        break;
+    case TERM_CONFIG2:
+        attr->config2 = value;
+        break;
+    case TERM_SAMPLE_PERIOD:
+        attr->sample_period = value;
+        attr->freq = 0;
+        break;
+    }
+    return 0;
 }
 
 /*
  * For the event assignment string "event" of the form "event=0x40,umask=1",
- * set the type, config, config1 and config2 correctly in perf_event_attr
- * for the given cpu.
+ * set config, config1 and config2 correctly in perf_event_attr
+ * for the PMU "pmu".
  *
  * For every assignment in the "event" string, the key specifies a file
- * in [pmu path for cpu]/format that describes how the value
+ * in [pmu path]/format that describes how the value
  * of the assignment is put into the bits of a perf_event_attr member.
  *
  * On a recent AMD cpu, for example, /sys/bus/event_source/devices/cpu/format/event
@@ -639,51 +632,366 @@ int read_perf_type(struct perf_cpu cpu)
  *
  * This means, that the lowest 8 bits of "event=[value]" are put into
  * attr->config[bits0-7], with the next 4 bits being put into attr->config[bits32-35]
+ *
+ * A term without a value, e.g. "inv", is the same as "inv=1".
+ *
+ * The terms of event_terms go to their attr field if "pmu" has no format of their name,
+ * e.g. "ldlat" to config1. The "period" term is ignored unless "flags" has
+ * PMU_EVENT_SAMPLE, so the attr is set up for counting. "pmu" may be NULL for events
+ * that only set config, config1 and config2. Nothing is allocated, the
+ * terms are read in place.
+ *
+ * Returns 0 on success, -1 for malformed terms or terms "pmu" has no format for
  */
+int apply_event_string(struct perf_event_attr* attr, const struct topology_pmu* pmu,
+                       const char* event, unsigned flags)
+{
+    if (event == NULL)
+    {
+        return -1;
+    }
+
+    const char* term = event;
+    while (true)
+    {
+        const char* end = strchr(term, ',');
+        end = end != NULL ? end : term + strlen(term);
+        const char* equal_sign = memchr(term, '=', end - term);
+        /* A term without a value, e.g. "edge" or "inv", sets its format to 1 */
+        const char* key_end = equal_sign != NULL ? equal_sign : end;
+        char key[64];
+        if (key_end == term || key_end - term >= sizeof(key) ||
+            (equal_sign != NULL && equal_sign + 1 == end))
+        {
+            return -1;
+        }
+        memcpy(key, term, key_end - term);
+        key[key_end - term] = '\0';
+        const struct event_term* special = find_event_term(key);
+
+        /* Some of the assignments look like "foo=None", they are zero */
+        uint64_t value = equal_sign == NULL;
+        if (equal_sign != NULL && (end - equal_sign - 1 != strlen("None") ||
+                                   strncmp(equal_sign + 1, "None", strlen("None")) != 0))
+        {
+            char* value_end;
+            value = strtoull(equal_sign + 1, &value_end, event_term_base(key, equal_sign + 1));
+            if (value_end != end)
+            {
+                return -1;
+            }
+        }
+
+        /* The period only matters for sampling, counting attrs keep sample_period 0 */
+        bool skip = special != NULL && special->field == TERM_SAMPLE_PERIOD &&
+                    !(flags & PMU_EVENT_SAMPLE);
+        if (!skip && apply_event_term(attr, pmu, key, value) == -1)
+        {
+            return -1;
+        }
+
+        if (*end == '\0')
+        {
+            return 0;
+        }
+        term = end + 1;
+    }
+}
+
+const struct pmu_events_map* common_events_map(void)
+{
+    for (const struct pmu_events_map* map = all_pmu_events_maps(); map->arch != NULL; map++)
+    {
+        if (strcmp(map->arch, "common") == 0)
+        {
+            return map;
+        }
+    }
+    return NULL;
+}
+
+static int encode_event(const struct pmu_event* ev, struct perf_cpu cpu, unsigned flags,
+                        struct perf_event_attr* attr)
+{
+    /* The software and tool events of arch/common only set config, whatever is in sysfs */
+    const struct topology_pmu* pmu = NULL;
+    if (ev->pmu != NULL && strcmp(ev->pmu, "software") == 0)
+    {
+        attr->type = PERF_TYPE_SOFTWARE;
+    }
+    else if (ev->pmu != NULL && strcmp(ev->pmu, "tool") == 0)
+    {
+        attr->type = PMU_EVENTS_TYPE_TOOL;
+    }
+    else
+    {
+        const struct pmu_topology* topo = pmu_topology_get();
+        pmu = topo != NULL ? topology_pmu_for_event(topo, ev, cpu) : NULL;
+        if (pmu == NULL)
+        {
+            return -1;
+        }
+        attr->type = pmu->type;
+    }
+
+    if (apply_event_string(attr, pmu, ev->event, flags) == -1)
+    {
+        return -1;
+    }
+
+    if (flags & PMU_EVENT_SAMPLE)
+    {
+        attr->precise_ip = ev->precise;
+    }
+    if (flags & PMU_EVENT_SAMPLE_MEM)
+    {
+        /* The data address and latency come from the PEBS record */
+        attr->precise_ip = ev->precise > 0 ? ev->precise : 1;
+        attr->sample_type |= PMU_EVENT_SAMPLE_MEM_TYPE;
+        attr->mmap_data = 1;
+    }
+    return 0;
+}
+
 int gen_attr_for_event(const struct pmu_event* ev, struct perf_cpu cpu,
                        struct perf_event_attr* attr)
 {
-    if ((attr->type = read_perf_type(cpu)) == -1)
+    uint64_t start = stats_start();
+    stats_count(PMU_EVENTS_GEN_ATTRS);
+    int ret = encode_event(ev, cpu, 0, attr);
+    stats_end(PMU_EVENTS_ENTRY_GEN_ATTR_FOR_EVENT, start);
+    return ret;
+}
+
+int gen_sample_attr_for_event(const struct pmu_event* ev, struct perf_cpu cpu, unsigned flags,
+                              struct perf_event_attr* attr)
+{
+    if ((flags & PMU_EVENT_SAMPLE_MEM) && !ev->data_la)
     {
         return -1;
     }
-    struct assignment_list asn_list;
-    if (parse_assignment_list(ev->event, &asn_list) == -1)
+
+    uint64_t start = stats_start();
+    stats_count(PMU_EVENTS_GEN_ATTRS);
+    int ret = encode_event(ev, cpu, flags | PMU_EVENT_SAMPLE, attr);
+    stats_end(PMU_EVENTS_ENTRY_GEN_ATTR_FOR_EVENT, start);
+    return ret;
+}
+
+/*
+ * Returns the pmu_table_entry of "pmus" that holds the entry with the id "id",
+ * NULL if there is none
+ */
+static const struct pmu_table_entry* find_table_entry(const struct pmu_table_entry* pmus,
+                                                      uint32_t num_pmus, uint32_t id)
+{
+    uint32_t low = 0, high = num_pmus;
+
+    /* Find the last table entry with first_id <= id */
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (pmus[mid].first_id <= id)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if (low == 0 || id - pmus[low - 1].first_id >= pmus[low - 1].num_entries)
+    {
+        return NULL;
+    }
+    return &pmus[low - 1];
+}
+
+uint32_t pmu_events_num_events(const struct pmu_events_map* map)
+{
+    return map->event_table.num_events;
+}
+
+uint32_t pmu_events_num_metrics(const struct pmu_events_map* map)
+{
+    return map->metric_table.num_metrics;
+}
+
+uint32_t pmu_events_num_generic_counters(const struct pmu_events_map* map, const char* pmu)
+{
+    for (uint32_t i = 0; i < map->event_table.num_pmus; i++)
+    {
+        if (strcmp(get_pmu_name(map->event_table.pmus[i]), pmu) == 0)
+        {
+            return map->event_table.pmus[i].num_generic_counters;
+        }
+    }
+    return 0;
+}
+
+int get_event_by_id(const struct pmu_events_map* map, pmu_event_id id, struct pmu_event* pmu_ev)
+{
+    const struct pmu_table_entry* entry =
+        find_table_entry(map->event_table.pmus, map->event_table.num_pmus, id);
+    if (entry == NULL)
     {
         return -1;
     }
+    decompress_event(entry->entries[id - entry->first_id].offset, pmu_ev);
+    pmu_ev->pmu = get_pmu_name(*entry);
+    return 0;
+}
 
-    int asn_nr = 0;
-    for (; asn_nr < asn_list.len; asn_nr++)
+int get_metric_by_id(const struct pmu_events_map* map, pmu_metric_id id,
+                     struct pmu_metric* pmu_metric)
+{
+    const struct pmu_table_entry* entry =
+        find_table_entry(map->metric_table.pmus, map->metric_table.num_pmus, id);
+    if (entry == NULL)
     {
-        struct assignment asn = asn_list.assignments[asn_nr];
+        return -1;
+    }
+    decompress_metric(entry->entries[id - entry->first_id].offset, pmu_metric);
+    pmu_metric->pmu = get_pmu_name(*entry);
+    return 0;
+}
+
+int get_event_id(const struct pmu_events_map* map, const char* pmu, const char* ev,
+                 pmu_event_id* id)
+{
+    const uint32_t* by_name = map->event_table.by_name;
+    uint32_t low = 0, high = map->event_table.num_events;
+    struct pmu_event candidate;
 
-        char* config_def_str = get_format_file_content(asn.key, cpu);
-        if (config_def_str == NULL)
+    /* Find the first event named "ev" */
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        get_event_by_id(map, by_name[mid], &candidate);
+        if (strcmp(candidate.name, ev) < 0)
         {
-            free_assignment_list(&asn_list);
-            return -1;
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
         }
+    }
 
-        struct config_def conf_def;
-        if (parse_config_def(config_def_str, &conf_def) == -1)
+    /* The events of the same name are sorted by id, and thereby by PMU */
+    for (; low < map->event_table.num_events; low++)
+    {
+        get_event_by_id(map, by_name[low], &candidate);
+        if (strcmp(candidate.name, ev) != 0)
         {
-            free_assignment_list(&asn_list);
-            free(config_def_str);
-            return -1;
+            break;
         }
+        if (pmu == NULL || strcmp(candidate.pmu, pmu) == 0)
+        {
+            *id = by_name[low];
+            return 0;
+        }
+    }
+    return -1;
+}
 
-        if (apply_config_def_to_attr(attr, asn.value, &conf_def) == -1)
+int get_metric_id(const struct pmu_events_map* map, const char* pmu, const char* metric,
+                  pmu_metric_id* id)
+{
+    const uint32_t* by_name = map->metric_table.by_name;
+    uint32_t low = 0, high = map->metric_table.num_metrics;
+    struct pmu_metric candidate;
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        get_metric_by_id(map, by_name[mid], &candidate);
+        if (strcasecmp(candidate.metric_name, metric) < 0)
         {
-            free_config_def(&conf_def);
-            free_assignment_list(&asn_list);
-            free(config_def_str);
-            return -1;
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    for (; low < map->metric_table.num_metrics; low++)
+    {
+        get_metric_by_id(map, by_name[low], &candidate);
+        if (strcasecmp(candidate.metric_name, metric) != 0)
+        {
+            break;
+        }
+        if (pmu == NULL || strcmp(candidate.pmu, pmu) == 0)
+        {
+            *id = by_name[low];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int gen_attr_for_event_id(const struct pmu_events_map* map, pmu_event_id id,
+                          struct perf_cpu cpu, struct perf_event_attr* attr)
+{
+    struct pmu_event ev;
+    if (get_event_by_id(map, id, &ev) == -1)
+    {
+        return -1;
+    }
+    return gen_attr_for_event(&ev, cpu, attr);
+}
+
+uint64_t pmu_event_sample_after_value(const struct pmu_event* ev)
+{
+    if (ev->event == NULL)
+    {
+        return 0;
+    }
+
+    /* Unlike the config terms, the period is decimal, see event_term_base() */
+    for (const char* term = ev->event; term != NULL; term = strchr(term, ','))
+    {
+        term += *term == ',';
+        if (strncmp(term, "period=", strlen("period=")) == 0)
+        {
+            const char* value = term + strlen("period=");
+            return strtoull(value, NULL, event_term_base("period", value));
         }
     }
     return 0;
 }
 
+/*
+ * Looks up "ev" in the sysfs aliases of all PMUs, in the order of their names
+ *
+ * Returns 0 on success, -1 if no PMU has such an alias
+ */
+static int get_event_by_alias(const char* ev, struct pmu_event* pmu_ev)
+{
+    const struct pmu_topology* topo = pmu_topology_get();
+    if (topo == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < topo->num_pmus; i++)
+    {
+        const struct pmu_alias_def* alias = topology_find_alias(topo, &topo->pmus[i], ev);
+        if (alias != NULL)
+        {
+            memset(pmu_ev, 0, sizeof(struct pmu_event));
+            pmu_ev->name = alias->name;
+            pmu_ev->event = alias->event;
+            pmu_ev->pmu = topo->pmus[i].name;
+            pmu_ev->unit = alias->scale_unit;
+            return 0;
+        }
+    }
+    return -1;
+}
+
 /*
  * Searches for the perf event "ev" in the pmu_events_map "map", returning the result
  * in "pmu_ev".
@@ -691,20 +999,38 @@ int gen_attr_for_event(const struct pmu_event* ev, struct perf_cpu cpu,
  * On success, 0 is returned and the event is put into "pmu_ev"
  * On failure, -1 is returned.
  */
-int get_event_by_name(const struct pmu_events_map* map, const char* ev, struct pmu_event* pmu_ev)
+static int find_event_by_name(const struct pmu_events_map* map, const char* ev,
+                              struct pmu_event* pmu_ev)
 {
-    for (int i = 0; i < map->event_table.num_pmus; i++)
+    pmu_event_id id;
+    if (get_event_id(map, NULL, ev, &id) == 0)
     {
-        struct pmu_table_entry entry = map->event_table.pmus[i];
-        for (int x = 0; x < entry.num_entries; x++)
-        {
-            decompress_event(entry.entries[x].offset, pmu_ev);
+        return get_event_by_id(map, id, pmu_ev);
+    }
 
-            if (strcmp(pmu_ev->name, ev) == 0)
-            {
-                return 0;
-            }
-        }
+    const struct pmu_events_map* common = common_events_map();
+    if (common != NULL && common != map && get_event_id(common, NULL, ev, &id) == 0)
+    {
+        return get_event_by_id(common, id, pmu_ev);
     }
-    return -1;
+    return get_event_by_alias(ev, pmu_ev);
+}
+
+int get_event_by_name(const struct pmu_events_map* map, const char* ev, struct pmu_event* pmu_ev)
+{
+    uint64_t start = stats_start();
+    int ret = find_event_by_name(map, ev, pmu_ev);
+    stats_end(PMU_EVENTS_ENTRY_GET_EVENT_BY_NAME, start);
+    return ret;
+}
+
+int get_metric_by_name(const struct pmu_events_map* map, const char* metric,
+                       struct pmu_metric* pmu_metric)
+{
+    uint64_t start = stats_start();
+    pmu_metric_id id;
+    int ret = get_metric_id(map, NULL, metric, &id) == 0 ? get_metric_by_id(map, id, pmu_metric)
+                                                         : -1;
+    stats_end(PMU_EVENTS_ENTRY_GET_METRIC_BY_NAME, start);
+    return ret;
 }
@@ -0,0 +1,410 @@
+#include <pmu-events/sampler.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Records are at most this large, as perf_event_header.size is 16 bits */
+#define SAMPLER_MAX_RECORD 65536
+
+/* One event on one CPU */
+struct sampler_stream
+{
+    int fd;
+    /* The metadata page, followed by the data pages */
+    struct perf_event_mmap_page* ring;
+    uint64_t period;
+    /* The count at the last pmu_sampler_adjust() */
+    uint64_t last_count;
+    /* Since the last pmu_sampler_adjust() */
+    uint64_t samples;
+    uint64_t throttled;
+    struct pmu_sampler_state state;
+};
+
+struct sampler_event
+{
+    char* name;
+    struct perf_event_attr attr;
+};
+
+struct pmu_sampler
+{
+    struct perf_cpu* cpus;
+    size_t num_cpus;
+    struct sampler_event* events;
+    size_t num_events;
+    struct pmu_sampler_budget budget;
+    /* [num_events][num_cpus] */
+    struct sampler_stream* streams;
+    size_t ring_len;
+    /* A record that wraps around the end of a ring buffer is copied in here */
+    char* scratch;
+    bool opened;
+    uint64_t last_adjust_ns;
+};
+
+struct pmu_sampler* pmu_sampler_new(const struct perf_cpu* cpus, size_t num_cpus,
+                                    const struct pmu_sampler_budget* budget)
+{
+    struct pmu_sampler* sampler = calloc(1, sizeof(struct pmu_sampler));
+    if (sampler == NULL)
+    {
+        return NULL;
+    }
+
+    sampler->cpus = malloc(num_cpus * sizeof(struct perf_cpu));
+    if (sampler->cpus == NULL && num_cpus != 0)
+    {
+        free(sampler);
+        return NULL;
+    }
+    memcpy(sampler->cpus, cpus, num_cpus * sizeof(struct perf_cpu));
+    sampler->num_cpus = num_cpus;
+    sampler->budget = *budget;
+    if (sampler->budget.sample_cost_ns <= 0)
+    {
+        sampler->budget.sample_cost_ns = PMU_SAMPLER_SAMPLE_COST_NS;
+    }
+    return sampler;
+}
+
+static void close_streams(struct pmu_sampler* sampler)
+{
+    size_t num_streams = sampler->num_events * sampler->num_cpus;
+    for (size_t i = 0; sampler->streams != NULL && i < num_streams; i++)
+    {
+        struct sampler_stream* stream = &sampler->streams[i];
+        if (stream->ring != NULL)
+        {
+            munmap(stream->ring, sampler->ring_len);
+        }
+        if (stream->fd != -1)
+        {
+            close(stream->fd);
+        }
+    }
+    free(sampler->streams);
+    free(sampler->scratch);
+    sampler->streams = NULL;
+    sampler->scratch = NULL;
+    sampler->opened = false;
+}
+
+void pmu_sampler_free(struct pmu_sampler* sampler)
+{
+    if (sampler == NULL)
+    {
+        return;
+    }
+    close_streams(sampler);
+    for (size_t i = 0; i < sampler->num_events; i++)
+    {
+        free(sampler->events[i].name);
+    }
+    free(sampler->events);
+    free(sampler->cpus);
+    free(sampler);
+}
+
+int pmu_sampler_add_event(struct pmu_sampler* sampler, const struct pmu_sampler_event* ev)
+{
+    /* Periods can not be adjusted in frequency mode, and group reads are not parsed */
+    if (sampler->opened || ev->attr.freq || ev->attr.sample_period == 0 ||
+        (ev->attr.read_format & PERF_FORMAT_GROUP))
+    {
+        return -1;
+    }
+
+    struct sampler_event* events =
+        realloc(sampler->events, (sampler->num_events + 1) * sizeof(struct sampler_event));
+    if (events == NULL)
+    {
+        return -1;
+    }
+    sampler->events = events;
+
+    struct sampler_event* event = &sampler->events[sampler->num_events];
+    event->name = strdup(ev->name ? ev->name : "");
+    if (event->name == NULL)
+    {
+        return -1;
+    }
+    event->attr = ev->attr;
+    event->attr.size = sizeof(struct perf_event_attr);
+    event->attr.disabled = 1;
+    sampler->num_events++;
+    return 0;
+}
+
+int pmu_sampler_open(struct pmu_sampler* sampler, size_t ring_pages)
+{
+    if (sampler->opened || ring_pages == 0 || (ring_pages & (ring_pages - 1)) != 0)
+    {
+        return -1;
+    }
+
+    size_t num_streams = sampler->num_events * sampler->num_cpus;
+    sampler->streams = calloc(num_streams ? num_streams : 1, sizeof(struct sampler_stream));
+    sampler->scratch = malloc(SAMPLER_MAX_RECORD);
+    if (sampler->streams == NULL || sampler->scratch == NULL)
+    {
+        close_streams(sampler);
+        return -1;
+    }
+    for (size_t i = 0; i < num_streams; i++)
+    {
+        sampler->streams[i].fd = -1;
+    }
+
+    sampler->ring_len = (1 + ring_pages) * sysconf(_SC_PAGESIZE);
+    for (size_t event = 0; event < sampler->num_events; event++)
+    {
+        struct perf_event_attr attr = sampler->events[event].attr;
+        for (size_t cpu = 0; cpu < sampler->num_cpus; cpu++)
+        {
+            struct sampler_stream* stream = &sampler->streams[event * sampler->num_cpus + cpu];
+            stream->fd = perf_event_open(&attr, -1, sampler->cpus[cpu].cpu, -1, 0);
+            if (stream->fd == -1)
+            {
+                close_streams(sampler);
+                return -1;
+            }
+            void* ring = mmap(NULL, sampler->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                              stream->fd, 0);
+            if (ring == MAP_FAILED)
+            {
+                close_streams(sampler);
+                return -1;
+            }
+            stream->ring = ring;
+            stream->period = attr.sample_period;
+            stream->state.period = attr.sample_period;
+        }
+    }
+    sampler->opened = true;
+    return 0;
+}
+
+static int sampler_ioctl(struct pmu_sampler* sampler, unsigned long request)
+{
+    if (!sampler->opened)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < sampler->num_events * sampler->num_cpus; i++)
+    {
+        if (ioctl(sampler->streams[i].fd, request, 0) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int pmu_sampler_enable(struct pmu_sampler* sampler)
+{
+    if (sampler_ioctl(sampler, PERF_EVENT_IOC_ENABLE) == -1)
+    {
+        return -1;
+    }
+    if (sampler->last_adjust_ns == 0)
+    {
+        sampler->last_adjust_ns = session_now_ns();
+    }
+    return 0;
+}
+
+int pmu_sampler_disable(struct pmu_sampler* sampler)
+{
+    return sampler_ioctl(sampler, PERF_EVENT_IOC_DISABLE);
+}
+
+/*
+ * Reads the records of one ring buffer, counting its samples and throttle records
+ */
+static void drain(struct pmu_sampler* sampler, size_t event, size_t cpu,
+                  pmu_sampler_sample_cb cb, void* data)
+{
+    struct sampler_stream* stream = &sampler->streams[event * sampler->num_cpus + cpu];
+    struct perf_event_mmap_page* ring = stream->ring;
+    const char* buf = (const char*)ring + ring->data_offset;
+    uint64_t size = ring->data_size;
+    uint64_t head = __atomic_load_n(&ring->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->data_tail;
+
+    while (tail < head)
+    {
+        /* Records are 8 byte aligned, so at least the header is in one piece */
+        const struct perf_event_header* header = (const void*)&buf[tail % size];
+        if (header->size < sizeof(struct perf_event_header))
+        {
+            break;
+        }
+        if (tail % size + header->size > size)
+        {
+            size_t first = size - tail % size;
+            memcpy(sampler->scratch, header, first);
+            memcpy(sampler->scratch + first, buf, header->size - first);
+            header = (const void*)sampler->scratch;
+        }
+
+        if (header->type == PERF_RECORD_SAMPLE)
+        {
+            stream->samples++;
+            if (cb != NULL)
+            {
+                struct pmu_sampler_sample sample = {
+                    .event = event,
+                    .cpu = cpu,
+                    .record = header,
+                };
+                cb(&sample, data);
+            }
+        }
+        else if (header->type == PERF_RECORD_THROTTLE)
+        {
+            stream->throttled++;
+        }
+        tail += header->size;
+    }
+    __atomic_store_n(&ring->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+long pmu_sampler_poll(struct pmu_sampler* sampler, pmu_sampler_sample_cb cb, void* data)
+{
+    if (!sampler->opened)
+    {
+        return -1;
+    }
+
+    long samples = 0;
+    for (size_t event = 0; event < sampler->num_events; event++)
+    {
+        for (size_t cpu = 0; cpu < sampler->num_cpus; cpu++)
+        {
+            const struct sampler_stream* stream =
+                &sampler->streams[event * sampler->num_cpus + cpu];
+            uint64_t before = stream->samples;
+            drain(sampler, event, cpu, cb, data);
+            samples += stream->samples - before;
+        }
+    }
+    return samples;
+}
+
+/*
+ * Returns the samples per second the budget allows every event on every CPU,
+ * INFINITY if it has no limit
+ */
+static double target_rate(const struct pmu_sampler* sampler)
+{
+    const struct pmu_sampler_budget* budget = &sampler->budget;
+    double rate = budget->samples_per_sec > 0 ? budget->samples_per_sec : INFINITY;
+
+    if (budget->max_overhead > 0 && sampler->num_events != 0)
+    {
+        /* The time of a CPU is shared by the samples of all events */
+        double per_cpu = budget->max_overhead * 1e9 / budget->sample_cost_ns;
+        double per_event = per_cpu / sampler->num_events;
+        rate = per_event < rate ? per_event : rate;
+    }
+    return rate;
+}
+
+/*
+ * Returns the period "wanted" within PMU_SAMPLER_MAX_STEP of "period" and within
+ * PMU_SAMPLER_MAX_STEP squared of "initial"
+ */
+static uint64_t clamp_period(double wanted, uint64_t period, uint64_t initial)
+{
+    double step = PMU_SAMPLER_MAX_STEP;
+    double low = period / step, high = period * step;
+    double min = initial / (step * step), max = initial * (step * step);
+
+    low = low > min ? low : min;
+    high = high < max ? high : max;
+    wanted = wanted < low ? low : wanted > high ? high : wanted;
+    return wanted >= 1 ? (uint64_t)wanted : 1;
+}
+
+int pmu_sampler_adjust(struct pmu_sampler* sampler)
+{
+    if (!sampler->opened)
+    {
+        return -1;
+    }
+
+    uint64_t now = session_now_ns();
+    double elapsed = (now - sampler->last_adjust_ns) / 1e9;
+    double rate = target_rate(sampler);
+    sampler->last_adjust_ns = now;
+    if (elapsed <= 0)
+    {
+        return 0;
+    }
+
+    for (size_t event = 0; event < sampler->num_events; event++)
+    {
+        uint64_t initial = sampler->events[event].attr.sample_period;
+        for (size_t cpu = 0; cpu < sampler->num_cpus; cpu++)
+        {
+            struct sampler_stream* stream = &sampler->streams[event * sampler->num_cpus + cpu];
+            /* Without PERF_FORMAT_GROUP, the count comes first, followed by up to 4 values */
+            uint64_t values[5];
+            if (read(stream->fd, values, sizeof(values)) < (ssize_t)sizeof(uint64_t))
+            {
+                return -1;
+            }
+            uint64_t occurred = values[0] - stream->last_count;
+            stream->last_count = values[0];
+
+            stream->state.samples_per_sec = stream->samples / elapsed;
+            stream->state.throttled = stream->throttled;
+            bool throttled = stream->throttled != 0;
+            stream->samples = 0;
+            stream->throttled = 0;
+
+            /* The period that yields "rate" samples at the rate the event occurred at */
+            double wanted = stream->period;
+            if (occurred != 0 && isfinite(rate))
+            {
+                wanted = occurred / (rate * elapsed);
+            }
+            /* Throttling stops the event, so it occurred more often than it was counted */
+            if (throttled && wanted < 2.0 * stream->period)
+            {
+                wanted = 2.0 * stream->period;
+            }
+
+            uint64_t period = clamp_period(wanted, stream->period, initial);
+            if (period != stream->period)
+            {
+                if (ioctl(stream->fd, PERF_EVENT_IOC_PERIOD, &period) == -1)
+                {
+                    return -1;
+                }
+                stream->period = period;
+                stream->state.period = period;
+            }
+        }
+    }
+    return 0;
+}
+
+int pmu_sampler_state(const struct pmu_sampler* sampler, size_t event, size_t cpu,
+                      struct pmu_sampler_state* state)
+{
+    if (!sampler->opened || event >= sampler->num_events || cpu >= sampler->num_cpus)
+    {
+        return -1;
+    }
+    *state = sampler->streams[event * sampler->num_cpus + cpu].state;
+    return 0;
+}
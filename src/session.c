@@ -0,0 +1,1222 @@
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/session.h>
+#include <pmu-events/topology.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+int perf_event_open(struct perf_event_attr* attr, pid_t pid, int cpu, int group_fd,
+                    unsigned long flags)
+{
+    return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+uint64_t session_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Returns the wall time the session has been enabled for, up to now
+ */
+uint64_t session_enabled_ns(const struct pmu_session* session)
+{
+    if (session->enabled)
+    {
+        return session->enabled_ns + (session_now_ns() - session->enabled_since_ns);
+    }
+    return session->enabled_ns;
+}
+
+/*
+ * Returns true if "group" is in the currently active window of groups
+ */
+bool session_group_is_active(const struct pmu_session* session, size_t group)
+{
+    if (session->active_groups == 0 || session->active_groups >= session->num_groups)
+    {
+        return true;
+    }
+    size_t offset = (group + session->num_groups - session->rotation_start) % session->num_groups;
+    return offset < session->active_groups;
+}
+
+/* The configs of the tool events, see arch/common/common/tool.json */
+enum tool_event
+{
+    TOOL_DURATION_TIME = 1,
+    TOOL_USER_TIME = 2,
+    TOOL_SYSTEM_TIME = 3,
+    TOOL_NUM_EVENTS = 13
+};
+
+/* The names of the tool events with a constant value, as metric literals (e.g. "#num_cpus") */
+static const char* const tool_literals[TOOL_NUM_EVENTS] = {
+    [4] = "has_pmem",
+    [5] = "num_cores",
+    [6] = "num_cpus",
+    [7] = "num_cpus_online",
+    [8] = "num_dies",
+    [9] = "num_packages",
+    [10] = "slots",
+    [11] = "smt_on",
+    [12] = "system_tsc_freq",
+};
+
+static bool is_tool_event(const struct session_event* ev)
+{
+    return ev->attr.type == PMU_EVENTS_TYPE_TOOL;
+}
+
+/*
+ * Returns true if the event is opened with perf_event_open, i.e. it is neither a tool
+ * event nor merged into an identical event of another group
+ */
+bool session_event_is_counter(const struct session_event* ev)
+{
+    return !is_tool_event(ev) && ev->merged_into == SESSION_NOT_MERGED;
+}
+
+/*
+ * Recomputes the kernel group leader and members of "grp", e.g. after events were merged
+ */
+void session_update_group(struct pmu_session* session, struct session_group* grp)
+{
+    grp->leader = grp->first_event;
+    grp->num_counters = 0;
+    for (size_t i = 0; i < grp->num_events; i++)
+    {
+        if (!session_event_is_counter(&session->events[grp->first_event + i]))
+        {
+            continue;
+        }
+        if (grp->num_counters++ == 0)
+        {
+            grp->leader = grp->first_event + i;
+        }
+    }
+}
+
+/*
+ * Reads the user and system time of the CPUs of the session from /proc/stat into
+ * session->cpu_times
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int read_cpu_times(struct pmu_session* session)
+{
+    FILE* stat = fopen("/proc/stat", "r");
+    if (stat == NULL)
+    {
+        return -1;
+    }
+
+    uint64_t ns_per_tick = 1000000000ULL / sysconf(_SC_CLK_TCK);
+    char line[256];
+    memset(session->cpu_times, 0, 2 * session->num_cpus * sizeof(uint64_t));
+    while (fgets(line, sizeof(line), stat) != NULL)
+    {
+        /* "cpu3 user nice system idle ...", after the "cpu " line with the sums */
+        int cpu;
+        unsigned long long user, nice, system;
+        if (strncmp(line, "cpu", 3) != 0 || !isdigit((unsigned char)line[3]) ||
+            sscanf(line + 3, "%d %llu %llu %llu", &cpu, &user, &nice, &system) != 4)
+        {
+            continue;
+        }
+        for (size_t c = 0; c < session->num_cpus; c++)
+        {
+            if (session->cpus[c].cpu == cpu)
+            {
+                session->cpu_times[2 * c] = user * ns_per_tick;
+                session->cpu_times[2 * c + 1] = system * ns_per_tick;
+            }
+        }
+    }
+    fclose(stat);
+    return 0;
+}
+
+/* What update_tools() does with the tool events */
+enum tool_update
+{
+    /* Take the start reading, on enable */
+    TOOLS_START,
+    /* Add the time since the start reading to the value, on disable */
+    TOOLS_STOP,
+    /* Put the counts into "counts" */
+    TOOLS_READ
+};
+
+/*
+ * Counts the tool events of the session. duration_time is the time the session was
+ * enabled, user_time and system_time the /proc/stat times of the CPU while it was.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int update_tools(struct pmu_session* session, enum tool_update update,
+                        struct pmu_count* counts)
+{
+    if (session->tools == NULL)
+    {
+        return 0;
+    }
+    /* The start and the current reading only matter while the session is enabled */
+    bool sample = update != TOOLS_READ || session->enabled;
+    if (session->cpu_times != NULL && sample && read_cpu_times(session) == -1)
+    {
+        return -1;
+    }
+
+    uint64_t enabled = session_enabled_ns(session);
+    for (size_t cpu = 0; cpu < session->num_cpus; cpu++)
+    {
+        for (size_t event = 0; event < session->num_events; event++)
+        {
+            if (!is_tool_event(&session->events[event]))
+            {
+                continue;
+            }
+
+            struct tool_counter* tool = &session->tools[cpu * session->num_events + event];
+            uint64_t config = session->events[event].attr.config;
+            uint64_t value = tool->value;
+            if (config == TOOL_DURATION_TIME)
+            {
+                value = enabled;
+            }
+            else if (sample && (config == TOOL_USER_TIME || config == TOOL_SYSTEM_TIME))
+            {
+                uint64_t reading = session->cpu_times[2 * cpu + (config == TOOL_SYSTEM_TIME)];
+                if (update == TOOLS_START)
+                {
+                    tool->start = reading;
+                }
+                else if (update == TOOLS_STOP)
+                {
+                    tool->value += reading - tool->start;
+                }
+                else
+                {
+                    value += reading - tool->start;
+                }
+            }
+
+            if (update == TOOLS_READ)
+            {
+                pmu_count_scale(&counts[cpu * session->num_events + event], value, enabled,
+                                enabled, enabled);
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Sets up the tool events of the session, which are not opened with perf_event_open()
+ *
+ * Returns 0 on success, -1 on failure (with errno set to EINVAL for unknown tool events)
+ */
+static int open_tools(struct pmu_session* session)
+{
+    bool has_tools = false, has_times = false;
+    for (size_t event = 0; event < session->num_events; event++)
+    {
+        uint64_t config = session->events[event].attr.config;
+        if (!is_tool_event(&session->events[event]))
+        {
+            continue;
+        }
+        if (config == 0 || config >= TOOL_NUM_EVENTS)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        has_tools = true;
+        has_times |= config == TOOL_USER_TIME || config == TOOL_SYSTEM_TIME;
+    }
+    if (!has_tools)
+    {
+        return 0;
+    }
+
+    session->tools = calloc(session->num_cpus * session->num_events, sizeof(struct tool_counter));
+    session->cpu_times = has_times ? malloc(2 * session->num_cpus * sizeof(uint64_t)) : NULL;
+    if ((session->tools == NULL && session->num_cpus != 0) ||
+        (has_times && session->cpu_times == NULL && session->num_cpus != 0))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (size_t event = 0; event < session->num_events; event++)
+    {
+        uint64_t config = session->events[event].attr.config;
+        double value;
+        if (!is_tool_event(&session->events[event]) || tool_literals[config] == NULL ||
+            metric_literal_value(tool_literals[config], &value) == -1)
+        {
+            continue;
+        }
+        for (size_t cpu = 0; cpu < session->num_cpus; cpu++)
+        {
+            session->tools[cpu * session->num_events + event].value = value;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads the physical package id of every CPU of the session into session->packages
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int read_packages(struct pmu_session* session, const struct pmu_topology* topo)
+{
+    session->packages = malloc((session->num_cpus ? session->num_cpus : 1) * sizeof(int));
+    if (session->packages == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t c = 0; c < session->num_cpus; c++)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/topology/physical_package_id",
+                 session->cpus[c].cpu);
+        char* full_path = concat_path(topo != NULL ? topo->root : "/sys", path);
+        char* content = full_path != NULL ? get_file_content(full_path) : NULL;
+        session->packages[c] = content != NULL ? strtol(content, NULL, 0) : -1;
+        free(content);
+        free(full_path);
+    }
+    return 0;
+}
+
+/*
+ * Returns the uncore PMU with a cpumask the leader of "grp" is on, NULL if there is none
+ */
+static const struct topology_pmu* uncore_pmu(const struct pmu_session* session,
+                                             const struct session_group* grp,
+                                             const struct pmu_topology* topo)
+{
+    if (topo == NULL || grp->num_counters == 0)
+    {
+        return NULL;
+    }
+    uint32_t type = session->events[grp->leader].attr.type;
+    for (size_t i = 0; i < topo->num_pmus; i++)
+    {
+        const struct topology_pmu* pmu = &topo->pmus[i];
+        if (pmu->type == type && !pmu->is_core && pmu->cpus != NULL)
+        {
+            return pmu;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Decides on which CPUs every group is opened, see pmu_session_open(), into
+ * session->placed, which stays NULL if all groups are opened on all CPUs
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int session_place_groups(struct pmu_session* session)
+{
+    const struct pmu_topology* topo = pmu_topology_get();
+    if (read_packages(session, topo) == -1)
+    {
+        return -1;
+    }
+
+    bool any = false;
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        struct session_group* grp = &session->groups[group];
+        grp->per_package = uncore_pmu(session, grp, topo) != NULL;
+        for (size_t i = 0; i < grp->num_events; i++)
+        {
+            grp->per_package |= session->events[grp->first_event + i].per_package;
+        }
+        any |= grp->per_package;
+    }
+    if (!any)
+    {
+        return 0;
+    }
+
+    session->placed = calloc(session->num_groups + 1, sizeof(struct pmu_cpuset));
+    if (session->placed == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        const struct session_group* grp = &session->groups[group];
+        /* The indices of the CPUs in the session, which may hold a CPU more than once */
+        struct pmu_cpuset* placed = &session->placed[group];
+        const struct topology_pmu* pmu = uncore_pmu(session, grp, topo);
+
+        /* With room for all CPUs, so that adding them can not fail */
+        if (pmu_cpuset_init(placed, session->num_cpus) == -1)
+        {
+            return -1;
+        }
+        if (!grp->per_package)
+        {
+            if (session->num_cpus != 0)
+            {
+                pmu_cpuset_add_range(placed, 0, session->num_cpus - 1);
+            }
+            continue;
+        }
+        for (size_t c = 0; pmu != NULL && c < session->num_cpus; c++)
+        {
+            if (session->cpus[c].cpu >= 0 && pmu_cpuset_test(&pmu->cpuset, session->cpus[c].cpu))
+            {
+                pmu_cpuset_add(placed, c);
+            }
+        }
+        if (!pmu_cpuset_empty(placed))
+        {
+            continue;
+        }
+
+        /* The first CPU of every package, and every CPU whose package is unknown */
+        for (size_t c = 0; c < session->num_cpus; c++)
+        {
+            bool first = true;
+            for (size_t prev = 0; prev < c && session->packages[c] != -1 && first; prev++)
+            {
+                first = session->packages[prev] != session->packages[c];
+            }
+            if (first)
+            {
+                pmu_cpuset_add(placed, c);
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns true if "group" is opened on the c-th CPU of the session
+ */
+bool session_group_is_placed(const struct pmu_session* session, size_t group, size_t cpu)
+{
+    return session->placed == NULL || pmu_cpuset_test(&session->placed[group], cpu);
+}
+
+int pmu_session_group_cpus(const struct pmu_session* session, size_t group,
+                           struct pmu_cpuset* cpus)
+{
+    if (!session->opened || group >= session->num_groups)
+    {
+        return -1;
+    }
+    pmu_cpuset_clear(cpus);
+    for (size_t c = 0; c < session->num_cpus; c++)
+    {
+        if (session_group_is_placed(session, group, c) && session->cpus[c].cpu >= 0 &&
+            pmu_cpuset_add(cpus, session->cpus[c].cpu) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct pmu_session* pmu_session_new(const struct perf_cpu* cpus, size_t num_cpus)
+{
+    struct pmu_session* session = calloc(1, sizeof(struct pmu_session));
+    if (session == NULL)
+    {
+        return NULL;
+    }
+
+    session->cpus = malloc(num_cpus * sizeof(struct perf_cpu));
+    if (session->cpus == NULL && num_cpus != 0)
+    {
+        free(session);
+        return NULL;
+    }
+    memcpy(session->cpus, cpus, num_cpus * sizeof(struct perf_cpu));
+    session->num_cpus = num_cpus;
+    session->cgroup_fd = -1;
+    return session;
+}
+
+struct pmu_session* pmu_session_new_cpuset(const struct pmu_cpuset* cpus)
+{
+    struct perf_cpu* array = malloc((pmu_cpuset_count(cpus) + 1) * sizeof(struct perf_cpu));
+    if (array == NULL)
+    {
+        return NULL;
+    }
+    size_t num_cpus = 0;
+    long cpu;
+    pmu_cpuset_for_each(cpu, cpus)
+    {
+        array[num_cpus++].cpu = cpu;
+    }
+
+    struct pmu_session* session = pmu_session_new(array, num_cpus);
+    free(array);
+    return session;
+}
+
+/*
+ * Creates a new, unopened session with the CPUs and groups of "session"
+ *
+ * Returns NULL on failure
+ */
+struct pmu_session* session_clone(const struct pmu_session* session)
+{
+    struct pmu_session* clone = pmu_session_new(session->cpus, session->num_cpus);
+    struct pmu_session_event* events = malloc((session->read_buf_len + 1) * sizeof(*events));
+    if (clone == NULL || events == NULL)
+    {
+        pmu_session_free(clone);
+        free(events);
+        return NULL;
+    }
+
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        const struct session_group* grp = &session->groups[group];
+        for (size_t i = 0; i < grp->num_events; i++)
+        {
+            const struct session_event* ev = &session->events[grp->first_event + i];
+            events[i].name = ev->name;
+            events[i].attr = ev->attr;
+            events[i].per_package = ev->per_package;
+        }
+        if (pmu_session_add_group(clone, events, grp->num_events) == -1)
+        {
+            pmu_session_free(clone);
+            clone = NULL;
+            break;
+        }
+        for (size_t i = 0; i < grp->num_events; i++)
+        {
+            clone->events[grp->first_event + i].armed =
+                session->events[grp->first_event + i].armed;
+        }
+    }
+    free(events);
+    return clone;
+}
+
+static void close_fds(struct pmu_session* session)
+{
+    if (session->fds == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < session->num_cpus * session->num_events; i++)
+    {
+        if (session->fds[i] != -1)
+        {
+            close(session->fds[i]);
+        }
+    }
+    free(session->fds);
+    free(session->tools);
+    free(session->cpu_times);
+    free(session->packages);
+    for (size_t group = 0; session->placed != NULL && group < session->num_groups; group++)
+    {
+        pmu_cpuset_release(&session->placed[group]);
+    }
+    free(session->placed);
+    free(session->saved);
+    session_uring_free(session->uring);
+    session_notify_free(session, session->notify);
+    session->fds = NULL;
+    session->tools = NULL;
+    session->cpu_times = NULL;
+    session->packages = NULL;
+    session->placed = NULL;
+    session->saved = NULL;
+    session->uring = NULL;
+    session->notify = NULL;
+    session->opened = false;
+    session->enabled = false;
+}
+
+void pmu_session_free(struct pmu_session* session)
+{
+    if (session == NULL)
+    {
+        return;
+    }
+    close_fds(session);
+    for (size_t i = 0; i < session->num_events; i++)
+    {
+        free(session->events[i].name);
+    }
+    free(session->events);
+    free(session->groups);
+    free(session->cpus);
+    free(session->read_buf);
+    free(session);
+}
+
+int pmu_session_add_group(struct pmu_session* session, const struct pmu_session_event* events,
+                          size_t num_events)
+{
+    if (session->opened || num_events == 0)
+    {
+        return -1;
+    }
+
+    struct session_group* groups =
+        realloc(session->groups, (session->num_groups + 1) * sizeof(struct session_group));
+    if (groups == NULL)
+    {
+        return -1;
+    }
+    session->groups = groups;
+
+    struct session_event* new_events = realloc(
+        session->events, (session->num_events + num_events) * sizeof(struct session_event));
+    if (new_events == NULL)
+    {
+        return -1;
+    }
+    session->events = new_events;
+
+    for (size_t i = 0; i < num_events; i++)
+    {
+        struct session_event* ev = &session->events[session->num_events + i];
+        ev->name = strdup(events[i].name ? events[i].name : "");
+        if (ev->name == NULL)
+        {
+            for (size_t x = 0; x < i; x++)
+            {
+                free(session->events[session->num_events + x].name);
+            }
+            return -1;
+        }
+        ev->attr = events[i].attr;
+        ev->attr.size = sizeof(struct perf_event_attr);
+        ev->group = session->num_groups;
+        ev->per_package = events[i].per_package;
+        ev->merged_into = SESSION_NOT_MERGED;
+        ev->armed = false;
+    }
+
+    size_t read_buf_len = 3 + num_events;
+    if (read_buf_len > session->read_buf_len)
+    {
+        uint64_t* read_buf = realloc(session->read_buf, read_buf_len * sizeof(uint64_t));
+        if (read_buf == NULL)
+        {
+            for (size_t i = 0; i < num_events; i++)
+            {
+                free(session->events[session->num_events + i].name);
+            }
+            return -1;
+        }
+        session->read_buf = read_buf;
+        session->read_buf_len = read_buf_len;
+    }
+
+    struct session_group* grp = &session->groups[session->num_groups];
+    grp->first_event = session->num_events;
+    grp->num_events = num_events;
+    grp->per_package = false;
+    grp->dropped = false;
+    grp->is_open = false;
+    session_update_group(session, grp);
+    session->num_events += num_events;
+    return session->num_groups++;
+}
+
+/*
+ * Opens "group" on all CPUs it is placed on, with the leader disabled
+ *
+ * Returns 0 on success, -1 on failure (with errno set by perf_event_open)
+ */
+static int open_group(struct pmu_session* session, size_t group)
+{
+    struct session_group* grp = &session->groups[group];
+
+    for (size_t cpu = 0; cpu < session->num_cpus; cpu++)
+    {
+        int* fds = &session->fds[cpu * session->num_events];
+        int leader_fd = -1;
+
+        for (size_t i = 0; i < grp->num_events && session_group_is_placed(session, group, cpu);
+             i++)
+        {
+            size_t event = grp->first_event + i;
+            struct perf_event_attr attr = session->events[event].attr;
+
+            /* Tool events are counted in the library, see update_tools() */
+            if (!session_event_is_counter(&session->events[event]))
+            {
+                continue;
+            }
+
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            /* Only the leader is disabled, the members follow it */
+            attr.disabled = event == grp->leader;
+
+            fds[event] = perf_event_open(
+                &attr, session->cgroup_fd, session->cpus[cpu].cpu, leader_fd,
+                PERF_FLAG_FD_CLOEXEC | (session->cgroup_fd != -1 ? PERF_FLAG_PID_CGROUP : 0));
+            if (fds[event] == -1 ||
+                (session->events[event].armed &&
+                 session_notify_add(session, event, cpu, fds[event]) == -1))
+            {
+                return -1;
+            }
+            if (event == grp->leader)
+            {
+                leader_fd = fds[event];
+            }
+        }
+    }
+    grp->is_open = true;
+    return 0;
+}
+
+static void close_group(struct pmu_session* session, size_t group)
+{
+    struct session_group* grp = &session->groups[group];
+
+    for (size_t cpu = 0; cpu < session->num_cpus; cpu++)
+    {
+        for (size_t i = 0; i < grp->num_events; i++)
+        {
+            int* fd = &session->fds[cpu * session->num_events + grp->first_event + i];
+            if (*fd != -1 && session->events[grp->first_event + i].armed)
+            {
+                session_notify_remove(session, grp->first_event + i, cpu);
+            }
+            if (*fd != -1)
+            {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+    grp->is_open = false;
+}
+
+/*
+ * Reads "group" on the c-th CPU into session->read_buf, as
+ * { nr, time_enabled, time_running, values[nr] }, without the events that are not counters
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int read_group(struct pmu_session* session, size_t group, size_t cpu)
+{
+    const struct session_group* grp = &session->groups[group];
+    int fd = session->fds[cpu * session->num_events + grp->leader];
+    size_t len = (3 + grp->num_counters) * sizeof(uint64_t);
+    return read(fd, session->read_buf, len) == len ? 0 : -1;
+}
+
+/*
+ * Adds the counts of the open "group" to session->saved and closes it
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int save_group(struct pmu_session* session, size_t group)
+{
+    const struct session_group* grp = &session->groups[group];
+
+    for (size_t cpu = 0; cpu < session->num_cpus && grp->num_counters != 0; cpu++)
+    {
+        if (!session_group_is_placed(session, group, cpu))
+        {
+            continue;
+        }
+        if (read_group(session, group, cpu) == -1)
+        {
+            return -1;
+        }
+
+        const uint64_t* values = &session->read_buf[3];
+        for (size_t i = 0; i < grp->num_events; i++)
+        {
+            size_t event = grp->first_event + i;
+            struct session_count* saved = &session->saved[cpu * session->num_events + event];
+            if (session_event_is_counter(&session->events[event]))
+            {
+                saved->raw += *values++;
+                saved->time_enabled += session->read_buf[1];
+                saved->time_running += session->read_buf[2];
+            }
+        }
+    }
+    close_group(session, group);
+    return 0;
+}
+
+/*
+ * With max_open_groups, closes the open groups that are no longer active and opens the
+ * active ones that are closed. The groups are opened disabled.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int update_open_groups(struct pmu_session* session)
+{
+    if (session->max_open_groups == 0)
+    {
+        return 0;
+    }
+
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        if (session->groups[group].is_open && !session_group_is_active(session, group) &&
+            save_group(session, group) == -1)
+        {
+            return -1;
+        }
+    }
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        const struct session_group* grp = &session->groups[group];
+        if (!grp->is_open && !grp->dropped && session_group_is_active(session, group) &&
+            open_group(session, group) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int open_session(struct pmu_session* session)
+{
+    if (session->opened)
+    {
+        return 0;
+    }
+
+    size_t num_fds = session->num_cpus * session->num_events;
+    session->fds = malloc(num_fds * sizeof(int));
+    if (session->fds == NULL && num_fds != 0)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < num_fds; i++)
+    {
+        session->fds[i] = -1;
+    }
+    session->opened = true;
+    if (session->max_open_groups != 0)
+    {
+        session->saved = calloc(num_fds ? num_fds : 1, sizeof(struct session_count));
+    }
+
+    bool armed = false;
+    for (size_t event = 0; event < session->num_events; event++)
+    {
+        armed |= session->events[event].armed;
+    }
+    session->notify = armed ? session_notify_new(session) : NULL;
+
+    /* The fd budget may already have placed the groups */
+    if (open_tools(session) == -1 || (armed && session->notify == NULL) ||
+        (session->packages == NULL && session_place_groups(session) == -1) ||
+        (session->max_open_groups != 0 && session->saved == NULL))
+    {
+        int err = errno;
+        close_fds(session);
+        errno = err;
+        return -1;
+    }
+
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        const struct session_group* grp = &session->groups[group];
+        bool open = session->max_open_groups == 0 || session_group_is_active(session, group);
+        if (!grp->dropped && open && open_group(session, group) == -1)
+        {
+            int err = errno;
+            close_fds(session);
+            errno = err;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int pmu_session_open(struct pmu_session* session)
+{
+    uint64_t start = stats_start();
+    int ret = open_session(session);
+    stats_end(PMU_EVENTS_ENTRY_SESSION_OPEN, start);
+    return ret;
+}
+
+/*
+ * Issues "request" (PERF_EVENT_IOC_ENABLE, ...) to the leaders of "group" on all CPUs
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int group_ioctl(struct pmu_session* session, size_t group, unsigned long request)
+{
+    size_t leader = session->groups[group].leader;
+
+    for (size_t cpu = 0; cpu < session->num_cpus; cpu++)
+    {
+        int fd = session->fds[cpu * session->num_events + leader];
+        if (fd != -1 && ioctl(fd, request, 0) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int pmu_session_enable(struct pmu_session* session)
+{
+    if (!session->opened)
+    {
+        return -1;
+    }
+    if (session->enabled)
+    {
+        return 0;
+    }
+
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        if (session_group_is_active(session, group) &&
+            group_ioctl(session, group, PERF_EVENT_IOC_ENABLE) == -1)
+        {
+            return -1;
+        }
+    }
+    if (update_tools(session, TOOLS_START, NULL) == -1)
+    {
+        return -1;
+    }
+    session->enabled = true;
+    session->enabled_since_ns = session_now_ns();
+    session->last_rotation_ns = session->enabled_since_ns;
+    return 0;
+}
+
+int pmu_session_disable(struct pmu_session* session)
+{
+    if (!session->enabled)
+    {
+        return 0;
+    }
+
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        if (session_group_is_active(session, group) &&
+            group_ioctl(session, group, PERF_EVENT_IOC_DISABLE) == -1)
+        {
+            return -1;
+        }
+    }
+    if (update_tools(session, TOOLS_STOP, NULL) == -1)
+    {
+        return -1;
+    }
+    session->enabled_ns = session_enabled_ns(session);
+    session->enabled = false;
+    return 0;
+}
+
+size_t pmu_session_num_cpus(const struct pmu_session* session)
+{
+    return session->num_cpus;
+}
+
+size_t pmu_session_num_events(const struct pmu_session* session)
+{
+    return session->num_events;
+}
+
+size_t pmu_session_num_groups(const struct pmu_session* session)
+{
+    return session->num_groups;
+}
+
+int pmu_session_cpu_package(const struct pmu_session* session, size_t cpu)
+{
+    if (session->packages == NULL || cpu >= session->num_cpus)
+    {
+        return -1;
+    }
+    return session->packages[cpu];
+}
+
+uint32_t pmu_session_event_flags(const struct pmu_session* session, size_t event)
+{
+    if (event >= session->num_events)
+    {
+        return 0;
+    }
+    const struct session_event* ev = &session->events[event];
+    uint32_t flags = ev->merged_into != SESSION_NOT_MERGED ? PMU_COUNT_MERGED : 0;
+    flags |= session->groups[ev->group].dropped ? PMU_COUNT_DROPPED : 0;
+    if (session->max_open_groups != 0 && session->max_open_groups < session->num_groups)
+    {
+        flags |= PMU_COUNT_MULTIPLEXED;
+    }
+    return flags;
+}
+
+const char* pmu_session_event_name(const struct pmu_session* session, size_t event)
+{
+    if (event >= session->num_events)
+    {
+        return NULL;
+    }
+    return session->events[event].name;
+}
+
+void pmu_count_scale(struct pmu_count* count, uint64_t raw, uint64_t time_enabled,
+                     uint64_t time_running, uint64_t enabled)
+{
+    count->raw = raw;
+    count->time_enabled = time_enabled;
+    count->time_running = time_running;
+    count->flags = 0;
+
+    if (enabled == 0)
+    {
+        /* Never enabled, so nothing to extrapolate */
+        count->scaled = raw;
+        count->running_fraction = 0.0;
+        return;
+    }
+
+    if (time_running == 0)
+    {
+        count->scaled = 0.0;
+        count->running_fraction = 0.0;
+        count->flags |= PMU_COUNT_NEVER_RAN;
+        return;
+    }
+
+    if (time_running >= enabled)
+    {
+        count->scaled = raw;
+        count->running_fraction = 1.0;
+        return;
+    }
+
+    count->running_fraction = (double)time_running / enabled;
+    count->scaled = raw / count->running_fraction;
+    count->flags |= PMU_COUNT_MULTIPLEXED;
+}
+
+static int read_session(struct pmu_session* session, struct pmu_count* counts)
+{
+    if (!session->opened)
+    {
+        return -1;
+    }
+
+    bool rotating = session->active_groups != 0 && session->active_groups < session->num_groups;
+    uint64_t session_enabled = rotating ? session_enabled_ns(session) : 0;
+
+    /* With io_uring, all groups are read at once up front */
+    if (session->uring != NULL && session_uring_read(session) == -1)
+    {
+        return -1;
+    }
+
+    for (size_t cpu = 0; cpu < session->num_cpus; cpu++)
+    {
+        for (size_t group = 0; group < session->num_groups; group++)
+        {
+            const struct session_group* grp = &session->groups[group];
+            struct pmu_count* grp_counts = &counts[cpu * session->num_events + grp->first_event];
+            uint32_t flags = grp->dropped ? PMU_COUNT_DROPPED : PMU_COUNT_NOT_PLACED;
+            if (grp->dropped || !session_group_is_placed(session, group, cpu))
+            {
+                for (size_t i = 0; i < grp->num_events; i++)
+                {
+                    pmu_count_scale(&grp_counts[i], 0, 0, 0, 0);
+                    grp_counts[i].flags = flags;
+                }
+                continue;
+            }
+            if (grp->num_counters == 0)
+            {
+                continue;
+            }
+
+            /* Closed groups only have the counts saved while they were open */
+            uint64_t time_enabled = 0, time_running = 0;
+            const uint64_t* values = NULL;
+            if (grp->is_open)
+            {
+                const uint64_t* buf = session->read_buf;
+                if (session->uring != NULL)
+                {
+                    buf = session_uring_group(session->uring, group, cpu);
+                }
+                else if (read_group(session, group, cpu) == -1)
+                {
+                    return -1;
+                }
+                time_enabled = buf[1];
+                time_running = buf[2];
+                values = &buf[3];
+            }
+
+            for (size_t i = 0; i < grp->num_events; i++)
+            {
+                size_t event = grp->first_event + i;
+                if (!session_event_is_counter(&session->events[event]))
+                {
+                    continue;
+                }
+
+                struct session_count sum = { values ? *values++ : 0, time_enabled, time_running };
+                if (session->saved != NULL)
+                {
+                    const struct session_count* saved =
+                        &session->saved[cpu * session->num_events + event];
+                    sum.raw += saved->raw;
+                    sum.time_enabled += saved->time_enabled;
+                    sum.time_running += saved->time_running;
+                }
+                pmu_count_scale(&grp_counts[i], sum.raw, sum.time_enabled, sum.time_running,
+                                rotating ? session_enabled : sum.time_enabled);
+                grp_counts[i].flags |= grp->per_package ? PMU_COUNT_PACKAGE : 0;
+            }
+        }
+    }
+
+    /* Merged events have the count of the event they were merged into */
+    for (size_t cpu = 0; cpu < session->num_cpus; cpu++)
+    {
+        struct pmu_count* cpu_counts = &counts[cpu * session->num_events];
+        for (size_t event = 0; event < session->num_events; event++)
+        {
+            size_t merged_into = session->events[event].merged_into;
+            if (merged_into != SESSION_NOT_MERGED)
+            {
+                cpu_counts[event] = cpu_counts[merged_into];
+                cpu_counts[event].flags |= PMU_COUNT_MERGED;
+            }
+        }
+    }
+    return update_tools(session, TOOLS_READ, counts);
+}
+
+int pmu_session_read(struct pmu_session* session, struct pmu_count* counts)
+{
+    uint64_t start = stats_start();
+    int ret = read_session(session, counts);
+    stats_end(PMU_EVENTS_ENTRY_SESSION_READ, start);
+    return ret;
+}
+
+int pmu_session_set_rotation(struct pmu_session* session, size_t active_groups,
+                             uint64_t interval_ns)
+{
+    bool enabled = session->enabled;
+
+    if (enabled && pmu_session_disable(session) == -1)
+    {
+        return -1;
+    }
+    /* Groups beyond the fd budget can not be opened at the same time */
+    if (session->max_open_groups != 0 &&
+        (active_groups == 0 || active_groups > session->max_open_groups))
+    {
+        active_groups = session->max_open_groups;
+    }
+    session->active_groups = active_groups;
+    session->rotation_interval_ns = interval_ns;
+    session->rotation_start = 0;
+    if (session->opened && update_open_groups(session) == -1)
+    {
+        return -1;
+    }
+    if (enabled)
+    {
+        return pmu_session_enable(session);
+    }
+    return 0;
+}
+
+int pmu_session_rotate(struct pmu_session* session)
+{
+    if (session->active_groups == 0 || session->active_groups >= session->num_groups)
+    {
+        return 0;
+    }
+
+    size_t new_start = (session->rotation_start + session->active_groups) % session->num_groups;
+
+    if (session->enabled)
+    {
+        for (size_t group = 0; group < session->num_groups; group++)
+        {
+            if (session_group_is_active(session, group) &&
+                group_ioctl(session, group, PERF_EVENT_IOC_DISABLE) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+
+    session->rotation_start = new_start;
+    session->last_rotation_ns = session_now_ns();
+    if (update_open_groups(session) == -1)
+    {
+        return -1;
+    }
+
+    if (session->enabled)
+    {
+        for (size_t group = 0; group < session->num_groups; group++)
+        {
+            if (session_group_is_active(session, group) &&
+                group_ioctl(session, group, PERF_EVENT_IOC_ENABLE) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int pmu_session_tick(struct pmu_session* session)
+{
+    if (!session->enabled || session->active_groups == 0 ||
+        session->active_groups >= session->num_groups)
+    {
+        return 0;
+    }
+
+    if (session_now_ns() - session->last_rotation_ns < session->rotation_interval_ns)
+    {
+        return 0;
+    }
+
+    if (pmu_session_rotate(session) == -1)
+    {
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,264 @@
+#include <pmu-events/stats.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The statistics of one thread. Only the owning thread writes a block, other threads
+ * read it with relaxed atomics. Blocks are never freed: the block of a thread that
+ * exited is handed to the next new thread, which keeps counting on top of it.
+ */
+struct stats_block
+{
+    struct pmu_events_stats stats;
+    struct stats_block* next;
+    /* Set while a thread owns the block */
+    bool in_use;
+};
+
+unsigned pmu_events_stats_flags;
+
+static struct stats_block* blocks;
+static __thread struct stats_block* own_block;
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+
+/* The sums at the last pmu_events_stats_reset(), subtracted from every read */
+static struct pmu_events_stats baseline;
+static pthread_mutex_t baseline_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* const counter_names[PMU_EVENTS_NUM_COUNTERS] = {
+    [PMU_EVENTS_MAP_FOR_CPU] = "map_for_cpu",
+    [PMU_EVENTS_MAP_FOR_CPU_MISSES] = "map_for_cpu_misses",
+    [PMU_EVENTS_REGEX_COMPILES] = "regex_compiles",
+    [PMU_EVENTS_FILE_READS] = "file_reads",
+    [PMU_EVENTS_GEN_ATTRS] = "gen_attrs",
+    [PMU_EVENTS_DECOMPRESSIONS] = "decompressions",
+};
+
+static const char* const entry_names[PMU_EVENTS_NUM_ENTRIES] = {
+    [PMU_EVENTS_ENTRY_MAP_FOR_CPU] = "map_for_cpu",
+    [PMU_EVENTS_ENTRY_GET_EVENT_BY_NAME] = "get_event_by_name",
+    [PMU_EVENTS_ENTRY_GET_METRIC_BY_NAME] = "get_metric_by_name",
+    [PMU_EVENTS_ENTRY_GEN_ATTR_FOR_EVENT] = "gen_attr_for_event",
+    [PMU_EVENTS_ENTRY_METRIC_PLAN_NEW] = "metric_plan_new",
+    [PMU_EVENTS_ENTRY_SESSION_OPEN] = "pmu_session_open",
+    [PMU_EVENTS_ENTRY_SESSION_READ] = "pmu_session_read",
+};
+
+static void release_block(void* block)
+{
+    __atomic_store_n(&((struct stats_block*)block)->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void create_block_key(void)
+{
+    pthread_key_create(&block_key, release_block);
+}
+
+/*
+ * Returns the block of the calling thread, taking over a released block or adding
+ * a new one on first use. Returns NULL on failure.
+ */
+static struct stats_block* thread_block(void)
+{
+    if (own_block != NULL)
+    {
+        return own_block;
+    }
+
+    struct stats_block* block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE);
+    for (; block != NULL; block = block->next)
+    {
+        bool in_use = false;
+        if (__atomic_compare_exchange_n(&block->in_use, &in_use, true, false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+    if (block == NULL)
+    {
+        block = calloc(1, sizeof(struct stats_block));
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        block->in_use = true;
+        block->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&blocks, &block->next, block, true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+        {
+        }
+    }
+
+    /* The block is released again when the thread exits */
+    pthread_once(&block_key_once, create_block_key);
+    pthread_setspecific(block_key, block);
+    own_block = block;
+    return block;
+}
+
+/*
+ * Adds "value" to a statistic of the own block
+ */
+static void add(uint64_t* stat, uint64_t value)
+{
+    __atomic_store_n(stat, *stat + value, __ATOMIC_RELAXED);
+}
+
+void stats_add(enum pmu_events_counter counter)
+{
+    struct stats_block* block = thread_block();
+    if (block != NULL)
+    {
+        add(&block->stats.counters[counter], 1);
+    }
+}
+
+uint64_t stats_now(void)
+{
+    return session_now_ns();
+}
+
+void stats_record(enum pmu_events_entry entry, uint64_t start)
+{
+    uint64_t ns = session_now_ns() - start;
+    struct stats_block* block = thread_block();
+    if (block == NULL)
+    {
+        return;
+    }
+
+    size_t bucket = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= PMU_EVENTS_STATS_BUCKETS)
+    {
+        bucket = PMU_EVENTS_STATS_BUCKETS - 1;
+    }
+    add(&block->stats.calls[entry], 1);
+    add(&block->stats.total_ns[entry], ns);
+    add(&block->stats.latency[entry][bucket], 1);
+}
+
+void pmu_events_stats_enable(unsigned flags)
+{
+    __atomic_store_n(&pmu_events_stats_flags, flags, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sums the blocks of all threads into "stats", from the start of the process
+ */
+static void sum_blocks(struct pmu_events_stats* stats)
+{
+    /* The statistics are nothing but uint64_t */
+    uint64_t* sums = (uint64_t*)stats;
+    size_t num_stats = sizeof(struct pmu_events_stats) / sizeof(uint64_t);
+
+    memset(stats, 0, sizeof(struct pmu_events_stats));
+    for (struct stats_block* block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block != NULL;
+         block = block->next)
+    {
+        uint64_t* values = (uint64_t*)&block->stats;
+        for (size_t i = 0; i < num_stats; i++)
+        {
+            sums[i] += __atomic_load_n(&values[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void pmu_events_stats_read(struct pmu_events_stats* stats)
+{
+    uint64_t* sums = (uint64_t*)stats;
+    size_t num_stats = sizeof(struct pmu_events_stats) / sizeof(uint64_t);
+
+    sum_blocks(stats);
+    pthread_mutex_lock(&baseline_lock);
+    const uint64_t* base = (const uint64_t*)&baseline;
+    for (size_t i = 0; i < num_stats; i++)
+    {
+        sums[i] -= base[i];
+    }
+    pthread_mutex_unlock(&baseline_lock);
+}
+
+void pmu_events_stats_reset(void)
+{
+    struct pmu_events_stats sums;
+    sum_blocks(&sums);
+    pthread_mutex_lock(&baseline_lock);
+    baseline = sums;
+    pthread_mutex_unlock(&baseline_lock);
+}
+
+const char* pmu_events_counter_name(enum pmu_events_counter counter)
+{
+    if ((unsigned)counter >= PMU_EVENTS_NUM_COUNTERS)
+    {
+        return NULL;
+    }
+    return counter_names[counter];
+}
+
+const char* pmu_events_entry_name(enum pmu_events_entry entry)
+{
+    if ((unsigned)entry >= PMU_EVENTS_NUM_ENTRIES)
+    {
+        return NULL;
+    }
+    return entry_names[entry];
+}
+
+/*
+ * Returns the upper bound in ns of the latency "fraction" of the calls stay below
+ */
+static uint64_t percentile(const uint64_t* latency, uint64_t calls, double fraction)
+{
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < PMU_EVENTS_STATS_BUCKETS; bucket++)
+    {
+        seen += latency[bucket];
+        if (seen >= fraction * calls)
+        {
+            return 2ULL << bucket;
+        }
+    }
+    return 2ULL << (PMU_EVENTS_STATS_BUCKETS - 1);
+}
+
+int pmu_events_stats_dump(FILE* file)
+{
+    struct pmu_events_stats stats;
+    pmu_events_stats_read(&stats);
+
+    for (size_t counter = 0; counter < PMU_EVENTS_NUM_COUNTERS; counter++)
+    {
+        if (fprintf(file, "%s: %" PRIu64 "\n", counter_names[counter], stats.counters[counter]) <
+            0)
+        {
+            return -1;
+        }
+    }
+    for (size_t entry = 0; entry < PMU_EVENTS_NUM_ENTRIES; entry++)
+    {
+        uint64_t calls = stats.calls[entry];
+        if (calls == 0)
+        {
+            continue;
+        }
+        if (fprintf(file,
+                    "%s: %" PRIu64 " calls, %" PRIu64 " ns, p50 < %" PRIu64 " ns, p99 < %" PRIu64
+                    " ns\n",
+                    entry_names[entry], calls, stats.total_ns[entry],
+                    percentile(stats.latency[entry], calls, 0.5),
+                    percentile(stats.latency[entry], calls, 0.99)) < 0)
+        {
+            return -1;
+        }
+    }
+    return fflush(file) == 0 ? 0 : -1;
+}
@@ -0,0 +1,640 @@
+#define _GNU_SOURCE
+
+#include <pmu-events/metric.h>
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/session.h>
+#include <pmu-events/tma.h>
+#include <pmu-events/topology.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <math.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const char* const node_names[PMU_TMA_NUM_NODES] = {
+    [PMU_TMA_RETIRING] = "tma_retiring",
+    [PMU_TMA_BAD_SPECULATION] = "tma_bad_speculation",
+    [PMU_TMA_FRONTEND_BOUND] = "tma_frontend_bound",
+    [PMU_TMA_BACKEND_BOUND] = "tma_backend_bound",
+    [PMU_TMA_HEAVY_OPERATIONS] = "tma_heavy_operations",
+    [PMU_TMA_LIGHT_OPERATIONS] = "tma_light_operations",
+    [PMU_TMA_BRANCH_MISPREDICTS] = "tma_branch_mispredicts",
+    [PMU_TMA_MACHINE_CLEARS] = "tma_machine_clears",
+    [PMU_TMA_FETCH_LATENCY] = "tma_fetch_latency",
+    [PMU_TMA_FETCH_BANDWIDTH] = "tma_fetch_bandwidth",
+    [PMU_TMA_MEMORY_BOUND] = "tma_memory_bound",
+    [PMU_TMA_CORE_BOUND] = "tma_core_bound",
+};
+
+/*
+ * The topdown events, in the order of their fractions in PERF_METRICS.
+ * The first four are level 1, the others level 2.
+ */
+static const char* const topdown_events[] = {
+    "topdown-retiring",  "topdown-bad-spec",      "topdown-fe-bound",  "topdown-be-bound",
+    "topdown-heavy-ops", "topdown-br-mispredict", "topdown-fetch-lat", "topdown-mem-bound",
+};
+
+#define NUM_TOPDOWN_L1 4
+#define NUM_TOPDOWN (sizeof(topdown_events) / sizeof(topdown_events[0]))
+
+/* The rdpmc index of PERF_METRICS, INTEL_PMC_FIXED_RDPMC_METRICS in the kernel */
+#define RDPMC_PERF_METRICS (1U << 29)
+
+/*
+ * With rdpmc, the counters are reset by a read() once the slots since the last reset
+ * exceed this many times the slots of the interval, as the 8 bit fractions of
+ * PERF_METRICS lose the precision for the interval otherwise
+ */
+#define RDPMC_RESET_FACTOR 16
+
+struct pmu_tma
+{
+    unsigned flags;
+    struct perf_cpu* cpus;
+    size_t num_cpus;
+    struct pmu_session* session;
+    /* [num_cpus][session events] */
+    struct pmu_count* counts;
+    /* The totals of the last read, [num_cpus][session events] */
+    double* last;
+
+    /* The plan of the metrics, NULL with PMU_TMA_PERF_METRICS */
+    struct metric_plan* plan;
+    struct metric_evaluator* eval;
+    /* The session event counting every plan event, -1 if it is not counted */
+    int* plan_events;
+    /* [plan events][num_cpus] */
+    double* deltas;
+    /* The plan metric of every node, -1 if it is not collected */
+    int node_metrics[PMU_TMA_NUM_NODES];
+
+    /* With PMU_TMA_PERF_METRICS: the number of topdown events after the slots event */
+    size_t num_topdown;
+    /* With PMU_TMA_RDPMC: the mmap page of the slots event per CPU, NULL if not mapped */
+    struct perf_event_mmap_page** pages;
+    /* The slots and PERF_METRICS rdpmc returned last per CPU, 0 after a read() */
+    uint64_t* rdpmc_slots;
+    uint64_t* rdpmc_metrics;
+};
+
+const char* pmu_tma_node_name(enum pmu_tma_node node)
+{
+    if ((unsigned)node >= PMU_TMA_NUM_NODES)
+    {
+        return NULL;
+    }
+    return node_names[node];
+}
+
+static double positive(double value)
+{
+    return value > 0 ? value : 0;
+}
+
+/*
+ * Computes the nodes from the slots attributed to every topdown event, in the order of
+ * topdown_events. The level 1 nodes are normalized to their sum, like the metric tables do.
+ */
+static void nodes_from_topdown(const double* topdown, bool level2, double* values)
+{
+    double sum = 0;
+    for (size_t i = 0; i < NUM_TOPDOWN_L1; i++)
+    {
+        sum += topdown[i];
+    }
+    for (size_t node = 0; node < PMU_TMA_NUM_NODES; node++)
+    {
+        values[node] = NAN;
+    }
+    if (sum <= 0)
+    {
+        return;
+    }
+
+    values[PMU_TMA_RETIRING] = topdown[0] / sum;
+    values[PMU_TMA_BAD_SPECULATION] = topdown[1] / sum;
+    values[PMU_TMA_FRONTEND_BOUND] = topdown[2] / sum;
+    values[PMU_TMA_BACKEND_BOUND] = topdown[3] / sum;
+    if (!level2)
+    {
+        return;
+    }
+
+    /* Every level 1 node is split into the one in PERF_METRICS and the rest */
+    static const struct
+    {
+        enum pmu_tma_node parent, measured, rest;
+    } splits[] = {
+        { PMU_TMA_RETIRING, PMU_TMA_HEAVY_OPERATIONS, PMU_TMA_LIGHT_OPERATIONS },
+        { PMU_TMA_BAD_SPECULATION, PMU_TMA_BRANCH_MISPREDICTS, PMU_TMA_MACHINE_CLEARS },
+        { PMU_TMA_FRONTEND_BOUND, PMU_TMA_FETCH_LATENCY, PMU_TMA_FETCH_BANDWIDTH },
+        { PMU_TMA_BACKEND_BOUND, PMU_TMA_MEMORY_BOUND, PMU_TMA_CORE_BOUND },
+    };
+    for (size_t i = 0; i < NUM_TOPDOWN - NUM_TOPDOWN_L1; i++)
+    {
+        double measured = topdown[NUM_TOPDOWN_L1 + i] / sum;
+        values[splits[i].measured] = measured;
+        values[splits[i].rest] = positive(values[splits[i].parent] - measured);
+    }
+}
+
+/*
+ * Returns the fraction of the slots of the topdown event "i" in a raw PERF_METRICS value
+ */
+static double perf_metrics_fraction(uint64_t perf_metrics, size_t i)
+{
+    return ((perf_metrics >> (8 * i)) & 0xff) / 255.0;
+}
+
+void pmu_tma_from_perf_metrics(uint64_t perf_metrics, bool level2, double* values)
+{
+    double topdown[NUM_TOPDOWN];
+    for (size_t i = 0; i < NUM_TOPDOWN; i++)
+    {
+        topdown[i] = perf_metrics_fraction(perf_metrics, i);
+    }
+    nodes_from_topdown(topdown, level2, values);
+}
+
+/*
+ * Returns true if the metric "name" is the metric of "node". Besides the names of the
+ * Intel tables, this accepts the ones without "tma_" used by the arm64 tables.
+ */
+static bool is_node_metric(const char* name, enum pmu_tma_node node)
+{
+    return strcasecmp(name, node_names[node]) == 0 ||
+           strcasecmp(name, node_names[node] + strlen("tma_")) == 0;
+}
+
+/*
+ * Returns true if "pmu" resolves to the core PMU "core" on "cpu"
+ */
+static bool on_core_pmu(const struct pmu_topology* topo, const char* pmu,
+                        const struct topology_pmu* core, struct perf_cpu cpu)
+{
+    struct pmu_event pe = { .pmu = pmu };
+    return topology_pmu_for_event(topo, &pe, cpu) == core;
+}
+
+/*
+ * Adds the groups of the plan that are on the core PMU, and finds the metrics of the nodes
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int add_plan_groups(struct pmu_tma* tma, const struct pmu_events_map* map,
+                           const struct pmu_topology* topo, const struct topology_pmu* core)
+{
+    const struct metric_plan* plan = tma->plan;
+    struct perf_cpu cpu = tma->cpus[0];
+    int ret = -1;
+
+    struct pmu_session_event* events =
+        malloc((plan->num_events + 1) * sizeof(struct pmu_session_event));
+    tma->plan_events = malloc((plan->num_events + 1) * sizeof(int));
+    if (events == NULL || tma->plan_events == NULL)
+    {
+        goto out;
+    }
+    for (size_t e = 0; e < plan->num_events; e++)
+    {
+        tma->plan_events[e] = -1;
+    }
+
+    int num_events = 0;
+    for (size_t g = 0; g < plan->num_groups; g++)
+    {
+        const struct metric_plan_group* group = &plan->groups[g];
+        bool usable = true;
+        for (size_t i = 0; i < group->num_events && usable; i++)
+        {
+            const struct metric_plan_event* ev = &plan->events[group->events[i]];
+            memset(&events[i], 0, sizeof(events[i]));
+            events[i].name = ev->name;
+            usable = on_core_pmu(topo, ev->pmu, core, cpu) &&
+                     gen_attr_for_plan_event(map, ev, cpu, &events[i].attr) == 0;
+        }
+        /* Events of other PMUs, or that cannot be counted here, stay NaN */
+        if (!usable)
+        {
+            continue;
+        }
+        if (pmu_session_add_group(tma->session, events, group->num_events) == -1)
+        {
+            goto out;
+        }
+        for (size_t i = 0; i < group->num_events; i++, num_events++)
+        {
+            if (tma->plan_events[group->events[i]] == -1)
+            {
+                tma->plan_events[group->events[i]] = num_events;
+            }
+        }
+    }
+
+    for (size_t node = 0; node < PMU_TMA_NUM_NODES; node++)
+    {
+        tma->node_metrics[node] = -1;
+        for (size_t m = 0; m < plan->num_metrics; m++)
+        {
+            const struct pmu_metric* pm = &plan->metrics[m].metric;
+            if (is_node_metric(pm->metric_name, node) && on_core_pmu(topo, pm->pmu, core, cpu))
+            {
+                tma->node_metrics[node] = m;
+                break;
+            }
+        }
+    }
+    ret = 0;
+
+out:
+    free(events);
+    return ret;
+}
+
+/*
+ * Adds the slots-led group of topdown events of the core PMU, as listed in its events/
+ * directory in sysfs
+ *
+ * Returns 0 on success, -1 if the PMU has no topdown events or on failure
+ */
+static int add_topdown_group(struct pmu_tma* tma, const struct pmu_events_map* map,
+                             const struct topology_pmu* core)
+{
+    struct pmu_session_event events[1 + NUM_TOPDOWN];
+    size_t max = tma->flags & PMU_TMA_LEVEL2 ? NUM_TOPDOWN : NUM_TOPDOWN_L1;
+    memset(events, 0, sizeof(events));
+
+    struct metric_plan_event ev = { .pmu = core->name, .name = "slots", .id = PMU_EVENT_ID_NONE };
+    events[0].name = ev.name;
+    if (gen_attr_for_plan_event(map, &ev, tma->cpus[0], &events[0].attr) == -1)
+    {
+        return -1;
+    }
+    for (tma->num_topdown = 0; tma->num_topdown < max; tma->num_topdown++)
+    {
+        ev.name = (char*)topdown_events[tma->num_topdown];
+        events[1 + tma->num_topdown].name = ev.name;
+        if (gen_attr_for_plan_event(map, &ev, tma->cpus[0],
+                                    &events[1 + tma->num_topdown].attr) == -1)
+        {
+            /* Only Sapphire Rapids and later have the level 2 events */
+            break;
+        }
+    }
+    if (tma->num_topdown < NUM_TOPDOWN_L1)
+    {
+        return -1;
+    }
+    return pmu_session_add_group(tma->session, events, 1 + tma->num_topdown) == -1 ? -1 : 0;
+}
+
+/*
+ * Maps the first page of the slots event on every CPU, so that it can be read with rdpmc
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int map_rdpmc_pages(struct pmu_tma* tma)
+{
+    tma->pages = calloc(tma->num_cpus, sizeof(struct perf_event_mmap_page*));
+    tma->rdpmc_slots = calloc(tma->num_cpus, sizeof(uint64_t));
+    tma->rdpmc_metrics = calloc(tma->num_cpus, sizeof(uint64_t));
+    if (tma->pages == NULL || tma->rdpmc_slots == NULL || tma->rdpmc_metrics == NULL)
+    {
+        return -1;
+    }
+
+    size_t num_events = pmu_session_num_events(tma->session);
+    for (size_t c = 0; c < tma->num_cpus; c++)
+    {
+        void* page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                          tma->session->fds[c * num_events], 0);
+        /* Without the page, the CPU is read with read() */
+        tma->pages[c] = page == MAP_FAILED ? NULL : page;
+    }
+    return 0;
+}
+
+struct pmu_tma* pmu_tma_new(const struct pmu_events_map* map, const struct perf_cpu* cpus,
+                            size_t num_cpus, unsigned flags)
+{
+    const struct pmu_topology* topo = pmu_topology_get();
+    if (map == NULL || num_cpus == 0 || topo == NULL)
+    {
+        return NULL;
+    }
+
+    /* The attrs are generated once for all CPUs, so they have to be of the same type */
+    const struct topology_pmu* core = topology_core_pmu_for_cpu(topo, cpus[0]);
+    for (size_t c = 1; c < num_cpus && core != NULL; c++)
+    {
+        if (topology_core_pmu_for_cpu(topo, cpus[c]) != core)
+        {
+            core = NULL;
+        }
+    }
+    if (core == NULL)
+    {
+        return NULL;
+    }
+
+    struct pmu_tma* tma = calloc(1, sizeof(struct pmu_tma));
+    if (tma == NULL)
+    {
+        return NULL;
+    }
+    tma->flags = flags;
+    tma->num_cpus = num_cpus;
+    tma->cpus = malloc(num_cpus * sizeof(struct perf_cpu));
+    tma->session = pmu_session_new(cpus, num_cpus);
+    if (tma->cpus == NULL || tma->session == NULL)
+    {
+        goto err;
+    }
+    memcpy(tma->cpus, cpus, num_cpus * sizeof(struct perf_cpu));
+
+    if (flags & PMU_TMA_PERF_METRICS)
+    {
+        if (add_topdown_group(tma, map, core) == -1)
+        {
+            goto err;
+        }
+    }
+    else
+    {
+        static const char* const names[] = { "TopdownL1", "TopdownL2" };
+        tma->plan = metric_plan_new(map, names, flags & PMU_TMA_LEVEL2 ? 2 : 1, 0);
+        if (tma->plan == NULL || add_plan_groups(tma, map, topo, core) == -1)
+        {
+            goto err;
+        }
+        tma->eval = metric_evaluator_new(tma->plan, map, num_cpus);
+        tma->deltas = malloc((tma->plan->num_events * num_cpus + 1) * sizeof(double));
+        if (tma->eval == NULL || tma->deltas == NULL)
+        {
+            goto err;
+        }
+    }
+
+    size_t num_events = pmu_session_num_events(tma->session);
+    tma->counts = calloc(num_cpus * num_events + 1, sizeof(struct pmu_count));
+    tma->last = calloc(num_cpus * num_events + 1, sizeof(double));
+    if (tma->counts == NULL || tma->last == NULL || pmu_session_open(tma->session) == -1)
+    {
+        goto err;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if ((flags & PMU_TMA_PERF_METRICS) && (flags & PMU_TMA_RDPMC) && map_rdpmc_pages(tma) == -1)
+    {
+        goto err;
+    }
+#endif
+    return tma;
+
+err:
+    pmu_tma_free(tma);
+    return NULL;
+}
+
+void pmu_tma_free(struct pmu_tma* tma)
+{
+    if (tma == NULL)
+    {
+        return;
+    }
+    for (size_t c = 0; tma->pages != NULL && c < tma->num_cpus; c++)
+    {
+        if (tma->pages[c] != NULL)
+        {
+            munmap(tma->pages[c], sysconf(_SC_PAGESIZE));
+        }
+    }
+    free(tma->pages);
+    free(tma->rdpmc_slots);
+    free(tma->rdpmc_metrics);
+    free(tma->deltas);
+    free(tma->plan_events);
+    metric_evaluator_free(tma->eval);
+    metric_plan_free(tma->plan);
+    free(tma->last);
+    free(tma->counts);
+    pmu_session_free(tma->session);
+    free(tma->cpus);
+    free(tma);
+}
+
+int pmu_tma_enable(struct pmu_tma* tma)
+{
+    if (pmu_session_read(tma->session, tma->counts) == -1)
+    {
+        return -1;
+    }
+    /* Deltas are taken from the totals when the counters were enabled */
+    size_t num_events = pmu_session_num_events(tma->session);
+    for (size_t i = 0; i < tma->num_cpus * num_events; i++)
+    {
+        tma->last[i] = tma->plan != NULL ? tma->counts[i].scaled : tma->counts[i].raw;
+    }
+    if (tma->rdpmc_slots != NULL)
+    {
+        memset(tma->rdpmc_slots, 0, tma->num_cpus * sizeof(uint64_t));
+        memset(tma->rdpmc_metrics, 0, tma->num_cpus * sizeof(uint64_t));
+    }
+    return pmu_session_enable(tma->session);
+}
+
+int pmu_tma_disable(struct pmu_tma* tma)
+{
+    return pmu_session_disable(tma->session);
+}
+
+static int read_plan(struct pmu_tma* tma, double* values)
+{
+    const struct metric_plan* plan = tma->plan;
+    size_t num_events = pmu_session_num_events(tma->session);
+
+    if (pmu_session_read(tma->session, tma->counts) == -1)
+    {
+        return -1;
+    }
+    for (size_t c = 0; c < tma->num_cpus; c++)
+    {
+        for (size_t e = 0; e < num_events; e++)
+        {
+            size_t i = c * num_events + e;
+            double scaled = tma->counts[i].scaled;
+            tma->counts[i].scaled = scaled - tma->last[i];
+            tma->last[i] = scaled;
+        }
+    }
+    for (size_t e = 0; e < plan->num_events; e++)
+    {
+        int se = tma->plan_events[e];
+        for (size_t c = 0; c < tma->num_cpus; c++)
+        {
+            tma->deltas[e * tma->num_cpus + c] =
+                se == -1 ? NAN : tma->counts[c * num_events + se].scaled;
+        }
+    }
+    if (metric_evaluator_push(tma->eval, tma->deltas, NULL, NULL) == -1)
+    {
+        return -1;
+    }
+
+    for (size_t node = 0; node < PMU_TMA_NUM_NODES; node++)
+    {
+        const double* metric = tma->node_metrics[node] == -1
+                                   ? NULL
+                                   : metric_evaluator_values(tma->eval, tma->node_metrics[node]);
+        for (size_t c = 0; c < tma->num_cpus; c++)
+        {
+            values[c * PMU_TMA_NUM_NODES + node] = metric != NULL ? metric[c] : NAN;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads the topdown group of the c-th CPU with read(), which also makes the kernel reset
+ * slots and PERF_METRICS, and adds the slots of every topdown event since the last read to
+ * "topdown". The slots already reported from rdpmc since the last read() are left out.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int read_topdown(struct pmu_tma* tma, size_t c, double* topdown)
+{
+    struct pmu_session* session = tma->session;
+    size_t num_events = 1 + tma->num_topdown;
+
+    /* { nr, time_enabled, time_running, values[nr] } */
+    size_t len = (3 + num_events) * sizeof(uint64_t);
+    if (read(session->fds[c * num_events], session->read_buf, len) != len)
+    {
+        return -1;
+    }
+
+    double* last = &tma->last[c * num_events];
+    uint64_t slots = tma->rdpmc_slots != NULL ? tma->rdpmc_slots[c] : 0;
+    uint64_t metrics = tma->rdpmc_metrics != NULL ? tma->rdpmc_metrics[c] : 0;
+    for (size_t i = 0; i < tma->num_topdown; i++)
+    {
+        double total = session->read_buf[4 + i];
+        topdown[i] += positive(total - last[1 + i] - slots * perf_metrics_fraction(metrics, i));
+        last[1 + i] = total;
+    }
+    last[0] = session->read_buf[3];
+    if (tma->rdpmc_slots != NULL)
+    {
+        tma->rdpmc_slots[c] = 0;
+        tma->rdpmc_metrics[c] = 0;
+    }
+    return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t rdpmc(uint32_t counter)
+{
+    uint32_t low, high;
+    __asm__ volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return (uint64_t)high << 32 | low;
+}
+
+/*
+ * Reads the slots of the c-th CPU since the kernel last reset them, and PERF_METRICS,
+ * with rdpmc. This only works on the CPU itself.
+ *
+ * Returns true on success, false if the counters have to be read with read()
+ */
+static bool rdpmc_topdown(const struct pmu_tma* tma, size_t c, uint64_t* slots,
+                          uint64_t* metrics)
+{
+    volatile struct perf_event_mmap_page* page = tma->pages[c];
+    if (page == NULL || sched_getcpu() != tma->cpus[c].cpu)
+    {
+        return false;
+    }
+
+    uint32_t seq;
+    do
+    {
+        seq = page->lock;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        if (!page->cap_user_rdpmc || page->index == 0)
+        {
+            return false;
+        }
+        uint64_t mask = page->pmc_width < 64 ? (1ULL << page->pmc_width) - 1 : ~0ULL;
+        *slots = rdpmc(page->index - 1) & mask;
+        *metrics = rdpmc(RDPMC_PERF_METRICS);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    } while (page->lock != seq);
+
+    /* Migrated while reading */
+    return sched_getcpu() == tma->cpus[c].cpu;
+}
+#endif
+
+/*
+ * Adds the slots of every topdown event on the c-th CPU since the last read to "topdown"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int read_topdown_cpu(struct pmu_tma* tma, size_t c, double* topdown)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t slots, metrics;
+    if (tma->pages != NULL && rdpmc_topdown(tma, c, &slots, &metrics))
+    {
+        uint64_t last_slots = tma->rdpmc_slots[c];
+        uint64_t last_metrics = tma->rdpmc_metrics[c];
+        if (slots < last_slots)
+        {
+            /* The kernel reset the counters, only the slots since then are known */
+            last_slots = 0;
+        }
+        for (size_t i = 0; i < tma->num_topdown; i++)
+        {
+            topdown[i] += positive(slots * perf_metrics_fraction(metrics, i) -
+                                   last_slots * perf_metrics_fraction(last_metrics, i));
+        }
+        tma->rdpmc_slots[c] = slots;
+        tma->rdpmc_metrics[c] = metrics;
+
+        if (slots <= RDPMC_RESET_FACTOR * (slots - last_slots))
+        {
+            return 0;
+        }
+        /* Reset, and add the few slots since the rdpmc to this interval */
+    }
+#endif
+    return read_topdown(tma, c, topdown);
+}
+
+static int read_perf_metrics(struct pmu_tma* tma, double* values)
+{
+    for (size_t c = 0; c < tma->num_cpus; c++)
+    {
+        double topdown[NUM_TOPDOWN] = { 0 };
+        if (read_topdown_cpu(tma, c, topdown) == -1)
+        {
+            return -1;
+        }
+        nodes_from_topdown(topdown, tma->num_topdown > NUM_TOPDOWN_L1,
+                           &values[c * PMU_TMA_NUM_NODES]);
+    }
+    return 0;
+}
+
+int pmu_tma_read(struct pmu_tma* tma, double* values)
+{
+    if (tma->plan != NULL)
+    {
+        return read_plan(tma, values);
+    }
+    return read_perf_metrics(tma, values);
+}
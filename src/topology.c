@@ -0,0 +1,1560 @@
+#include <pmu-events/cpuset.h>
+#include <pmu-events/hotplug.h>
+#include <pmu-events/pmu-events.h>
+#include <pmu-events/topology.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TOPOLOGY_MAGIC "pmu-events-topology"
+#define TOPOLOGY_VERSION 1
+
+static struct pmu_topology* default_topology = NULL;
+/*
+ * Snapshots replaced by pmu_topology_set() or a refresh. Readers may still hold them,
+ * so they are only freed when the library is unloaded.
+ */
+static struct pmu_topology* retired_topologies = NULL;
+/* Serializes reading the aliases of the PMUs of shared snapshots, see ensure_aliases() */
+static pthread_mutex_t aliases_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cmp_pmu_name(const void* a, const void* b)
+{
+    const struct topology_pmu *pmu_a = a, *pmu_b = b;
+    return strcmp(pmu_a->name, pmu_b->name);
+}
+
+static int cmp_format_name(const void* a, const void* b)
+{
+    const struct pmu_format_def *fmt_a = a, *fmt_b = b;
+    return strcmp(fmt_a->name, fmt_b->name);
+}
+
+static int cmp_alias_name(const void* a, const void* b)
+{
+    const struct pmu_alias_def *alias_a = a, *alias_b = b;
+    return strcmp(alias_a->name, alias_b->name);
+}
+
+/*
+ * Returns the highest CPU number in a range list string like "0-3,8" plus one,
+ * or 0 if the string can not be parsed.
+ */
+static size_t cpu_list_end(const char* str)
+{
+    struct pmu_cpuset set = PMU_CPUSET_INIT;
+    if (str == NULL || pmu_cpuset_parse(&set, str) == -1)
+    {
+        return 0;
+    }
+    size_t end = pmu_cpuset_last(&set) + 1;
+    pmu_cpuset_release(&set);
+    return end;
+}
+
+/*
+ * Parses the CPU list "str" into "set", a NULL "str" means all CPUs.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int cpuset_from_str(const struct pmu_topology* topo, struct pmu_cpuset* set,
+                           const char* str)
+{
+    if (str != NULL)
+    {
+        return pmu_cpuset_parse(set, str);
+    }
+    pmu_cpuset_clear(set);
+    return topo->num_cpus ? pmu_cpuset_add_range(set, 0, topo->num_cpus - 1) : 0;
+}
+
+/*
+ * (Re)computes pmu->cpuset from pmu->cpus.
+ *
+ * The "cpu" PMU does not have a cpus file, it is responsible for every CPU.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int fill_cpuset(const struct pmu_topology* topo, struct topology_pmu* pmu)
+{
+    if (pmu->cpus == NULL && !pmu->is_core)
+    {
+        pmu_cpuset_clear(&pmu->cpuset);
+        return 0;
+    }
+    return cpuset_from_str(topo, &pmu->cpuset, pmu->cpus);
+}
+
+/*
+ * Fills the dense CPU -> core PMU array from the cpusets of all core PMUs.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int fill_core_pmu(struct pmu_topology* topo)
+{
+    free(topo->core_pmu);
+    topo->core_pmu = malloc((topo->num_cpus ? topo->num_cpus : 1) * sizeof(int));
+    if (topo->core_pmu == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t cpu = 0; cpu < topo->num_cpus; cpu++)
+    {
+        topo->core_pmu[cpu] = -1;
+    }
+
+    for (size_t i = 0; i < topo->num_pmus; i++)
+    {
+        struct topology_pmu* pmu = &topo->pmus[i];
+
+        if (fill_cpuset(topo, pmu) == -1)
+        {
+            return -1;
+        }
+        if (!pmu->is_core)
+        {
+            continue;
+        }
+        long cpu;
+        pmu_cpuset_for_each(cpu, &pmu->cpuset)
+        {
+            if ((size_t)cpu >= topo->num_cpus)
+            {
+                break;
+            }
+            if (topo->core_pmu[cpu] == -1)
+            {
+                topo->core_pmu[cpu] = i;
+            }
+        }
+    }
+    return 0;
+}
+
+static void free_aliases(struct topology_pmu* pmu)
+{
+    for (size_t i = 0; i < pmu->num_aliases; i++)
+    {
+        free(pmu->aliases[i].name);
+        free(pmu->aliases[i].event);
+        free(pmu->aliases[i].unit);
+        free(pmu->aliases[i].scale_unit);
+    }
+    free(pmu->aliases);
+    pmu->aliases = NULL;
+    pmu->num_aliases = 0;
+}
+
+static void free_pmu(struct topology_pmu* pmu)
+{
+    for (size_t i = 0; i < pmu->num_formats; i++)
+    {
+        free(pmu->formats[i].name);
+        free(pmu->formats[i].def);
+        free_config_def(&pmu->formats[i].config);
+    }
+    free(pmu->formats);
+    free_aliases(pmu);
+    free(pmu->name);
+    free(pmu->cpus);
+    pmu_cpuset_release(&pmu->cpuset);
+}
+
+/*
+ * Adds the format "name" with the definition "def" to the PMU.
+ *
+ * Formats we can not parse are silently skipped.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int add_format(struct topology_pmu* pmu, const char* name, const char* def)
+{
+    struct config_def config;
+    if (parse_config_def(def, &config) == -1)
+    {
+        return 0;
+    }
+
+    struct pmu_format_def* formats =
+        realloc(pmu->formats, (pmu->num_formats + 1) * sizeof(struct pmu_format_def));
+    if (formats == NULL)
+    {
+        free_config_def(&config);
+        return -1;
+    }
+    pmu->formats = formats;
+
+    struct pmu_format_def* fmt = &pmu->formats[pmu->num_formats];
+    fmt->name = strdup(name);
+    fmt->def = strdup(def);
+    fmt->config = config;
+    pmu->num_formats++;
+    if (fmt->name == NULL || fmt->def == NULL)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads all the files in [pmu_path]/format into pmu->formats
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int read_formats(struct topology_pmu* pmu, const char* pmu_path)
+{
+    char* format_path = concat_path(pmu_path, "format");
+    if (format_path == NULL)
+    {
+        return -1;
+    }
+
+    DIR* format_dir = opendir(format_path);
+    if (format_dir == NULL)
+    {
+        /* Software PMUs and the like have no format directory */
+        free(format_path);
+        return 0;
+    }
+
+    struct dirent* ent;
+    while ((ent = readdir(format_dir)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+        {
+            continue;
+        }
+        char* path = concat_path(format_path, ent->d_name);
+        if (path == NULL)
+        {
+            closedir(format_dir);
+            free(format_path);
+            return -1;
+        }
+        char* content = get_file_content(path);
+        free(path);
+        if (content == NULL)
+        {
+            continue;
+        }
+        if (add_format(pmu, ent->d_name, content) == -1)
+        {
+            free(content);
+            closedir(format_dir);
+            free(format_path);
+            return -1;
+        }
+        free(content);
+    }
+    closedir(format_dir);
+    free(format_path);
+
+    qsort(pmu->formats, pmu->num_formats, sizeof(struct pmu_format_def), cmp_format_name);
+    return 0;
+}
+
+/*
+ * (Re)reads the "cpus" or "cpumask" file of the PMU at "pmu_path" into pmu->cpus
+ * and determines whether it is a core PMU.
+ */
+static void read_pmu_cpus(struct topology_pmu* pmu, const char* pmu_path)
+{
+    free(pmu->cpus);
+
+    char* cpus_path = concat_path(pmu_path, "cpus");
+    pmu->cpus = cpus_path ? get_file_content(cpus_path) : NULL;
+    free(cpus_path);
+
+    /*
+     * The "cpu" PMU (mostly x86) is responsible for all cores, on all other
+     * systems the core PMUs are those which contain a "cpus" file.
+     */
+    pmu->is_core = pmu->cpus != NULL || strcmp(pmu->name, "cpu") == 0;
+
+    if (pmu->cpus == NULL)
+    {
+        char* cpumask_path = concat_path(pmu_path, "cpumask");
+        pmu->cpus = cpumask_path ? get_file_content(cpumask_path) : NULL;
+        free(cpumask_path);
+    }
+
+    if (pmu->cpus != NULL && *pmu->cpus == '\0')
+    {
+        free(pmu->cpus);
+        pmu->cpus = NULL;
+    }
+}
+
+/*
+ * Reads the PMU [devices_path]/[name] into "pmu".
+ *
+ * Returns 0 on success, 1 if the directory does not describe a usable PMU
+ * and -1 on failure.
+ */
+static int read_pmu(struct topology_pmu* pmu, const char* devices_path, const char* name)
+{
+    memset(pmu, 0, sizeof(*pmu));
+
+    char* pmu_path = concat_path(devices_path, name);
+    if (pmu_path == NULL)
+    {
+        return -1;
+    }
+
+    char* type_path = concat_path(pmu_path, "type");
+    char* type_str = type_path ? get_file_content(type_path) : NULL;
+    free(type_path);
+    if (type_str == NULL)
+    {
+        free(pmu_path);
+        return 1;
+    }
+
+    char* endptr;
+    pmu->type = strtoul(type_str, &endptr, 10);
+    if (*endptr != '\0' || endptr == type_str)
+    {
+        free(type_str);
+        free(pmu_path);
+        return 1;
+    }
+    free(type_str);
+
+    pmu->name = strdup(name);
+    if (pmu->name == NULL)
+    {
+        free(pmu_path);
+        return -1;
+    }
+
+    read_pmu_cpus(pmu, pmu_path);
+
+    int ret = read_formats(pmu, pmu_path);
+    free(pmu_path);
+    return ret;
+}
+
+/*
+ * Reads [root]/devices/system/cpu/online into "online", falling back to all
+ * CPUs being online.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int read_online(const struct pmu_topology* topo, struct pmu_cpuset* online)
+{
+    char* online_path = concat_path(topo->root, "devices/system/cpu/online");
+    if (online_path == NULL)
+    {
+        return -1;
+    }
+    char* content = get_file_content(online_path);
+    free(online_path);
+
+    int ret = cpuset_from_str(topo, online, content);
+    free(content);
+    return ret;
+}
+
+/*
+ * FNV-1a over the PMU names and the online CPUs
+ */
+static uint64_t compute_generation(const struct pmu_topology* topo)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < topo->num_pmus; i++)
+    {
+        for (const char* c = topo->pmus[i].name; *c != '\0'; c++)
+        {
+            hash = (hash ^ (unsigned char)*c) * 0x100000001b3ULL;
+        }
+        hash = (hash ^ topo->pmus[i].type) * 0x100000001b3ULL;
+    }
+    /* Only the words with online CPUs, sets of the same CPUs may differ in their length */
+    for (size_t word = 0; word < topo->online.num_words; word++)
+    {
+        if (topo->online.words[word] != 0)
+        {
+            hash = (hash ^ word) * 0x100000001b3ULL;
+            hash = (hash ^ topo->online.words[word]) * 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+/*
+ * Determines the number of possible CPUs from [root]/devices/system/cpu/possible,
+ * falling back to the highest CPU mentioned by any PMU.
+ */
+static size_t read_num_cpus(const struct pmu_topology* topo)
+{
+    size_t num_cpus = 0;
+
+    char* possible_path = concat_path(topo->root, "devices/system/cpu/possible");
+    if (possible_path != NULL)
+    {
+        char* possible = get_file_content(possible_path);
+        num_cpus = cpu_list_end(possible);
+        free(possible);
+        free(possible_path);
+    }
+
+    for (size_t i = 0; i < topo->num_pmus; i++)
+    {
+        size_t end = cpu_list_end(topo->pmus[i].cpus);
+        if (end > num_cpus)
+        {
+            num_cpus = end;
+        }
+    }
+    return num_cpus;
+}
+
+struct pmu_topology* pmu_topology_new(const char* sysfs_root)
+{
+    struct pmu_topology* topo = calloc(1, sizeof(struct pmu_topology));
+    if (topo == NULL)
+    {
+        return NULL;
+    }
+
+    topo->root = strdup(sysfs_root ? sysfs_root : "/sys");
+    char* devices_path = topo->root ? concat_path(topo->root, "bus/event_source/devices") : NULL;
+    if (devices_path == NULL)
+    {
+        pmu_topology_free(topo);
+        return NULL;
+    }
+
+    DIR* devices = opendir(devices_path);
+    if (devices == NULL)
+    {
+        free(devices_path);
+        pmu_topology_free(topo);
+        return NULL;
+    }
+
+    struct dirent* ent;
+    while ((ent = readdir(devices)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        struct topology_pmu* pmus =
+            realloc(topo->pmus, (topo->num_pmus + 1) * sizeof(struct topology_pmu));
+        if (pmus == NULL)
+        {
+            goto err;
+        }
+        topo->pmus = pmus;
+
+        int ret = read_pmu(&topo->pmus[topo->num_pmus], devices_path, ent->d_name);
+        if (ret == -1)
+        {
+            free_pmu(&topo->pmus[topo->num_pmus]);
+            goto err;
+        }
+        if (ret == 1)
+        {
+            free_pmu(&topo->pmus[topo->num_pmus]);
+            continue;
+        }
+        topo->num_pmus++;
+    }
+    closedir(devices);
+    free(devices_path);
+
+    qsort(topo->pmus, topo->num_pmus, sizeof(struct topology_pmu), cmp_pmu_name);
+
+    topo->num_cpus = read_num_cpus(topo);
+    if (read_online(topo, &topo->online) == -1 || fill_core_pmu(topo) == -1)
+    {
+        pmu_topology_free(topo);
+        return NULL;
+    }
+    topo->generation = compute_generation(topo);
+    return topo;
+
+err:
+    closedir(devices);
+    free(devices_path);
+    pmu_topology_free(topo);
+    return NULL;
+}
+
+void pmu_topology_free(struct pmu_topology* topo)
+{
+    if (topo == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < topo->num_pmus; i++)
+    {
+        free_pmu(&topo->pmus[i]);
+    }
+    free(topo->pmus);
+    free(topo->core_pmu);
+    pmu_cpuset_release(&topo->online);
+    free(topo->root);
+    free(topo);
+}
+
+static int ensure_aliases(const struct pmu_topology* topo, const struct topology_pmu* pmu);
+
+/*
+ * The serialized form is line based:
+ *
+ *  pmu-events-topology 1
+ *  root /sys
+ *  num_cpus 80
+ *  online 0-79
+ *  pmu armv8_pmuv3_0 8 1 0-79
+ *  format event config:0-15
+ *  alias cpu_cycles event=0x11
+ *  ...
+ *  pmu power 17 0 0
+ *  alias energy-pkg event=0x02 2.3283064365386962890625e-10Joules
+ *
+ * "format" and "alias" lines belong to the preceding "pmu" line, an alias is followed by
+ * its ScaleUnit if it has a scale or unit. A PMU without a cpus/cpumask file has "-" in
+ * place of the CPU list. If the "online" line is missing, all CPUs are considered online.
+ *
+ * A loaded snapshot has the saved aliases, it does not read the events directories.
+ */
+int pmu_topology_save(const struct pmu_topology* topo, const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(file, "%s %d\n", TOPOLOGY_MAGIC, TOPOLOGY_VERSION);
+    fprintf(file, "root %s\n", topo->root);
+    fprintf(file, "num_cpus %zu\n", topo->num_cpus);
+
+    char* online = pmu_cpuset_format(&topo->online);
+    if (online == NULL)
+    {
+        fclose(file);
+        return -1;
+    }
+    if (*online != '\0')
+    {
+        fprintf(file, "online %s\n", online);
+    }
+    free(online);
+
+    for (size_t i = 0; i < topo->num_pmus; i++)
+    {
+        const struct topology_pmu* pmu = &topo->pmus[i];
+        fprintf(file, "pmu %s %u %d %s\n", pmu->name, pmu->type, pmu->is_core,
+                pmu->cpus ? pmu->cpus : "-");
+        for (size_t x = 0; x < pmu->num_formats; x++)
+        {
+            fprintf(file, "format %s %s\n", pmu->formats[x].name, pmu->formats[x].def);
+        }
+
+        if (ensure_aliases(topo, pmu) == -1)
+        {
+            fclose(file);
+            return -1;
+        }
+        for (size_t x = 0; x < pmu->num_aliases; x++)
+        {
+            const struct pmu_alias_def* alias = &pmu->aliases[x];
+            fprintf(file, "alias %s %s%s%s\n", alias->name, alias->event,
+                    alias->scale_unit ? " " : "", alias->scale_unit ? alias->scale_unit : "");
+        }
+    }
+
+    if (fclose(file) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Appends the saved alias "name" of "event" to "pmu", with the ScaleUnit "scale_unit"
+ * (e.g. "1e-3Joules", NULL if there is none) split into scale and unit
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int add_alias(struct topology_pmu* pmu, const char* name, const char* event,
+                     const char* scale_unit)
+{
+    struct pmu_alias_def* aliases =
+        realloc(pmu->aliases, (pmu->num_aliases + 1) * sizeof(struct pmu_alias_def));
+    if (aliases == NULL)
+    {
+        return -1;
+    }
+    pmu->aliases = aliases;
+
+    struct pmu_alias_def* alias = &pmu->aliases[pmu->num_aliases];
+    memset(alias, 0, sizeof(*alias));
+    alias->name = strdup(name);
+    alias->event = strdup(event);
+    alias->scale = 1.0;
+    bool failed = alias->name == NULL || alias->event == NULL;
+    if (scale_unit != NULL)
+    {
+        char* unit;
+        alias->scale = strtod(scale_unit, &unit);
+        alias->scale_unit = strdup(scale_unit);
+        alias->unit = *unit != '\0' ? strdup(unit) : NULL;
+        failed |= alias->scale_unit == NULL || (*unit != '\0' && alias->unit == NULL);
+    }
+    if (failed)
+    {
+        free(alias->name);
+        free(alias->event);
+        free(alias->unit);
+        free(alias->scale_unit);
+        return -1;
+    }
+    pmu->num_aliases++;
+    return 0;
+}
+
+/*
+ * Parses a single line of the serialized topology into "topo"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int load_line(struct pmu_topology* topo, char* line)
+{
+    char* saveptr;
+    char* key = strtok_r(line, " ", &saveptr);
+
+    if (key == NULL)
+    {
+        return 0;
+    }
+
+    if (strcmp(key, "root") == 0)
+    {
+        char* root = strtok_r(NULL, "", &saveptr);
+        if (root == NULL)
+        {
+            return -1;
+        }
+        free(topo->root);
+        topo->root = strdup(root);
+        return topo->root ? 0 : -1;
+    }
+    else if (strcmp(key, "num_cpus") == 0)
+    {
+        char* num_cpus = strtok_r(NULL, " ", &saveptr);
+        if (num_cpus == NULL)
+        {
+            return -1;
+        }
+        topo->num_cpus = strtoul(num_cpus, NULL, 10);
+        return 0;
+    }
+    else if (strcmp(key, "online") == 0)
+    {
+        char* online = strtok_r(NULL, " ", &saveptr);
+        if (online == NULL)
+        {
+            return -1;
+        }
+        return pmu_cpuset_parse(&topo->online, online);
+    }
+    else if (strcmp(key, "pmu") == 0)
+    {
+        char* name = strtok_r(NULL, " ", &saveptr);
+        char* type = strtok_r(NULL, " ", &saveptr);
+        char* is_core = strtok_r(NULL, " ", &saveptr);
+        char* cpus = strtok_r(NULL, " ", &saveptr);
+        if (name == NULL || type == NULL || is_core == NULL || cpus == NULL)
+        {
+            return -1;
+        }
+
+        struct topology_pmu* pmus =
+            realloc(topo->pmus, (topo->num_pmus + 1) * sizeof(struct topology_pmu));
+        if (pmus == NULL)
+        {
+            return -1;
+        }
+        topo->pmus = pmus;
+
+        struct topology_pmu* pmu = &topo->pmus[topo->num_pmus++];
+        memset(pmu, 0, sizeof(*pmu));
+        pmu->name = strdup(name);
+        pmu->type = strtoul(type, NULL, 10);
+        pmu->is_core = strcmp(is_core, "1") == 0;
+        if (strcmp(cpus, "-") != 0)
+        {
+            pmu->cpus = strdup(cpus);
+        }
+        return pmu->name ? 0 : -1;
+    }
+    else if (strcmp(key, "format") == 0)
+    {
+        char* name = strtok_r(NULL, " ", &saveptr);
+        char* def = strtok_r(NULL, " ", &saveptr);
+        if (name == NULL || def == NULL || topo->num_pmus == 0)
+        {
+            return -1;
+        }
+        return add_format(&topo->pmus[topo->num_pmus - 1], name, def);
+    }
+    else if (strcmp(key, "alias") == 0)
+    {
+        char* name = strtok_r(NULL, " ", &saveptr);
+        char* event = strtok_r(NULL, " ", &saveptr);
+        char* scale_unit = strtok_r(NULL, "", &saveptr);
+        if (name == NULL || event == NULL || topo->num_pmus == 0)
+        {
+            return -1;
+        }
+        return add_alias(&topo->pmus[topo->num_pmus - 1], name, event, scale_unit);
+    }
+    return -1;
+}
+
+struct pmu_topology* pmu_topology_load(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    struct pmu_topology* topo = calloc(1, sizeof(struct pmu_topology));
+    if (topo == NULL)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    char* line = NULL;
+    size_t line_len = 0;
+    ssize_t len;
+    bool first = true;
+    while ((len = getline(&line, &line_len, file)) != -1)
+    {
+        if (len > 0 && line[len - 1] == '\n')
+        {
+            line[len - 1] = '\0';
+        }
+
+        if (first)
+        {
+            char magic[sizeof(TOPOLOGY_MAGIC) + 16];
+            snprintf(magic, sizeof(magic), "%s %d", TOPOLOGY_MAGIC, TOPOLOGY_VERSION);
+            if (strcmp(line, magic) != 0)
+            {
+                goto err;
+            }
+            first = false;
+            continue;
+        }
+
+        if (load_line(topo, line) == -1)
+        {
+            goto err;
+        }
+    }
+    free(line);
+    fclose(file);
+
+    if (first || topo->root == NULL)
+    {
+        pmu_topology_free(topo);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < topo->num_pmus; i++)
+    {
+        /* PMUs without formats, like "software", have no format array at all */
+        if (topo->pmus[i].num_formats > 1)
+        {
+            qsort(topo->pmus[i].formats, topo->pmus[i].num_formats,
+                  sizeof(struct pmu_format_def), cmp_format_name);
+        }
+        if (topo->pmus[i].num_aliases > 1)
+        {
+            qsort(topo->pmus[i].aliases, topo->pmus[i].num_aliases,
+                  sizeof(struct pmu_alias_def), cmp_alias_name);
+        }
+        topo->pmus[i].aliases_read = true;
+    }
+    qsort(topo->pmus, topo->num_pmus, sizeof(struct topology_pmu), cmp_pmu_name);
+
+    /* Without an "online" line, all CPUs are online */
+    if ((topo->online.num_words == 0 && cpuset_from_str(topo, &topo->online, NULL) == -1) ||
+        fill_core_pmu(topo) == -1)
+    {
+        pmu_topology_free(topo);
+        return NULL;
+    }
+    topo->generation = compute_generation(topo);
+    return topo;
+
+err:
+    free(line);
+    fclose(file);
+    pmu_topology_free(topo);
+    return NULL;
+}
+
+const struct pmu_topology* pmu_topology_get(void)
+{
+    struct pmu_topology* topo = __atomic_load_n(&default_topology, __ATOMIC_ACQUIRE);
+    if (topo != NULL)
+    {
+        return topo;
+    }
+
+    const char* path = getenv("PMU_EVENTS_TOPOLOGY");
+    if (path != NULL)
+    {
+        topo = pmu_topology_load(path);
+    }
+    if (topo == NULL)
+    {
+        topo = pmu_topology_new(NULL);
+    }
+    if (topo == NULL)
+    {
+        return NULL;
+    }
+
+    /* Threads that get here at the same time all build a snapshot, only the first is kept */
+    struct pmu_topology* first = NULL;
+    if (!__atomic_compare_exchange_n(&default_topology, &first, topo, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE))
+    {
+        pmu_topology_free(topo);
+        return first;
+    }
+    return topo;
+}
+
+static void retire_topology(struct pmu_topology* topo)
+{
+    if (topo == NULL)
+    {
+        return;
+    }
+    topo->next_retired = __atomic_load_n(&retired_topologies, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&retired_topologies, &topo->next_retired, topo, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+__attribute__((destructor)) static void free_retired_topologies(void)
+{
+    struct pmu_topology* topo = __atomic_exchange_n(&retired_topologies, NULL, __ATOMIC_ACQUIRE);
+    while (topo != NULL)
+    {
+        struct pmu_topology* next = topo->next_retired;
+        pmu_topology_free(topo);
+        topo = next;
+    }
+}
+
+void pmu_topology_set(struct pmu_topology* topo)
+{
+    struct pmu_topology* old = __atomic_exchange_n(&default_topology, topo, __ATOMIC_ACQ_REL);
+    if (old != topo)
+    {
+        retire_topology(old);
+    }
+}
+
+bool topology_publish(const struct pmu_topology* old, struct pmu_topology* topo)
+{
+    struct pmu_topology* expected = (struct pmu_topology*)old;
+    if (!__atomic_compare_exchange_n(&default_topology, &expected, topo, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        pmu_topology_free(topo);
+        return false;
+    }
+    retire_topology(expected);
+    return true;
+}
+
+size_t pmu_topology_num_pmus(const struct pmu_topology* topo)
+{
+    return topo->num_pmus;
+}
+
+const char* pmu_topology_pmu_name(const struct pmu_topology* topo, size_t pmu)
+{
+    if (pmu >= topo->num_pmus)
+    {
+        return NULL;
+    }
+    return topo->pmus[pmu].name;
+}
+
+int pmu_topology_pmu_type(const struct pmu_topology* topo, size_t pmu)
+{
+    if (pmu >= topo->num_pmus)
+    {
+        return -1;
+    }
+    return topo->pmus[pmu].type;
+}
+
+const char* pmu_topology_pmu_cpus(const struct pmu_topology* topo, size_t pmu)
+{
+    if (pmu >= topo->num_pmus)
+    {
+        return NULL;
+    }
+    return topo->pmus[pmu].cpus;
+}
+
+const struct pmu_cpuset* pmu_topology_pmu_cpuset(const struct pmu_topology* topo, size_t pmu)
+{
+    if (pmu >= topo->num_pmus)
+    {
+        return NULL;
+    }
+    return &topo->pmus[pmu].cpuset;
+}
+
+const struct pmu_cpuset* pmu_topology_online(const struct pmu_topology* topo)
+{
+    return &topo->online;
+}
+
+const char* pmu_topology_pmu_format(const struct pmu_topology* topo, size_t pmu,
+                                    const char* format)
+{
+    if (pmu >= topo->num_pmus)
+    {
+        return NULL;
+    }
+    const struct pmu_format_def* fmt = topology_find_format(&topo->pmus[pmu], format);
+    return fmt ? fmt->def : NULL;
+}
+
+int pmu_topology_pmu_alias(const struct pmu_topology* topo, size_t pmu, const char* name,
+                           struct pmu_event_alias* alias)
+{
+    if (pmu >= topo->num_pmus)
+    {
+        return -1;
+    }
+    const struct pmu_alias_def* def = topology_find_alias(topo, &topo->pmus[pmu], name);
+    if (def == NULL)
+    {
+        return -1;
+    }
+    alias->name = def->name;
+    alias->event = def->event;
+    alias->scale = def->scale;
+    alias->unit = def->unit;
+    return 0;
+}
+
+int pmu_topology_find_pmu(const struct pmu_topology* topo, const char* name)
+{
+    struct topology_pmu key = { .name = (char*)name };
+    const struct topology_pmu* pmu =
+        bsearch(&key, topo->pmus, topo->num_pmus, sizeof(struct topology_pmu), cmp_pmu_name);
+
+    if (pmu == NULL)
+    {
+        return -1;
+    }
+    return pmu - topo->pmus;
+}
+
+int pmu_topology_core_pmu(const struct pmu_topology* topo, struct perf_cpu cpu)
+{
+    if (cpu.cpu < 0 || cpu.cpu >= topo->num_cpus)
+    {
+        return -1;
+    }
+    return topo->core_pmu[cpu.cpu];
+}
+
+const struct topology_pmu* topology_core_pmu_for_cpu(const struct pmu_topology* topo,
+                                                     struct perf_cpu cpu)
+{
+    int pmu = pmu_topology_core_pmu(topo, cpu);
+    if (pmu == -1)
+    {
+        return NULL;
+    }
+    return &topo->pmus[pmu];
+}
+
+/*
+ * Returns the PMU which the event "ev" has to be opened on for "cpu".
+ *
+ * Events without a PMU, or the "default_core"/"cpu" PMU, belong to the core PMU
+ * of the cpu. Otherwise the PMU is looked up by name. For uncore PMUs, which
+ * exist as multiple numbered instances (uncore_imc -> uncore_imc_0, uncore_imc_1, ...),
+ * the first instance is returned.
+ *
+ * Returns NULL if there is no matching PMU.
+ */
+const struct topology_pmu* topology_pmu_for_event(const struct pmu_topology* topo,
+                                                  const struct pmu_event* ev, struct perf_cpu cpu)
+{
+    if (ev->pmu == NULL || strcmp(ev->pmu, "default_core") == 0 || strcmp(ev->pmu, "cpu") == 0)
+    {
+        return topology_core_pmu_for_cpu(topo, cpu);
+    }
+
+    int idx = pmu_topology_find_pmu(topo, ev->pmu);
+    if (idx != -1)
+    {
+        return &topo->pmus[idx];
+    }
+
+    size_t len = strlen(ev->pmu);
+    for (size_t i = 0; i < topo->num_pmus; i++)
+    {
+        const char* name = topo->pmus[i].name;
+        if (strncmp(name, ev->pmu, len) == 0 && name[len] == '_' && name[len + 1] != '\0' &&
+            strspn(name + len + 1, "0123456789") == strlen(name + len + 1))
+        {
+            return &topo->pmus[i];
+        }
+    }
+    return NULL;
+}
+
+const struct pmu_format_def* topology_find_format(const struct topology_pmu* pmu,
+                                                  const char* name)
+{
+    struct pmu_format_def key = { .name = (char*)name };
+    return bsearch(&key, pmu->formats, pmu->num_formats, sizeof(struct pmu_format_def),
+                   cmp_format_name);
+}
+
+/*
+ * Returns true if the file "name" in [pmu]/events describes another alias,
+ * e.g. "energy-pkg.scale"
+ */
+static bool is_alias_attribute(const char* name)
+{
+    static const char* const suffixes[] = { ".scale", ".unit", ".per-pkg", ".snapshot" };
+    size_t len = strlen(name);
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+    {
+        size_t suffix_len = strlen(suffixes[i]);
+        if (len > suffix_len && strcmp(name + len - suffix_len, suffixes[i]) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Returns the content of the file [events_path]/[name][suffix], NULL if there is none
+ */
+static char* read_alias_file(const char* events_path, const char* name, const char* suffix)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s%s", events_path, name, suffix) >= sizeof(path))
+    {
+        return NULL;
+    }
+    return get_file_content(path);
+}
+
+/*
+ * Reads the alias "name" in "events_path" into "alias"
+ *
+ * Returns 0 on success, 1 if the file can not be read and -1 on failure
+ */
+static int read_alias(struct pmu_alias_def* alias, const char* events_path, const char* name)
+{
+    memset(alias, 0, sizeof(*alias));
+    alias->event = read_alias_file(events_path, name, "");
+    if (alias->event == NULL)
+    {
+        return 1;
+    }
+    alias->name = strdup(name);
+    if (alias->name == NULL)
+    {
+        return -1;
+    }
+
+    char* scale = read_alias_file(events_path, name, ".scale");
+    alias->scale = scale != NULL ? strtod(scale, NULL) : 1.0;
+    alias->unit = read_alias_file(events_path, name, ".unit");
+    if (scale != NULL || alias->unit != NULL)
+    {
+        size_t len = (scale ? strlen(scale) : 1) + (alias->unit ? strlen(alias->unit) : 0) + 1;
+        alias->scale_unit = malloc(len);
+        if (alias->scale_unit == NULL)
+        {
+            free(scale);
+            return -1;
+        }
+        snprintf(alias->scale_unit, len, "%s%s", scale ? scale : "1",
+                 alias->unit ? alias->unit : "");
+    }
+    free(scale);
+    return 0;
+}
+
+/*
+ * Reads all aliases in [root]/bus/event_source/devices/[pmu]/events into pmu->aliases.
+ * PMUs without an events directory have no aliases.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int read_aliases(const struct pmu_topology* topo, struct topology_pmu* pmu)
+{
+    char events_path[PATH_MAX];
+    if (snprintf(events_path, sizeof(events_path), "%s/bus/event_source/devices/%s/events",
+                 topo->root, pmu->name) >= sizeof(events_path))
+    {
+        return -1;
+    }
+
+    DIR* events = opendir(events_path);
+    if (events == NULL)
+    {
+        __atomic_store_n(&pmu->aliases_read, true, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    struct dirent* ent;
+    while ((ent = readdir(events)) != NULL)
+    {
+        if (ent->d_name[0] == '.' || is_alias_attribute(ent->d_name))
+        {
+            continue;
+        }
+
+        struct pmu_alias_def* aliases =
+            realloc(pmu->aliases, (pmu->num_aliases + 1) * sizeof(struct pmu_alias_def));
+        if (aliases == NULL)
+        {
+            closedir(events);
+            free_aliases(pmu);
+            return -1;
+        }
+        pmu->aliases = aliases;
+
+        struct pmu_alias_def* alias = &pmu->aliases[pmu->num_aliases];
+        int ret = read_alias(alias, events_path, ent->d_name);
+        if (ret != 0)
+        {
+            free(alias->name);
+            free(alias->event);
+            free(alias->unit);
+        }
+        if (ret == -1)
+        {
+            closedir(events);
+            free_aliases(pmu);
+            return -1;
+        }
+        if (ret == 0)
+        {
+            pmu->num_aliases++;
+        }
+    }
+    closedir(events);
+
+    if (pmu->num_aliases > 1)
+    {
+        qsort(pmu->aliases, pmu->num_aliases, sizeof(struct pmu_alias_def), cmp_alias_name);
+    }
+    __atomic_store_n(&pmu->aliases_read, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Makes sure the aliases of "pmu" are read. Snapshots are shared between threads, so the
+ * first lookup reads them under aliases_lock, and aliases_read publishes them to the
+ * lookups that do not take the lock.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int ensure_aliases(const struct pmu_topology* topo, const struct topology_pmu* pmu)
+{
+    if (__atomic_load_n(&pmu->aliases_read, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&aliases_lock);
+    int ret = pmu->aliases_read ? 0 : read_aliases(topo, (struct topology_pmu*)pmu);
+    pthread_mutex_unlock(&aliases_lock);
+    return ret;
+}
+
+/*
+ * Returns the alias "name" in the events directory of "pmu", NULL if there is none.
+ *
+ * The directory is only read on the first lookup on the PMU, after that the aliases
+ * live in the snapshot.
+ */
+const struct pmu_alias_def* topology_find_alias(const struct pmu_topology* topo,
+                                                const struct topology_pmu* pmu, const char* name)
+{
+    if (ensure_aliases(topo, pmu) == -1)
+    {
+        return NULL;
+    }
+    if (pmu->num_aliases == 0)
+    {
+        return NULL;
+    }
+
+    struct pmu_alias_def key = { .name = (char*)name };
+    return bsearch(&key, pmu->aliases, pmu->num_aliases, sizeof(struct pmu_alias_def),
+                   cmp_alias_name);
+}
+
+/*
+ * Puts the CPUs of "a" that are not in "b", below topo->num_cpus, into the newly
+ * allocated CPU list "cpus" of length "num"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int cpus_difference(const struct pmu_topology* topo, const struct pmu_cpuset* a,
+                           const struct pmu_cpuset* b, struct perf_cpu** cpus, size_t* num)
+{
+    struct pmu_cpuset diff = PMU_CPUSET_INIT;
+    if (pmu_cpuset_copy(&diff, a) == -1)
+    {
+        return -1;
+    }
+    pmu_cpuset_andnot(&diff, b);
+
+    /* Nothing is allocated without a difference, see pmu_events_check_changes() */
+    size_t count = pmu_cpuset_count(&diff);
+    *cpus = count != 0 ? malloc(count * sizeof(struct perf_cpu)) : NULL;
+    *num = 0;
+    long cpu;
+    pmu_cpuset_for_each(cpu, &diff)
+    {
+        if ((size_t)cpu >= topo->num_cpus || *cpus == NULL)
+        {
+            break;
+        }
+        (*cpus)[(*num)++].cpu = cpu;
+    }
+    pmu_cpuset_release(&diff);
+    return count == 0 || *cpus != NULL ? 0 : -1;
+}
+
+/*
+ * Appends a copy of "name" to the string list "names" of length "num"
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int append_name(char*** names, size_t* num, const char* name)
+{
+    char** new_names = realloc(*names, (*num + 1) * sizeof(char*));
+    if (new_names == NULL)
+    {
+        return -1;
+    }
+    *names = new_names;
+    (*names)[*num] = strdup(name);
+    if ((*names)[*num] == NULL)
+    {
+        return -1;
+    }
+    (*num)++;
+    return 0;
+}
+
+void free_topology_change(struct pmu_events_change* change)
+{
+    for (size_t i = 0; i < change->num_pmus_added; i++)
+    {
+        free(change->pmus_added[i]);
+    }
+    for (size_t i = 0; i < change->num_pmus_removed; i++)
+    {
+        free(change->pmus_removed[i]);
+    }
+    free(change->pmus_added);
+    free(change->pmus_removed);
+    free(change->cpus_online);
+    free(change->cpus_offline);
+    memset(change, 0, sizeof(*change));
+}
+
+static int cmp_str(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/*
+ * Copies the PMU "src" of another snapshot into "dst". The aliases are only copied
+ * if they were already read, otherwise they are read on the first lookup as usual.
+ *
+ * Returns 0 on success, -1 on failure. "dst" has to be freed with free_pmu() either way.
+ */
+static int copy_pmu(struct topology_pmu* dst, const struct topology_pmu* src)
+{
+    memset(dst, 0, sizeof(*dst));
+    dst->name = strdup(src->name);
+    dst->cpus = src->cpus ? strdup(src->cpus) : NULL;
+    dst->type = src->type;
+    dst->is_core = src->is_core;
+    if (dst->name == NULL || (src->cpus != NULL && dst->cpus == NULL))
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < src->num_formats; i++)
+    {
+        if (add_format(dst, src->formats[i].name, src->formats[i].def) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if (!__atomic_load_n(&src->aliases_read, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < src->num_aliases; i++)
+    {
+        const struct pmu_alias_def* alias = &src->aliases[i];
+        if (add_alias(dst, alias->name, alias->event, alias->scale_unit) == -1)
+        {
+            return -1;
+        }
+    }
+    dst->aliases_read = true;
+    return 0;
+}
+
+/*
+ * Builds a new snapshot "refreshed" from "topo" and the current state of sysfs,
+ * recording what changed in "change". "topo" itself is not modified, as other
+ * threads may be reading it.
+ *
+ * Only the PMUs that appeared are read completely, the others are copied. If CPUs
+ * went on- or offline, the cpus/cpumask files of the remaining PMUs are re-read, as
+ * the kernel moves the cpumask of uncore PMUs away from offlined CPUs. Format
+ * definitions of already known PMUs are never re-read.
+ *
+ * Returns 1 if something changed, 0 if not and -1 on failure.
+ * On success, the caller has to free "change" with free_topology_change(), and
+ * if something changed, publish or free "refreshed".
+ */
+int topology_refresh(const struct pmu_topology* topo, struct pmu_topology** refreshed,
+                     struct pmu_events_change* change)
+{
+    memset(change, 0, sizeof(*change));
+    *refreshed = NULL;
+
+    struct pmu_cpuset online = PMU_CPUSET_INIT;
+    if (read_online(topo, &online) == -1 ||
+        cpus_difference(topo, &online, &topo->online, &change->cpus_online,
+                        &change->num_cpus_online) == -1 ||
+        cpus_difference(topo, &topo->online, &online, &change->cpus_offline,
+                        &change->num_cpus_offline) == -1)
+    {
+        goto err;
+    }
+
+    char* devices_path = concat_path(topo->root, "bus/event_source/devices");
+    if (devices_path == NULL)
+    {
+        goto err;
+    }
+    DIR* devices = opendir(devices_path);
+    if (devices == NULL)
+    {
+        free(devices_path);
+        goto err;
+    }
+
+    char** names = NULL;
+    size_t num_names = 0;
+    struct dirent* ent;
+    while ((ent = readdir(devices)) != NULL)
+    {
+        if (ent->d_name[0] != '.' && append_name(&names, &num_names, ent->d_name) == -1)
+        {
+            closedir(devices);
+            goto err_names;
+        }
+    }
+    closedir(devices);
+    qsort(names, num_names, sizeof(char*), cmp_str);
+
+    /* Both lists are sorted by name, so merge them */
+    size_t old_pmu = 0, name = 0;
+    while (old_pmu < topo->num_pmus || name < num_names)
+    {
+        int cmp;
+        if (old_pmu == topo->num_pmus)
+        {
+            cmp = 1;
+        }
+        else if (name == num_names)
+        {
+            cmp = -1;
+        }
+        else
+        {
+            cmp = strcmp(topo->pmus[old_pmu].name, names[name]);
+        }
+
+        if (cmp == 0)
+        {
+            old_pmu++;
+            name++;
+        }
+        else if (cmp < 0)
+        {
+            if (append_name(&change->pmus_removed, &change->num_pmus_removed,
+                            topo->pmus[old_pmu++].name) == -1)
+            {
+                goto err_names;
+            }
+        }
+        else
+        {
+            if (append_name(&change->pmus_added, &change->num_pmus_added, names[name++]) == -1)
+            {
+                goto err_names;
+            }
+        }
+    }
+
+    bool cpus_changed = change->num_cpus_online != 0 || change->num_cpus_offline != 0;
+    if (!cpus_changed && change->num_pmus_added == 0 && change->num_pmus_removed == 0)
+    {
+        for (size_t i = 0; i < num_names; i++)
+        {
+            free(names[i]);
+        }
+        free(names);
+        free(devices_path);
+        pmu_cpuset_release(&online);
+        return 0;
+    }
+
+    struct pmu_topology* new_topo = calloc(1, sizeof(struct pmu_topology));
+    if (new_topo == NULL)
+    {
+        goto err_names;
+    }
+    new_topo->num_cpus = topo->num_cpus;
+    new_topo->online = online;
+    online = (struct pmu_cpuset)PMU_CPUSET_INIT;
+    new_topo->root = strdup(topo->root);
+    new_topo->pmus =
+        malloc((topo->num_pmus + change->num_pmus_added + 1) * sizeof(struct topology_pmu));
+    if (new_topo->root == NULL || new_topo->pmus == NULL)
+    {
+        goto err_topo;
+    }
+
+    /* pmus_removed is sorted as well, copy all the others */
+    size_t removed = 0;
+    for (size_t i = 0; i < topo->num_pmus; i++)
+    {
+        if (removed < change->num_pmus_removed &&
+            strcmp(topo->pmus[i].name, change->pmus_removed[removed]) == 0)
+        {
+            removed++;
+            continue;
+        }
+
+        struct topology_pmu* pmu = &new_topo->pmus[new_topo->num_pmus++];
+        if (copy_pmu(pmu, &topo->pmus[i]) == -1)
+        {
+            goto err_topo;
+        }
+        if (cpus_changed)
+        {
+            char* pmu_path = concat_path(devices_path, pmu->name);
+            if (pmu_path != NULL)
+            {
+                read_pmu_cpus(pmu, pmu_path);
+                free(pmu_path);
+            }
+        }
+    }
+
+    size_t added = 0;
+    for (size_t i = 0; i < change->num_pmus_added; i++)
+    {
+        struct topology_pmu* pmu = &new_topo->pmus[new_topo->num_pmus];
+        int ret = read_pmu(pmu, devices_path, change->pmus_added[i]);
+        if (ret == -1)
+        {
+            new_topo->num_pmus++;
+            goto err_topo;
+        }
+        if (ret != 0)
+        {
+            /* Not a usable PMU (yet), it is not reported as added */
+            free_pmu(pmu);
+            free(change->pmus_added[i]);
+            continue;
+        }
+        new_topo->num_pmus++;
+        change->pmus_added[added++] = change->pmus_added[i];
+    }
+    change->num_pmus_added = added;
+
+    qsort(new_topo->pmus, new_topo->num_pmus, sizeof(struct topology_pmu), cmp_pmu_name);
+    if (fill_core_pmu(new_topo) == -1)
+    {
+        goto err_topo;
+    }
+    new_topo->generation = compute_generation(new_topo);
+
+    for (size_t i = 0; i < num_names; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    free(devices_path);
+
+    if (!cpus_changed && change->num_pmus_added == 0 && change->num_pmus_removed == 0)
+    {
+        pmu_topology_free(new_topo);
+        free_topology_change(change);
+        return 0;
+    }
+    *refreshed = new_topo;
+    return 1;
+
+err_topo:
+    pmu_topology_free(new_topo);
+err_names:
+    for (size_t i = 0; i < num_names; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    free(devices_path);
+err:
+    pmu_cpuset_release(&online);
+    free_topology_change(change);
+    return -1;
+}
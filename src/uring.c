@@ -0,0 +1,319 @@
+#include <pmu-events/session.h>
+
+#include <pmu-events/_impl/pmu-events.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
+/* The most reads that are in flight at once, larger sessions are read in several batches */
+#define URING_MAX_ENTRIES 4096
+
+#ifdef HAVE_IO_URING
+
+struct session_uring
+{
+    int fd;
+    /* The SQ and CQ rings, which share one mapping with IORING_FEAT_SINGLE_MMAP */
+    void* rings;
+    size_t rings_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    unsigned entries;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    /*
+     * The PERF_FORMAT_GROUP reads of all groups, [num_cpus][num_groups] in the order of
+     * the counts matrix, the group of a CPU at buf[cpu * stride + offsets[group]]
+     */
+    uint64_t* buf;
+    size_t buf_len;
+    size_t* offsets;
+    size_t stride;
+    /* The buffer is registered with the kernel, and read into with IORING_OP_READ_FIXED */
+    bool fixed;
+};
+
+/*
+ * Returns true if pmu_session_read() reads "group" on the c-th CPU from the kernel
+ */
+static bool is_read(const struct pmu_session* session, size_t group, size_t cpu)
+{
+    const struct session_group* grp = &session->groups[group];
+    return grp->is_open && !grp->dropped && grp->num_counters != 0 &&
+           session_group_is_placed(session, group, cpu);
+}
+
+void session_uring_free(struct session_uring* uring)
+{
+    if (uring == NULL)
+    {
+        return;
+    }
+    if (uring->sqes != NULL)
+    {
+        munmap(uring->sqes, uring->sqes_len);
+    }
+    if (uring->rings != NULL)
+    {
+        munmap(uring->rings, uring->rings_len);
+    }
+    if (uring->fd != -1)
+    {
+        close(uring->fd);
+    }
+    free(uring->buf);
+    free(uring->offsets);
+    free(uring);
+}
+
+/*
+ * Sets up the ring with "entries" entries and maps it
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int setup_ring(struct session_uring* uring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    uring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (uring->fd == -1)
+    {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        /* Kernels before 5.4, treated like kernels without io_uring */
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->rings_len = sq_len > cq_len ? sq_len : cq_len;
+    uring->rings = mmap(NULL, uring->rings_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (uring->rings == MAP_FAILED)
+    {
+        uring->rings = NULL;
+        return -1;
+    }
+    uring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED)
+    {
+        uring->sqes = NULL;
+        return -1;
+    }
+
+    char* rings = uring->rings;
+    uring->entries = params.sq_entries;
+    uring->sq_tail = (unsigned*)(rings + params.sq_off.tail);
+    uring->sq_mask = (unsigned*)(rings + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned*)(rings + params.sq_off.array);
+    uring->cq_head = (unsigned*)(rings + params.cq_off.head);
+    uring->cq_tail = (unsigned*)(rings + params.cq_off.tail);
+    uring->cq_mask = (unsigned*)(rings + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * Returns true if the kernel supports IORING_OP_READ, which is needed without a registered
+ * buffer. Kernels before 5.6 have neither IORING_OP_READ nor IORING_REGISTER_PROBE.
+ */
+static bool supports_read(const struct session_uring* uring)
+{
+    unsigned num_ops = IORING_OP_READ + 1;
+    struct io_uring_probe* probe =
+        calloc(1, sizeof(struct io_uring_probe) + num_ops * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+    {
+        return false;
+    }
+    bool supported =
+        syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PROBE, probe, num_ops) == 0 &&
+        probe->last_op >= IORING_OP_READ &&
+        (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+int pmu_session_use_io_uring(struct pmu_session* session)
+{
+    if (!session->opened)
+    {
+        return -1;
+    }
+    if (session->uring != NULL)
+    {
+        return 0;
+    }
+
+    struct session_uring* uring = calloc(1, sizeof(struct session_uring));
+    if (uring == NULL)
+    {
+        return -1;
+    }
+    uring->fd = -1;
+
+    uring->offsets = malloc((session->num_groups ? session->num_groups : 1) * sizeof(size_t));
+    if (uring->offsets == NULL)
+    {
+        session_uring_free(uring);
+        return -1;
+    }
+    for (size_t group = 0; group < session->num_groups; group++)
+    {
+        uring->offsets[group] = uring->stride;
+        uring->stride += 3 + session->groups[group].num_counters;
+    }
+    uring->buf_len = session->num_cpus * uring->stride * sizeof(uint64_t);
+    uring->buf = malloc(uring->buf_len ? uring->buf_len : 1);
+
+    size_t num_reads = session->num_cpus * session->num_groups;
+    unsigned entries = num_reads < URING_MAX_ENTRIES ? num_reads : URING_MAX_ENTRIES;
+    if (uring->buf == NULL || setup_ring(uring, entries ? entries : 1) == -1)
+    {
+        /* Keep the errno of io_uring_setup, e.g. ENOSYS or EPERM */
+        int err = errno;
+        session_uring_free(uring);
+        errno = err;
+        return -1;
+    }
+
+    /* Reads into a registered buffer save pinning the pages on every read */
+    struct iovec iov = { .iov_base = uring->buf, .iov_len = uring->buf_len };
+    uring->fixed = uring->buf_len != 0 && syscall(__NR_io_uring_register, uring->fd,
+                                                  IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    if (!uring->fixed && !supports_read(uring))
+    {
+        session_uring_free(uring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    session->uring = uring;
+    return 0;
+}
+
+/*
+ * Submits the "num" queued reads and waits for all of them
+ *
+ * Returns 0 on success, -1 if a read failed or was short
+ */
+static int submit_and_wait(struct session_uring* uring, unsigned num)
+{
+    unsigned submitted = 0, completed = 0;
+    int ret = 0;
+
+    while (completed < num)
+    {
+        int n = syscall(__NR_io_uring_enter, uring->fd, num - submitted, num - completed,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+        submitted += n > 0 ? n : 0;
+
+        unsigned head = *uring->cq_head;
+        unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, completed++)
+        {
+            /* The user data is the length of the read */
+            const struct io_uring_cqe* cqe = &uring->cqes[head & *uring->cq_mask];
+            if (cqe->res < 0 || (uint64_t)cqe->res != cqe->user_data)
+            {
+                ret = -1;
+            }
+        }
+        __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return ret;
+}
+
+int session_uring_read(struct pmu_session* session)
+{
+    struct session_uring* uring = session->uring;
+    unsigned queued = 0;
+
+    for (size_t cpu = 0; cpu < session->num_cpus; cpu++)
+    {
+        for (size_t group = 0; group < session->num_groups; group++)
+        {
+            if (!is_read(session, group, cpu))
+            {
+                continue;
+            }
+            if (queued == uring->entries)
+            {
+                if (submit_and_wait(uring, queued) == -1)
+                {
+                    return -1;
+                }
+                queued = 0;
+            }
+
+            const struct session_group* grp = &session->groups[group];
+            unsigned tail = *uring->sq_tail;
+            unsigned index = tail & *uring->sq_mask;
+            struct io_uring_sqe* sqe = &uring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = uring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = session->fds[cpu * session->num_events + grp->leader];
+            sqe->addr = (uintptr_t)&uring->buf[cpu * uring->stride + uring->offsets[group]];
+            sqe->len = (3 + grp->num_counters) * sizeof(uint64_t);
+            sqe->user_data = sqe->len;
+            uring->sq_array[index] = index;
+            __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+            queued++;
+        }
+    }
+    return queued != 0 ? submit_and_wait(uring, queued) : 0;
+}
+
+const uint64_t* session_uring_group(const struct session_uring* uring, size_t group, size_t cpu)
+{
+    return &uring->buf[cpu * uring->stride + uring->offsets[group]];
+}
+
+#else
+
+int pmu_session_use_io_uring(struct pmu_session* session)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void session_uring_free(struct session_uring* uring)
+{
+}
+
+int session_uring_read(struct pmu_session* session)
+{
+    return -1;
+}
+
+const uint64_t* session_uring_group(const struct session_uring* uring, size_t group, size_t cpu)
+{
+    return NULL;
+}
+
+#endif
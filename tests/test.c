@@ -1,9 +1,30 @@
 #include <pmu-events/_impl/pmu-events.h>
+#include <pmu-events/cache.h>
+#include <pmu-events/cgroup.h>
+#include <pmu-events/cpuset.h>
+#include <pmu-events/decode.h>
+#include <pmu-events/event-set.h>
+#include <pmu-events/hotplug.h>
+#include <pmu-events/metric.h>
+#include <pmu-events/parse.h>
 #include <pmu-events/pmu-events.h>
+#include <pmu-events/sampler.h>
+#include <pmu-events/session.h>
+#include <pmu-events/stats.h>
+#include <pmu-events/tma.h>
+#include <pmu-events/topology.h>
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /*
  * catch2 for poor people
@@ -18,6 +39,155 @@
         return -1;                                                                                 \
     }
 
+/*
+ * Creates the file "path" below "root" (and all directories leading to it) with
+ * the given content, for building fake sysfs trees.
+ */
+static int write_file(const char* root, const char* path, const char* content)
+{
+    char full_path[4096];
+    snprintf(full_path, sizeof(full_path), "%s/%s", root, path);
+
+    for (char* slash = strchr(full_path + strlen(root) + 1, '/'); slash != NULL;
+         slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdir(full_path, 0755);
+        *slash = '/';
+    }
+
+    int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    ssize_t len = write(fd, content, strlen(content));
+    close(fd);
+    return len == strlen(content) ? 0 : -1;
+}
+
+/*
+ * Removes the fake sysfs tree "path" created with mkdtemp() and write_file()
+ */
+static void remove_tree(const char* path)
+{
+    DIR* dir = opendir(path);
+    if (dir != NULL)
+    {
+        struct dirent* ent;
+        while ((ent = readdir(dir)) != NULL)
+        {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            {
+                continue;
+            }
+            char child[4096];
+            snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+            if (ent->d_type == DT_DIR)
+            {
+                remove_tree(child);
+            }
+            else
+            {
+                unlink(child);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+static const struct pmu_events_map* find_map(const char* arch)
+{
+    const struct pmu_events_map* maps = all_pmu_events_maps();
+    for (size_t i = 0; maps[i].arch != NULL; i++)
+    {
+        if (strcmp(maps[i].arch, arch) == 0)
+        {
+            return &maps[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the slot of the event "name" on "pmu" in the plan, -1 if it is not planned
+ */
+static int find_plan_event(const struct metric_plan* plan, const char* pmu, const char* name)
+{
+    for (size_t i = 0; i < plan->num_events; i++)
+    {
+        if (strcmp(plan->events[i].pmu, pmu) == 0 && strcmp(plan->events[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Records the threshold crossings of one metric on up to 3 CPUs
+ */
+struct crossing_record
+{
+    size_t metric;
+    bool seen[3];
+    struct metric_threshold_crossing crossings[3];
+};
+
+static void record_crossing(const struct metric_threshold_crossing* crossing, void* data)
+{
+    struct crossing_record* record = data;
+    if (crossing->metric == record->metric && crossing->cpu < 3)
+    {
+        record->seen[crossing->cpu] = true;
+        record->crossings[crossing->cpu] = *crossing;
+    }
+}
+
+/*
+ * Looks up an event of the test map on a thread of its own
+ */
+static void* lookup_event(void* map)
+{
+    struct pmu_event ev;
+    get_event_by_name(map, "eist_trans", &ev);
+    return NULL;
+}
+
+/*
+ * Looks up the "energy-pkg" alias of the "power" PMU of the topology "topo", returns "topo"
+ * if it is there
+ */
+static void* lookup_alias(void* topo)
+{
+    struct pmu_event_alias alias;
+    int power = pmu_topology_find_pmu(topo, "power");
+    return pmu_topology_pmu_alias(topo, power, "energy-pkg", &alias) == 0 ? topo : NULL;
+}
+
+static void* get_topology(void* unused)
+{
+    (void)unused;
+    return (void*)pmu_topology_get();
+}
+
+static void count_change(const struct pmu_events_change* change, void* data)
+{
+    struct pmu_events_change* total = data;
+    total->num_cpus_online += change->num_cpus_online;
+    total->num_cpus_offline += change->num_cpus_offline;
+    total->num_pmus_added += change->num_pmus_added;
+    total->num_pmus_removed += change->num_pmus_removed;
+}
+
+static void remove_self(const struct pmu_events_change* change, void* data)
+{
+    (void)change;
+    *(int*)data += 1;
+    pmu_events_remove_change_callback(remove_self, data);
+}
+
 int main(void)
 {
     char* test_name;
@@ -134,6 +304,1570 @@ int main(void)
         free_config_def(&def);
     }
 
+    TEST_CASE("event and metric ids are dense and round-trip");
+    {
+        const struct pmu_events_map* map = find_map("testarch");
+        REQUIRE(map != NULL);
+        REQUIRE(pmu_events_num_events(map) > 0 && pmu_events_num_metrics(map) > 0);
+
+        for (pmu_event_id id = 0; id < pmu_events_num_events(map); id++)
+        {
+            struct pmu_event ev;
+            pmu_event_id found;
+            REQUIRE(get_event_by_id(map, id, &ev) == 0);
+            REQUIRE(get_event_id(map, ev.pmu, ev.name, &found) == 0 && found == id);
+        }
+        for (pmu_metric_id id = 0; id < pmu_events_num_metrics(map); id++)
+        {
+            struct pmu_metric pm;
+            pmu_metric_id found;
+            REQUIRE(get_metric_by_id(map, id, &pm) == 0);
+            REQUIRE(get_metric_id(map, pm.pmu, pm.metric_name, &found) == 0 && found == id);
+        }
+
+        struct pmu_event ev;
+        pmu_event_id id;
+        REQUIRE(get_event_by_id(map, pmu_events_num_events(map), &ev) == -1);
+        REQUIRE(get_event_id(map, NULL, "no_such_event", &id) == -1);
+        REQUIRE(get_event_id(map, "default_core", "event-hyphen", &id) == -1);
+        REQUIRE(get_event_id(map, NULL, "event-hyphen", &id) == 0);
+        REQUIRE(get_event_by_id(map, id, &ev) == 0 && strcmp(ev.pmu, "uncore_cbox") == 0);
+
+        pmu_metric_id metric;
+        REQUIRE(get_metric_id(map, NULL, "dcache_l2_hits", &metric) == 0);
+    }
+
+    TEST_CASE("metric_expr_parse works");
+    {
+        struct metric_expr* expr = metric_expr_parse("a + b * 2 if #smt_on else -c");
+        REQUIRE(expr != NULL && expr->type == EXPR_SELECT);
+        REQUIRE(expr->args[0]->type == EXPR_BINARY && expr->args[0]->op == '+');
+        REQUIRE(expr->args[0]->args[1]->op == '*' && expr->args[0]->args[1]->args[1]->value == 2);
+        REQUIRE(expr->args[1]->type == EXPR_LITERAL && strcmp(expr->args[1]->name, "smt_on") == 0);
+        REQUIRE(expr->args[2]->type == EXPR_UNARY && expr->args[2]->op == '-');
+        metric_expr_free(expr);
+
+        expr = metric_expr_parse("d_ratio(cpu_core@topdown\\-be\\-bound@, 1e9)");
+        REQUIRE(expr != NULL && expr->type == EXPR_FUNCTION && expr->func == EXPR_D_RATIO);
+        REQUIRE(strcmp(expr->args[0]->name, "cpu_core@topdown-be-bound@") == 0);
+        REQUIRE(expr->args[1]->value == 1e9);
+        metric_expr_free(expr);
+
+        REQUIRE(metric_expr_parse("(a + b") == NULL);
+        REQUIRE(metric_expr_parse("a +") == NULL);
+        REQUIRE(metric_expr_parse("min(a)") == NULL);
+    }
+
+    TEST_CASE("metric_plan_new dedupes events of dependent metrics");
+    {
+        const struct pmu_events_map* map = find_map("testarch");
+        REQUIRE(map != NULL);
+
+        const char* names[] = { "DCache_L2_Hits", "dcache_l2_misses" };
+        struct metric_plan* plan = metric_plan_new(map, names, 2, 0);
+        REQUIRE(plan != NULL);
+
+        /* l2_rqsts.demand_data_rd_hit is used by both DCache_L2_All_Hits and _Miss */
+        REQUIRE(plan->num_events == 6);
+        REQUIRE(plan->num_metrics == 5);
+        REQUIRE(plan->num_groups == 1 && plan->groups[0].num_events == 6);
+        for (size_t m = 0; m < plan->num_metrics; m++)
+        {
+            for (size_t i = 0; i < plan->metrics[m].num_metrics; i++)
+            {
+                REQUIRE(plan->metrics[m].metrics[i] < m);
+            }
+        }
+        REQUIRE(strcmp(plan->metrics[4].metric.metric_name, "DCache_L2_Misses") == 0);
+        REQUIRE(plan->metrics[4].requested && !plan->metrics[0].requested);
+        for (size_t i = 0; i < plan->num_events; i++)
+        {
+            struct pmu_event ev;
+            if (plan->events[i].id != PMU_EVENT_ID_NONE)
+            {
+                REQUIRE(get_event_by_id(map, plan->events[i].id, &ev) == 0);
+                REQUIRE(strcmp(ev.name, plan->events[i].name) == 0);
+            }
+        }
+        for (size_t m = 0; m < plan->num_metrics; m++)
+        {
+            struct pmu_metric pm;
+            REQUIRE(get_metric_by_id(map, plan->metrics[m].id, &pm) == 0);
+            REQUIRE(pm.metric_name == plan->metrics[m].metric.metric_name);
+        }
+        metric_plan_free(plan);
+
+        const char* group[] = { "group1" };
+        plan = metric_plan_new(map, group, 1, 0);
+        REQUIRE(plan != NULL);
+        /* IPC and cache_miss_cycles share inst_retired.any */
+        REQUIRE(plan->num_events == 4);
+        metric_plan_free(plan);
+
+        const char* cycle[] = { "M1" };
+        REQUIRE(metric_plan_new(map, cycle, 1, 0) == NULL);
+        const char* unknown[] = { "no_such_metric" };
+        REQUIRE(metric_plan_new(map, unknown, 1, 0) == NULL);
+    }
+
+    TEST_CASE("metric_evaluator computes metrics from their dependencies");
+    {
+        const char* names[] = { "DCache_L2_Hits" };
+        struct metric_plan* plan = metric_plan_new(find_map("testarch"), names, 1, 0);
+        REQUIRE(plan != NULL);
+
+        size_t num_cpus = 100;
+        struct metric_evaluator* eval =
+            metric_evaluator_new(plan, find_map("testarch"), num_cpus);
+        REQUIRE(eval != NULL);
+
+        double* deltas = malloc(plan->num_events * num_cpus * sizeof(double));
+        REQUIRE(deltas != NULL);
+        for (size_t i = 0; i < plan->num_events * num_cpus; i++)
+        {
+            deltas[i] = 1;
+        }
+        REQUIRE(metric_evaluator_push(eval, deltas, NULL, NULL) == 0);
+
+        /* hits: 3 * 1, misses: max(1 - 1, 0) + 1 + 1 */
+        const double* values = metric_evaluator_values(eval, plan->num_metrics - 1);
+        REQUIRE(values != NULL && values[0] == 0.6 && values[num_cpus - 1] == 0.6);
+
+        free(deltas);
+        metric_evaluator_free(eval);
+        metric_plan_free(plan);
+    }
+
+    TEST_CASE("metric_evaluator_aggregate computes metrics per core and package");
+    {
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/type", "4\n") == 0);
+        /* cpu0 and cpu1 are cores of package 0, cpu2 and cpu3 SMT siblings in package 1 */
+        const char* packages[] = { "0\n", "0\n", "1\n", "1\n" };
+        const char* cores[] = { "0\n", "1\n", "0\n", "0\n" };
+        struct perf_cpu cpus[4];
+        for (int c = 0; c < 4; c++)
+        {
+            char path[128];
+            snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/topology/physical_package_id",
+                     c);
+            REQUIRE(write_file(root, path, packages[c]) == 0);
+            snprintf(path, sizeof(path), "devices/system/cpu/cpu%d/topology/core_id", c);
+            REQUIRE(write_file(root, path, cores[c]) == 0);
+            cpus[c].cpu = c;
+        }
+        struct pmu_topology* topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        pmu_topology_set(topo);
+
+        /* Frontend_Bound_SMT is PerCore, DCache_L2_All, which DCache_L2_Hits refers to, PerChip */
+        const struct pmu_events_map* map = find_map("testarch");
+        const char* names[] = { "Frontend_Bound_SMT", "DCache_L2_Hits" };
+        struct metric_plan* plan = metric_plan_new(map, names, 2, METRIC_PLAN_THRESHOLDS);
+        REQUIRE(plan != NULL);
+        size_t frontend = plan->num_metrics, all = plan->num_metrics, hits = plan->num_metrics;
+        for (size_t m = 0; m < plan->num_metrics; m++)
+        {
+            const char* name = plan->metrics[m].metric.metric_name;
+            frontend = strcmp(name, "Frontend_Bound_SMT") == 0 ? m : frontend;
+            all = strcmp(name, "DCache_L2_All") == 0 ? m : all;
+            hits = strcmp(name, "DCache_L2_Hits") == 0 ? m : hits;
+        }
+        REQUIRE(frontend != plan->num_metrics && all != plan->num_metrics &&
+                hits != plan->num_metrics);
+        int idq = find_plan_event(plan, "default_core", "idq_uops_not_delivered.core");
+        REQUIRE(idq != -1);
+
+        struct metric_evaluator* eval = metric_evaluator_new(plan, map, 4);
+        REQUIRE(eval != NULL);
+        REQUIRE(metric_evaluator_aggregate(eval, cpus) == 0);
+
+        double* deltas = malloc(plan->num_events * 4 * sizeof(double));
+        REQUIRE(deltas != NULL);
+        for (size_t i = 0; i < plan->num_events * 4; i++)
+        {
+            deltas[i] = 1;
+        }
+        deltas[idq * 4 + 3] = 3;
+        struct crossing_record record;
+        memset(&record, 0, sizeof(record));
+        record.metric = frontend;
+        REQUIRE(metric_evaluator_push(eval, deltas, record_crossing, &record) == 0);
+
+        /* idq / (4 * (cycles / 2) * (1 + 1)): 1 / 4 per CPU, but (1 + 3) / 8 for the core */
+        const double* values = metric_evaluator_values(eval, frontend);
+        REQUIRE(values[0] == 0.25 && values[1] == 0.25 && values[2] == 0.5 && values[3] == 0.5);
+        REQUIRE(!record.seen[0] && !record.seen[1] && record.seen[2]);
+        REQUIRE(record.crossings[2].above && record.crossings[2].value == 0.5);
+
+        /* 5 per CPU, summed per package, while DCache_L2_Hits still uses the CPU's own */
+        values = metric_evaluator_values(eval, all);
+        REQUIRE(values[0] == 10 && values[1] == 10 && values[2] == 10 && values[3] == 10);
+        values = metric_evaluator_values(eval, hits);
+        REQUIRE(values[0] == 0.6 && values[3] == 0.6);
+
+        free(deltas);
+        metric_evaluator_free(eval);
+        metric_plan_free(plan);
+        pmu_topology_set(NULL);
+        remove_tree(root);
+    }
+
+#ifdef __x86_64__
+    TEST_CASE("metric_evaluator reports threshold crossings");
+    {
+        const struct pmu_events_map* map = all_pmu_events_maps();
+        while (map->arch != NULL && strcmp(map->cpuid, "GenuineIntel-6-(97|9A|B7|BA|BF)") != 0)
+        {
+            map++;
+        }
+        REQUIRE(map->arch != NULL);
+
+        /* On cpu_atom: TOPDOWN_RETIRING.ALL / (5 * CPU_CLK_UNHALTED.CORE) > 0.75 */
+        const char* names[] = { "tma_retiring" };
+        struct metric_plan* plan = metric_plan_new(map, names, 1, METRIC_PLAN_THRESHOLDS);
+        REQUIRE(plan != NULL);
+
+        struct crossing_record record;
+        memset(&record, 0, sizeof(record));
+        record.metric = plan->num_metrics;
+        for (size_t m = 0; m < plan->num_metrics; m++)
+        {
+            if (strcmp(plan->metrics[m].metric.pmu, "cpu_atom") == 0 &&
+                strcmp(plan->metrics[m].metric.metric_name, "tma_retiring") == 0)
+            {
+                record.metric = m;
+            }
+        }
+        REQUIRE(record.metric != plan->num_metrics);
+
+        int retiring = find_plan_event(plan, "cpu_atom", "topdown_retiring.all");
+        int clk = find_plan_event(plan, "cpu_atom", "cpu_clk_unhalted.core");
+        REQUIRE(retiring != -1 && clk != -1);
+
+        struct metric_evaluator* eval = metric_evaluator_new(plan, map, 3);
+        REQUIRE(eval != NULL);
+
+        double* deltas = calloc(plan->num_events * 3, sizeof(double));
+        REQUIRE(deltas != NULL);
+        double interval1[2][3] = { { 80, 10, 0 }, { 20, 20, 0 } };
+        memcpy(&deltas[retiring * 3], interval1[0], sizeof(interval1[0]));
+        memcpy(&deltas[clk * 3], interval1[1], sizeof(interval1[1]));
+        REQUIRE(metric_evaluator_push(eval, deltas, record_crossing, &record) == 0);
+
+        /* Only cpu 0 crossed, cpu 2 divided by zero */
+        REQUIRE(record.seen[0] && record.crossings[0].above && record.crossings[0].value == 0.8);
+        REQUIRE(!record.seen[1] && !record.seen[2]);
+
+        memset(record.seen, 0, sizeof(record.seen));
+        double interval2[3] = { 10, 80, 0 };
+        memcpy(&deltas[retiring * 3], interval2, sizeof(interval2));
+        REQUIRE(metric_evaluator_push(eval, deltas, record_crossing, &record) == 0);
+
+        REQUIRE(record.seen[0] && !record.crossings[0].above);
+        REQUIRE(record.seen[1] && record.crossings[1].above && record.crossings[1].value == 0.8);
+        REQUIRE(!record.seen[2]);
+
+        free(deltas);
+        metric_evaluator_free(eval);
+        metric_plan_free(plan);
+    }
+#endif
+
+    TEST_CASE("pmu_event_decode finds the events of encoded attrs");
+    {
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        REQUIRE(write_file(root, "devices/system/cpu/possible", "0-1\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/type", "4\n") == 0);
+        const char* cpu_formats[][2] = {
+            { "event", "config:0-7" },        { "umask", "config:8-15" },
+            { "inv", "config:23" },           { "cmask", "config:24-31" },
+            { "ldlat", "config1:0-15" },      { "offcore_rsp", "config1:0-63" },
+            { "frontend", "config1:0-23" },
+        };
+        for (size_t i = 0; i < sizeof(cpu_formats) / sizeof(cpu_formats[0]); i++)
+        {
+            char path[256];
+            snprintf(path, sizeof(path), "bus/event_source/devices/cpu/format/%s",
+                     cpu_formats[i][0]);
+            REQUIRE(write_file(root, path, cpu_formats[i][1]) == 0);
+        }
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_cbox_0/type", "12\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_cbox_0/cpumask", "0\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_cbox_0/format/event",
+                           "config:0-7\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_cbox_0/format/umask",
+                           "config:8-15\n") == 0);
+
+        struct pmu_topology* topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        pmu_topology_set(topo);
+
+        const struct pmu_events_map* map = find_map("testarch");
+        struct pmu_event_decoder* dec = pmu_event_decoder_new(map, NULL);
+        REQUIRE(dec != NULL);
+
+        struct perf_cpu cpu;
+        cpu.cpu = 0;
+        size_t num_decoded = 0;
+        for (pmu_event_id id = 0; id < pmu_events_num_events(map); id++)
+        {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            if (gen_attr_for_event_id(map, id, cpu, &attr) == -1)
+            {
+                continue;
+            }
+
+            /* Events with the same encoding decode to the same event */
+            pmu_event_id decoded;
+            struct perf_event_attr decoded_attr;
+            memset(&decoded_attr, 0, sizeof(decoded_attr));
+            REQUIRE(pmu_event_decode(dec, &attr, &decoded) == PMU_EVENT_DECODE_EXACT);
+            REQUIRE(gen_attr_for_event_id(map, decoded, cpu, &decoded_attr) == 0);
+            REQUIRE(decoded_attr.type == attr.type && decoded_attr.config == attr.config);
+            num_decoded++;
+        }
+        REQUIRE(num_decoded >= 6);
+
+        pmu_event_id dispatch_blocked, decoded;
+        REQUIRE(get_event_id(map, NULL, "dispatch_blocked.any", &dispatch_blocked) == 0);
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        /* event=9,period=200000,umask=0x20: the period is no part of the config */
+        REQUIRE(gen_attr_for_event_id(map, dispatch_blocked, cpu, &attr) == 0);
+        REQUIRE(attr.type == 4 && attr.config == (0x9 | 0x20 << 8) && attr.sample_period == 0);
+        REQUIRE(pmu_event_decode(dec, &attr, &decoded) == PMU_EVENT_DECODE_EXACT);
+        REQUIRE(decoded == dispatch_blocked);
+        attr.config |= 1ULL << 24;
+        REQUIRE(pmu_event_decode(dec, &attr, &decoded) == PMU_EVENT_DECODE_PARTIAL);
+        REQUIRE(decoded == dispatch_blocked);
+
+        attr.config = 0xb7;
+        attr.config1 = 0x10001;
+        REQUIRE(pmu_event_decode(dec, &attr, &decoded) == -1);
+        attr.type = 1234;
+        REQUIRE(pmu_event_decode(dec, &attr, &decoded) == -1);
+        pmu_event_decoder_free(dec);
+
+#if defined(__x86_64__) || defined(PMU_EVENTS_TEST_OFFLINE)
+        /* The CounterMask is decimal: cmask=16,event=0xc2,inv=1,umask=0x2 */
+        map = map_for_cpuid("x86", "GenuineIntel-6-55-4");
+        dec = pmu_event_decoder_new(map, NULL);
+        REQUIRE(dec != NULL);
+        pmu_event_id total_cycles;
+        REQUIRE(get_event_id(map, NULL, "uops_retired.total_cycles", &total_cycles) == 0);
+        memset(&attr, 0, sizeof(attr));
+        REQUIRE(gen_attr_for_event_id(map, total_cycles, cpu, &attr) == 0);
+        REQUIRE(attr.config == (0xc2 | 0x2 << 8 | 1 << 23 | 16ULL << 24));
+        REQUIRE(pmu_event_decode(dec, &attr, &decoded) == PMU_EVENT_DECODE_EXACT);
+        REQUIRE(decoded == total_cycles);
+        pmu_event_decoder_free(dec);
+#endif
+
+        pmu_topology_set(NULL);
+        remove_tree(root);
+    }
+
+    TEST_CASE("map_for_cpuid selects maps without looking at the local CPU");
+    {
+        const struct pmu_events_map* test_map = find_map("testarch");
+        REQUIRE(map_for_cpuid(NULL, "testcpu") == test_map);
+        REQUIRE(map_for_cpuid("testarch", "testcpu") == test_map);
+        REQUIRE(map_for_cpuid("x86", "testcpu") == NULL);
+        REQUIRE(map_for_cpuid(NULL, "nocpu") == NULL);
+        REQUIRE(map_for_cpuid(NULL, NULL) == NULL);
+
+#if defined(__x86_64__) || defined(PMU_EVENTS_TEST_OFFLINE)
+        /* The stepping is ignored for maps that do not list it */
+        const struct pmu_events_map* map = map_for_cpuid("x86", "GenuineIntel-6-5E-3");
+        REQUIRE(map != NULL && strcmp(map->cpuid, "GenuineIntel-6-(4E|5E|8E|9E|A5|A6)") == 0);
+        REQUIRE(map_for_cpuid("x86", "GenuineIntel-6-5E") == map);
+        REQUIRE(map_for_cpuid("x86", "GenuineIntel-6-5EE-3") == NULL);
+#endif
+#ifdef PMU_EVENTS_TEST_OFFLINE
+        /* Later variants and revisions of a part use the map of the part */
+        map = map_for_cpuid("arm64", "0x00000000410fd0c0");
+        REQUIRE(map != NULL && strcmp(map->arch, "arm64") == 0);
+        REQUIRE(map_for_cpuid(NULL, "0x00000000413fd0c1") == map);
+        REQUIRE(map_for_cpuid("x86", "0x00000000410fd0c0") == NULL);
+
+        map = map_for_cpuid("s390", "IBM 3931 703 A01 3.6.0 1a");
+        REQUIRE(map != NULL && strcmp(map->arch, "s390") == 0);
+#endif
+    }
+
+    TEST_CASE("pmu_event_set operations match a lookup by name");
+    {
+        const struct pmu_events_map* test_map = find_map("testarch");
+        struct pmu_event_set* all = pmu_event_set_new(test_map);
+        REQUIRE(all != NULL && all->num_ids == pmu_events_num_events(test_map));
+
+        struct pmu_event_set* same = pmu_event_set_intersect(all, all, PMU_EVENT_SET_SAME_ENCODING);
+        struct pmu_event_set* none = pmu_event_set_difference(all, all, 0);
+        REQUIRE(same != NULL && same->num_ids == all->num_ids);
+        REQUIRE(none != NULL && none->num_ids == 0);
+        pmu_event_set_free(same);
+        pmu_event_set_free(none);
+        pmu_event_set_free(all);
+
+#if defined(__x86_64__) || defined(PMU_EVENTS_TEST_OFFLINE)
+        /* skylakex and cascadelakex share most, but not all events */
+        struct pmu_event_set* skx = pmu_event_set_new(map_for_cpuid("x86", "GenuineIntel-6-55-4"));
+        struct pmu_event_set* clx = pmu_event_set_new(map_for_cpuid("x86", "GenuineIntel-6-55-7"));
+        REQUIRE(skx != NULL && clx != NULL && skx->map != clx->map);
+
+        struct pmu_event_set* common = pmu_event_set_intersect(skx, clx, 0);
+        struct pmu_event_set* only_skx = pmu_event_set_difference(skx, clx, 0);
+        struct pmu_event_set* common_encoding =
+            pmu_event_set_intersect(skx, clx, PMU_EVENT_SET_SAME_ENCODING);
+        struct pmu_event_pair* pairs;
+        size_t num_pairs;
+        REQUIRE(common != NULL && only_skx != NULL && common_encoding != NULL);
+        REQUIRE(pmu_event_set_join(skx, clx, PMU_EVENT_SET_SAME_ENCODING, &pairs, &num_pairs) == 0);
+
+        REQUIRE(common->num_ids + only_skx->num_ids == skx->num_ids);
+        REQUIRE(only_skx->num_ids > 0);
+        REQUIRE(common_encoding->num_ids > 0 && common_encoding->num_ids <= common->num_ids);
+        REQUIRE(num_pairs == common_encoding->num_ids);
+
+        size_t c = 0, o = 0;
+        for (size_t i = 0; i < skx->num_ids; i++)
+        {
+            struct pmu_event ev;
+            pmu_event_id id;
+            REQUIRE(get_event_by_id(skx->map, skx->ids[i], &ev) == 0);
+            if (get_event_id(clx->map, ev.pmu, ev.name, &id) == 0)
+            {
+                REQUIRE(c < common->num_ids && common->ids[c++] == skx->ids[i]);
+            }
+            else
+            {
+                REQUIRE(o < only_skx->num_ids && only_skx->ids[o++] == skx->ids[i]);
+            }
+        }
+
+        for (size_t i = 0; i < num_pairs; i++)
+        {
+            struct pmu_event ev_skx, ev_clx;
+            REQUIRE(pairs[i].a == common_encoding->ids[i]);
+            REQUIRE(get_event_by_id(skx->map, pairs[i].a, &ev_skx) == 0);
+            REQUIRE(get_event_by_id(clx->map, pairs[i].b, &ev_clx) == 0);
+            REQUIRE(strcmp(ev_skx.name, ev_clx.name) == 0 && strcmp(ev_skx.pmu, ev_clx.pmu) == 0);
+        }
+        free(pairs);
+        pmu_event_set_free(common_encoding);
+        pmu_event_set_free(only_skx);
+        pmu_event_set_free(common);
+        pmu_event_set_free(clx);
+        pmu_event_set_free(skx);
+#endif
+    }
+
+    TEST_CASE("metric_plan_new leads the topdown events with the slots event");
+    {
+#if defined(__x86_64__) || defined(PMU_EVENTS_TEST_OFFLINE)
+        const struct pmu_events_map* map = map_for_cpuid("x86", "GenuineIntel-6-6A-0");
+        REQUIRE(map != NULL);
+        const char* names[] = { "TopdownL1" };
+        struct metric_plan* plan = metric_plan_new(map, names, 1, 0);
+        REQUIRE(plan != NULL);
+
+        size_t num_topdown_groups = 0;
+        for (size_t g = 0; g < plan->num_groups; g++)
+        {
+            const struct metric_plan_group* group = &plan->groups[g];
+            size_t num_topdown = 0;
+            for (size_t i = 0; i < group->num_events; i++)
+            {
+                num_topdown += strncmp(plan->events[group->events[i]].name, "topdown-", 8) == 0;
+            }
+            if (num_topdown == 0)
+            {
+                continue;
+            }
+            num_topdown_groups++;
+            REQUIRE(num_topdown == 4);
+            REQUIRE(strcmp(plan->events[group->events[0]].name, "topdown.slots") == 0);
+        }
+        REQUIRE(num_topdown_groups == 1);
+        metric_plan_free(plan);
+#endif
+    }
+
+    TEST_CASE("gen_attr_for_plan_event handles sysfs aliases and extra terms");
+    {
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        REQUIRE(write_file(root, "devices/system/cpu/possible", "0\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/type", "4\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/event", "config:0-7\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/umask", "config:8-15\n") ==
+                0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/cmask", "config:24-31\n") ==
+                0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/edge", "config:18\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/inv", "config:23\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/events/topdown-retiring",
+                           "event=0x00,umask=0x80\n") == 0);
+
+        struct pmu_topology* topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        pmu_topology_set(topo);
+
+        const struct pmu_events_map* map = find_map("testarch");
+        struct perf_cpu cpu;
+        cpu.cpu = 0;
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+
+        struct metric_plan_event ev = { .pmu = "default_core",
+                                        .name = "topdown-retiring",
+                                        .id = PMU_EVENT_ID_NONE };
+        REQUIRE(gen_attr_for_plan_event(map, &ev, cpu, &attr) == 0);
+        REQUIRE(attr.type == 4 && attr.config == 0x8000);
+
+        ev.pmu = "cpu";
+        ev.name = "dispatch_blocked.any,cmask=1";
+        REQUIRE(gen_attr_for_plan_event(map, &ev, cpu, &attr) == 0);
+        REQUIRE(attr.type == 4 && attr.config == (0x9 | 0x20 << 8 | 1 << 24));
+
+        /* Terms without a value, as in "cpu@ICACHE_16B.IFDATA_STALL,cmask=1,edge@" */
+        ev.name = "dispatch_blocked.any,cmask=1,edge";
+        REQUIRE(gen_attr_for_plan_event(map, &ev, cpu, &attr) == 0);
+        REQUIRE(attr.config == (0x9 | 0x20 << 8 | 1 << 18 | 1 << 24));
+        ev.name = "dispatch_blocked.any,inv,cmask=1";
+        memset(&attr, 0, sizeof(attr));
+        REQUIRE(gen_attr_for_plan_event(map, &ev, cpu, &attr) == 0);
+        REQUIRE(attr.config == (0x9 | 0x20 << 8 | 1 << 23 | 1 << 24));
+
+        ev.name = "topdown-bad-spec";
+        REQUIRE(gen_attr_for_plan_event(map, &ev, cpu, &attr) == -1);
+
+        /* The test map has neither TopdownL1 metrics nor a slots alias */
+        REQUIRE(pmu_tma_new(map, &cpu, 1, 0) == NULL);
+        REQUIRE(pmu_tma_new(map, &cpu, 1, PMU_TMA_PERF_METRICS) == NULL);
+        pmu_topology_set(NULL);
+        remove_tree(root);
+    }
+
+    TEST_CASE("metric_plan_new keeps the modifiers of events");
+    {
+#if defined(__x86_64__) || defined(PMU_EVENTS_TEST_OFFLINE)
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        REQUIRE(write_file(root, "devices/system/cpu/possible", "0\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/type", "4\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/event", "config:0-7\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/umask", "config:8-15\n") ==
+                0);
+
+        struct pmu_topology* topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        pmu_topology_set(topo);
+
+        /* "CPU_CLK_UNHALTED.THREAD_P:k / CPU_CLK_UNHALTED.THREAD" and its ":k" events */
+        const struct pmu_events_map* map = map_for_cpuid("x86", "GenuineIntel-6-55-4");
+        REQUIRE(map != NULL);
+        const char* names[] = { "tma_info_system_kernel_utilization",
+                                "tma_info_system_kernel_cpi" };
+        struct metric_plan* plan = metric_plan_new(map, names, 2, 0);
+        REQUIRE(plan != NULL);
+        REQUIRE(plan->num_events == 3);
+
+        struct perf_cpu cpu = { .cpu = 0 };
+        size_t num_kernel = 0;
+        for (size_t i = 0; i < plan->num_events; i++)
+        {
+            const struct metric_plan_event* ev = &plan->events[i];
+            REQUIRE(strcmp(ev->pmu, "default_core") == 0 && ev->id != PMU_EVENT_ID_NONE);
+            REQUIRE(strchr(ev->name, ':') == NULL);
+
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            REQUIRE(gen_attr_for_plan_event(map, ev, cpu, &attr) == 0);
+            REQUIRE(attr.type == 4);
+            if (ev->modifiers != NULL)
+            {
+                REQUIRE(strcmp(ev->modifiers, "k") == 0);
+                REQUIRE(attr.exclude_user && attr.exclude_hv && !attr.exclude_kernel);
+                num_kernel++;
+            }
+            else
+            {
+                REQUIRE(strcmp(ev->name, "cpu_clk_unhalted.thread") == 0);
+                REQUIRE(!attr.exclude_user && !attr.exclude_kernel);
+            }
+        }
+        REQUIRE(num_kernel == 2);
+        metric_plan_free(plan);
+
+        struct metric_plan_event ev = { .pmu = "default_core",
+                                        .name = "cpu_clk_unhalted.thread_p",
+                                        .modifiers = "x" };
+        REQUIRE(get_event_id(map, ev.pmu, ev.name, &ev.id) == 0);
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        REQUIRE(gen_attr_for_plan_event(map, &ev, cpu, &attr) == -1);
+        pmu_topology_set(NULL);
+        remove_tree(root);
+#endif
+    }
+
+    TEST_CASE("metric_plan_new groups cpu@ references with the other core events");
+    {
+#if defined(__x86_64__) || defined(PMU_EVENTS_TEST_OFFLINE)
+        /* "ICACHE_16B.IFDATA_STALL + 2 * cpu@ICACHE_16B.IFDATA_STALL\\,cmask\\=1\\,edge@" */
+        const struct pmu_events_map* map = map_for_cpuid("x86", "GenuineIntel-6-55-4");
+        REQUIRE(map != NULL);
+        const char* names[] = { "tma_icache_misses" };
+        struct metric_plan* plan = metric_plan_new(map, names, 1, 0);
+        REQUIRE(plan != NULL);
+        REQUIRE(find_plan_event(plan, "default_core", "icache_16b.ifdata_stall,cmask=1,edge") !=
+                -1);
+        for (size_t i = 0; i < plan->num_events; i++)
+        {
+            REQUIRE(strcmp(plan->events[i].pmu, "default_core") == 0);
+        }
+        REQUIRE(plan->num_groups == 1 && plan->groups[0].num_events == plan->num_events);
+        metric_plan_free(plan);
+#endif
+    }
+
+    TEST_CASE("metric_plan_new splits groups that need more generic counters than there are");
+    {
+#if defined(__x86_64__) || defined(PMU_EVENTS_TEST_OFFLINE)
+        /* Haswell has 3 fixed and 4 generic counters per thread */
+        const struct pmu_events_map* map = map_for_cpuid("x86", "GenuineIntel-6-3C");
+        REQUIRE(map != NULL);
+        REQUIRE(pmu_events_num_generic_counters(map, "default_core") == 4);
+        REQUIRE(pmu_events_num_generic_counters(map, "uncore_cbox") == 0);
+
+        struct pmu_event ev;
+        REQUIRE(get_event_by_name(map, "cpu_clk_unhalted.thread", &ev) == 0 && ev.fixed_counter);
+        REQUIRE(get_event_by_name(map, "cpu_clk_unhalted.thread_p", &ev) == 0 &&
+                !ev.fixed_counter);
+
+        const char* names[] = { "tma_ports_utilized_0" };
+        struct metric_plan* plan = metric_plan_new(map, names, 1, 0);
+        REQUIRE(plan != NULL);
+        size_t num_core_groups = 0, num_grouped = 0;
+        for (size_t g = 0; g < plan->num_groups; g++)
+        {
+            const struct metric_plan_group* group = &plan->groups[g];
+            size_t num_generic = 0;
+            for (size_t i = 0; i < group->num_events; i++)
+            {
+                const struct metric_plan_event* pe = &plan->events[group->events[i]];
+                REQUIRE(strcmp(pe->pmu, "default_core") == 0);
+                num_generic += pe->id == PMU_EVENT_ID_NONE ||
+                               (get_event_by_id(map, pe->id, &ev) == 0 && !ev.fixed_counter);
+            }
+            REQUIRE(num_generic <= 4);
+            num_core_groups++;
+            num_grouped += group->num_events;
+        }
+        REQUIRE(num_core_groups == 2 && num_grouped == plan->num_events);
+        metric_plan_free(plan);
+#endif
+    }
+
+    TEST_CASE("gen_sample_attr_for_event sets up precise and memory sampling");
+    {
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        REQUIRE(write_file(root, "devices/system/cpu/possible", "0\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/type", "4\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/event", "config:0-7\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/umask", "config:8-15\n") ==
+                0);
+
+        struct pmu_topology* topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        pmu_topology_set(topo);
+
+        const struct pmu_events_map* map = find_map("testarch");
+        struct perf_cpu cpu = { .cpu = 0 };
+        struct pmu_event ev;
+        REQUIRE(get_event_by_name(map, "mem_trans_retired.load_latency_gt_4", &ev) == 0);
+        REQUIRE(ev.precise == 2 && ev.data_la);
+
+        /* Without an ldlat format, the threshold goes to config1 as a whole */
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        REQUIRE(gen_attr_for_event(&ev, cpu, &attr) == 0);
+        REQUIRE(attr.config == 0x1cd && attr.config1 == 4);
+        REQUIRE(attr.sample_period == 0 && attr.precise_ip == 0);
+
+        memset(&attr, 0, sizeof(attr));
+        REQUIRE(gen_sample_attr_for_event(&ev, cpu, PMU_EVENT_SAMPLE, &attr) == 0);
+        REQUIRE(attr.sample_period == 100003 && attr.precise_ip == 2 && attr.sample_type == 0);
+
+        memset(&attr, 0, sizeof(attr));
+        REQUIRE(gen_sample_attr_for_event(&ev, cpu, PMU_EVENT_SAMPLE_MEM, &attr) == 0);
+        REQUIRE(attr.sample_type == PMU_EVENT_SAMPLE_MEM_TYPE && attr.mmap_data);
+        REQUIRE(attr.config1 == 4 && attr.sample_period == 100003);
+
+        REQUIRE(get_event_by_name(map, "eist_trans", &ev) == 0);
+        REQUIRE(ev.precise == 0 && !ev.data_la);
+        memset(&attr, 0, sizeof(attr));
+        REQUIRE(gen_sample_attr_for_event(&ev, cpu, PMU_EVENT_SAMPLE, &attr) == 0);
+        REQUIRE(attr.sample_period == 200000 && attr.precise_ip == 0);
+        REQUIRE(gen_sample_attr_for_event(&ev, cpu, PMU_EVENT_SAMPLE_MEM, &attr) == -1);
+        pmu_topology_set(NULL);
+        remove_tree(root);
+    }
+
+    TEST_CASE("get_event_by_name falls back to the sysfs aliases");
+    {
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        REQUIRE(write_file(root, "devices/system/cpu/possible", "0\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/type", "4\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/event", "config:0-7\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/events/ref-cycles",
+                           "config=0x300\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/power/type", "17\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/power/format/event",
+                           "config:0-7\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/power/events/energy-pkg",
+                           "event=0x02\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/power/events/energy-pkg.scale",
+                           "2.3283064365386962890625e-10\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/power/events/energy-pkg.unit",
+                           "Joules\n") == 0);
+
+        struct pmu_topology* topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        pmu_topology_set(topo);
+
+        const struct pmu_events_map* map = find_map("testarch");
+        struct perf_cpu cpu;
+        cpu.cpu = 0;
+        struct pmu_event ev;
+        struct perf_event_attr attr;
+        REQUIRE(get_event_by_name(map, "energy-pkg", &ev) == 0);
+        REQUIRE(strcmp(ev.pmu, "power") == 0 && strcmp(ev.event, "event=0x02") == 0);
+        REQUIRE(strcmp(ev.unit, "2.3283064365386962890625e-10Joules") == 0);
+        memset(&attr, 0, sizeof(attr));
+        REQUIRE(gen_attr_for_event(&ev, cpu, &attr) == 0);
+        REQUIRE(attr.type == 17 && attr.config == 2);
+
+        REQUIRE(get_event_by_name(map, "ref-cycles", &ev) == 0);
+        REQUIRE(strcmp(ev.pmu, "cpu") == 0 && ev.unit == NULL);
+        memset(&attr, 0, sizeof(attr));
+        REQUIRE(gen_attr_for_event(&ev, cpu, &attr) == 0);
+        REQUIRE(attr.type == 4 && attr.config == 0x300);
+
+        struct pmu_event_alias alias;
+        int power = pmu_topology_find_pmu(topo, "power");
+        REQUIRE(pmu_topology_pmu_alias(topo, power, "energy-pkg", &alias) == 0);
+        REQUIRE(alias.scale > 2.32e-10 && alias.scale < 2.33e-10);
+        REQUIRE(strcmp(alias.unit, "Joules") == 0);
+        REQUIRE(pmu_topology_pmu_alias(topo, power, "energy-pkg.scale", &alias) == -1);
+        REQUIRE(pmu_topology_pmu_alias(topo, power, "ref-cycles", &alias) == -1);
+
+        /* Saved snapshots keep their aliases, rather than reading those of the root again */
+        char path[] = "/tmp/pmu-events-topology-XXXXXX";
+        int fd = mkstemp(path);
+        REQUIRE(fd != -1);
+        close(fd);
+        REQUIRE(pmu_topology_save(topo, path) == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/power/events/energy-pkg",
+                           "event=0x03\n") == 0);
+        struct pmu_topology* loaded = pmu_topology_load(path);
+        unlink(path);
+        REQUIRE(loaded != NULL);
+        REQUIRE(pmu_topology_pmu_alias(loaded, power, "energy-pkg", &alias) == 0);
+        REQUIRE(strcmp(alias.event, "event=0x02") == 0);
+        REQUIRE(alias.scale > 2.32e-10 && alias.scale < 2.33e-10);
+        REQUIRE(strcmp(alias.unit, "Joules") == 0);
+        int core = pmu_topology_find_pmu(loaded, "cpu");
+        REQUIRE(pmu_topology_pmu_alias(loaded, core, "ref-cycles", &alias) == 0);
+        REQUIRE(strcmp(alias.event, "config=0x300") == 0 && alias.unit == NULL);
+        REQUIRE(alias.scale == 1.0);
+        pmu_topology_free(loaded);
+
+        /* Concurrent first lookups on a shared snapshot */
+        struct pmu_topology* shared = pmu_topology_new(root);
+        REQUIRE(shared != NULL);
+        pthread_t threads[4];
+        for (size_t i = 0; i < 4; i++)
+        {
+            REQUIRE(pthread_create(&threads[i], NULL, lookup_alias, shared) == 0);
+        }
+        for (size_t i = 0; i < 4; i++)
+        {
+            void* found;
+            REQUIRE(pthread_join(threads[i], &found) == 0 && found == shared);
+        }
+        pmu_topology_free(shared);
+
+        /* The tables come first */
+        REQUIRE(get_event_by_name(map, "dispatch_blocked.any", &ev) == 0);
+        REQUIRE(strstr(ev.event, "umask=0x20") != NULL);
+        REQUIRE(get_event_by_name(map, "no-such-alias", &ev) == -1);
+        pmu_topology_set(NULL);
+        remove_tree(root);
+    }
+
+    TEST_CASE("pmu_parse_events resolves perf event specifications");
+    {
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        REQUIRE(write_file(root, "devices/system/cpu/possible", "0\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/type", "4\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/event", "config:0-7\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/umask", "config:8-15\n") ==
+                0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/inv", "config:23\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/cmask", "config:24-31\n") ==
+                0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/events/cycles", "event=0x3c\n") ==
+                0);
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_imc_0/type", "12\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_imc_0/format/event",
+                           "config:0-7\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_imc_0/format/umask",
+                           "config:8-15\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_imc_0/events/cas_count_read",
+                           "event=0x04,umask=0x3\n") == 0);
+
+        struct pmu_topology* topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        pmu_topology_set(topo);
+
+        const struct pmu_events_map* map = find_map("testarch");
+        struct perf_cpu cpu = { .cpu = 0 };
+        struct pmu_parsed_event events[4];
+        size_t offset;
+
+        const char* spec = "cpu/event=0x3c,umask=0,cmask=1,inv/ukpp";
+        REQUIRE(pmu_parse_events(map, cpu, spec, events, 4, &offset) == 1);
+        REQUIRE(events[0].spec == spec && events[0].spec_len == strlen(spec));
+        REQUIRE(events[0].attr.type == 4 && events[0].attr.config == (0x3c | 1 << 23 | 1 << 24));
+        REQUIRE(!events[0].attr.exclude_user && !events[0].attr.exclude_kernel);
+        REQUIRE(events[0].attr.exclude_hv && events[0].attr.precise_ip == 2);
+
+        REQUIRE(pmu_parse_events(map, cpu, "{cycles,EIST_TRANS}:S", events, 4, &offset) == 2);
+        REQUIRE(events[0].leader == 0 && events[1].leader == 0);
+        REQUIRE(events[0].attr.config == 0x3c && events[1].attr.config == 0x3a);
+        REQUIRE(events[0].attr.sample_type & PERF_SAMPLE_READ);
+        REQUIRE(events[0].attr.read_format & PERF_FORMAT_GROUP);
+        REQUIRE(events[1].attr.sample_type == 0);
+
+        spec = "uncore_imc/cas_count_read/,eist_trans:u,cpu/period=1000,name=x/D,r1a8";
+        REQUIRE(pmu_parse_events(map, cpu, spec, events, 4, &offset) == 4);
+        REQUIRE(events[0].attr.type == 12 && events[0].attr.config == 0x304);
+        REQUIRE(events[1].leader == 1 && events[1].spec_len == strlen("eist_trans:u"));
+        REQUIRE(events[1].attr.exclude_kernel && !events[1].attr.exclude_user);
+        REQUIRE(events[2].attr.sample_period == 1000 && events[2].attr.pinned);
+        REQUIRE(events[3].attr.type == PERF_TYPE_RAW && events[3].attr.config == 0x1a8);
+
+        REQUIRE(pmu_parse_events(map, cpu, "cpu/event=0x3c,bogus/", events, 4, &offset) == -1);
+        REQUIRE(errno == ENOENT && offset == strlen("cpu/event=0x3c,"));
+        REQUIRE(pmu_parse_events(map, cpu, "cycles:uq", events, 4, &offset) == -1);
+        REQUIRE(errno == EINVAL && offset == strlen("cycles:u"));
+        REQUIRE(pmu_parse_events(map, cpu, "{cycles", events, 4, &offset) == -1);
+        REQUIRE(errno == EINVAL && offset == strlen("{cycles"));
+        REQUIRE(pmu_parse_events(map, cpu, "cycles:pppp", events, 4, &offset) == -1);
+        REQUIRE(pmu_parse_events(map, cpu, "cycles,cycles", events, 1, &offset) == -1);
+        REQUIRE(errno == ENOSPC && offset == strlen("cycles,"));
+        pmu_topology_set(NULL);
+        remove_tree(root);
+    }
+
+    TEST_CASE("pmu_tma_from_perf_metrics splits the slots");
+    {
+        /* Level 1: 102, 25, 51 and 77 of 255, level 2: 51, 20, 30 and 40 of 255 */
+        uint64_t perf_metrics = 0x281e1433ULL << 32 | 0x4d331966ULL;
+        double values[PMU_TMA_NUM_NODES];
+
+        pmu_tma_from_perf_metrics(perf_metrics, true, values);
+        REQUIRE(fabs(values[PMU_TMA_RETIRING] - 0.4) < 1e-9);
+        REQUIRE(fabs(values[PMU_TMA_BACKEND_BOUND] - 77 / 255.0) < 1e-9);
+        REQUIRE(fabs(values[PMU_TMA_HEAVY_OPERATIONS] - 0.2) < 1e-9);
+        REQUIRE(fabs(values[PMU_TMA_LIGHT_OPERATIONS] - 0.2) < 1e-9);
+        REQUIRE(fabs(values[PMU_TMA_MACHINE_CLEARS] - 5 / 255.0) < 1e-9);
+        REQUIRE(fabs(values[PMU_TMA_FETCH_BANDWIDTH] - 21 / 255.0) < 1e-9);
+        REQUIRE(fabs(values[PMU_TMA_CORE_BOUND] - 37 / 255.0) < 1e-9);
+
+        pmu_tma_from_perf_metrics(perf_metrics, false, values);
+        REQUIRE(fabs(values[PMU_TMA_BAD_SPECULATION] - 25 / 255.0) < 1e-9);
+        REQUIRE(isnan(values[PMU_TMA_MEMORY_BOUND]));
+
+        pmu_tma_from_perf_metrics(0, true, values);
+        REQUIRE(isnan(values[PMU_TMA_RETIRING]));
+
+        REQUIRE(strcmp(pmu_tma_node_name(PMU_TMA_CORE_BOUND), "tma_core_bound") == 0);
+        REQUIRE(pmu_tma_node_name(PMU_TMA_NUM_NODES) == NULL);
+    }
+
+    TEST_CASE("pmu_events_cache serves the attrs of gen_attr_for_event_id");
+    {
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        REQUIRE(write_file(root, "devices/system/cpu/possible", "0-1\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/type", "4\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/event", "config:0-7\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/umask", "config:8-15\n") ==
+                0);
+        struct pmu_topology* topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        pmu_topology_set(topo);
+
+        char path[256];
+        snprintf(path, sizeof(path), "%s/run/cache", root);
+        const struct pmu_events_map* map = find_map("testarch");
+        REQUIRE(pmu_events_cache_open(map, path, root) == NULL);
+        REQUIRE(pmu_events_cache_build(map, path, 0) == 0);
+        struct pmu_events_cache* cache = pmu_events_cache_open(map, path, root);
+        REQUIRE(cache != NULL);
+
+        size_t num_resolved = 0;
+        for (pmu_event_id id = 0; id < pmu_events_num_events(map); id++)
+        {
+            struct perf_cpu cpu;
+            cpu.cpu = id % 2;
+            struct perf_event_attr attr, cached;
+            memset(&attr, 0, sizeof(attr));
+            memset(&cached, 0, sizeof(cached));
+            int flags = pmu_events_cache_lookup(cache, id, cpu, &cached);
+            REQUIRE(flags != -1 && !(flags & PMU_EVENTS_CACHE_PROBED));
+            REQUIRE((gen_attr_for_event_id(map, id, cpu, &attr) == 0) ==
+                    ((flags & PMU_EVENTS_CACHE_RESOLVED) != 0));
+            REQUIRE(memcmp(&attr, &cached, sizeof(attr)) == 0);
+            num_resolved += (flags & PMU_EVENTS_CACHE_RESOLVED) != 0;
+        }
+        REQUIRE(num_resolved > 0);
+        struct perf_cpu cpu;
+        cpu.cpu = 2;
+        struct perf_event_attr attr;
+        REQUIRE(pmu_events_cache_lookup(cache, 0, cpu, &attr) == -1);
+        cpu.cpu = 0;
+        REQUIRE(pmu_events_cache_lookup(cache, pmu_events_num_events(map), cpu, &attr) == -1);
+
+        /* The cache goes stale with the PMUs, but stays mapped for its users */
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_imc_0/type", "12\n") == 0);
+        REQUIRE(pmu_events_cache_open(map, path, root) == NULL);
+        REQUIRE(pmu_events_cache_lookup(cache, 0, cpu, &attr) != -1);
+        pmu_events_cache_close(cache);
+        pmu_topology_set(NULL);
+        remove_tree(root);
+    }
+
+    TEST_CASE("pmu_count_scale extrapolates multiplexed counts");
+    {
+        struct pmu_count count;
+
+        pmu_count_scale(&count, 100, 1000, 1000, 1000);
+        REQUIRE(count.scaled == 100.0 && count.running_fraction == 1.0 && count.flags == 0);
+
+        pmu_count_scale(&count, 100, 1000, 250, 1000);
+        REQUIRE(count.scaled == 400.0 && count.running_fraction == 0.25);
+        REQUIRE(count.flags == PMU_COUNT_MULTIPLEXED);
+
+        pmu_count_scale(&count, 0, 1000, 0, 1000);
+        REQUIRE(count.scaled == 0.0 && count.flags == PMU_COUNT_NEVER_RAN);
+
+        /* user-space rotation scales to the session time instead */
+        pmu_count_scale(&count, 100, 500, 500, 2000);
+        REQUIRE(count.scaled == 400.0 && count.running_fraction == 0.25);
+    }
+
+    TEST_CASE("pmu_session rotates groups in user-space")
+    {
+        struct perf_cpu cpu;
+        cpu.cpu = 0;
+        struct pmu_session* session = pmu_session_new(&cpu, 1);
+        REQUIRE(session != NULL);
+
+        struct pmu_session_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.name = "cpu-clock";
+        ev.attr.type = PERF_TYPE_SOFTWARE;
+        ev.attr.config = PERF_COUNT_SW_CPU_CLOCK;
+        REQUIRE(pmu_session_add_group(session, &ev, 1) == 0);
+        REQUIRE(pmu_session_add_group(session, &ev, 1) == 1);
+
+        REQUIRE(pmu_session_open(session) == 0);
+        REQUIRE(pmu_session_set_rotation(session, 1, 0) == 0);
+        REQUIRE(pmu_session_enable(session) == 0);
+        usleep(20000);
+        REQUIRE(pmu_session_tick(session) == 1);
+        usleep(20000);
+        REQUIRE(pmu_session_disable(session) == 0);
+
+        struct pmu_count counts[2];
+        REQUIRE(pmu_session_read(session, counts) == 0);
+        for (int i = 0; i < 2; i++)
+        {
+            REQUIRE(counts[i].raw > 0);
+            REQUIRE(counts[i].flags == PMU_COUNT_MULTIPLEXED);
+            REQUIRE(counts[i].running_fraction > 0.2 && counts[i].running_fraction < 0.8);
+        }
+        pmu_session_free(session);
+    }
+
+    TEST_CASE("pmu_session counts software and tool events")
+    {
+        const struct pmu_events_map* map = find_map("testarch");
+        struct perf_cpu cpu;
+        cpu.cpu = 0;
+        struct pmu_event pe;
+        const char* names[] = { "duration_time", "cpu-clock", "user_time", "num_cpus" };
+        struct pmu_session_event evs[4];
+        memset(evs, 0, sizeof(evs));
+        for (int i = 0; i < 4; i++)
+        {
+            REQUIRE(get_event_by_name(map, names[i], &pe) == 0);
+            evs[i].name = names[i];
+            REQUIRE(gen_attr_for_event(&pe, cpu, &evs[i].attr) == 0);
+        }
+        REQUIRE(evs[0].attr.type == PMU_EVENTS_TYPE_TOOL && evs[0].attr.config == 1);
+        REQUIRE(evs[1].attr.type == PERF_TYPE_SOFTWARE);
+        REQUIRE(evs[1].attr.config == PERF_COUNT_SW_CPU_CLOCK);
+        REQUIRE(get_event_by_name(map, "cs", &pe) == 0 && strcmp(pe.pmu, "software") == 0);
+
+        struct pmu_session* session = pmu_session_new(&cpu, 1);
+        REQUIRE(session != NULL);
+        /* The tool event before cpu-clock does not lead the group in the kernel */
+        REQUIRE(pmu_session_add_group(session, evs, 3) == 0);
+        REQUIRE(pmu_session_add_group(session, &evs[3], 1) == 1);
+        REQUIRE(pmu_session_open(session) == 0);
+        REQUIRE(pmu_session_enable(session) == 0);
+        usleep(20000);
+        REQUIRE(pmu_session_disable(session) == 0);
+
+        struct pmu_count counts[4];
+        REQUIRE(pmu_session_read(session, counts) == 0);
+        REQUIRE(counts[0].raw >= 20000000 && counts[0].raw == counts[0].time_enabled);
+        REQUIRE(counts[1].raw > 0);
+        REQUIRE(counts[2].running_fraction == 1.0);
+        double num_cpus = 0;
+        metric_literal_value("num_cpus", &num_cpus);
+        REQUIRE(counts[3].raw == (uint64_t)num_cpus);
+
+        /* Nothing is counted while the session is disabled */
+        usleep(1000);
+        struct pmu_count later[4];
+        REQUIRE(pmu_session_read(session, later) == 0);
+        REQUIRE(later[0].raw == counts[0].raw && later[2].raw == counts[2].raw);
+        pmu_session_free(session);
+
+        struct pmu_session_event bad = evs[0];
+        bad.attr.config = 99;
+        session = pmu_session_new(&cpu, 1);
+        REQUIRE(pmu_session_add_group(session, &bad, 1) == 0);
+        REQUIRE(pmu_session_open(session) == -1 && errno == EINVAL);
+        pmu_session_free(session);
+    }
+
+    TEST_CASE("pmu_session opens per-package groups once per package")
+    {
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        REQUIRE(write_file(root, "devices/system/cpu/possible", "0-1\n") == 0);
+        REQUIRE(write_file(root, "devices/system/cpu/cpu0/topology/physical_package_id",
+                           "0\n") == 0);
+        REQUIRE(write_file(root, "devices/system/cpu/cpu1/topology/physical_package_id",
+                           "0\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/type", "4\n") == 0);
+        struct pmu_topology* topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        pmu_topology_set(topo);
+
+        /* The same CPU twice stands in for two CPUs of one package */
+        struct perf_cpu cpus[2];
+        cpus[0].cpu = 0;
+        cpus[1].cpu = 0;
+        struct pmu_session_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.name = "cpu-clock";
+        ev.attr.type = PERF_TYPE_SOFTWARE;
+        ev.attr.config = PERF_COUNT_SW_CPU_CLOCK;
+        ev.per_package = true;
+
+        struct pmu_count counts[2];
+        struct pmu_session* session = pmu_session_new(cpus, 2);
+        REQUIRE(pmu_session_add_group(session, &ev, 1) == 0);
+        REQUIRE(pmu_session_open(session) == 0);
+        REQUIRE(pmu_session_cpu_package(session, 1) == 0);
+        struct pmu_cpuset placed = PMU_CPUSET_INIT;
+        REQUIRE(pmu_session_group_cpus(session, 0, &placed) == 0);
+        REQUIRE(pmu_cpuset_count(&placed) == 1 && pmu_cpuset_test(&placed, 0));
+        pmu_cpuset_release(&placed);
+        REQUIRE(pmu_session_enable(session) == 0);
+        usleep(1000);
+        REQUIRE(pmu_session_disable(session) == 0);
+        REQUIRE(pmu_session_read(session, counts) == 0);
+        REQUIRE(counts[0].raw > 0 && counts[0].flags == PMU_COUNT_PACKAGE);
+        REQUIRE(counts[1].raw == 0 && counts[1].flags == PMU_COUNT_NOT_PLACED);
+        pmu_session_free(session);
+
+        /* Uncore PMUs are placed on their cpumask, here on a CPU outside of the session */
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_fake/type", "1\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_fake/cpumask", "1\n") == 0);
+        topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        pmu_topology_set(topo);
+        ev.per_package = false;
+        session = pmu_session_new(cpus, 2);
+        REQUIRE(pmu_session_add_group(session, &ev, 1) == 0);
+        REQUIRE(pmu_session_open(session) == 0);
+        REQUIRE(pmu_session_read(session, counts) == 0);
+        REQUIRE(counts[0].flags & PMU_COUNT_PACKAGE);
+        REQUIRE(counts[1].flags == PMU_COUNT_NOT_PLACED);
+        pmu_session_free(session);
+        pmu_topology_set(NULL);
+        remove_tree(root);
+    }
+
+    TEST_CASE("pmu_session_open_budget degrades the session to fit the fds")
+    {
+        struct perf_cpu cpu;
+        cpu.cpu = 0;
+        struct pmu_session* session = pmu_session_new(&cpu, 1);
+        struct pmu_session_event evs[3];
+        memset(evs, 0, sizeof(evs));
+        const uint64_t configs[] = { PERF_COUNT_SW_CPU_CLOCK, PERF_COUNT_SW_TASK_CLOCK,
+                                     PERF_COUNT_SW_PAGE_FAULTS };
+        for (int i = 0; i < 3; i++)
+        {
+            evs[i].name = "sw";
+            evs[i].attr.type = PERF_TYPE_SOFTWARE;
+            evs[i].attr.config = configs[i];
+        }
+        /* { cpu-clock, task-clock }, { cpu-clock, page-faults }, { cpu-clock, 2 x page-faults } */
+        REQUIRE(pmu_session_add_group(session, evs, 2) == 0);
+        evs[1].attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+        REQUIRE(pmu_session_add_group(session, evs, 2) == 1);
+        REQUIRE(pmu_session_add_group(session, evs, 3) == 2);
+
+        struct pmu_session_budget budget;
+        REQUIRE(pmu_session_open_budget(session, 2, &budget) == 0);
+        REQUIRE(budget.required_fds == 7 && budget.available_fds == 2);
+        REQUIRE(budget.raised_limit == 0 && budget.merged_events == 4);
+        REQUIRE(budget.dropped_groups == 0 && budget.open_groups == 1);
+        REQUIRE(pmu_session_event_flags(session, 0) == PMU_COUNT_MULTIPLEXED);
+        REQUIRE(pmu_session_event_flags(session, 2) ==
+                (PMU_COUNT_MERGED | PMU_COUNT_MULTIPLEXED));
+
+        REQUIRE(pmu_session_enable(session) == 0);
+        usleep(10000);
+        REQUIRE(pmu_session_tick(session) == 1);
+        usleep(10000);
+        REQUIRE(pmu_session_disable(session) == 0);
+
+        struct pmu_count counts[7];
+        REQUIRE(pmu_session_read(session, counts) == 0);
+        REQUIRE(counts[0].raw > 0 && (counts[0].flags & PMU_COUNT_MULTIPLEXED));
+        REQUIRE(counts[2].raw == counts[0].raw && (counts[2].flags & PMU_COUNT_MERGED));
+        REQUIRE(counts[6].flags & PMU_COUNT_MERGED);
+        pmu_session_free(session);
+
+        /* A group of three events never fits into two fds */
+        session = pmu_session_new(&cpu, 1);
+        REQUIRE(pmu_session_add_group(session, evs, 3) == 0);
+        REQUIRE(pmu_session_open_budget(session, 2, &budget) == 0);
+        REQUIRE(budget.dropped_groups == 1);
+        REQUIRE(pmu_session_read(session, counts) == 0);
+        REQUIRE(counts[0].flags == PMU_COUNT_DROPPED && counts[0].raw == 0);
+        pmu_session_free(session);
+    }
+
+    TEST_CASE("pmu_session_use_io_uring reads the same counts as read()")
+    {
+        struct perf_cpu cpu;
+        cpu.cpu = 0;
+        struct pmu_session* session = pmu_session_new(&cpu, 1);
+        struct pmu_session_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.name = "page-faults";
+        ev.attr.type = PERF_TYPE_SOFTWARE;
+        ev.attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+        for (int i = 0; i < 3; i++)
+        {
+            REQUIRE(pmu_session_add_group(session, &ev, 1) == i);
+        }
+        REQUIRE(pmu_session_use_io_uring(session) == -1);
+        REQUIRE(pmu_session_open(session) == 0);
+        REQUIRE(pmu_session_enable(session) == 0);
+        char* mem = malloc(1 << 22);
+        memset(mem, 1, 1 << 22);
+        free(mem);
+        REQUIRE(pmu_session_disable(session) == 0);
+
+        struct pmu_count plain[3], batched[3];
+        REQUIRE(pmu_session_read(session, plain) == 0 && plain[0].raw > 0);
+        /* Sandboxes may not allow io_uring, there is nothing to compare then */
+        int ret = pmu_session_use_io_uring(session);
+        REQUIRE(ret == 0 || errno == ENOSYS || errno == EPERM);
+        if (ret == 0)
+        {
+            REQUIRE(pmu_session_read(session, batched) == 0);
+            for (int i = 0; i < 3; i++)
+            {
+                REQUIRE(batched[i].raw == plain[i].raw);
+                REQUIRE(batched[i].time_enabled == plain[i].time_enabled);
+            }
+        }
+        pmu_session_free(session);
+    }
+
+    TEST_CASE("pmu_session_overflows reports the armed events that overflowed")
+    {
+        struct perf_cpu cpu = { .cpu = 0 };
+        struct pmu_session* session = pmu_session_new(&cpu, 1);
+        struct pmu_session_event ev[2];
+        memset(ev, 0, sizeof(ev));
+        ev[0].name = "cpu-clock";
+        ev[0].attr.type = PERF_TYPE_SOFTWARE;
+        ev[0].attr.config = PERF_COUNT_SW_CPU_CLOCK;
+        ev[1].name = "task-clock";
+        ev[1].attr.type = PERF_TYPE_SOFTWARE;
+        ev[1].attr.config = PERF_COUNT_SW_TASK_CLOCK;
+        REQUIRE(pmu_session_add_group(session, ev, 2) == 0);
+        REQUIRE(pmu_session_add_group(session, ev, 1) == 1);
+
+        /* Every ms of CPU time */
+        REQUIRE(pmu_session_arm(session, 1, 1000000) == 0);
+        REQUIRE(pmu_session_arm(session, 3, 1000000) == -1);
+        REQUIRE(pmu_session_notify_fd(session) == -1);
+        REQUIRE(pmu_session_open(session) == 0);
+        REQUIRE(pmu_session_arm(session, 2, 1000000) == -1);
+
+        struct pollfd pfd = { .fd = pmu_session_notify_fd(session), .events = POLLIN };
+        REQUIRE(pfd.fd != -1);
+        struct pmu_overflow overflows[4];
+        REQUIRE(pmu_session_overflows(session, overflows, 4) == 0);
+        REQUIRE(pmu_session_enable(session) == 0);
+        uint64_t start = session_now_ns();
+        while (session_now_ns() - start < 20000000)
+        {
+        }
+        REQUIRE(poll(&pfd, 1, 1000) == 1 && (pfd.revents & POLLIN));
+        REQUIRE(pmu_session_overflows(session, overflows, 4) == 1);
+        REQUIRE(overflows[0].event == 1 && overflows[0].cpu == 0);
+        REQUIRE(overflows[0].overflows > 0);
+
+        struct pmu_count counts[3];
+        REQUIRE(pmu_session_disable(session) == 0);
+        REQUIRE(pmu_session_read(session, counts) == 0 && counts[1].raw >= 1000000);
+        pmu_session_free(session);
+    }
+
+    TEST_CASE("pmu_sampler adapts the sampling period to the budget")
+    {
+        struct pmu_event eist;
+        REQUIRE(get_event_by_name(find_map("testarch"), "eist_trans", &eist) == 0);
+        REQUIRE(pmu_event_sample_after_value(&eist) == 200000);
+        struct pmu_event leading_zero = { .event = "event=0x3c,period=0100" };
+        REQUIRE(pmu_event_sample_after_value(&leading_zero) == 100);
+        struct pmu_event no_event = { .name = "no_event" };
+        REQUIRE(pmu_event_sample_after_value(&no_event) == 0);
+
+        /* 5000 samples per second of a busy CPU, 5 times what the budget allows */
+        struct perf_cpu cpu = { .cpu = 0 };
+        struct pmu_sampler_budget budget = { .samples_per_sec = 1000 };
+        struct pmu_sampler_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.name = "cpu-clock";
+        ev.attr.type = PERF_TYPE_SOFTWARE;
+        ev.attr.config = PERF_COUNT_SW_CPU_CLOCK;
+        ev.attr.sample_period = 200000;
+        ev.attr.sample_type = PERF_SAMPLE_IP;
+
+        struct pmu_sampler* sampler = pmu_sampler_new(&cpu, 1, &budget);
+        REQUIRE(sampler != NULL);
+        REQUIRE(pmu_sampler_add_event(sampler, &ev) == 0);
+        REQUIRE(pmu_sampler_open(sampler, 8) == 0);
+        REQUIRE(pmu_sampler_enable(sampler) == 0);
+        uint64_t start = session_now_ns();
+        while (session_now_ns() - start < 50000000)
+        {
+        }
+        REQUIRE(pmu_sampler_poll(sampler, NULL, NULL) > 0);
+        REQUIRE(pmu_sampler_adjust(sampler) == 0);
+
+        struct pmu_sampler_state state;
+        REQUIRE(pmu_sampler_state(sampler, 0, 0, &state) == 0);
+        REQUIRE(state.samples_per_sec > 0);
+        REQUIRE(state.period > 200000 && state.period <= 200000 * PMU_SAMPLER_MAX_STEP);
+        REQUIRE(pmu_sampler_state(sampler, 1, 0, &state) == -1);
+        pmu_sampler_free(sampler);
+    }
+
+    TEST_CASE("pmu_cgroups attaches and detaches cgroups")
+    {
+        struct perf_cpu cpu;
+        cpu.cpu = 0;
+        struct pmu_session* session = pmu_session_new(&cpu, 1);
+        struct pmu_session_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.name = "cpu-clock";
+        ev.attr.type = PERF_TYPE_SOFTWARE;
+        ev.attr.config = PERF_COUNT_SW_CPU_CLOCK;
+        REQUIRE(pmu_session_add_group(session, &ev, 1) == 0);
+        struct pmu_cgroups* cgroups = pmu_cgroups_new(session);
+        pmu_session_free(session);
+        REQUIRE(cgroups != NULL);
+
+        REQUIRE(pmu_cgroups_attach(cgroups, "/no-such-cgroup") == -1 && errno == ENOENT);
+        REQUIRE(pmu_cgroups_detach(cgroups, 0) == -1);
+        REQUIRE(pmu_cgroups_enable(cgroups) == 0);
+
+        /* Only the v2 hierarchy has the perf_event controller everywhere */
+        int id = pmu_cgroups_attach(cgroups, "/sys/fs/cgroup");
+        if (id == -1)
+        {
+            id = pmu_cgroups_attach(cgroups, "/sys/fs/cgroup/unified");
+        }
+        if (id != -1)
+        {
+            struct pmu_count count;
+            REQUIRE(id == 0 && pmu_cgroups_read(cgroups, id, &count) == 0);
+            REQUIRE(pmu_cgroups_attach(cgroups, "/sys/fs/cgroup/unified") == 1 ||
+                    pmu_cgroups_attach(cgroups, "/sys/fs/cgroup") == 1);
+            REQUIRE(pmu_cgroups_num_attached(cgroups) == 2);
+            REQUIRE(pmu_cgroups_detach(cgroups, id) == 0);
+            REQUIRE(pmu_cgroups_read(cgroups, id, &count) == -1);
+            REQUIRE(pmu_cgroups_num_attached(cgroups) == 1);
+        }
+        pmu_cgroups_free(cgroups);
+    }
+
+    TEST_CASE("pmu_events_stats counts the work done on every thread")
+    {
+        const struct pmu_events_map* map = find_map("testarch");
+        struct pmu_events_stats stats;
+        struct pmu_event ev;
+        pmu_events_stats_enable(PMU_EVENTS_STATS_COUNTERS | PMU_EVENTS_STATS_LATENCY);
+        pmu_events_stats_reset();
+
+        REQUIRE(get_event_by_name(map, "eist_trans", &ev) == 0);
+        /* The binary search over the names decompresses every event it looks at */
+        pmu_events_stats_read(&stats);
+        uint64_t decompressions = stats.counters[PMU_EVENTS_DECOMPRESSIONS];
+        REQUIRE(decompressions > 1);
+        pthread_t thread;
+        REQUIRE(pthread_create(&thread, NULL, lookup_event, (void*)map) == 0);
+        REQUIRE(pthread_join(thread, NULL) == 0);
+        struct perf_cpu cpu = { .cpu = 0 };
+        map_for_cpu_invalidate(cpu);
+        map_for_cpu(cpu);
+        map_for_cpu(cpu);
+
+        pmu_events_stats_read(&stats);
+        REQUIRE(stats.counters[PMU_EVENTS_DECOMPRESSIONS] == 2 * decompressions);
+        REQUIRE(stats.counters[PMU_EVENTS_MAP_FOR_CPU] == 2);
+        REQUIRE(stats.counters[PMU_EVENTS_MAP_FOR_CPU_MISSES] == 1);
+        REQUIRE(stats.calls[PMU_EVENTS_ENTRY_GET_EVENT_BY_NAME] == 2);
+        uint64_t calls = 0;
+        for (size_t bucket = 0; bucket < PMU_EVENTS_STATS_BUCKETS; bucket++)
+        {
+            calls += stats.latency[PMU_EVENTS_ENTRY_MAP_FOR_CPU][bucket];
+        }
+        REQUIRE(calls == 2);
+
+        char* dump = NULL;
+        size_t dump_len = 0;
+        FILE* file = open_memstream(&dump, &dump_len);
+        REQUIRE(file != NULL && pmu_events_stats_dump(file) == 0);
+        fclose(file);
+        REQUIRE(strstr(dump, "map_for_cpu_misses: 1\n") != NULL);
+        REQUIRE(strstr(dump, "get_event_by_name: 2 calls") != NULL);
+        free(dump);
+
+        /* Nothing is counted once collecting stops */
+        pmu_events_stats_enable(0);
+        REQUIRE(get_event_by_name(map, "eist_trans", &ev) == 0);
+        pmu_events_stats_read(&stats);
+        REQUIRE(stats.counters[PMU_EVENTS_DECOMPRESSIONS] == 2 * decompressions);
+        pmu_events_stats_reset();
+        pmu_events_stats_read(&stats);
+        REQUIRE(stats.counters[PMU_EVENTS_MAP_FOR_CPU] == 0);
+    }
+
+    TEST_CASE("pmu_topology survives a save/load round trip")
+    {
+        struct pmu_topology* topo = pmu_topology_new(NULL);
+        REQUIRE(topo != NULL);
+
+        char path[] = "/tmp/pmu-events-topology-XXXXXX";
+        int fd = mkstemp(path);
+        REQUIRE(fd != -1);
+        close(fd);
+
+        REQUIRE(pmu_topology_save(topo, path) == 0);
+        struct pmu_topology* loaded = pmu_topology_load(path);
+        unlink(path);
+        REQUIRE(loaded != NULL);
+
+        REQUIRE(pmu_topology_num_pmus(loaded) == pmu_topology_num_pmus(topo));
+        for (size_t i = 0; i < pmu_topology_num_pmus(topo); i++)
+        {
+            REQUIRE(strcmp(pmu_topology_pmu_name(loaded, i), pmu_topology_pmu_name(topo, i)) == 0);
+            REQUIRE(pmu_topology_pmu_type(loaded, i) == pmu_topology_pmu_type(topo, i));
+            REQUIRE(pmu_topology_find_pmu(loaded, pmu_topology_pmu_name(topo, i)) == i);
+        }
+
+        struct perf_cpu cpu;
+        cpu.cpu = 0;
+        REQUIRE(pmu_topology_core_pmu(loaded, cpu) == pmu_topology_core_pmu(topo, cpu));
+
+        pmu_topology_free(loaded);
+        pmu_topology_free(topo);
+    }
+
+    TEST_CASE("pmu_topology_get builds one snapshot for concurrent callers")
+    {
+        pmu_topology_set(NULL);
+        pthread_t threads[4];
+        for (size_t i = 0; i < 4; i++)
+        {
+            REQUIRE(pthread_create(&threads[i], NULL, get_topology, NULL) == 0);
+        }
+        void* topos[4];
+        for (size_t i = 0; i < 4; i++)
+        {
+            REQUIRE(pthread_join(threads[i], &topos[i]) == 0);
+        }
+        for (size_t i = 0; i < 4; i++)
+        {
+            REQUIRE(topos[i] != NULL && topos[i] == (void*)pmu_topology_get());
+        }
+    }
+
+    TEST_CASE("pmu_topology_load fails for garbage")
+    {
+        char path[] = "/tmp/pmu-events-topology-XXXXXX";
+        int fd = mkstemp(path);
+        REQUIRE(fd != -1);
+        REQUIRE(write(fd, "foo\n", 4) == 4);
+        close(fd);
+
+        REQUIRE(pmu_topology_load(path) == NULL);
+        unlink(path);
+    }
+
+    TEST_CASE("pmu_events_check_changes picks up hotplug and new PMUs")
+    {
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        REQUIRE(write_file(root, "devices/system/cpu/possible", "0-3\n") == 0);
+        REQUIRE(write_file(root, "devices/system/cpu/online", "0-3\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/type", "4\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu/format/event", "config:0-7\n") == 0);
+
+        struct pmu_topology* topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        pmu_topology_set(topo);
+
+        int removed_calls = 0;
+        struct pmu_events_change total;
+        memset(&total, 0, sizeof(total));
+        REQUIRE(pmu_events_add_change_callback(remove_self, &removed_calls) == 0);
+        REQUIRE(pmu_events_add_change_callback(count_change, &total) == 0);
+
+        REQUIRE(pmu_events_check_changes() == 0);
+
+        REQUIRE(write_file(root, "devices/system/cpu/online", "0-2\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_imc_0/type", "12\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/uncore_imc_0/cpumask", "0\n") == 0);
+        REQUIRE(pmu_events_check_changes() == 1);
+
+        REQUIRE(total.num_cpus_offline == 1);
+        REQUIRE(total.num_cpus_online == 0);
+        REQUIRE(total.num_pmus_added == 1);
+        REQUIRE(total.num_pmus_removed == 0);
+        REQUIRE(removed_calls == 1);
+        REQUIRE(pmu_topology_find_pmu(pmu_topology_get(), "uncore_imc_0") != -1);
+
+        /* The old snapshot is replaced, not modified */
+        REQUIRE(pmu_topology_get() != topo);
+        REQUIRE(pmu_topology_num_pmus(topo) == 1);
+        REQUIRE(pmu_topology_find_pmu(topo, "uncore_imc_0") == -1);
+        REQUIRE(pmu_cpuset_count(pmu_topology_online(topo)) == 4);
+
+        struct perf_cpu cpu;
+        cpu.cpu = 3;
+        REQUIRE(read_perf_type(cpu) == 4);
+
+        REQUIRE(pmu_events_remove_change_callback(count_change, &total) == 0);
+        pmu_topology_set(NULL);
+        remove_tree(root);
+    }
+
+    TEST_CASE("pmu_cpuset parses, iterates and combines CPU lists")
+    {
+        struct pmu_cpuset a = PMU_CPUSET_INIT, b = PMU_CPUSET_INIT;
+        REQUIRE(pmu_cpuset_parse(&a, "0-3,62-65,1030\n") == 0);
+        REQUIRE(pmu_cpuset_count(&a) == 9);
+        REQUIRE(pmu_cpuset_test(&a, 63) && !pmu_cpuset_test(&a, 4) && !pmu_cpuset_test(&a, 5000));
+        REQUIRE(pmu_cpuset_next(&a, 4) == 62 && pmu_cpuset_next(&a, 66) == 1030);
+        REQUIRE(pmu_cpuset_next(&a, 1031) == -1 && pmu_cpuset_last(&a) == 1030);
+
+        long cpu, sum = 0;
+        pmu_cpuset_for_each(cpu, &a)
+        {
+            sum += cpu;
+        }
+        REQUIRE(sum == 0 + 1 + 2 + 3 + 62 + 63 + 64 + 65 + 1030);
+
+        char* str = pmu_cpuset_format(&a);
+        REQUIRE(str != NULL && strcmp(str, "0-3,62-65,1030") == 0);
+        free(str);
+
+        REQUIRE(pmu_cpuset_parse(&b, "2-63") == 0);
+        REQUIRE(pmu_cpuset_and(&b, &a) == 0);
+        str = pmu_cpuset_format(&b);
+        REQUIRE(str != NULL && strcmp(str, "2-3,62-63") == 0);
+        free(str);
+        REQUIRE(pmu_cpuset_subset(&b, &a) && !pmu_cpuset_subset(&a, &b));
+
+        REQUIRE(pmu_cpuset_andnot(&a, &b) == 0 && pmu_cpuset_count(&a) == 5);
+        REQUIRE(pmu_cpuset_or(&a, &b) == 0);
+        REQUIRE(pmu_cpuset_parse(&b, "0-3,62-65,1030") == 0 && pmu_cpuset_equal(&a, &b));
+
+        /* Malformed lists leave the set alone */
+        REQUIRE(pmu_cpuset_parse(&a, "1,,2") == -1 && errno == EINVAL);
+        REQUIRE(pmu_cpuset_parse(&a, "3-1") == -1 && errno == EINVAL);
+        REQUIRE(pmu_cpuset_parse(&a, "0-99999") == -1 && errno == ERANGE);
+        REQUIRE(pmu_cpuset_equal(&a, &b));
+        REQUIRE(pmu_cpuset_parse(&a, "") == 0 && pmu_cpuset_empty(&a));
+
+        pmu_cpuset_release(&a);
+        pmu_cpuset_release(&b);
+
+        /* The snapshot of a large system */
+        char root[] = "/tmp/pmu-events-sysfs-XXXXXX";
+        REQUIRE(mkdtemp(root) != NULL);
+        REQUIRE(write_file(root, "devices/system/cpu/possible", "0-2047\n") == 0);
+        REQUIRE(write_file(root, "devices/system/cpu/online", "0-1999,2040\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu_core/type", "4\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu_core/cpus", "0-1023\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu_atom/type", "10\n") == 0);
+        REQUIRE(write_file(root, "bus/event_source/devices/cpu_atom/cpus", "1024-2047\n") == 0);
+
+        struct pmu_topology* topo = pmu_topology_new(root);
+        REQUIRE(topo != NULL);
+        REQUIRE(pmu_cpuset_count(pmu_topology_online(topo)) == 2001);
+        const struct pmu_cpuset* atom =
+            pmu_topology_pmu_cpuset(topo, pmu_topology_find_pmu(topo, "cpu_atom"));
+        REQUIRE(atom != NULL && pmu_cpuset_count(atom) == 1024 && pmu_cpuset_next(atom, 0) == 1024);
+        struct perf_cpu big = { .cpu = 2040 };
+        REQUIRE(pmu_topology_core_pmu(topo, big) == pmu_topology_find_pmu(topo, "cpu_atom"));
+
+        struct pmu_session* session = pmu_session_new_cpuset(atom);
+        REQUIRE(session != NULL && pmu_session_num_cpus(session) == 1024);
+        pmu_session_free(session);
+        pmu_topology_free(topo);
+        remove_tree(root);
+    }
+
     TEST_CASE("get_format_file_content works")
     {
         struct perf_cpu cpu;
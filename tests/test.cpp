@@ -0,0 +1,192 @@
+#include <pmu-events/models.hpp>
+#include <pmu-events/models/nehalemep.hpp>
+#include <pmu-events/models/skylakex.hpp>
+#include <pmu-events/models/test_soc_cpu.hpp>
+#include <pmu-events/pmu-events.hpp>
+#include <pmu-events/topology.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+/*
+ * catch2 for poor people
+ */
+#define TEST_CASE(name) test_name = name;
+
+#define REQUIRE(term)                                                                              \
+    if (!(term))                                                                                   \
+    {                                                                                              \
+        fprintf(stderr, "Test failed: %s\n", test_name);                                           \
+        fprintf(stderr, "Failing expression: %s\n", #term);                                        \
+        return -1;                                                                                 \
+    }
+
+namespace test_soc = pmu_events::models::test_soc_cpu;
+
+/*
+ * Everything below is evaluated by the compiler
+ */
+static_assert(pmu_events::fnv1a("") == 0xcbf29ce484222325ULL);
+static_assert(pmu_events::fnv1a("a") == 0xaf63dc4c8601ec8cULL);
+
+static_assert(test_soc::events.lookup("eist_trans") != nullptr);
+static_assert(test_soc::events.lookup("eist_trans", "uncore_cbox") == nullptr);
+static_assert(test_soc::events.lookup("eist_transs") == nullptr);
+
+constexpr const pmu_events::event_desc& eist_trans = test_soc::event("eist_trans");
+static_assert(std::string_view(eist_trans.pmu) == "default_core");
+static_assert(std::string_view(eist_trans.topic) == "other");
+
+constexpr pmu_events::event_encoding dispatch_blocked =
+    pmu_events::encode(test_soc::event("dispatch_blocked.any", "default_core"));
+static_assert(dispatch_blocked.num_terms == 3);
+static_assert(dispatch_blocked.get("event") == 9);
+static_assert(dispatch_blocked.get("umask") == 0x20);
+static_assert(dispatch_blocked.get("period") == 200000);
+static_assert(!dispatch_blocked.has("cmask"));
+
+constexpr pmu_events::event_config dispatch_blocked_config =
+    pmu_events::encode_config(dispatch_blocked, pmu_events::x86_core_formats);
+static_assert(dispatch_blocked_config.config == 0x2009);
+static_assert(dispatch_blocked_config.config1 == 0);
+
+static_assert(pmu_events::encode_config(pmu_events::encode("event=0xcd,umask=0x1,ldlat=0x80"),
+                                        pmu_events::x86_core_formats)
+                  .config1 == 0x80);
+
+/* Like apply_event_string(): the counter mask is decimal, "None" is 0 */
+constexpr const pmu_events::event_desc& total_cycles =
+    pmu_events::models::skylakex::event("uops_retired.total_cycles");
+static_assert(pmu_events::encode(total_cycles).get("cmask") == 16);
+static_assert(pmu_events::encode(total_cycles).get("umask") == 2);
+
+constexpr const pmu_events::event_desc& latency_above_threshold_0 =
+    pmu_events::models::nehalemep::event("mem_inst_retired.latency_above_threshold_0");
+static_assert(pmu_events::encode(latency_above_threshold_0).has("ldlat"));
+static_assert(pmu_events::encode(latency_above_threshold_0).get("ldlat", 1) == 0);
+static_assert(pmu_events::encode("event=0x3c,inv").get("inv") == 1);
+
+static const pmu_events_map* find_map(const char* arch)
+{
+    const pmu_events_map* maps = all_pmu_events_maps();
+    for (size_t i = 0; maps[i].arch != nullptr; i++)
+    {
+        if (strcmp(maps[i].arch, arch) == 0)
+        {
+            return &maps[i];
+        }
+    }
+    return nullptr;
+}
+
+static bool same_string(const char* a, const char* b)
+{
+    if (a == nullptr || b == nullptr)
+    {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+int main(void)
+{
+    const char* test_name;
+
+    TEST_CASE("models lists the test model");
+    {
+        bool found = false;
+        for (const pmu_events::model_info& model : pmu_events::models::all)
+        {
+            if (strcmp(model.cpuid, "testcpu") == 0)
+            {
+                REQUIRE(strcmp(model.model, "test_soc_cpu") == 0);
+                found = true;
+            }
+        }
+        REQUIRE(found);
+    }
+
+    TEST_CASE("constexpr events match the C tables");
+    {
+        const pmu_events_map* map = find_map("testarch");
+        REQUIRE(map != nullptr);
+
+        for (const pmu_events::event_desc& desc : test_soc::events.events)
+        {
+            REQUIRE(desc.hash == pmu_events::fnv1a(desc.name));
+
+            pmu_event_id id;
+            REQUIRE(get_event_id(map, desc.pmu, desc.name, &id) == 0 && id == desc.id);
+
+            struct pmu_event c_ev;
+            REQUIRE(get_event_by_name(map, desc.name, &c_ev) == 0);
+
+            struct pmu_event ev = desc.to_pmu_event();
+            REQUIRE(same_string(ev.name, c_ev.name));
+            REQUIRE(same_string(ev.pmu, c_ev.pmu));
+            REQUIRE(same_string(ev.topic, c_ev.topic));
+            REQUIRE(same_string(ev.desc, c_ev.desc));
+            REQUIRE(same_string(ev.event, c_ev.event));
+            REQUIRE(same_string(ev.compat, c_ev.compat));
+            REQUIRE(same_string(ev.unit, c_ev.unit));
+            REQUIRE(same_string(ev.long_desc, c_ev.long_desc));
+            REQUIRE(ev.perpkg == c_ev.perpkg);
+            REQUIRE(ev.deprecated == c_ev.deprecated);
+            REQUIRE(ev.precise == c_ev.precise && ev.data_la == c_ev.data_la);
+        }
+    }
+
+    TEST_CASE("event_table::lookup works at runtime");
+    {
+        const char* name = "segment_reg_loads.any";
+        const pmu_events::event_desc* desc = test_soc::events.lookup(name);
+        REQUIRE(desc != nullptr);
+        REQUIRE(strcmp(desc->event, "event=6,period=200000,umask=0x80") == 0);
+        REQUIRE(test_soc::events.lookup("segment_reg_loads") == nullptr);
+    }
+
+    TEST_CASE("encode_config matches gen_attr_for_event");
+    {
+        /* A snapshot with the x86 core formats, whatever the host has */
+        char path[] = "/tmp/pmu-events-topology-XXXXXX";
+        int fd = mkstemp(path);
+        REQUIRE(fd != -1);
+        FILE* file = fdopen(fd, "w");
+        REQUIRE(file != nullptr);
+        fprintf(file, "pmu-events-topology 1\nroot /sys\nnum_cpus 1\npmu cpu 4 1 0\n");
+        for (const pmu_events::format_def& format : pmu_events::x86_core_formats)
+        {
+            fprintf(file, "format %.*s %.*s\n", (int)format.name.size(), format.name.data(),
+                    (int)format.def.size(), format.def.data());
+        }
+        fclose(file);
+        pmu_topology* topo = pmu_topology_load(path);
+        unlink(path);
+        REQUIRE(topo != nullptr);
+        pmu_topology_set(topo);
+
+        constexpr pmu_events::event_config total_cycles_config = pmu_events::encode_config(
+            pmu_events::encode(total_cycles), pmu_events::x86_core_formats);
+        constexpr pmu_events::event_config latency_config = pmu_events::encode_config(
+            pmu_events::encode(latency_above_threshold_0), pmu_events::x86_core_formats);
+        const pmu_events::event_desc* descs[] = { &total_cycles, &latency_above_threshold_0 };
+        const pmu_events::event_config configs[] = { total_cycles_config, latency_config };
+
+        perf_cpu cpu;
+        cpu.cpu = 0;
+        for (size_t i = 0; i < sizeof(descs) / sizeof(descs[0]); i++)
+        {
+            struct pmu_event ev = descs[i]->to_pmu_event();
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            REQUIRE(gen_attr_for_event(&ev, cpu, &attr) == 0);
+            REQUIRE(attr.config == configs[i].config);
+            REQUIRE(attr.config1 == configs[i].config1);
+            REQUIRE(attr.config2 == configs[i].config2);
+        }
+        pmu_topology_set(nullptr);
+    }
+    return 0;
+}